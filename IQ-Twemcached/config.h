@@ -22,6 +22,9 @@
 /* Define to 1 if machine is big endian */
 /* #undef HAVE_BIG_ENDIAN */
 
+/* Define to 1 if the compact item header is enabled */
+/* #undef HAVE_COMPACT_ITEM */
+
 /* Define to 1 if debug log is enabled */
 /* #undef HAVE_DEBUG_LOG */
 
@@ -66,6 +66,7 @@
 #define MC_DAEMONIZE        false
 #define MC_MAXIMIZE_CORE    false
 #define MC_DISABLE_CAS      false
+#define MC_LOCKFREE_GET     false
 
 #define MC_LOG_FILE         NULL
 #define MC_LOG_DEFAULT      LOG_NOTICE
@@ -78,6 +79,16 @@
 
 #define MC_HASH_MAX_POWER   HASH_MAX_POWER
 
+#define MC_LOCK_POWER       ITEM_LOCK_DEFAULT_POWER
+#define MC_LOCK_MAX_POWER   ITEM_LOCK_MAX_POWER
+
+#define MC_REAPER_RATE      REAPER_DEFAULT_RATE
+#define MC_REBALANCE_INTVL  REBALANCE_DEFAULT_INTERVAL
+#define MC_ADMIT_SKETCH     ADMIT_DEFAULT_SKETCH
+#define MC_CRAWLER_DUTY     CRAWLER_DEFAULT_DUTY
+#define MC_MIGRATE_RATE     MIGRATE_DEFAULT_RATE
+#define MC_TRANS_MAXBYTES   TRANS_DEFAULT_MAXBYTES
+
 #define MC_KLOG_INTVL       KLOG_DEFAULT_INTVL
 #define MC_KLOG_SMP_RATE    KLOG_DEFAULT_SMP_RATE
 #define MC_KLOG_ENTRY       KLOG_DEFAULT_ENTRY
@@ -90,6 +101,11 @@
 #define MC_USER             NULL
 
 #define MC_REQ_PER_EVENT    20
+#define MC_COALESCE_BYTES   65536
+#define MC_IO_ENGINE        IO_ENGINE_LIBEVENT
+#define MC_IO_ENGINE_STR    "libevent"
+#define MC_ACCEPT           THREAD_ACCEPT_DISPATCHER
+#define MC_ACCEPT_STR       "dispatcher"
 #define MC_MAX_CONNS        1024
 #define MC_BACKLOG          1024
 
@@ -99,6 +115,13 @@
 #define MC_UNIX_PATH        NULL
 #define MC_ACCESS_MASK      0700
 
+#define MC_HASH_TABLE       HASH_TABLE_CHAINED
+#define MC_HASH_TABLE_STR   "chained"
+#define MC_HASH_TYPE        HASH_LOOKUP3
+#define MC_HASH_TYPE_STR    "lookup3"
+#define MC_STORAGE          STORAGE_SLAB
+#define MC_STORAGE_STR      "slab"
+
 #define MC_EVICT            EVICT_LRU
 #define MC_EVICT_STR        "lru"
 #define MC_FACTOR           1.25
@@ -111,6 +134,7 @@ static int show_stats_description; /* show twemcache stats description? */
 static int show_sizes;             /* show twemcache struct sizes? */
 static int parse_profile;          /* parse profile? */
 static char *profile_optarg;       /* profile optarg */
+static char *bench_name;           /* microbenchmark to run */
 
 static struct option long_options[] = {
     { "help",                 no_argument,        NULL,   'h' }, /* help */
@@ -121,18 +145,34 @@ static struct option long_options[] = {
     { "daemonize",            no_argument,        NULL,   'd' }, /* daemon mode */
     { "maximize-core-limit",  no_argument,        NULL,   'r' }, /* maximize corefile limit */
     { "disable-cas",          no_argument,        NULL,   'C' }, /* disable cas */
+    { "lockfree-get",         no_argument,        NULL,   'O' }, /* serve gets without item locks */
     { "describe-stats",       no_argument,        NULL,   'D' }, /* print stats description and exit */
     { "show-sizes",           no_argument,        NULL,   'S' }, /* print slab & item struct sizes and exit */
+    { "bench",                required_argument,  NULL,   'B' }, /* run a microbenchmark and exit */
     { "output",               required_argument,  NULL,   'o' }, /* output logfile */
     { "verbosity",            required_argument,  NULL,   'v' }, /* log verbosity level */
     { "stats-aggr-interval",  required_argument,  NULL,   'A' }, /* stats aggregation interval in usec */
+    { "hash-power",           required_argument,  NULL,   'e' }, /* hash table size as power of 2 */
+    { "hash-table",           required_argument,  NULL,   'T' }, /* hash table layout */
+    { "hash",                 required_argument,  NULL,   'H' }, /* key hash function */
     { "klog-entry",           required_argument,  NULL,   'x' }, /* command logging entry number */
     { "klog-file",            required_argument,  NULL,   'X' }, /* command logging file */
     { "klog-sample-rate",     required_argument,  NULL,   'y' }, /* command logging sampling rate */
     { "threads",              required_argument,  NULL,   't' }, /* # of threads */
+    { "lock-power",           required_argument,  NULL,   'K' }, /* # of item lock stripes as power of 2 */
+    { "reaper-rate",          required_argument,  NULL,   'F' }, /* # items the stale fragment reaper scans per sec */
+    { "rebalance-interval",   required_argument,  NULL,   'Y' }, /* secs between slab rebalancer decisions */
+    { "storage",              required_argument,  NULL,   'Q' }, /* item storage */
+    { "admission-sketch",     required_argument,  NULL,   'N' }, /* per mille of max memory for the admission filter */
+    { "crawler-duty",         required_argument,  NULL,   'w' }, /* % of time the expired item crawler runs */
+    { "migrate-rate",         required_argument,  NULL,   'W' }, /* # bytes per sec fragment migration streams */
+    { "trans-memory",         required_argument,  NULL,   'J' }, /* max memory for transaction and session key sets in MB */
     { "pidfile",              required_argument,  NULL,   'P' }, /* pid file */
     { "user",                 required_argument,  NULL,   'u' }, /* user identity to run as */
     { "max-requests",         required_argument,  NULL,   'R' }, /* max request per event */
+    { "coalesce-bytes",       required_argument,  NULL,   'j' }, /* max bytes of held replies */
+    { "io-engine",            required_argument,  NULL,   'i' }, /* engine driving tcp sockets */
+    { "accept",               required_argument,  NULL,   'q' }, /* who accepts tcp connections */
     { "max-conns",            required_argument,  NULL,   'c' }, /* max simultaneous connections */
     { "backlog",              required_argument,  NULL,   'b' }, /* tcp backlog queue limit */
     { "port",                 required_argument,  NULL,   'p' }, /* tcp port number to listen on */
@@ -160,18 +200,34 @@ static char short_options[] =
     "d"  /* daemon mode */
     "r"  /* maximize corefile limit */
     "C"  /* disable cas */
+    "O"  /* serve gets without item locks */
     "D"  /* print stats description and exit */
     "S"  /* print slab & item struct sizes and exit */
+    "B:" /* run a microbenchmark and exit */
     "o:" /* output logfile */
     "v:" /* log verbosity level */
     "A:" /* stats aggregation interval in msec */
+    "e:" /* hash table size as power of 2 */
+    "T:" /* hash table layout */
+    "H:" /* key hash function */
     "x:" /* command logging entry number */
     "X:" /* command logging file */
     "y:" /* command logging sample rate */
     "t:" /* # of threads */
+    "K:" /* # of item lock stripes as power of 2 */
+    "F:" /* # items the stale fragment reaper scans per sec */
+    "Y:" /* secs between slab rebalancer decisions */
+    "Q:" /* item storage */
+    "N:" /* per mille of max memory for the admission filter */
+    "w:" /* % of time the expired item crawler runs */
+    "W:" /* # bytes per sec fragment migration streams */
+    "J:" /* max memory for transaction and session key sets in MB */
     "P:" /* pid file */
     "u:" /* user identity to run as */
     "R:" /* max request per event */
+    "j:" /* max bytes of held replies */
+    "i:" /* engine driving tcp sockets */
+    "q:" /* who accepts tcp connections */
     "c:" /* max simultaneous connections */
     "b:" /* tcp backlog queue limit */
     "p:" /* tcp port number to listen on */
@@ -193,11 +249,13 @@ static void
 mc_show_usage(void)
 {
     log_stderr(
-        "Usage: twemcache [-?hVCELdkrDS] [-o output file] [-v verbosity level]" CRLF
-        "           [-A stats aggr interval] [-e hash power]" CRLF
-        "           [-t threads] [-P pid file] [-u user]" CRLF
+        "Usage: twemcache [-?hVCOELdkrDS] [-o output file] [-v verbosity level]" CRLF
+        "           [-B bench] [-A stats aggr interval] [-e hash power] [-T hash table]" CRLF
+        "           [-H hash] [-Y rebalance interval] [-Q storage] [-N admission sketch]" CRLF
+        "           [-t threads] [-K lock power] [-F reaper rate] [-W migrate rate]" CRLF
+        "           [-w crawler duty] [-J trans memory] [-P pid file] [-u user]" CRLF
         "           [-x command logging entry] [-X command logging file] [-y command logging sample rate]" CRLF
-        "           [-R max requests] [-c max conns] [-b backlog] [-p port] [-U udp port]" CRLF
+        "           [-R max requests] [-j coalesce bytes] [-i io engine] [-q accept] [-c max conns] [-b backlog] [-p port] [-U udp port]" CRLF
         "           [-l interface] [-s unix path] [-a access mask] [-M eviction strategy]" CRLF
         "           [-f factor] [-m max memory] [-n min item chunk size] [-I slab size]" CRLF
         "           [-z slab profile]" CRLF
@@ -212,8 +270,10 @@ mc_show_usage(void)
         "  -d, --daemonize             : run as a daemon" CRLF
         "  -r, --maximize-core-limit   : maximize core file limit" CRLF
         "  -C, --disable-cas           : disable use of cas" CRLF
+        "  -O, --lockfree-get          : serve get hits without taking item locks" CRLF
         "  -D, --describe-stats        : print stats description and exit" CRLF
-        "  -S, --show-sizes            : print slab and item struct sizes and exit"
+        "  -S, --show-sizes            : print slab and item struct sizes and exit" CRLF
+        "  -B, --bench=S               : run a microbenchmark, assoc or hash, and exit"
         " ");
 
     log_stderr(
@@ -221,13 +281,41 @@ mc_show_usage(void)
         "  -v, --verbosity=N           : set the logging level (default: %d, min: %d, max: %d)" CRLF
         "  -A, --stats-aggr-interval=N : set the stats aggregation interval in usec (default: %d usec)" CRLF
         "  -e, --hash-power=N          : set the hash table size as a power of 2 (default: 0, adjustable)" CRLF
-        "  -t, --threads=N             : set number of threads to use (default: %d)" CRLF
-        "  -P, --pidfile=S             : set the pid file (default: %s)" CRLF
-        "  -u, --user=S                : set user identity when run as root (default: %s)"
+        "  -T, --hash-table=S          : set the hash table layout, chained or tagged (default: %s)" CRLF
+        "  -H, --hash=S                : set the key hash, lookup3, crc32c or wyhash, same on all servers (default: %s)"
         " ",
         MC_LOG_FILE != NULL ? MC_LOG_FILE : "stderr", MC_LOG_DEFAULT, MC_LOG_MIN, MC_LOG_MAX,
         MC_STATS_INTVL,
+        MC_HASH_TABLE_STR,
+        MC_HASH_TYPE_STR
+        );
+
+    log_stderr(
+        "  -t, --threads=N             : set number of threads to use (default: %d)" CRLF
+        "  -K, --lock-power=N          : set the number of item lock stripes as a power of 2 (default: %d, max: %d)" CRLF
+        "  -F, --reaper-rate=N         : set the # items per sec the stale fragment reaper scans, 0 disables it (default: %d)" CRLF
+        "  -W, --migrate-rate=N        : set the # bytes per sec fragment migration streams, 0 for no limit (default: %d)" CRLF
+        "  -J, --trans-memory=N        : set the memory for transaction and session key sets in MB (default: %d)"
+        " ",
         MC_WORKERS,
+        MC_LOCK_POWER, MC_LOCK_MAX_POWER,
+        MC_REAPER_RATE,
+        MC_MIGRATE_RATE,
+        MC_TRANS_MAXBYTES / MB
+        );
+
+    log_stderr(
+        "  -Y, --rebalance-interval=N  : set the secs between moves of slabs to classes that evict, 0 disables it (default: %d)" CRLF
+        "  -Q, --storage=S             : set the item storage, slab or segment (ttl bucketed, append-only) (default: %s)" CRLF
+        "  -N, --admission-sketch=N    : set the per mille of max memory for the frequency sketch that admits items over lru victims, 0 disables it (default: %d)" CRLF
+        "  -w, --crawler-duty=N        : set the %% of time the expired item crawler runs, 0 disables it (default: %d)" CRLF
+        "  -P, --pidfile=S             : set the pid file (default: %s)" CRLF
+        "  -u, --user=S                : set user identity when run as root (default: %s)"
+        " ",
+        MC_REBALANCE_INTVL,
+        MC_STORAGE_STR,
+        MC_ADMIT_SKETCH,
+        MC_CRAWLER_DUTY,
         MC_PID_FILE != NULL ? MC_PID_FILE : "off",
         MC_USER != NULL ? MC_USER : "off"
         );
@@ -244,6 +332,9 @@ mc_show_usage(void)
 
     log_stderr(
         "  -R, --max-requests=N        : set the maximum number of requests per event (default: %d)" CRLF
+        "  -j, --coalesce-bytes=N      : set the max bytes of replies to pipelined requests written out together, 0 disables it (default: %d)" CRLF
+        "  -i, --io-engine=S           : set the engine driving tcp sockets, libevent or uring (io_uring, linux 6.0+) (default: %s)" CRLF
+        "  -q, --accept=S              : set who accepts tcp connections, dispatcher, reuseport (every worker on a socket of its own) or cpu (reuseport, by the cpu a connection arrives on) (default: %s)" CRLF
         "  -c, --max-conns=N           : set the maximum simultaneous connections (default: %d)" CRLF
         "  -b, --backlog=N             : set the backlog queue limit (default %d)" CRLF
         "  -p, --port=N                : set the tcp port to listen on (default: %d)" CRLF
@@ -252,7 +343,8 @@ mc_show_usage(void)
         "  -s, --unix-path=S           : set the unix socket path to listen on (default: %s)" CRLF
         "  -a, --access-mask=O         : set the access mask for unix socket in octal (default: %04o)"
         " ",
-        MC_REQ_PER_EVENT, MC_MAX_CONNS, MC_BACKLOG,
+        MC_REQ_PER_EVENT, MC_COALESCE_BYTES, MC_IO_ENGINE_STR, MC_ACCEPT_STR,
+        MC_MAX_CONNS, MC_BACKLOG,
         MC_TCP_PORT, MC_UDP_PORT,
         MC_INTERFACE != NULL ? MC_INTERFACE : "all",
         MC_UNIX_PATH != NULL ? MC_UNIX_PATH : "off", MC_ACCESS_MASK
@@ -494,6 +586,7 @@ mc_set_default_options(void)
     settings.daemonize = MC_DAEMONIZE;
     settings.max_corefile = MC_MAXIMIZE_CORE;
     settings.use_cas = MC_DISABLE_CAS ? false : true;
+    settings.lockfree_get = MC_LOCKFREE_GET;
 
     settings.log_filename = MC_LOG_FILE;
     settings.verbose = MC_LOG_DEFAULT;
@@ -511,6 +604,9 @@ mc_set_default_options(void)
     settings.username = MC_USER;
 
     settings.reqs_per_event = MC_REQ_PER_EVENT;
+    settings.coalesce_bytes = MC_COALESCE_BYTES;
+    settings.io_engine = MC_IO_ENGINE;
+    settings.accept_mode = MC_ACCEPT;
     settings.maxconns = MC_MAX_CONNS;
     settings.backlog = MC_BACKLOG;
     settings.port = MC_TCP_PORT;
@@ -527,6 +623,16 @@ mc_set_default_options(void)
     settings.chunk_size = MC_CHUNK_SIZE;
     settings.slab_size = MC_SLAB_SIZE;
     settings.hash_power = 0;
+    settings.hash_table = MC_HASH_TABLE;
+    settings.hash_type = MC_HASH_TYPE;
+    settings.lock_power = MC_LOCK_POWER;
+    settings.reaper_rate = MC_REAPER_RATE;
+    settings.rebalance_interval = MC_REBALANCE_INTVL;
+    settings.storage = MC_STORAGE;
+    settings.admit_sketch = MC_ADMIT_SKETCH;
+    settings.crawler_duty = MC_CRAWLER_DUTY;
+    settings.migrate_rate = MC_MIGRATE_RATE;
+    settings.trans_maxbytes = MC_TRANS_MAXBYTES;
 
     settings.accepting_conns = true;
     settings.oldest_live = 0;
@@ -598,6 +704,10 @@ mc_get_options(int argc, char **argv)
             settings.use_cas = false;
             break;
 
+        case 'O':
+            settings.lockfree_get = true;
+            break;
+
         case 'D':
             show_stats_description = 1;
             show_version = 1;
@@ -661,6 +771,31 @@ mc_get_options(int argc, char **argv)
             settings.hash_power = value;
             break;
 
+        case 'T':
+            if (strcmp(optarg, "chained") == 0) {
+                settings.hash_table = HASH_TABLE_CHAINED;
+            } else if (strcmp(optarg, "tagged") == 0) {
+                settings.hash_table = HASH_TABLE_TAGGED;
+            } else {
+                log_stderr("twemcache: option -T value '%s' is not a valid "
+                           "hash table layout", optarg);
+                return MC_ERROR;
+            }
+            break;
+
+        case 'H':
+            settings.hash_type = hash_type(optarg);
+            if (settings.hash_type == HASH_INVALID) {
+                log_stderr("twemcache: option -H value '%s' is not a valid "
+                           "hash", optarg);
+                return MC_ERROR;
+            }
+            break;
+
+        case 'B':
+            bench_name = optarg;
+            break;
+
         case 'x':
             value = mc_atoi(optarg, strlen(optarg));
             if (value <= 0) {
@@ -703,6 +838,96 @@ mc_get_options(int argc, char **argv)
             settings.num_workers = value;
             break;
 
+        case 'K':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -K requires a number");
+                return MC_ERROR;
+            }
+
+            if (value > MC_LOCK_MAX_POWER) {
+                log_stderr("twemcache: lock power cannot be greater than %d",
+                           MC_LOCK_MAX_POWER);
+                return MC_ERROR;
+            }
+
+            settings.lock_power = value;
+            break;
+
+        case 'F':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -F requires a number");
+                return MC_ERROR;
+            }
+
+            settings.reaper_rate = value;
+            break;
+
+        case 'Y':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -Y requires a number");
+                return MC_ERROR;
+            }
+
+            settings.rebalance_interval = value;
+            break;
+
+        case 'Q':
+            if (strcmp(optarg, "slab") == 0) {
+                settings.storage = STORAGE_SLAB;
+            } else if (strcmp(optarg, "segment") == 0) {
+                settings.storage = STORAGE_SEGMENT;
+            } else {
+                log_stderr("twemcache: option -Q value '%s' is not a valid "
+                           "item storage", optarg);
+                return MC_ERROR;
+            }
+            break;
+
+        case 'N':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > 1000) {
+                log_stderr("twemcache: option -N requires a number between 0 "
+                           "and 1000");
+                return MC_ERROR;
+            }
+
+            settings.admit_sketch = value;
+            break;
+
+        case 'w':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > 100) {
+                log_stderr("twemcache: option -w requires a number between 0 "
+                           "and 100");
+                return MC_ERROR;
+            }
+
+            settings.crawler_duty = value;
+            break;
+
+        case 'W':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -W requires a number");
+                return MC_ERROR;
+            }
+
+            settings.migrate_rate = value;
+            break;
+
+        case 'J':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("twemcache: option -J requires a non zero number");
+                return MC_ERROR;
+            }
+
+            settings.trans_maxbytes = (size_t)value * MB;
+            break;
+
         case 'P':
             settings.pid_filename = optarg;
             break;
@@ -721,6 +946,47 @@ mc_get_options(int argc, char **argv)
             settings.reqs_per_event = value;
             break;
 
+        case 'j':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -j requires a number");
+                return MC_ERROR;
+            }
+
+            settings.coalesce_bytes = value;
+            break;
+
+        case 'i':
+            if (strcmp(optarg, "libevent") == 0) {
+                settings.io_engine = IO_ENGINE_LIBEVENT;
+            } else if (strcmp(optarg, "uring") == 0) {
+                if (!uring_supported()) {
+                    log_stderr("twemcache: option -i value '%s' is not "
+                               "supported on this platform", optarg);
+                    return MC_ERROR;
+                }
+                settings.io_engine = IO_ENGINE_URING;
+            } else {
+                log_stderr("twemcache: option -i value '%s' is not a valid "
+                           "io engine", optarg);
+                return MC_ERROR;
+            }
+            break;
+
+        case 'q':
+            if (strcmp(optarg, "dispatcher") == 0) {
+                settings.accept_mode = THREAD_ACCEPT_DISPATCHER;
+            } else if (strcmp(optarg, "reuseport") == 0) {
+                settings.accept_mode = THREAD_ACCEPT_REUSEPORT;
+            } else if (strcmp(optarg, "cpu") == 0) {
+                settings.accept_mode = THREAD_ACCEPT_CPU;
+            } else {
+                log_stderr("twemcache: option -q value '%s' is not a valid "
+                           "accept mode", optarg);
+                return MC_ERROR;
+            }
+            break;
+
         case 'c':
             value = mc_atoi(optarg, strlen(optarg));
             if (value <= 0) {
@@ -933,7 +1199,13 @@ mc_get_options(int argc, char **argv)
             case 'A':
             case 'e':
             case 't':
+            case 'K':
+            case 'F':
+            case 'Y':
+            case 'W':
+            case 'J':
             case 'R':
+            case 'j':
             case 'c':
             case 'b':
             case 'p':
@@ -950,6 +1222,12 @@ mc_get_options(int argc, char **argv)
             case 'l':
             case 'I':
             case 'z':
+            case 'T':
+            case 'H':
+            case 'Q':
+            case 'i':
+            case 'q':
+            case 'B':
                 log_stderr("twemcache: option -%c requires a string", optopt);
                 break;
 
@@ -981,6 +1259,25 @@ mc_get_options(int argc, char **argv)
     	}
     }
 
+    if (settings.storage == STORAGE_SEGMENT) {
+        /* lease items must stay put, which only the reserved slabs do */
+        if (settings.reserved_percentage == 0) {
+            log_stderr("twemcache: segment storage needs reserved memory for "
+                       "lease items (set percentage-reserved)");
+            return MC_ERROR;
+        }
+
+        /*
+         * growing a tagged table peeks at items without holding their
+         * stripe, which a cleared segment does not keep in place
+         */
+        if (settings.hash_table == HASH_TABLE_TAGGED) {
+            log_stderr("twemcache: segment storage needs the chained hash "
+                       "table");
+            return MC_ERROR;
+        }
+    }
+
     return MC_OK;
 }
 
@@ -1287,11 +1584,12 @@ mc_print(void)
          MC_VERSION_STRING, settings.pid, settings.num_workers);
 
     loga("configured with debug logs %s, asserts %s, panic %s, stats %s, "
-         "klog %s", MC_DEBUG_LOG ? "enabled" : "disabled",
+         "klog %s, compact items %s", MC_DEBUG_LOG ? "enabled" : "disabled",
          MC_ASSERT_LOG ? "enabled" : "disabled",
          MC_ASSERT_PANIC ? "enabled" : "disabled",
          MC_DISABLE_STATS ? "disabled" : "enabled",
-         MC_DISABLE_KLOG ? "disabled" : "enabled");
+         MC_DISABLE_KLOG ? "disabled" : "enabled",
+         MC_COMPACT_ITEM ? "enabled" : "disabled");
 
     slab_print();
 }
@@ -1327,6 +1625,11 @@ main(int argc, char **argv)
         exit(0);
     }
 
+    if (bench_name != NULL) {
+        status = bench_run(bench_name);
+        exit(status == MC_OK ? 0 : 1);
+    }
+
     if (settings.max_corefile) {
         status = mc_maximize_core();
         if (status != MC_OK) {
@@ -0,0 +1,265 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * TinyLFU admission filter
+ *
+ * Scans of keys that are read once and never again go through the item
+ * lru q just like hot keys do, and push them out. With --admission-sketch
+ * set, a new item that can only be had by reusing the lru item of its
+ * class is admitted only if its key was asked for more often than the key
+ * of that victim; otherwise the victim stays, and the new item is not
+ * stored. Items that fit in free memory are always admitted, so the
+ * cache warms up as before, and only the lru victim is second-guessed.
+ *
+ * How often a key was asked for is estimated with a count-min sketch of
+ * ADMIT_DEPTH rows of 4-bit counters, sized as a per mille of maxbytes.
+ * Reads and writes of a key count one in a counter of each row, picked by
+ * hashing the key, and the estimate is the smallest of those counters.
+ * Once ADMIT_SAMPLE_FACTOR counts per counter of a row have been made,
+ * all counters are halved, so the sketch ages and keys that were hot a
+ * while ago do not stay hot forever.
+ *
+ * Counters are packed 16 to a 64-bit word and updated with compare and
+ * swap, so workers count without a lock. Aging races with counting, and
+ * a count made while the sketch ages may be halved or not, which only
+ * makes the estimate a little less exact.
+ */
+
+#define ADMIT_COUNTER_BITS  4
+#define ADMIT_COUNTER_MAX   0xf
+#define ADMIT_WORD_NCOUNTER (64 / ADMIT_COUNTER_BITS)
+#define ADMIT_HALVE_MASK    0x7777777777777777ULL
+
+static uint64_t *admit_table;           /* sketch rows, back to back */
+static uint32_t admit_width;            /* # counters per row, power of 2 */
+static uint32_t admit_nword;            /* # words of the sketch */
+static uint64_t admit_sample;           /* # counts between agings */
+static volatile uint64_t admit_ncount;  /* # counts since the last aging */
+static volatile uint64_t admit_nage;    /* # agings */
+
+/*
+ * Get the counter index of key in each row, by double hashing the key
+ * hash
+ */
+static void
+admit_index(const char *key, size_t nkey, uint32_t *idx)
+{
+    uint32_t hv, step, i;
+
+    hv = hash(key, nkey, 0);
+    step = (uint32_t)(((uint64_t)hv * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+
+    for (i = 0; i < ADMIT_DEPTH; i++) {
+        idx[i] = i * admit_width + ((hv + i * step) & (admit_width - 1));
+    }
+}
+
+static uint32_t
+admit_counter(uint32_t idx)
+{
+    uint64_t word;
+
+    word = admit_table[idx / ADMIT_WORD_NCOUNTER];
+
+    return (uint32_t)(word >> ((idx % ADMIT_WORD_NCOUNTER) * ADMIT_COUNTER_BITS)) &
+           ADMIT_COUNTER_MAX;
+}
+
+static void
+admit_counter_incr(uint32_t idx)
+{
+    volatile uint64_t *word;
+    uint64_t old;
+    uint32_t shift;
+
+    word = &admit_table[idx / ADMIT_WORD_NCOUNTER];
+    shift = (idx % ADMIT_WORD_NCOUNTER) * ADMIT_COUNTER_BITS;
+
+    do {
+        old = *word;
+        if (((old >> shift) & ADMIT_COUNTER_MAX) == ADMIT_COUNTER_MAX) {
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(word, old, old + (1ULL << shift)));
+}
+
+/*
+ * Halve all counters of the sketch
+ */
+static void
+admit_age(void)
+{
+    volatile uint64_t *word;
+    uint64_t old;
+    uint32_t i;
+
+    for (i = 0; i < admit_nword; i++) {
+        word = &admit_table[i];
+        do {
+            old = *word;
+        } while (!__sync_bool_compare_and_swap(word, old,
+                                               (old >> 1) & ADMIT_HALVE_MASK));
+    }
+
+    __sync_fetch_and_add(&admit_nage, 1);
+}
+
+static uint32_t
+admit_estimate(const char *key, size_t nkey)
+{
+    uint32_t idx[ADMIT_DEPTH], i, count, min;
+
+    admit_index(key, nkey, idx);
+
+    for (min = ADMIT_COUNTER_MAX, i = 0; i < ADMIT_DEPTH; i++) {
+        count = admit_counter(idx[i]);
+        if (count < min) {
+            min = count;
+        }
+    }
+
+    return min;
+}
+
+bool
+admit_enabled(void)
+{
+    return admit_table != NULL;
+}
+
+/*
+ * Count one read or write of key
+ */
+void
+admit_record(const char *key, size_t nkey)
+{
+    uint32_t idx[ADMIT_DEPTH], i;
+
+    if (admit_table == NULL) {
+        return;
+    }
+
+    admit_index(key, nkey, idx);
+
+    for (i = 0; i < ADMIT_DEPTH; i++) {
+        admit_counter_incr(idx[i]);
+    }
+
+    /* only the one count that gets to the sample size ages the sketch */
+    if (__sync_add_and_fetch(&admit_ncount, 1) == admit_sample) {
+        admit_age();
+        __sync_sub_and_fetch(&admit_ncount, admit_sample);
+    }
+}
+
+/*
+ * Return true if a new item of key is to be stored in place of the lru
+ * victim, which it is if key is estimated to be asked for more often
+ */
+bool
+admit_accept(const char *key, size_t nkey, struct item *victim)
+{
+    if (admit_table == NULL) {
+        return true;
+    }
+
+    return admit_estimate(key, nkey) >
+           admit_estimate(item_key(victim), victim->nkey);
+}
+
+void
+admit_get_stats(struct admit_stats *stats)
+{
+    stats->nbyte = (size_t)admit_nword * sizeof(*admit_table);
+    stats->width = admit_width;
+    stats->sample = admit_sample;
+    stats->age = admit_nage;
+}
+
+rstatus_t
+admit_init(void)
+{
+    size_t nbyte;
+    uint64_t ncounter;
+
+    admit_table = NULL;
+    admit_width = 0;
+    admit_nword = 0;
+    admit_sample = 0;
+    admit_ncount = 0;
+    admit_nage = 0;
+
+    if (settings.admit_sketch == 0) {
+        /* admission filter is disabled */
+        return MC_OK;
+    }
+
+    if (settings.storage == STORAGE_SEGMENT) {
+        /* segments are cleared whole, there is no lru victim to weigh */
+        return MC_OK;
+    }
+
+    nbyte = settings.maxbytes / 1000 * settings.admit_sketch;
+    ncounter = (uint64_t)nbyte * 8 / ADMIT_COUNTER_BITS / ADMIT_DEPTH;
+
+    /* largest power of 2 that fits, so that the counters index a uint32_t */
+    for (admit_width = ADMIT_MIN_WIDTH;
+         (uint64_t)admit_width * 2 <= ncounter && admit_width < (1U << 28);
+         admit_width <<= 1) {
+    }
+
+    admit_nword = admit_width / ADMIT_WORD_NCOUNTER * ADMIT_DEPTH;
+    admit_sample = (uint64_t)admit_width * ADMIT_SAMPLE_FACTOR;
+
+    admit_table = mc_zalloc(sizeof(*admit_table) * admit_nword);
+    if (admit_table == NULL) {
+        log_error("create of admission sketch with %"PRIu32" words failed: %s",
+                  admit_nword, strerror(errno));
+        return MC_ENOMEM;
+    }
+
+    log_debug(LOG_INFO, "created admission sketch of %"PRIu32" rows of %"PRIu32
+              " counters", ADMIT_DEPTH, admit_width);
+
+    return MC_OK;
+}
+
+void
+admit_deinit(void)
+{
+    if (admit_table != NULL) {
+        mc_free(admit_table);
+        admit_table = NULL;
+    }
+}
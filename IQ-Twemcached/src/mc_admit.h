@@ -0,0 +1,52 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_ADMIT_H_
+#define _MC_ADMIT_H_
+
+#define ADMIT_DEFAULT_SKETCH 0      /* per mille of maxbytes for the sketch, 0 disables it */
+#define ADMIT_DEPTH          4      /* # sketch rows, one counter per key in each */
+#define ADMIT_MIN_WIDTH      64     /* min # counters per sketch row */
+#define ADMIT_SAMPLE_FACTOR  10     /* # counts per counter of a row between agings */
+
+struct admit_stats {
+    size_t     nbyte;         /* # bytes of the sketch */
+    uint32_t   width;         /* # counters per row */
+    uint64_t   sample;        /* # counts between agings */
+    uint64_t   age;           /* # times the sketch was aged */
+};
+
+rstatus_t admit_init(void);
+void admit_deinit(void);
+bool admit_enabled(void);
+void admit_record(const char *key, size_t nkey);
+bool admit_accept(const char *key, size_t nkey, struct item *victim);
+void admit_get_stats(struct admit_stats *stats);
+
+#endif
@@ -35,9 +35,6 @@
 
 extern struct settings settings;
 
-extern pthread_mutex_t configuration_lock; /* lock protecting configuration number update */
-int32_t configuration_number = 0; /* the current configuration number */
-
 /*
  * Parsing tokens:
  *
@@ -114,6 +111,7 @@ int32_t configuration_number = 0; /* the current configuration number */
 #define TOKEN_MAX               16
 #define TOKEN_LEASE_RELEASE		3
 #define TOKEN_HASH_XLEASE		3
+#define TOKEN_FRAGMENT			1
 #define TRANS_ID				3
 
 #define SUFFIX_MAX_LEN 44 /* =11+11+21+1 enough to hold " <uint32_t> <uint32_t> <uint64_t>\0" */
@@ -301,17 +299,54 @@ static void asc_write_crash(struct conn *c) {
 	asc_write_string(c, str, len);
 }
 
-static int asc_check_config(int client_configuration_number, struct conn *c) {
-	int32_t server_config = -1;
-	pthread_mutex_lock(&configuration_lock);
-	server_config = configuration_number;
-	pthread_mutex_unlock(&configuration_lock);
-	if (client_configuration_number != -1) {
-		if (client_configuration_number != server_config) {
-			asc_write_crash(c);
-			return -1;
-		}
+/*
+ * Check the client configuration number against the configuration of the
+ * fragment key belongs to; key is NULL for requests that name a
+ * transaction instead of a key. Returns the configuration number to stamp
+ * new items with, or -1 after replying FAIL.
+ */
+static int asc_check_config(int client_configuration_number, const char *key,
+		size_t nkey, struct conn *c) {
+	int32_t server_config;
+
+	if (!fragment_check(client_configuration_number, key, nkey, &server_config)) {
+		asc_write_crash(c);
+		return -1;
+	}
+	return server_config;
+}
+
+/*
+ * Multi-key version of asc_check_config for get and delete; every key
+ * starting at key_token has to pass the check before any of them is
+ * processed. The tokens are scanned on a private array, so the caller's
+ * tokens are left as they are.
+ */
+static int asc_check_config_keys(int client_configuration_number,
+		struct token *key_token, struct conn *c) {
+	struct token token[TOKEN_MAX];
+	int32_t server_config = 0;
+
+	if (client_configuration_number == -1) {
+		return 0;
 	}
+
+	do {
+		while (key_token->len != 0) {
+			if (!fragment_check(client_configuration_number, key_token->val,
+					key_token->len, &server_config)) {
+				asc_write_crash(c);
+				return -1;
+			}
+			key_token++;
+		}
+
+		if (key_token->val != NULL) {
+			asc_tokenize(key_token->val, token, TOKEN_MAX);
+			key_token = token;
+		}
+	} while (key_token->val != NULL);
+
 	return server_config;
 }
 
@@ -1163,6 +1198,28 @@ static void asc_write_version(struct conn *c) {
  * We get here after reading the value in update commands. The command
  * is stored in c->req_type, and the item is ready in c->item.
  */
+/*
+ * Unpack the bulkset payload that asc_process_bulkset read into c->m_buf
+ */
+static void asc_complete_bulkset(struct conn *c) {
+	if (!strcrlf(c->m_buf + c->m_nbyte)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with missing crlf", c->sd, c->req_type);
+
+		asc_write_client_error(c);
+	} else if (migrate_import(c->m_buf, c->m_nbyte, c->m_config) == MC_OK) {
+		asc_write_stored(c);
+	} else {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d "
+				"for req of type %d with malformed payload", c->sd,
+				c->req_type);
+
+		asc_write_client_error(c);
+	}
+
+	mc_free(c->m_buf);
+}
+
 void asc_complete_nread(struct conn *c) {
 	item_store_result_t ret;
 	item_co_result_t retco;
@@ -1171,6 +1228,11 @@ void asc_complete_nread(struct conn *c) {
 	char* sid;
 	size_t nsid;
 
+	if (c->req_type == REQ_BULKSET) {
+		asc_complete_bulkset(c);
+		return;
+	}
+
 	it = c->item;
 	sid = c->tid;
 	nsid = c->ntid;
@@ -1300,18 +1362,18 @@ void asc_complete_nread(struct conn *c) {
 	c->item = NULL;
 }
 
+static bool asc_token_noreply(struct token *t) {
+	return ((t->len == sizeof("noreply") - 1)
+			&& str7cmp(t->val, 'n', 'o', 'r', 'e', 'p', 'l', 'y')) ? true : false;
+}
+
 static void asc_set_noreply_maybe(struct conn *c, struct token *token,
 		int ntoken) {
-	struct token *t;
-
 	if (ntoken < 2) {
 		return;
 	}
 
-	t = &token[ntoken - 2];
-
-	if ((t->len == sizeof("noreply") - 1)
-			&& str7cmp(t->val, 'n', 'o', 'r', 'e', 'p', 'l', 'y')) {
+	if (asc_token_noreply(&token[ntoken - 2])) {
 		c->noreply = 1;
 	}
 }
@@ -1393,8 +1455,6 @@ static rstatus_t asc_respond_get(struct conn *c, unsigned valid_key_iter,
 
 static inline void asc_process_update_configuration(struct conn *c,
 		struct token *token, int ntoken) {
-	asc_set_noreply_maybe(c, token, ntoken);
-
 	if (!asc_ntoken_valid(c, ntoken)) {
 		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
 				"req of type %d with %d invalid tokens", c->sd,
@@ -1402,21 +1462,270 @@ static inline void asc_process_update_configuration(struct conn *c,
 		asc_write_client_error(c);
 		return;
 	}
+
+	/*
+	 * An optional fragment table follows the configuration number as
+	 * <nfragment> <fragment cfg 0> ... <fragment cfg nfragment-1>. The
+	 * table can be longer than TOKEN_MAX, so it is tokenized in batches
+	 * like the keys of a multiget. Whether the request ends in noreply
+	 * is only known once the last batch has been seen, so errors are
+	 * reported after the whole request has been consumed.
+	 */
+	rstatus_t status = MC_OK;
+	bool noreply = false;
 	int new_configuration_number;
+	int32_t nfragment = -1;
+	int32_t *fconfig = NULL;
+	int32_t i = 0;
+	struct token *cfg_token;
+
 	if (!mc_strtol(token[TOKEN_CONFIG].val, &new_configuration_number)) {
 		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
 				"invalid flags '%.*s'", c->sd, c->req_type,
 				token[TOKEN_CONFIG].len, token[TOKEN_CONFIG].val);
+		status = MC_ERROR;
+	}
+
+	cfg_token = &token[TOKEN_CONFIG + 1];
+	do {
+		for (; cfg_token->len != 0; cfg_token++) {
+			if (noreply) {
+				/* noreply must be the last token */
+				noreply = false;
+				status = MC_ERROR;
+			}
+
+			if (asc_token_noreply(cfg_token)) {
+				noreply = true;
+			} else if (status != MC_OK) {
+				continue;
+			} else if (nfragment < 0) {
+				if (!mc_strtol(cfg_token->val, &nfragment) || nfragment <= 0
+						|| nfragment > FRAGMENT_MAX) {
+					log_debug(LOG_NOTICE, "client error on c %d for req of "
+							"type %d and invalid fragment count '%.*s'", c->sd,
+							c->req_type, cfg_token->len, cfg_token->val);
+					status = MC_ERROR;
+					continue;
+				}
+
+				fconfig = mc_alloc(sizeof(*fconfig) * nfragment);
+				if (fconfig == NULL) {
+					status = MC_ENOMEM;
+				}
+			} else if (i == nfragment || !mc_strtol(cfg_token->val, &fconfig[i])
+					|| fconfig[i] > new_configuration_number) {
+				log_debug(LOG_NOTICE, "client error on c %d for req of type "
+						"%d and invalid fragment cfg '%.*s'", c->sd,
+						c->req_type, cfg_token->len, cfg_token->val);
+				status = MC_ERROR;
+			} else {
+				i++;
+			}
+		}
+
+		if (cfg_token->val != NULL) {
+			ntoken = asc_tokenize(cfg_token->val, token, TOKEN_MAX);
+			/* ntoken is unused */
+			cfg_token = token;
+		}
+	} while (cfg_token->val != NULL);
+
+	c->noreply = noreply ? 1 : 0;
+
+	if (status == MC_OK && nfragment > 0 && i != nfragment) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"%d of %d fragment cfgs", c->sd, c->req_type, i, nfragment);
+		status = MC_ERROR;
+	}
+
+	if (status == MC_OK && fragment_update(new_configuration_number,
+			(uint32_t)MAX(nfragment, 0), fconfig) != MC_OK) {
+		status = MC_ENOMEM;
+	}
+
+	if (fconfig != NULL) {
+		mc_free(fconfig);
+	}
+
+	switch (status) {
+	case MC_OK:
+		asc_write_ok(c);
+		break;
+
+	case MC_ERROR:
+		asc_write_client_error(c);
+		break;
+
+	default:
+		asc_write_server_error(c);
+		break;
+	}
+}
+
+/*
+ * dropfrag <fragment> [noreply]
+ *
+ * Drop all items of a fragment of the current configuration table, e.g.
+ * once the fragment has been handed over to another server.
+ */
+static inline void asc_process_drop_fragment(struct conn *c,
+		struct token *token, int ntoken) {
+	uint32_t fid, nfragment, ndrop;
+
+	asc_set_noreply_maybe(c, token, ntoken);
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+		asc_write_client_error(c);
+		return;
+	}
+
+	nfragment = fragment_count();
+	if (!mc_strtoul(token[TOKEN_FRAGMENT].val, &fid) || fid >= nfragment) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"invalid fragment '%.*s' of %"PRIu32"", c->sd, c->req_type,
+				token[TOKEN_FRAGMENT].len, token[TOKEN_FRAGMENT].val,
+				nfragment);
 
 		asc_write_client_error(c);
 		return;
 	}
-	pthread_mutex_lock(&configuration_lock);
-	configuration_number = new_configuration_number;
-	pthread_mutex_unlock(&configuration_lock);
+
+	ndrop = item_drop_fragment(fid, nfragment);
+
+	loga("dropped %"PRIu32" items of fragment %"PRIu32" of "
+			"%"PRIu32"", ndrop, fid, nfragment);
+
 	asc_write_ok(c);
 }
 
+/*
+ * migrate <fragment> <host> <port> [<config>] [noreply]
+ *
+ * Stream all items of a fragment of the current configuration table to
+ * the server at host:port in the background. The peer stores them with
+ * configuration number config, or with its own configuration of each key
+ * when config is -1 or omitted.
+ */
+static inline void asc_process_migrate(struct conn *c, struct token *token,
+		int ntoken) {
+	uint32_t fid, nfragment;
+	int32_t config;
+	struct token *host, *port;
+
+	asc_set_noreply_maybe(c, token, ntoken);
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+		asc_write_client_error(c);
+		return;
+	}
+
+	nfragment = fragment_count();
+	if (!mc_strtoul(token[TOKEN_FRAGMENT].val, &fid) || fid >= nfragment) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"invalid fragment '%.*s' of %"PRIu32"", c->sd, c->req_type,
+				token[TOKEN_FRAGMENT].len, token[TOKEN_FRAGMENT].val,
+				nfragment);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	host = &token[TOKEN_FRAGMENT + 1];
+	port = &token[TOKEN_FRAGMENT + 2];
+
+	config = -1;
+	if (ntoken - (c->noreply ? 1 : 0) == 6
+			&& !mc_strtol(token[TOKEN_FRAGMENT + 3].val, &config)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"invalid config '%.*s'", c->sd, c->req_type,
+				token[TOKEN_FRAGMENT + 3].len, token[TOKEN_FRAGMENT + 3].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (migrate_start(fid, nfragment, config, host->val, host->len, port->val,
+			port->len) != MC_OK) {
+		log_warn("server error on c %d for req of type %d because a "
+				"migration is in progress", c->sd, c->req_type);
+
+		asc_write_server_error(c);
+		return;
+	}
+
+	asc_write_ok(c);
+}
+
+/*
+ * bulkset <config> <bytes> [noreply]\r\n<records>\r\n
+ *
+ * Store a chunk of a fragment migration stream. The payload, at most
+ * migrate_chunk_max() bytes, is read into a buffer of the connection and
+ * unpacked in asc_complete_bulkset().
+ */
+static inline void asc_process_bulkset(struct conn *c, struct token *token,
+		int ntoken) {
+	int32_t config;
+	uint32_t vlen;
+
+	asc_set_noreply_maybe(c, token, ntoken);
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (!mc_strtol(token[TOKEN_CONFIG].val, &config)
+			|| !mc_strtoul(token[TOKEN_CONFIG + 1].val, &vlen)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"invalid config '%.*s' or length '%.*s'", c->sd, c->req_type,
+				token[TOKEN_CONFIG].len, token[TOKEN_CONFIG].val,
+				token[TOKEN_CONFIG + 1].len, token[TOKEN_CONFIG + 1].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (vlen > migrate_chunk_max()) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"payload size %"PRIu32" out of range", c->sd, c->req_type,
+				vlen);
+
+		asc_write_client_error(c);
+		c->write_and_go = CONN_SWALLOW;
+		c->sbytes = vlen + CRLF_LEN;
+		return;
+	}
+
+	ASSERT(c->m_buf == NULL);
+	c->m_buf = mc_alloc(vlen + CRLF_LEN);
+	if (c->m_buf == NULL) {
+		log_warn("server error on c %d for req of type %d because of oom in "
+				"reading payload", c->sd, c->req_type);
+
+		asc_write_server_error(c);
+		c->write_and_go = CONN_SWALLOW;
+		c->sbytes = vlen + CRLF_LEN;
+		return;
+	}
+
+	c->m_nbyte = vlen;
+	c->m_config = config;
+	c->ritem = c->m_buf;
+	c->rlbytes = vlen + CRLF_LEN;
+	conn_set_state(c, CONN_NREAD);
+}
+
 static inline void asc_process_read(struct conn *c, struct token *token,
 		int ntoken) {
 	rstatus_t status;
@@ -1445,7 +1754,7 @@ static inline void asc_process_read(struct conn *c, struct token *token,
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config_keys(client_configuration_number, &token[TOKEN_KEY], c) == -1) {
 		return;
 	}
 
@@ -1564,7 +1873,7 @@ static void asc_process_update(struct conn *c, struct token *token, int ntoken)
 	time_t exptime;
 	uint64_t req_cas_id = 0;
 	struct item *it;
-	bool handle_cas;
+	bool handle_cas, rejected;
 	req_type_t type;
 	uint8_t id;
 
@@ -1653,7 +1962,8 @@ static void asc_process_update(struct conn *c, struct token *token, int ntoken)
 		}
 	}
 
-	int32_t server_config = asc_check_config(client_configuration_number, c);
+	int32_t server_config = asc_check_config(client_configuration_number,
+			token[3].val, token[3].len, c);
 
 	if (server_config == -1) {
 		/* swallow the data line */
@@ -1690,14 +2000,21 @@ static void asc_process_update(struct conn *c, struct token *token, int ntoken)
 		server_config = next_fragment_cfg_id;
 	}
 
-	it = item_alloc_config(id, key, nkey, flags, time_reltime(exptime), vlen,
-			server_config);
+	it = item_alloc_admit(id, key, nkey, flags, time_reltime(exptime), vlen,
+			server_config, &rejected);
 	if (it == NULL) {
-		log_warn("server error on c %d for req of type %d because of oom in "
-				"storing item", c->sd, c->req_type);
-		log_warn("could not set key(%d, %s) - value(%d) ", nkey, key, vlen);
+		if (rejected) {
+			log_debug(LOG_VERB, "admission filter kept out key '%.*s' on c %d",
+					nkey, key, c->sd);
 
-		asc_write_server_error(c);
+			asc_write_not_stored(c);
+		} else {
+			log_warn("server error on c %d for req of type %d because of oom in "
+					"storing item", c->sd, c->req_type);
+			log_warn("could not set key(%d, %s) - value(%d) ", nkey, key, vlen);
+
+			asc_write_server_error(c);
+		}
 
 		/* swallow the data line */
 		c->write_and_go = CONN_SWALLOW;
@@ -1762,7 +2079,8 @@ static void asc_process_arithmetic(struct conn *c, struct token *token,
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -1853,7 +2171,7 @@ static void asc_process_delete(struct conn *c, struct token *token, int ntoken)
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config_keys(client_configuration_number, &token[3], c) == -1) {
 		return;
 	}
 
@@ -1934,7 +2252,8 @@ static void asc_process_unlease(struct conn *c, struct token *token, int ntoken)
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -2134,7 +2453,8 @@ static void asc_process_qareg(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -2196,7 +2516,7 @@ static void asc_process_dar(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number, NULL, 0, c) == -1) {
 		return;
 	}
 
@@ -2254,7 +2574,8 @@ static void asc_process_qaread(struct conn *c, struct token *token, int ntoken)
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -2355,7 +2676,8 @@ static void asc_process_sar(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -2495,7 +2817,8 @@ static void asc_process_iqincr_iqdecr(struct conn *c, struct token *token,
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -2623,7 +2946,8 @@ static void asc_process_iqappend_iqprepend(struct conn *c, struct token *token,
 	tid = token[4].val;
 	tid_size = token[4].len;
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		c->write_and_go = CONN_SWALLOW;
 		c->sbytes = vlen + CRLF_LEN;
 		return;
@@ -2686,7 +3010,8 @@ static void asc_process_oqincr_oqdecr(struct conn *c, struct token *token,
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[3].val, token[3].len, c) == -1) {
 		return;
 	}
 
@@ -2860,17 +3185,13 @@ static void asc_process_commit(struct conn *c, struct token *token, int ntoken)
 		return;
 	}
 
-	int server_cfg_id = asc_check_config(client_configuration_number, c);
-
-	if (server_cfg_id == -1) {
+	if (asc_check_config(client_configuration_number, NULL, 0, c) == -1) {
 		return;
 	}
 
-	if (frag_configuration_number != -1) {
-		server_cfg_id = frag_configuration_number;
-	}
-
-	item_iq_result_t exc = item_commit(tid, tid_size, c, pending, server_cfg_id);
+	/* without an explicit fragment config, keys keep their fragment's own */
+	item_iq_result_t exc = item_commit(tid, tid_size, c, pending,
+			frag_configuration_number);
 
 	// process memcached to create and maintain the list
 	if (exc == IQ_OK) {
@@ -3378,7 +3699,8 @@ static void asc_process_swap(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	int32_t server_config = asc_check_config(client_configuration_number, c);
+	int32_t server_config = asc_check_config(client_configuration_number,
+			token[3].val, token[3].len, c);
 
 	if (server_config == -1) {
 		/* swallow the data line */
@@ -3588,7 +3910,8 @@ static void asc_process_iqget(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -3627,6 +3950,21 @@ static void asc_process_iqget(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
+	/* optional: msec to wait on a held I lease before HOTMISS, see mc_wait.c */
+	c->w_msec = 0;
+	if (ntoken - c->noreply > 6) {
+		int wait;
+		if (!mc_strtol(token[5].val, &wait) || wait < 0) {
+			log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+					"invalid wait '%.*s'", c->sd, c->req_type,
+					token[5].len, token[5].val);
+
+			asc_write_client_error(c);
+			return;
+		}
+		c->w_msec = MIN(wait, WAIT_MAX_MSEC);
+	}
+
 	exc = item_iqget(key, key_size, (lease_token_t) lease_token, tid, tid_size,
 			c, &it, &new_lease_token, 0, foreground);
 
@@ -3648,6 +3986,9 @@ static void asc_process_iqget(struct conn *c, struct token *token, int ntoken) {
 	case IQ_SERVER_ERROR:
 		asc_write_server_error(c);
 		break;
+	case IQ_WAIT:
+		conn_set_state(c, CONN_PARK);
+		break;
 	default:
 		break;
 	}
@@ -3656,6 +3997,491 @@ static void asc_process_iqget(struct conn *c, struct token *token, int ntoken) {
 		item_remove(it);
 }
 
+/*
+ * Collect the keys (tids, for mcommit) of a batched request, from the one
+ * in key_token to the end of the request, into an array allocated with
+ * mc_alloc. The tokens are scanned on a private array, as in
+ * asc_check_config_keys. Returns the # keys, or 0 after replying with an
+ * error.
+ */
+static uint32_t asc_batch_keys(struct conn *c, struct token *key_token,
+		struct item_batch **batch) {
+	struct token token[TOKEN_MAX];
+	struct token *t;
+	struct item_batch *b = NULL;
+	uint32_t n = 0;
+
+	/* count the keys on the first pass, fill them in on the second */
+	for (;;) {
+		n = 0;
+		t = key_token;
+		do {
+			while (t->len != 0) {
+				if (t->len > KEY_MAX_LEN) {
+					log_debug(LOG_NOTICE, "client error on c %d for req of type "
+							"%d and %d length key", c->sd, c->req_type, t->len);
+
+					asc_write_client_error(c);
+					if (b != NULL) {
+						mc_free(b);
+					}
+					return 0;
+				}
+
+				if (b != NULL) {
+					b[n].key = t->val;
+					b[n].nkey = t->len;
+				}
+				n++;
+				t++;
+			}
+
+			if (t->val != NULL) {
+				asc_tokenize(t->val, token, TOKEN_MAX);
+				t = token;
+			}
+		} while (t->val != NULL);
+
+		if (b != NULL) {
+			break;
+		}
+
+		b = mc_alloc(sizeof(*b) * n);
+		if (b == NULL) {
+			log_warn("server error on c %d for req of type %d with %"PRIu32
+					" keys with enomem", c->sd, c->req_type, n);
+
+			asc_write_server_error(c);
+			return 0;
+		}
+	}
+
+	*batch = b;
+	return n;
+}
+
+/*
+ * Reply to a batched request with one line per key, in the order of the
+ * request, followed by END. A line is the reply of the single key command
+ * with the key (tid) after the reply word:
+ *
+ *   miqget:  VALUE key flags p nbyte config + data, LVALUE key flags p
+ *            token, NOVALUE key
+ *   mqareg:  LEASE key marked, INVALID key
+ *   mqaread: LVALUE key 0 p token, LEASE key flags p token nbyte + data,
+ *            INVALID key
+ *   mcommit: OK tid, NOT_FOUND tid
+ *
+ * or SERVER_ERROR key. Values go out of the items, which are handed to the
+ * connection to remove once the reply is sent; the other items of the
+ * batch are removed here.
+ */
+static void asc_write_batch(struct conn *c, struct item_batch *batch,
+		uint32_t n, int read_value) {
+	struct item_batch *b;
+	struct item *it;
+	const char *str;
+	char buf[SUFFIX_MAX_LEN];
+	char *suffix;
+	unsigned nitem = 0, nsuffix = 0;
+	uint32_t i;
+	int sz;
+	rstatus_t status = MC_OK;
+
+	for (i = 0; i < n && status == MC_OK; i++) {
+		b = &batch[i];
+		it = NULL; /* item whose value goes out */
+		sz = 0;
+
+		switch (c->req_type) {
+		case REQ_MIQGET:
+			if (b->status == IQ_VALUE) {
+				str = "VALUE ";
+				it = b->it;
+				sz = mc_snprintf(buf, SUFFIX_MAX_LEN,
+						" %"PRIu32" %"PRIu8" %"PRIu32" %"PRIu32, it->dataflags,
+						it->p, it->nbyte, it->config_number);
+			} else if (b->status == IQ_MISS || b->status == IQ_LEASE) {
+				str = "LVALUE ";
+				sz = mc_snprintf(buf, SUFFIX_MAX_LEN,
+						" %"PRIu32" %"PRIu8" %"PRIu64,
+						b->it != NULL ? b->it->dataflags : 0,
+						b->it != NULL ? b->it->p : 0, b->token);
+			} else if (b->status == IQ_NO_VALUE) {
+				str = "NOVALUE ";
+			} else {
+				str = "SERVER_ERROR ";
+			}
+			break;
+
+		case REQ_MQAREG:
+			if (b->status == MC_OK) {
+				str = "LEASE ";
+				sz = mc_snprintf(buf, SUFFIX_MAX_LEN, " %"PRIu8, b->p);
+			} else if (b->status == MC_INVALID) {
+				str = "INVALID ";
+			} else {
+				str = "SERVER_ERROR ";
+			}
+			break;
+
+		case REQ_MQAREAD:
+			if (b->status == MC_OK && read_value != 0 && b->it != NULL) {
+				str = "LEASE ";
+				it = b->it;
+				sz = mc_snprintf(buf, SUFFIX_MAX_LEN,
+						" %"PRIu32" %"PRIu8" %"PRIu64" %"PRIu32, it->dataflags,
+						b->p, b->token, it->nbyte);
+			} else if (b->status == MC_OK) {
+				str = "LVALUE ";
+				sz = mc_snprintf(buf, SUFFIX_MAX_LEN,
+						" %"PRIu32" %"PRIu8" %"PRIu64, 0, b->p, b->token);
+			} else if (b->status == MC_INVALID) {
+				str = "INVALID ";
+			} else {
+				str = "SERVER_ERROR ";
+			}
+			break;
+
+		case REQ_MCOMMIT:
+			if (b->status == IQ_OK) {
+				str = "OK ";
+			} else if (b->status == IQ_NOT_FOUND) {
+				str = "NOT_FOUND ";
+			} else {
+				str = "SERVER_ERROR ";
+			}
+			break;
+
+		default:
+			NOT_REACHED();
+			str = "SERVER_ERROR ";
+			break;
+		}
+		ASSERT(sz >= 0 && sz <= SUFFIX_SIZE);
+
+		if (it != NULL && nitem >= c->isize) {
+			struct item **new_list;
+
+			new_list = mc_realloc(c->ilist, sizeof(struct item *) * c->isize * 2);
+			if (new_list == NULL) {
+				status = MC_ENOMEM;
+				break;
+			}
+			c->isize *= 2;
+			c->ilist = new_list;
+		}
+
+		status = conn_add_iov(c, str, strlen(str));
+		if (status != MC_OK) {
+			break;
+		}
+
+		status = conn_add_iov(c, b->key, b->nkey);
+		if (status != MC_OK) {
+			break;
+		}
+
+		if (sz > 0) {
+			status = asc_create_suffix(c, nsuffix, &suffix);
+			if (status != MC_OK) {
+				break;
+			}
+			nsuffix++;
+
+			memcpy(suffix, buf, sz);
+			status = conn_add_iov(c, suffix, sz);
+			if (status != MC_OK) {
+				break;
+			}
+		}
+
+		status = conn_add_iov(c, CRLF, CRLF_LEN);
+		if (status != MC_OK) {
+			break;
+		}
+
+		if (it != NULL) {
+			*(c->ilist + nitem) = it;
+			nitem++;
+			b->it = NULL;
+
+			status = conn_add_iov(c, item_data(it), it->nbyte);
+			if (status != MC_OK) {
+				break;
+			}
+
+			status = conn_add_iov(c, CRLF, CRLF_LEN);
+			if (status != MC_OK) {
+				break;
+			}
+		}
+
+		klog_write(c->peer, c->req_type, b->key, b->nkey, 0, sz);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (batch[i].it != NULL) {
+			item_remove(batch[i].it);
+			batch[i].it = NULL;
+		}
+	}
+
+	c->icurr = c->ilist;
+	c->ileft = nitem;
+
+	c->scurr = c->slist;
+	c->sleft = nsuffix;
+
+	log_debug(LOG_VVERB, ">%d END", c->sd);
+
+	/*
+	 * As in asc_process_read, a reply cut short by out-of-memory may not
+	 * end in \r\n, so we send SERVER_ERROR instead of END.
+	 */
+	if (status != MC_OK || conn_add_iov(c, "END\r\n", 5) != MC_OK
+			|| (c->udp && conn_build_udp_headers(c) != MC_OK)) {
+		log_warn("server error on c %d for req of type %d with enomem", c->sd,
+				c->req_type);
+
+		asc_write_server_error(c);
+	} else {
+		conn_set_state(c, CONN_MWRITE);
+		c->msg_curr = 0;
+	}
+}
+
+/*
+ * Command: miqget <config> <key>+
+ *
+ * iqget of every key, with no lease token and without waiting on held
+ * leases
+ */
+static void asc_process_miqget(struct conn *c, struct token *token,
+		int ntoken) {
+	struct item_batch *batch;
+	uint32_t n;
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	int client_configuration_number;
+	if (!mc_strtol(token[TOKEN_CONFIG].val, &client_configuration_number)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[TOKEN_CONFIG].len, token[TOKEN_CONFIG].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (asc_check_config_keys(client_configuration_number, &token[TOKEN_KEY],
+			c) == -1) {
+		return;
+	}
+
+	n = asc_batch_keys(c, &token[TOKEN_KEY], &batch);
+	if (n == 0) {
+		return;
+	}
+
+	/* one reply for the whole batch, so no key parks on a held lease */
+	c->w_msec = 0;
+
+	item_iqget_batch(batch, n, c);
+	asc_write_batch(c, batch, n, 1);
+
+	mc_free(batch);
+}
+
+/*
+ * Command: mqareg <config> <tid> <key>+
+ */
+static void asc_process_mqareg(struct conn *c, struct token *token,
+		int ntoken) {
+	struct item_batch *batch;
+	uint32_t n;
+	char *tid;
+	size_t tid_size;
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	int client_configuration_number;
+	if (!mc_strtol(token[TOKEN_CONFIG].val, &client_configuration_number)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[TOKEN_CONFIG].len, token[TOKEN_CONFIG].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	tid = token[2].val;
+	tid_size = token[2].len;
+	if (tid_size > TID_MAX_LEN) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and %d "
+				"length tid", c->sd, c->req_type, tid_size);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (asc_check_config_keys(client_configuration_number, &token[3],
+			c) == -1) {
+		return;
+	}
+
+	n = asc_batch_keys(c, &token[3], &batch);
+	if (n == 0) {
+		return;
+	}
+
+	item_quarantine_and_register_batch(tid, tid_size, batch, n, c);
+	asc_write_batch(c, batch, n, 0);
+
+	mc_free(batch);
+}
+
+/*
+ * Command: mqaread <config> <tid> <read_value> <key>+
+ */
+static void asc_process_mqaread(struct conn *c, struct token *token,
+		int ntoken) {
+	struct item_batch *batch;
+	uint32_t n;
+	char *tid;
+	size_t tid_size;
+	int read_value;
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	int client_configuration_number;
+	if (!mc_strtol(token[TOKEN_CONFIG].val, &client_configuration_number)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[TOKEN_CONFIG].len, token[TOKEN_CONFIG].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	tid = token[2].val;
+	tid_size = token[2].len;
+	if (tid_size > TID_MAX_LEN) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and %d "
+				"length tid", c->sd, c->req_type, tid_size);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (!mc_strtol(token[3].val, &read_value)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[3].len, token[3].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (asc_check_config_keys(client_configuration_number, &token[4],
+			c) == -1) {
+		return;
+	}
+
+	n = asc_batch_keys(c, &token[4], &batch);
+	if (n == 0) {
+		return;
+	}
+
+	item_quarantine_and_read_batch(tid, tid_size, batch, n, c);
+	asc_write_batch(c, batch, n, read_value);
+
+	mc_free(batch);
+}
+
+/*
+ * Command: mcommit <config> <fconfig> <pending> <tid>+
+ */
+static void asc_process_mcommit(struct conn *c, struct token *token,
+		int ntoken) {
+	struct item_batch *batch;
+	uint32_t n;
+	int32_t pending;
+
+	if (!asc_ntoken_valid(c, ntoken)) {
+		log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+				"req of type %d with %d invalid tokens", c->sd,
+				c->req_type, ntoken);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	int client_configuration_number;
+	if (!mc_strtol(token[1].val, &client_configuration_number)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[1].len, token[1].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	int frag_configuration_number = -1;
+	if (!mc_strtol(token[2].val, &frag_configuration_number)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+				"invalid flags '%.*s'", c->sd, c->req_type,
+				token[2].len, token[2].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (!mc_strtol(token[3].val, &pending)) {
+		log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+				"invalid delta '%.*s'", c->sd, c->req_type,
+				token[3].len, token[3].val);
+
+		asc_write_client_error(c);
+		return;
+	}
+
+	if (asc_check_config(client_configuration_number, NULL, 0, c) == -1) {
+		return;
+	}
+
+	n = asc_batch_keys(c, &token[4], &batch);
+	if (n == 0) {
+		return;
+	}
+
+	item_commit_batch(batch, n, c, pending, frag_configuration_number);
+	asc_write_batch(c, batch, n, 0);
+
+	mc_free(batch);
+}
+
 static void asc_process_iset(struct conn *c, struct token *token, int ntoken) {
 	char *key; /* key need to be granted lease */
 	size_t key_size; /* # key bytes */
@@ -3688,7 +4514,8 @@ static void asc_process_iset(struct conn *c, struct token *token, int ntoken) {
 		return;
 	}
 
-	if (asc_check_config(client_configuration_number, c) == -1) {
+	if (asc_check_config(client_configuration_number,
+			token[TOKEN_KEY].val, token[TOKEN_KEY].len, c) == -1) {
 		return;
 	}
 
@@ -3775,6 +4602,20 @@ static void asc_process_stats(struct conn *c, struct token *token, int ntoken) {
 		return;
 	} else if (strncmp(t->val, "settings", t->len) == 0) {
 		stats_settings(c);
+	} else if (strncmp(t->val, "reaper", t->len) == 0) {
+		stats_reaper(c);
+	} else if (strncmp(t->val, "crawler", t->len) == 0) {
+		stats_crawler(c);
+	} else if (strncmp(t->val, "fragments", t->len) == 0) {
+		stats_fragments(c);
+	} else if (strncmp(t->val, "migrate", t->len) == 0) {
+		stats_migrate(c);
+	} else if (strncmp(t->val, "trans", t->len) == 0) {
+		stats_trans(c);
+	} else if (strncmp(t->val, "timer", t->len) == 0) {
+		stats_timer(c);
+	} else if (strncmp(t->val, "hash", t->len) == 0) {
+		stats_hash(c);
 	} else if (strncmp(t->val, "cachedump", t->len) == 0) {
 		char *buf;
 		unsigned int bytes, id, limit = 0;
@@ -4211,6 +5052,10 @@ static req_type_t asc_parse_type(struct conn *c, struct token *token,
 			type = REQ_OQINCR;
 		} else if (str6cmp(tval, 'o', 'q', 'd', 'e', 'c', 'r')) {
 			type = REQ_OQDECR;
+		} else if (str6cmp(tval, 'm', 'i', 'q', 'g', 'e', 't')) {
+			type = REQ_MIQGET;
+		} else if (str6cmp(tval, 'm', 'q', 'a', 'r', 'e', 'g')) {
+			type = REQ_MQAREG;
 		}
 
 		break;
@@ -4232,6 +5077,14 @@ static req_type_t asc_parse_type(struct conn *c, struct token *token,
 			type = REQ_GETPRIK;
 		} else if (str7cmp(tval, 'o', 'q', 'w', 'r', 'i', 't', 'e')) {
 			type = REQ_OQWRITE;
+		} else if (str7cmp(tval, 'm', 'i', 'g', 'r', 'a', 't', 'e')) {
+			type = REQ_MIGRATE;
+		} else if (str7cmp(tval, 'b', 'u', 'l', 'k', 's', 'e', 't')) {
+			type = REQ_BULKSET;
+		} else if (str7cmp(tval, 'm', 'q', 'a', 'r', 'e', 'a', 'd')) {
+			type = REQ_MQAREAD;
+		} else if (str7cmp(tval, 'm', 'c', 'o', 'm', 'm', 'i', 't')) {
+			type = REQ_MCOMMIT;
 		}
 
 		break;
@@ -4243,6 +5096,8 @@ static req_type_t asc_parse_type(struct conn *c, struct token *token,
 			type = REQ_VALIDATE;
 		} else if (str8cmp(tval, 'o', 'q', 'a', 'p', 'p', 'e', 'n', 'd')) {
 			type = REQ_OQAPPEND;
+		} else if (str8cmp(tval, 'd', 'r', 'o', 'p', 'f', 'r', 'a', 'g')) {
+			type = REQ_DROPFRAG;
 		}
 
 		break;
@@ -4284,10 +5139,7 @@ static void asc_dispatch(struct conn *c) {
 	 * directly into it, then continue in asc_complete_nread().
 	 */
 
-	c->msg_curr = 0;
-	c->msg_used = 0;
-	c->iov_used = 0;
-	status = conn_add_msghdr(c);
+	status = conn_reset_reply(c);
 	if (status != MC_OK) {
 		log_warn("server error on c %d for req of type %d because of oom in "
 				"preparing response", c->sd, c->req_type);
@@ -4416,6 +5268,18 @@ static void asc_dispatch(struct conn *c) {
 		asc_process_verbosity(c, token, ntoken);
 		break;
 
+	case REQ_DROPFRAG:
+		asc_process_drop_fragment(c, token, ntoken);
+		break;
+
+	case REQ_MIGRATE:
+		asc_process_migrate(c, token, ntoken);
+		break;
+
+	case REQ_BULKSET:
+		asc_process_bulkset(c, token, ntoken);
+		break;
+
 	case REQ_CONFIG:
 		asc_process_config(c, token, ntoken);
 		break;
@@ -4477,6 +5341,22 @@ static void asc_dispatch(struct conn *c) {
 		asc_process_commit(c, token, ntoken);
 		break;
 
+	case REQ_MIQGET:
+		asc_process_miqget(c, token, ntoken);
+		break;
+
+	case REQ_MQAREG:
+		asc_process_mqareg(c, token, ntoken);
+		break;
+
+	case REQ_MQAREAD:
+		asc_process_mqaread(c, token, ntoken);
+		break;
+
+	case REQ_MCOMMIT:
+		asc_process_mcommit(c, token, ntoken);
+		break;
+
 	case REQ_RELEASE:
 		asc_process_release(c, token, ntoken);
 		break;
@@ -4515,7 +5395,8 @@ rstatus_t asc_parse(struct conn *c) {
 
 			/*
 			 * We didn't have a '\n' in the first k. This _has_ to be a
-			 * large multiget, if not we should just nuke the connection.
+			 * large multiget, batched iq command or fragment table, if not
+			 * we should just nuke the connection.
 			 */
 
 			/* ignore leading whitespaces */
@@ -4524,7 +5405,12 @@ rstatus_t asc_parse(struct conn *c) {
 			}
 
 			if (ptr - c->rcurr > 100
-					|| (strncmp(ptr, "get ", 4) && strncmp(ptr, "gets ", 5))) {
+					|| (strncmp(ptr, "get ", 4) && strncmp(ptr, "gets ", 5)
+							&& strncmp(ptr, "miqget ", 7)
+							&& strncmp(ptr, "mqareg ", 7)
+							&& strncmp(ptr, "mqaread ", 8)
+							&& strncmp(ptr, "mcommit ", 8)
+							&& strncmp(ptr, "updateconf ", 11))) {
 
 				conn_set_state(c, CONN_CLOSE);
 				return MC_ERROR;
@@ -4557,6 +5443,14 @@ rstatus_t asc_parse(struct conn *c) {
 	return MC_OK;
 }
 
+/*
+ * Replay the request a parked connection was waiting on; c->req still
+ * points at it because nothing is read off a parked connection.
+ */
+void asc_resume(struct conn *c) {
+	asc_dispatch(c);
+}
+
 void asc_append_stats(struct conn *c, const char *key, uint16_t klen,
 		const char *val, uint32_t vlen) {
 	char *pos;
@@ -29,73 +29,149 @@
 
 #include <mc_core.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define HASHSIZE(_n) (1UL << (_n))
 #define HASHMASK(_n) (HASHSIZE(_n) - 1)
 
-#define HASH_DEFAULT_MOVE_SIZE  1
 #define HASH_DEFAULT_POWER      16
+#define HASH_TAG_DEFAULT_POWER  13  /* same memory as the default chained table */
+
+/*
+ * The tagged hash table is an open addressing table of cache line sized
+ * buckets. Each bucket holds up to HASH_TAG_NSLOT items, along with a one
+ * byte tag per item derived from its hash, so that a lookup compares all
+ * tags of a bucket at once and only touches the items whose tag matches.
+ *
+ * An item lives in its home bucket or, when that is full, in one of the
+ * buckets that follow it. The overflow count of a bucket is the number of
+ * items that probed past it, so a lookup ends at the first bucket that no
+ * item overflowed from. Counts saturate at TAG_OVERFLOW_MAX and then stick,
+ * which only makes lookups probe further than they need to.
+ *
+ * Lock stripes do not map to buckets in this table, so slots are claimed
+ * with a compare-and-swap on their tag and overflow counts are updated
+ * atomically. Items that find no free slot at all, which only happens
+ * while the table is waiting to be expanded, go on the spill list.
+ */
+#define TAG_OVERFLOW        HASH_TAG_NSLOT  /* index of the overflow count */
+#define TAG_SLOT_MASK       ((1U << HASH_TAG_NSLOT) - 1)
+#define TAG_FREE            0x00            /* slot is free */
+#define TAG_BUSY            0xff            /* slot is claimed by an insert */
+#define TAG_OVERFLOW_MAX    0xff            /* overflow count saturation */
+#define TAG_BUCKET_ALIGN    64
+
+union tag_ctl {
+    uint64_t     word;
+    uint8_t      tag[HASH_TAG_NSLOT + 1]; /* slot tags and overflow count */
+};
+
+struct tag_bucket {
+    union tag_ctl ctl;                    /* slot tags and overflow count */
+    struct item   *slot[HASH_TAG_NSLOT];  /* item of each slot */
+};
+
+/*
+ * A lookup of a companion item, or of a whole family, that visits all
+ * items which may be one
+ */
+struct assoc_visit {
+    const char  *key;     /* base key */
+    size_t      nkey;     /* base key length */
+    const char  *prefix;  /* companion prefix, NULL for the whole family */
+    struct item **family; /* family members found */
+};
+
+typedef bool (*assoc_visit_t)(struct item *it, struct assoc_visit *v);
 
 extern struct settings settings;
-extern pthread_mutex_t cache_lock;
 
 /*
  * We always look for items in the primary_hashtable expect when we are
  * expanding. During expansion (expanding = 1), we migrate key-values at
- * bucket granularity - nhash_move_size from old_hashtable to primary_hashtable.
+ * bucket granularity from old_hashtable to primary_hashtable.
  * The expand_bucket tells us how far we have gotton and it takes
  * values in the range [0, HASHSIZE(hash_power - 1) - 1]
+ *
+ * An old bucket is moved holding only the item lock stripe of its keys,
+ * which is the same for all of them, as there are never more stripes than
+ * old buckets. Whoever holds that stripe thus either sees the bucket not
+ * moved yet, or moved along with an expand_bucket past it.
+ *
+ * With the tagged layout, primary_tagtable and old_tagtable take the place
+ * of primary_hashtable and old_hashtable. Old buckets hold keys of any
+ * stripe there, so their items are moved one at a time under their own
+ * stripe, and lookups try both tables until expansion is over.
  */
+static int hash_table;                      /* hash table layout */
 static struct item_slh *primary_hashtable;  /* primary (main) hash table */
 static struct item_slh *old_hashtable;      /* secondary (old) hash table */
+static struct tag_bucket *primary_tagtable; /* primary (main) tagged table */
+static struct tag_bucket *old_tagtable;     /* secondary (old) tagged table */
 static uint32_t nhash_item;                 /* # items in hash table */
 static uint32_t hash_power;                 /* # buckets = 2^hash_power */
 
 static int expanding;                       /* expanding? */
-static uint32_t nhash_move_size;            /* # hash buckets to move during expansion */
 static uint32_t expand_bucket;              /* last expanded bucket */
+static uint64_t nexpand;                    /* # expansions */
+static uint64_t nhash_move;                 /* # items moved by expansions */
+
+static volatile int expand_wanted;          /* expansion requested by insert? */
+static volatile uint32_t assoc_seq;         /* odd while items move between tables */
 
+static struct item_slh spill;               /* items not in the tagged table */
+static volatile uint32_t nspill;            /* # items on the spill list */
+static pthread_mutex_t spill_lock;          /* spill list writer lock */
+
+static pthread_mutex_t maintenance_lock;    /* maintenance thread lock */
 static pthread_cond_t maintenance_cond;     /* maintenance thread condvar */
 static pthread_t maintenance_tid;           /* maintenance thread id */
 static volatile int run_maintenance_thread; /* run maintenance thread? */
 
+/* prefix of each companion key, indexed by assoc_family_t */
+static const char *assoc_family_prefix[ASSOC_NFAMILY] = {
+    NULL, "ls:", "pd:", "nv:", "pt:", "co:"
+};
+
+static bool assoc_expand_needed(void);
+static void assoc_expand(void);
+static void assoc_expand_done(void);
+static void assoc_move_bucket(uint32_t b);
+static void assoc_tag_move_bucket(uint32_t b);
+
 static void *
 assoc_maintenance_thread(void *arg)
 {
-    uint32_t i, hv;
-    struct item_slh *old_bucket, *new_bucket;
-    struct item *it, *next;
-
     while (run_maintenance_thread) {
-        /*
-         * Lock the cache, and bulk move multiple buckets to the new
-         * hash table
-         */
-        pthread_mutex_lock(&cache_lock);
-
-        for (i = 0; i < nhash_move_size && expanding == 1; i++) {
-
-            old_bucket = &old_hashtable[expand_bucket];
+        pthread_mutex_lock(&maintenance_lock);
+        while (run_maintenance_thread && expanding == 0 && expand_wanted == 0) {
+            /* we are done expanding, just wait for the next invocation */
+            pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+        }
+        pthread_mutex_unlock(&maintenance_lock);
 
-            SLIST_FOREACH_SAFE(it, old_bucket, h_sle, next) {
-                hv = hash(item_key(it), it->nkey, 0);
-                new_bucket = &primary_hashtable[hv & HASHMASK(hash_power)];
-                SLIST_REMOVE(old_bucket, it, item, h_sle);
-                SLIST_INSERT_HEAD(new_bucket, it, h_sle);
+        if (expand_wanted) {
+            expand_wanted = 0;
+            if (assoc_expand_needed()) {
+                assoc_expand();
             }
+        }
 
-            expand_bucket++;
-            if (expand_bucket == HASHSIZE(hash_power - 1)) {
-                expanding = 0;
-                mc_free(old_hashtable);
+        /* move the old buckets one by one, each under a single stripe */
+        while (run_maintenance_thread && expanding == 1 &&
+               expand_bucket < HASHSIZE(hash_power - 1)) {
+            if (hash_table == HASH_TABLE_TAGGED) {
+                assoc_tag_move_bucket(expand_bucket);
+            } else {
+                assoc_move_bucket(expand_bucket);
             }
         }
 
-        if (expanding == 0) {
-            /* we are done expanding, just wait for the next invocation */
-            pthread_cond_wait(&maintenance_cond, &cache_lock);
+        if (run_maintenance_thread && expanding == 1) {
+            assoc_expand_done();
         }
-
-        pthread_mutex_unlock(&cache_lock);
     }
 
     return NULL;
@@ -119,10 +195,10 @@ assoc_start_maintenance_thread(void)
 static void
 assoc_stop_maintenance_thread(void)
 {
-    pthread_mutex_lock(&cache_lock);
+    pthread_mutex_lock(&maintenance_lock);
     run_maintenance_thread = 0;
     pthread_cond_signal(&maintenance_cond);
-    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&maintenance_lock);
 
     /* wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
@@ -140,19 +216,93 @@ assoc_create_table(uint32_t table_sz)
     }
 
     for (i = 0; i < table_sz; i++) {
-        SLIST_INIT(&table[i]);
+        ITEM_SLIST_INIT(&table[i]);
+    }
+
+    return table;
+}
+
+static struct tag_bucket *
+assoc_create_tagtable(uint32_t table_sz)
+{
+    void *table;
+    size_t size;
+    err_t err;
+
+    size = sizeof(struct tag_bucket) * table_sz;
+
+    /* a bucket must not straddle two cache lines */
+    err = posix_memalign(&table, TAG_BUCKET_ALIGN, size);
+    if (err != 0) {
+        log_error("posix_memalign of %zu bytes failed: %s", size,
+                  strerror(err));
+        return NULL;
     }
 
+    memset(table, 0, size);
+
     return table;
 }
 
+/*
+ * Return true if key starts with the prefix of a companion key (lease,
+ * pending, pending version, ptrans or co lease). This only decides where
+ * a key is placed: a client key that happens to carry such a prefix lands
+ * in the bucket and stripe of its suffix, which is harmless. Whether an
+ * item is a companion is told by item_is_companion.
+ */
+static bool
+assoc_key_prefixed(const char *key, size_t nkey)
+{
+    if (nkey <= PREFIX_KEY_LEN || key[2] != ':') {
+        return false;
+    }
+
+    switch (key[0]) {
+    case 'l':
+        return key[1] == 's';
+    case 'p':
+        return key[1] == 'd' || key[1] == 't';
+    case 'n':
+        return key[1] == 'v';
+    case 'c':
+        return key[1] == 'o';
+    default:
+        return false;
+    }
+}
+
+/*
+ * Hash a key for bucket and lock stripe selection. Companion keys (lease,
+ * pending, pending version, ptrans and co lease) hash on their base key,
+ * so that they always share a bucket and a lock stripe with it.
+ */
+uint32_t
+assoc_hash(const char *key, size_t nkey)
+{
+    if (assoc_key_prefixed(key, nkey)) {
+        key += PREFIX_KEY_LEN;
+        nkey -= PREFIX_KEY_LEN;
+    }
+
+    return hash(key, nkey, 0);
+}
+
+/*
+ * Return the current hash power of the primary hash table
+ */
+uint32_t
+assoc_hash_power(void)
+{
+    return hash_power;
+}
+
 static struct item_slh *
-assoc_get_bucket(const char *key, size_t nkey)
+assoc_get_bucket_hv(uint32_t hv)
 {
     struct item_slh *bucket;
-    uint32_t hv, oldbucket, curbucket;
+    uint32_t oldbucket, curbucket;
 
-    hv = hash(key, nkey, 0);
     oldbucket = hv & HASHMASK(hash_power - 1);
     curbucket = hv & HASHMASK(hash_power);
 
@@ -165,28 +315,494 @@ assoc_get_bucket(const char *key, size_t nkey)
     return bucket;
 }
 
+static struct item_slh *
+assoc_get_bucket(const char *key, size_t nkey)
+{
+    return assoc_get_bucket_hv(assoc_hash(key, nkey));
+}
+
+/*
+ * Tag of a hash value, taken from other bits than the bucket index, and
+ * never TAG_FREE or TAG_BUSY
+ */
+static inline uint8_t
+assoc_tag(uint32_t hv)
+{
+    uint8_t tag;
+
+    tag = (uint8_t)((hv * 2654435761U) >> 24);
+    if (tag == TAG_FREE) {
+        return 1;
+    }
+    if (tag == TAG_BUSY) {
+        return TAG_BUSY - 1;
+    }
+
+    return tag;
+}
+
+/*
+ * Return the bitmap of the slots in ctl whose tag is tag
+ */
+static inline uint32_t
+assoc_tag_match(const union tag_ctl *ctl, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i word, eq;
+
+    word = _mm_loadl_epi64((const __m128i *)ctl);
+    eq = _mm_cmpeq_epi8(word, _mm_set1_epi8((char)tag));
+
+    return (uint32_t)_mm_movemask_epi8(eq) & TAG_SLOT_MASK;
+#else
+    uint32_t i, match;
+
+    for (match = 0, i = 0; i < HASH_TAG_NSLOT; i++) {
+        if (ctl->tag[i] == tag) {
+            match |= 1U << i;
+        }
+    }
+
+    return match;
+#endif
+}
+
+static void
+assoc_tag_overflow_incr(struct tag_bucket *bucket)
+{
+    uint8_t *overflow = &bucket->ctl.tag[TAG_OVERFLOW];
+    uint8_t count;
+
+    do {
+        count = *(volatile uint8_t *)overflow;
+        if (count == TAG_OVERFLOW_MAX) {
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(overflow, count, count + 1));
+}
+
+static void
+assoc_tag_overflow_decr(struct tag_bucket *bucket)
+{
+    uint8_t *overflow = &bucket->ctl.tag[TAG_OVERFLOW];
+    uint8_t count;
+
+    do {
+        count = *(volatile uint8_t *)overflow;
+        if (count == TAG_OVERFLOW_MAX) {
+            /* we no longer know how many items are past this bucket */
+            return;
+        }
+        ASSERT(count > 0);
+    } while (!__sync_bool_compare_and_swap(overflow, count, count - 1));
+}
+
+/*
+ * Find key with hash value hv in a tagged table with 2^power buckets. The
+ * tags and overflow count of a bucket are read in one go, so this is also
+ * safe without the item lock of key; a slot whose tag matches always
+ * holds an item, if not necessarily the one with key.
+ */
+static struct item *
+assoc_tag_find_table(struct tag_bucket *table, uint32_t power, uint32_t hv,
+                     const char *key, size_t nkey)
+{
+    struct tag_bucket *bucket;
+    struct item *it;
+    union tag_ctl ctl;
+    uint32_t b, n, mask, match;
+    uint8_t tag;
+
+    mask = HASHMASK(power);
+    tag = assoc_tag(hv);
+
+    for (b = hv & mask, n = 0; n <= mask; b = (b + 1) & mask, n++) {
+        bucket = &table[b];
+        ctl.word = *(volatile uint64_t *)&bucket->ctl.word;
+
+        for (match = assoc_tag_match(&ctl, tag); match != 0;
+             match &= match - 1) {
+            it = *(struct item * volatile *)&bucket->slot[__builtin_ctz(match)];
+            if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
+                return it;
+            }
+        }
+
+        if (ctl.tag[TAG_OVERFLOW] == 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Call visit on each item in a tagged table with 2^power buckets that may
+ * have hash value hv, until it returns true. Returns the item visit
+ * returned true on, or NULL.
+ */
+static struct item *
+assoc_tag_visit_table(struct tag_bucket *table, uint32_t power, uint32_t hv,
+                      assoc_visit_t visit, struct assoc_visit *v)
+{
+    struct tag_bucket *bucket;
+    struct item *it;
+    uint32_t b, n, mask, match;
+    uint8_t tag;
+
+    mask = HASHMASK(power);
+    tag = assoc_tag(hv);
+
+    for (b = hv & mask, n = 0; n <= mask; b = (b + 1) & mask, n++) {
+        bucket = &table[b];
+
+        for (match = assoc_tag_match(&bucket->ctl, tag); match != 0;
+             match &= match - 1) {
+            it = bucket->slot[__builtin_ctz(match)];
+            if (visit(it, v)) {
+                return it;
+            }
+        }
+
+        if (bucket->ctl.tag[TAG_OVERFLOW] == 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert it with hash value hv into a tagged table with 2^power buckets.
+ * Returns false if the table has no free slot.
+ */
+static bool
+assoc_tag_insert_table(struct tag_bucket *table, uint32_t power, uint32_t hv,
+                       struct item *it)
+{
+    struct tag_bucket *bucket;
+    union tag_ctl ctl;
+    uint32_t b, n, p, mask, match, slot;
+
+    mask = HASHMASK(power);
+
+    for (b = hv & mask, n = 0; n <= mask; b = (b + 1) & mask, n++) {
+        bucket = &table[b];
+        ctl.word = *(volatile uint64_t *)&bucket->ctl.word;
+
+        for (match = assoc_tag_match(&ctl, TAG_FREE); match != 0;
+             match &= match - 1) {
+            slot = __builtin_ctz(match);
+            if (__sync_bool_compare_and_swap(&bucket->ctl.tag[slot],
+                                             TAG_FREE, TAG_BUSY)) {
+                goto claimed;
+            }
+        }
+    }
+
+    return false;
+
+claimed:
+    /* count it in every bucket it probed past before it becomes visible */
+    for (p = hv & mask; p != b; p = (p + 1) & mask) {
+        assoc_tag_overflow_incr(&table[p]);
+    }
+
+    bucket->slot[slot] = it;
+    /* lock-free readers must never see the tag before the item */
+    __sync_synchronize();
+    *(volatile uint8_t *)&bucket->ctl.tag[slot] = assoc_tag(hv);
+
+    return true;
+}
+
+/*
+ * Remove it with hash value hv from a tagged table with 2^power buckets.
+ * The slot keeps pointing to it until it is reused, for the sake of
+ * lock-free readers that already matched its tag. Returns false if it
+ * is not in the table.
+ */
+static bool
+assoc_tag_delete_table(struct tag_bucket *table, uint32_t power, uint32_t hv,
+                       struct item *it)
+{
+    struct tag_bucket *bucket;
+    uint32_t b, n, p, mask, match, slot;
+    uint8_t tag;
+
+    mask = HASHMASK(power);
+    tag = assoc_tag(hv);
+
+    for (b = hv & mask, n = 0; n <= mask; b = (b + 1) & mask, n++) {
+        bucket = &table[b];
+
+        for (match = assoc_tag_match(&bucket->ctl, tag); match != 0;
+             match &= match - 1) {
+            slot = __builtin_ctz(match);
+            if (bucket->slot[slot] != it) {
+                continue;
+            }
+
+            *(volatile uint8_t *)&bucket->ctl.tag[slot] = TAG_FREE;
+
+            for (p = hv & mask; p != b; p = (p + 1) & mask) {
+                assoc_tag_overflow_decr(&table[p]);
+            }
+
+            return true;
+        }
+
+        if (bucket->ctl.tag[TAG_OVERFLOW] == 0) {
+            break;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * The spill list is walked without a lock the way lock-free readers walk
+ * a chained bucket; writers serialize on spill_lock.
+ */
+static struct item *
+assoc_spill_find(const char *key, size_t nkey)
+{
+    struct item *it;
+
+    for (it = ITEM_SLIST_FIRST_VOLATILE(&spill); it != NULL;
+         it = ITEM_SLIST_NEXT_VOLATILE(it, h_sle)) {
+        if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
+            break;
+        }
+    }
+
+    return it;
+}
+
+static struct item *
+assoc_spill_visit(assoc_visit_t visit, struct assoc_visit *v)
+{
+    struct item *it;
+
+    ITEM_SLIST_FOREACH(it, &spill, h_sle) {
+        if (visit(it, v)) {
+            break;
+        }
+    }
+
+    return it;
+}
+
+static void
+assoc_spill_insert(struct item *it)
+{
+    pthread_mutex_lock(&spill_lock);
+    ITEM_SLIST_INSERT_HEAD(&spill, it, h_sle);
+    nspill++;
+    pthread_mutex_unlock(&spill_lock);
+
+    log_debug(LOG_INFO, "tagged hash table with %"PRIu32" items is full, "
+              "%"PRIu32" items spilled", nhash_item, nspill);
+}
+
+static void
+assoc_spill_delete(struct item *it)
+{
+    pthread_mutex_lock(&spill_lock);
+    ITEM_SLIST_REMOVE(&spill, it, h_sle);
+    nspill--;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+/*
+ * Find key with hash value hv in the tagged tables table and, if not NULL,
+ * old, of 2^power and 2^(power - 1) buckets, or on the spill list
+ */
+static struct item *
+assoc_tag_find(struct tag_bucket *table, struct tag_bucket *old,
+               uint32_t power, uint32_t hv, const char *key, size_t nkey)
+{
+    struct item *it;
+
+    it = assoc_tag_find_table(table, power, hv, key, nkey);
+    if (it == NULL && old != NULL) {
+        it = assoc_tag_find_table(old, power - 1, hv, key, nkey);
+    }
+    if (it == NULL && nspill != 0) {
+        it = assoc_spill_find(key, nkey);
+    }
+
+    return it;
+}
+
+static struct item *
+assoc_tag_visit(uint32_t hv, assoc_visit_t visit, struct assoc_visit *v)
+{
+    struct item *it;
+
+    it = assoc_tag_visit_table(primary_tagtable, hash_power, hv, visit, v);
+    if (it == NULL && expanding == 1) {
+        it = assoc_tag_visit_table(old_tagtable, hash_power - 1, hv, visit, v);
+    }
+    if (it == NULL && nspill != 0) {
+        it = assoc_spill_visit(visit, v);
+    }
+
+    return it;
+}
+
+/*
+ * Place it with hash value hv in the primary tagged table, or on the
+ * spill list if the table is full
+ */
+static void
+assoc_tag_place(struct item *it, uint32_t hv)
+{
+    if (!assoc_tag_insert_table(primary_tagtable, hash_power, hv, it)) {
+        assoc_spill_insert(it);
+    }
+}
+
+/*
+ * Move the items in old bucket b to the primary hash table, holding the
+ * stripe that all keys in the bucket share
+ */
+static void
+assoc_move_bucket(uint32_t b)
+{
+    struct item_slh *old_bucket, *new_bucket;
+    struct item *it, *next;
+    uint32_t hv;
+
+    item_lock_hash(b);
+
+    /* lock-free readers retry under the item lock while this is odd */
+    assoc_seq++;
+    __sync_synchronize();
+
+    old_bucket = &old_hashtable[b];
+
+    ITEM_SLIST_FOREACH_SAFE(it, old_bucket, h_sle, next) {
+        hv = assoc_hash(item_key(it), it->nkey);
+        new_bucket = &primary_hashtable[hv & HASHMASK(hash_power)];
+        ITEM_SLIST_REMOVE(old_bucket, it, h_sle);
+        ITEM_SLIST_INSERT_HEAD(new_bucket, it, h_sle);
+        nhash_move++;
+    }
+
+    /* readers pick a table by expand_bucket, so it moves with the items */
+    expand_bucket++;
+
+    __sync_synchronize();
+    assoc_seq++;
+
+    item_unlock();
+}
+
+/*
+ * Move the items in bucket b of the old tagged table to the primary one,
+ * each under its own stripe. An item is only looked at without its stripe
+ * to learn the stripe, and is checked to still be in its slot and to hash
+ * to the stripe once that is held. The overflow counts of the old table
+ * are left as they are, as they only have to be an upper bound.
+ */
+static void
+assoc_tag_move_bucket(uint32_t b)
+{
+    struct tag_bucket *bucket;
+    struct item *it;
+    uint32_t slot, hv;
+    uint8_t nkey;
+    bool moved;
+
+    bucket = &old_tagtable[b];
+
+    for (slot = 0; slot < HASH_TAG_NSLOT; slot++) {
+        do {
+            if (*(volatile uint8_t *)&bucket->ctl.tag[slot] == TAG_FREE) {
+                break;
+            }
+
+            it = *(struct item * volatile *)&bucket->slot[slot];
+
+            /* an item being reused may carry a bogus key length */
+            nkey = it->nkey;
+            if (ITEM_HDR_SIZE + nkey > slab_chunk_size(item_2_slab(it))) {
+                moved = false;
+                continue;
+            }
+
+            item_lock_hash(assoc_hash(item_key(it), nkey));
+
+            moved = false;
+            hv = assoc_hash(item_key(it), it->nkey);
+            if (bucket->ctl.tag[slot] != TAG_FREE &&
+                bucket->slot[slot] == it && item_hash_locked(hv)) {
+                assoc_seq++;
+                __sync_synchronize();
+
+                bucket->ctl.tag[slot] = TAG_FREE;
+                assoc_tag_place(it, hv);
+                nhash_move++;
+
+                __sync_synchronize();
+                assoc_seq++;
+                moved = true;
+            }
+
+            item_unlock();
+        } while (!moved);
+    }
+
+    expand_bucket++;
+}
+
 rstatus_t
 assoc_init(void)
 {
     rstatus_t status;
     uint32_t hashtable_sz;
 
+    hash_table = settings.hash_table;
+
     primary_hashtable = NULL;
-    hash_power = settings.hash_power > 0 ? settings.hash_power : HASH_DEFAULT_POWER;
+    primary_tagtable = NULL;
+    if (settings.hash_power > 0) {
+        hash_power = settings.hash_power;
+    } else if (hash_table == HASH_TABLE_TAGGED) {
+        hash_power = HASH_TAG_DEFAULT_POWER;
+    } else {
+        hash_power = HASH_DEFAULT_POWER;
+    }
 
     old_hashtable = NULL;
-    nhash_move_size = HASH_DEFAULT_MOVE_SIZE;
+    old_tagtable = NULL;
     nhash_item = 0;
     expanding = 0;
     expand_bucket = 0;
+    nexpand = 0;
+    nhash_move = 0;
+    expand_wanted = 0;
+
+    ITEM_SLIST_INIT(&spill);
+    nspill = 0;
+    pthread_mutex_init(&spill_lock, NULL);
 
     hashtable_sz = HASHSIZE(hash_power);
 
-    primary_hashtable = assoc_create_table(hashtable_sz);
-    if (primary_hashtable == NULL) {
-        return MC_ENOMEM;
+    if (hash_table == HASH_TABLE_TAGGED) {
+        primary_tagtable = assoc_create_tagtable(hashtable_sz);
+        if (primary_tagtable == NULL) {
+            return MC_ENOMEM;
+        }
+    } else {
+        primary_hashtable = assoc_create_table(hashtable_sz);
+        if (primary_hashtable == NULL) {
+            return MC_ENOMEM;
+        }
     }
 
+    pthread_mutex_init(&maintenance_lock, NULL);
     pthread_cond_init(&maintenance_cond, NULL);
     run_maintenance_thread = 1;
 
@@ -202,6 +818,61 @@ void
 assoc_deinit(void)
 {
     assoc_stop_maintenance_thread();
+
+    if (primary_hashtable != NULL) {
+        mc_free(primary_hashtable);
+    }
+    if (old_hashtable != NULL) {
+        mc_free(old_hashtable);
+    }
+    if (primary_tagtable != NULL) {
+        mc_free(primary_tagtable);
+    }
+    if (old_tagtable != NULL) {
+        mc_free(old_tagtable);
+    }
+}
+
+/*
+ * Visitor that matches the companion item v->prefix of v->key
+ */
+static bool
+assoc_visit_companion(struct item *it, struct assoc_visit *v)
+{
+    return ((v->nkey + PREFIX_KEY_LEN == it->nkey) &&
+            (memcmp(v->key, item_key(it) + PREFIX_KEY_LEN, v->nkey) == 0) &&
+            (memcmp(v->prefix, item_key(it), PREFIX_KEY_LEN) == 0));
+}
+
+/*
+ * Visitor that records each family member of v->key in v->family
+ */
+static bool
+assoc_visit_family(struct item *it, struct assoc_visit *v)
+{
+    uint32_t m;
+
+    if (v->nkey == it->nkey) {
+        if (memcmp(v->key, item_key(it), v->nkey) == 0) {
+            v->family[ASSOC_FAMILY_KEY] = it;
+        }
+        return false;
+    }
+
+    if (v->nkey + PREFIX_KEY_LEN != it->nkey ||
+        memcmp(v->key, item_key(it) + PREFIX_KEY_LEN, v->nkey) != 0) {
+        return false;
+    }
+
+    for (m = ASSOC_FAMILY_KEY + 1; m < ASSOC_NFAMILY; m++) {
+        if (memcmp(assoc_family_prefix[m], item_key(it),
+                   PREFIX_KEY_LEN) == 0) {
+            v->family[m] = it;
+            break;
+        }
+    }
+
+    return false;
 }
 
 struct item *
@@ -211,13 +882,18 @@ assoc_find(const char *key, size_t nkey)
     struct item *it;
     uint32_t depth;
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(key != NULL && nkey != 0);
 
+    if (hash_table == HASH_TABLE_TAGGED) {
+        return assoc_tag_find(primary_tagtable,
+                              expanding == 1 ? old_tagtable : NULL,
+                              hash_power, assoc_hash(key, nkey), key, nkey);
+    }
+
     bucket = assoc_get_bucket(key, nkey);
 
-    for (depth = 0, it = SLIST_FIRST(bucket); it != NULL;
-         depth++, it = SLIST_NEXT(it, h_sle)) {
+    for (depth = 0, it = ITEM_SLIST_FIRST(bucket); it != NULL;
+         depth++, it = ITEM_SLIST_NEXT(it, h_sle)) {
         if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
             break;
         }
@@ -226,38 +902,277 @@ assoc_find(const char *key, size_t nkey)
     return it;
 }
 
+/*
+ * Find the companion item member of key, e.g. its lease, without building
+ * the companion key. The companion key hashes on key as is, which is not
+ * the bucket of key itself when key looks like a companion key.
+ */
+struct item *
+assoc_find_companion(assoc_family_t member, const char *key, size_t nkey)
+{
+    struct item_slh *bucket;
+    struct item *it;
+    struct assoc_visit v;
+    uint32_t hv;
+
+    ASSERT(key != NULL && nkey != 0);
+    ASSERT(member > ASSOC_FAMILY_KEY && member < ASSOC_NFAMILY);
+
+    v.key = key;
+    v.nkey = nkey;
+    v.prefix = assoc_family_prefix[member];
+    v.family = NULL;
+
+    hv = hash(key, nkey, 0);
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        return assoc_tag_visit(hv, assoc_visit_companion, &v);
+    }
+
+    bucket = assoc_get_bucket_hv(hv);
+
+    for (it = ITEM_SLIST_FIRST(bucket); it != NULL;
+         it = ITEM_SLIST_NEXT(it, h_sle)) {
+        if (assoc_visit_companion(it, &v)) {
+            break;
+        }
+    }
+
+    return it;
+}
+
+/*
+ * Find key and all of its companion items in a single walk of the bucket
+ * they share; family[m] is set to member m, or NULL if there is none.
+ */
+void
+assoc_find_family(const char *key, size_t nkey, struct item **family)
+{
+    struct item_slh *bucket;
+    struct item *it;
+    struct assoc_visit v;
+    uint32_t m;
+
+    ASSERT(key != NULL && nkey != 0);
+
+    if (assoc_key_prefixed(key, nkey)) {
+        /* key and its companions hash to different buckets */
+        family[ASSOC_FAMILY_KEY] = assoc_find(key, nkey);
+        for (m = ASSOC_FAMILY_KEY + 1; m < ASSOC_NFAMILY; m++) {
+            family[m] = assoc_find_companion(m, key, nkey);
+        }
+        return;
+    }
+
+    for (m = 0; m < ASSOC_NFAMILY; m++) {
+        family[m] = NULL;
+    }
+
+    v.key = key;
+    v.nkey = nkey;
+    v.prefix = NULL;
+    v.family = family;
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        assoc_tag_visit(assoc_hash(key, nkey), assoc_visit_family, &v);
+        return;
+    }
+
+    bucket = assoc_get_bucket(key, nkey);
+
+    ITEM_SLIST_FOREACH(it, bucket, h_sle) {
+        assoc_visit_family(it, &v);
+    }
+}
+
+/*
+ * Find an item without holding its item lock. The caller must be inside a
+ * read-side epoch (thread_epoch_enter), which keeps the hash tables and the
+ * items reachable from them from being recycled under us. Inserts publish
+ * a fully initialized item and deletes leave the next pointer of the
+ * deleted item intact, so a chain can always be walked to its end.
+ *
+ * Items that move between tables during expansion can make the walk skip
+ * part of a chain. Returns false when the lookup raced with such a move;
+ * the caller should then retry with assoc_find under the item lock.
+ */
+bool
+assoc_find_lockfree(const char *key, size_t nkey, struct item **itp)
+{
+    struct item_slh *bucket;
+    struct tag_bucket *table, *old;
+    struct item *it;
+    uint32_t seq, power;
+
+    ASSERT(key != NULL && nkey != 0);
+
+    seq = assoc_seq;
+    if ((seq & 1) != 0) {
+        return false;
+    }
+    __sync_synchronize();
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        bucket = NULL;
+        table = primary_tagtable;
+        old = expanding == 1 ? old_tagtable : NULL;
+        power = hash_power;
+    } else {
+        table = old = NULL;
+        power = 0;
+        bucket = assoc_get_bucket(key, nkey);
+    }
+
+    __sync_synchronize();
+    if (assoc_seq != seq) {
+        return false;
+    }
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        it = assoc_tag_find(table, old, power, assoc_hash(key, nkey), key,
+                            nkey);
+    } else {
+        for (it = ITEM_SLIST_FIRST_VOLATILE(bucket); it != NULL;
+             it = ITEM_SLIST_NEXT_VOLATILE(it, h_sle)) {
+            if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
+                break;
+            }
+        }
+    }
+
+    if (it == NULL) {
+        /* a miss is only conclusive if no item moved in the meantime */
+        __sync_synchronize();
+        if (assoc_seq != seq) {
+            return false;
+        }
+    }
+
+    *itp = it;
+
+    return true;
+}
+
 static bool
 assoc_expand_needed(void)
 {
-    return ((settings.hash_power == 0) && (expanding == 0) &&
+    if (expanding != 0) {
+        return false;
+    }
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        /* the tagged table holds at most HASH_TAG_NSLOT items a bucket */
+        return (nhash_item > HASHSIZE(hash_power) * HASH_TAG_LOAD_MAX);
+    }
+
+    return ((settings.hash_power == 0) &&
             (nhash_item > (HASHSIZE(hash_power) * 3 / 2)));
 }
 
 /*
  * Expand the hashtable to the next power of 2. On failure, continue using
- * the old hashtable
+ * the old hashtable.
+ *
+ * The new table is allocated before all item operations are locked out
+ * for the swap, which then takes no time. Items on the spill list of the
+ * tagged table are placed in the new one right away.
  */
 static void
 assoc_expand(void)
 {
     uint32_t hashtable_sz = HASHSIZE(hash_power + 1);
+    struct item_slh *table, spilled;
+    struct tag_bucket *tagtable;
+    struct item *it;
 
-    old_hashtable = primary_hashtable;
-    primary_hashtable = assoc_create_table(hashtable_sz);
-    if (primary_hashtable == NULL) {
-        primary_hashtable = old_hashtable;
-        return;
+    table = NULL;
+    tagtable = NULL;
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        tagtable = assoc_create_tagtable(hashtable_sz);
+        if (tagtable == NULL) {
+            return;
+        }
+    } else {
+        table = assoc_create_table(hashtable_sz);
+        if (table == NULL) {
+            return;
+        }
     }
 
+    item_lock_global();
+
+    assoc_seq++;
+    __sync_synchronize();
+
     log_debug(LOG_INFO, "expanding hash table with %"PRIu32" items to "
-              "%"PRIu32" buckets of size %"PRIu32" bytes", nhash_item,
-              hashtable_sz, sizeof(struct item_slh) * hashtable_sz);
+              "%"PRIu32" buckets", nhash_item, hashtable_sz);
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        old_tagtable = primary_tagtable;
+        primary_tagtable = tagtable;
+    } else {
+        old_hashtable = primary_hashtable;
+        primary_hashtable = table;
+    }
 
     hash_power++;
     expanding = 1;
     expand_bucket = 0;
+    nexpand++;
+
+    spilled = spill;
+    ITEM_SLIST_INIT(&spill);
+    nspill = 0;
+
+    while ((it = ITEM_SLIST_FIRST(&spilled)) != NULL) {
+        ITEM_SLIST_REMOVE_HEAD(&spilled, h_sle);
+        assoc_tag_place(it, assoc_hash(item_key(it), it->nkey));
+    }
+
+    __sync_synchronize();
+    assoc_seq++;
+
+    item_unlock();
+}
+
+/*
+ * Retire the old table once all of its buckets have moved. Lookups in the
+ * tagged layout may be probing the old table until they see expanding
+ * cleared, so it is cleared with all item locks held; lock-free readers
+ * are waited out with an epoch.
+ */
+static void
+assoc_expand_done(void)
+{
+    item_lock_global();
+    expanding = 0;
+    item_unlock();
+
+    thread_epoch_synchronize();
+
+    if (hash_table == HASH_TABLE_TAGGED) {
+        mc_free(old_tagtable);
+    } else {
+        mc_free(old_hashtable);
+    }
+
+    log_debug(LOG_INFO, "expanded hash table to %"PRIu32" buckets with "
+              "%"PRIu32" items", HASHSIZE(hash_power), nhash_item);
+}
 
+/*
+ * Ask the maintenance thread to expand the hash table. The table is
+ * swapped out by the maintenance thread with all item locks held, as
+ * inserts only hold the lock stripe of their own key.
+ */
+static void
+assoc_signal_expand(void)
+{
+    pthread_mutex_lock(&maintenance_lock);
+    expand_wanted = 1;
     pthread_cond_signal(&maintenance_cond);
+    pthread_mutex_unlock(&maintenance_lock);
 }
 
 void
@@ -265,41 +1180,164 @@ assoc_insert(struct item *it)
 {
     struct item_slh *bucket;
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(assoc_find(item_key(it), it->nkey) == NULL);
 
-    bucket = assoc_get_bucket(item_key(it), it->nkey);
-    SLIST_INSERT_HEAD(bucket, it, h_sle);
-    nhash_item++;
+    if (hash_table == HASH_TABLE_TAGGED) {
+        assoc_tag_place(it, assoc_hash(item_key(it), it->nkey));
+    } else {
+        bucket = assoc_get_bucket(item_key(it), it->nkey);
+        /* lock-free readers must never see the item before its next link */
+        ITEM_SLIST_INSERT_HEAD(bucket, it, h_sle);
+    }
+    __sync_fetch_and_add(&nhash_item, 1);
 
-    if (assoc_expand_needed()) {
-        assoc_expand();
+    if (expand_wanted == 0 && assoc_expand_needed()) {
+        assoc_signal_expand();
     }
 }
 
+static void
+assoc_tag_delete(const char *key, size_t nkey)
+{
+    struct item *it;
+    uint32_t hv;
+
+    hv = assoc_hash(key, nkey);
+    it = assoc_tag_find(primary_tagtable, expanding == 1 ? old_tagtable : NULL,
+                        hash_power, hv, key, nkey);
+    ASSERT(it != NULL);
+
+    if (assoc_tag_delete_table(primary_tagtable, hash_power, hv, it)) {
+        return;
+    }
+
+    if (expanding == 1 &&
+        assoc_tag_delete_table(old_tagtable, hash_power - 1, hv, it)) {
+        return;
+    }
+
+    assoc_spill_delete(it);
+}
+
 void
 assoc_delete(const char *key, size_t nkey)
 {
     struct item_slh *bucket;
     struct item *it, *prev;
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(assoc_find(key, nkey) != NULL);
 
+    if (hash_table == HASH_TABLE_TAGGED) {
+        assoc_tag_delete(key, nkey);
+        __sync_fetch_and_sub(&nhash_item, 1);
+        return;
+    }
+
     bucket = assoc_get_bucket(key, nkey);
 
-    for (prev = NULL, it = SLIST_FIRST(bucket); it != NULL;
-         prev = it, it = SLIST_NEXT(it, h_sle)) {
+    for (prev = NULL, it = ITEM_SLIST_FIRST(bucket); it != NULL;
+         prev = it, it = ITEM_SLIST_NEXT(it, h_sle)) {
         if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
             break;
         }
     }
 
     if (prev == NULL) {
-        SLIST_REMOVE_HEAD(bucket, h_sle);
+        ITEM_SLIST_REMOVE_HEAD(bucket, h_sle);
     } else {
-        SLIST_REMOVE_AFTER(prev, h_sle);
+        ITEM_SLIST_REMOVE_AFTER(prev, h_sle);
+    }
+
+    __sync_fetch_and_sub(&nhash_item, 1);
+}
+
+/*
+ * Sample the lengths of chained buckets, or the occupancy of tagged ones,
+ * at up to ASSOC_STATS_NSAMPLE evenly spread buckets of the primary table.
+ * The buckets are read like a lock-free lookup does, inside an epoch,
+ * so this is only a snapshot that may be off by the items that moved.
+ * Freed items are only waited out with lock-free gets on, so otherwise
+ * all item locks are held while sampling.
+ */
+static void
+assoc_sample(struct assoc_stats *stats)
+{
+    struct item_slh *table;
+    struct tag_bucket *tagtable;
+    struct item *it;
+    union tag_ctl ctl;
+    uint64_t i, b, nbucket, stride, len;
+    uint32_t seq;
+
+    if (!settings.lockfree_get) {
+        item_lock_global();
+    }
+    thread_epoch_enter();
+
+    /* the primary table and its size change together, with seq odd */
+    for (;;) {
+        seq = assoc_seq;
+        __sync_synchronize();
+        table = primary_hashtable;
+        tagtable = primary_tagtable;
+        nbucket = HASHSIZE(hash_power);
+        __sync_synchronize();
+        if ((seq & 1) == 0 && assoc_seq == seq) {
+            break;
+        }
+    }
+
+    stats->nsample = MIN(nbucket, ASSOC_STATS_NSAMPLE);
+    stride = nbucket / stats->nsample;
+
+    for (i = 0; i < stats->nsample; i++) {
+        b = i * stride;
+
+        if (hash_table == HASH_TABLE_TAGGED) {
+            ctl.word = *(volatile uint64_t *)&tagtable[b].ctl.word;
+            len = HASH_TAG_NSLOT - __builtin_popcount(
+                assoc_tag_match(&ctl, TAG_FREE));
+            if (ctl.tag[TAG_OVERFLOW] != 0) {
+                stats->noverflow++;
+            }
+        } else {
+            /* items moving between chains could send us around forever */
+            for (len = 0, it = ITEM_SLIST_FIRST_VOLATILE(&table[b]);
+                 it != NULL && len < UINT8_MAX;
+                 len++, it = ITEM_SLIST_NEXT_VOLATILE(it, h_sle)) {
+            }
+        }
+
+        stats->hist[MIN(len, ASSOC_STATS_NBIN - 1)]++;
+    }
+
+    thread_epoch_exit();
+    if (!settings.lockfree_get) {
+        item_unlock();
+    }
+}
+
+void
+assoc_get_stats(struct assoc_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    stats->layout = hash_table;
+    stats->power = hash_power;
+    stats->nbucket = HASHSIZE(stats->power);
+    stats->nslot = stats->nbucket;
+    if (hash_table == HASH_TABLE_TAGGED) {
+        stats->nslot *= HASH_TAG_NSLOT;
+    }
+    stats->nitem = nhash_item;
+    stats->nspill = nspill;
+    stats->expanding = (expanding == 1);
+    if (stats->expanding) {
+        stats->expand_bucket = expand_bucket;
+        stats->expand_nbucket = HASHSIZE(stats->power - 1);
     }
+    stats->nexpand = nexpand;
+    stats->nmove = nhash_move;
 
-    nhash_item--;
+    assoc_sample(stats);
 }
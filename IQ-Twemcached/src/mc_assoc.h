@@ -31,12 +31,64 @@
 #define _MC_ASSOC_H_
 
 #define HASH_MAX_POWER  32
+#define HASH_TAG_NSLOT      7   /* # items in a tagged hash table bucket */
+#define HASH_TAG_LOAD_MAX   6   /* # items a bucket the tagged table grows at */
+
+/*
+ * Hash table layouts
+ */
+typedef enum hash_table_type {
+    HASH_TABLE_CHAINED,     /* a chain of items per bucket */
+    HASH_TABLE_TAGGED,      /* open addressing over tagged buckets */
+    HASH_TABLE_INVALID
+} hash_table_type_t;
+
+/*
+ * A key and its companion keys, which all share one hash bucket
+ */
+typedef enum assoc_family {
+    ASSOC_FAMILY_KEY,       /* the key itself */
+    ASSOC_FAMILY_LEASE,     /* lease, "ls:" */
+    ASSOC_FAMILY_PENDING,   /* pending marker, "pd:" */
+    ASSOC_FAMILY_VERSION,   /* pending version, "nv:" */
+    ASSOC_FAMILY_PTRANS,    /* ptrans, "pt:" */
+    ASSOC_FAMILY_COLEASE,   /* co lease, "co:" */
+    ASSOC_NFAMILY
+} assoc_family_t;
+
+#define ASSOC_STATS_NSAMPLE 4096    /* max # buckets sampled for stats */
+#define ASSOC_STATS_NBIN    9       /* # bucket length bins, the last open */
+
+struct assoc_stats {
+    int      layout;                    /* hash table layout */
+    uint32_t power;                     /* hash power */
+    uint64_t nbucket;                   /* # buckets */
+    uint64_t nslot;                     /* # items the buckets hold */
+    uint32_t nitem;                     /* # items */
+    uint32_t nspill;                    /* # items on the spill list */
+    bool     expanding;                 /* expansion in progress? */
+    uint64_t expand_bucket;             /* # old buckets moved */
+    uint64_t expand_nbucket;            /* # old buckets */
+    uint64_t nexpand;                   /* # expansions */
+    uint64_t nmove;                     /* # items moved by expansions */
+    uint64_t nsample;                   /* # buckets sampled */
+    uint64_t noverflow;                 /* # sampled buckets probed past */
+    uint64_t hist[ASSOC_STATS_NBIN];    /* # sampled buckets by # items */
+};
 
 rstatus_t assoc_init(void);
 void assoc_deinit(void);
 
+uint32_t assoc_hash(const char *key, size_t nkey);
+uint32_t assoc_hash_power(void);
+
 struct item *assoc_find(const char *key, size_t nkey);
+struct item *assoc_find_companion(assoc_family_t member, const char *key, size_t nkey);
+void assoc_find_family(const char *key, size_t nkey, struct item **family);
+bool assoc_find_lockfree(const char *key, size_t nkey, struct item **itp);
 void assoc_insert(struct item *item);
 void assoc_delete(const char *key, size_t nkey);
 
+void assoc_get_stats(struct assoc_stats *stats);
+
 #endif
@@ -0,0 +1,426 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <mc_core.h>
+
+/*
+ * Microbenchmarks of server internals, run with -B name before the server
+ * starts, and printed to stderr.
+ */
+
+#define BENCH_ASSOC_TABLE_SIZE  (4 * MB)        /* hash table memory */
+#define BENCH_ASSOC_ITEM_SIZE   128             /* item with a small value */
+#define BENCH_ASSOC_KEY_LEN     16              /* prefix and 10 digits */
+#define BENCH_ASSOC_NLOOKUP     (2 * 1000 * 1000)
+
+#define BENCH_HASH_NKEY         4096            /* distinct keys per length */
+#define BENCH_HASH_NHASH        (4 * 1024 * 1024)
+#define BENCH_HASH_DIST_NKEY    (1024 * 1024)   /* keys hashed into buckets */
+#define BENCH_HASH_DIST_POWER   16
+
+extern struct settings settings;
+
+struct bench {
+    const char *name;           /* benchmark name */
+    rstatus_t  (*run)(void);    /* benchmark */
+};
+
+struct bench_assoc_table {
+    const char *name;           /* layout name */
+    int        layout;          /* hash_table_type_t */
+    uint32_t   nslot;           /* # items a bucket holds */
+    size_t     bucket_size;     /* bucket size in bytes */
+    double     load_max;        /* load at which the table would grow */
+};
+
+/* items per slot, where a chained bucket has one slot */
+static const double bench_assoc_load[] = { 0.25, 0.5, 0.75, 0.85, 1.5 };
+
+static const struct bench_assoc_table bench_assoc_tables[] = {
+    { "chained", HASH_TABLE_CHAINED, 1, sizeof(struct item_slh), 1.5 },
+    { "tagged", HASH_TABLE_TAGGED, HASH_TAG_NSLOT, 64 /* cache line */,
+      (double)HASH_TAG_LOAD_MAX / HASH_TAG_NSLOT },
+};
+
+/* key lengths, of short and long keys and of the 30-60 bytes of most keys */
+static const uint32_t bench_hash_klen[] = { 8, 16, 32, 48, 64, 128, 250 };
+
+static int64_t
+bench_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void
+bench_assoc_key(char *key, const char *prefix, uint32_t i)
+{
+    char buf[BENCH_ASSOC_KEY_LEN + 1];
+
+    mc_snprintf(buf, sizeof(buf), "%s%010"PRIu32, prefix, i);
+    memcpy(key, buf, BENCH_ASSOC_KEY_LEN);
+}
+
+/*
+ * Time nlookup lookups of the n keys in keys, which are expected to be
+ * found if hit is set. Returns the time per lookup in nsec, or a negative
+ * value if a lookup did not find what it expected.
+ */
+static double
+bench_assoc_lookup(const char *keys, uint32_t n, bool hit)
+{
+    struct item *it;
+    int64_t start, usec;
+    uint32_t i, j;
+
+    start = bench_usec();
+
+    for (i = 0, j = 0; i < BENCH_ASSOC_NLOOKUP; i++) {
+        it = assoc_find(keys + (size_t)j * BENCH_ASSOC_KEY_LEN,
+                        BENCH_ASSOC_KEY_LEN);
+        if ((it != NULL) != hit) {
+            return -1.0;
+        }
+        if (++j == n) {
+            j = 0;
+        }
+    }
+
+    usec = bench_usec() - start;
+
+    return usec * 1000.0 / BENCH_ASSOC_NLOOKUP;
+}
+
+/*
+ * Fill a table of the given layout to the given load with n items laid out
+ * one after another in slabs, and time lookups of them in random order, and
+ * lookups of keys that are not there.
+ */
+static rstatus_t
+bench_assoc_table(const struct bench_assoc_table *t, double load)
+{
+    rstatus_t status;
+    struct item *it;
+    struct slab *slab;
+    char *slabs, *hits, *misses, tmp[BENCH_ASSOC_KEY_LEN];
+    uint32_t power, nbucket, n, nitem, nslab, i, j;
+    double hit_ns, miss_ns;
+
+    nbucket = BENCH_ASSOC_TABLE_SIZE / t->bucket_size;
+    for (power = 0; (1U << power) < nbucket; power++) {
+        /* nbucket is a power of 2 */
+    }
+    n = (uint32_t)(load * nbucket * t->nslot);
+    nitem = slab_size() / BENCH_ASSOC_ITEM_SIZE;
+    nslab = (n + nitem - 1) / nitem;
+
+    slabs = mc_zalloc((size_t)nslab * settings.slab_size);
+    hits = mc_alloc((size_t)n * BENCH_ASSOC_KEY_LEN);
+    misses = mc_alloc((size_t)n * BENCH_ASSOC_KEY_LEN);
+    if (slabs == NULL || hits == NULL || misses == NULL) {
+        status = MC_ENOMEM;
+        goto done;
+    }
+
+    /* compact item links need the slabs of the items in the ref table */
+    status = slab_ref_init(nslab);
+    if (status != MC_OK) {
+        goto done;
+    }
+    for (i = 0; i < nslab; i++) {
+        slab = (struct slab *)(slabs + (size_t)i * settings.slab_size);
+        slab->magic = SLAB_MAGIC;
+        slab_ref_add(slab);
+    }
+
+    settings.hash_table = t->layout;
+    settings.hash_power = (int)power;
+
+    status = assoc_init();
+    if (status != MC_OK) {
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        slab = (struct slab *)(slabs + (size_t)(i / nitem) * settings.slab_size);
+        it = (struct item *)(slab->data +
+                             (size_t)(i % nitem) * BENCH_ASSOC_ITEM_SIZE);
+        item_hdr_init(it, (uint32_t)((uint8_t *)it - (uint8_t *)slab),
+                      SLABCLASS_MIN_ID);
+        it->nkey = BENCH_ASSOC_KEY_LEN;
+        bench_assoc_key(item_key(it), "bench:", i);
+        assoc_insert(it);
+
+        bench_assoc_key(hits + (size_t)i * BENCH_ASSOC_KEY_LEN, "bench:", i);
+        bench_assoc_key(misses + (size_t)i * BENCH_ASSOC_KEY_LEN, "bmiss:", i);
+    }
+
+    /* look keys up in an order that has nothing to do with memory order */
+    for (i = n - 1; i > 0; i--) {
+        j = (uint32_t)rand() % (i + 1);
+        memcpy(tmp, hits + (size_t)i * BENCH_ASSOC_KEY_LEN, BENCH_ASSOC_KEY_LEN);
+        memcpy(hits + (size_t)i * BENCH_ASSOC_KEY_LEN,
+               hits + (size_t)j * BENCH_ASSOC_KEY_LEN, BENCH_ASSOC_KEY_LEN);
+        memcpy(hits + (size_t)j * BENCH_ASSOC_KEY_LEN, tmp, BENCH_ASSOC_KEY_LEN);
+    }
+
+    hit_ns = bench_assoc_lookup(hits, n, true);
+    miss_ns = bench_assoc_lookup(misses, n, false);
+
+    assoc_deinit();
+
+    if (hit_ns < 0 || miss_ns < 0) {
+        log_stderr("twemcache: %s hash table lookup returned a wrong item",
+                   t->name);
+        status = MC_ERROR;
+        goto done;
+    }
+
+    log_stderr("%-8s %6.2f %10"PRIu32" %7"PRIu32" %10.1f %10.1f", t->name,
+               load, n, power, hit_ns, miss_ns);
+
+done:
+    slab_ref_deinit();
+    if (slabs != NULL) {
+        mc_free(slabs);
+    }
+    if (hits != NULL) {
+        mc_free(hits);
+    }
+    if (misses != NULL) {
+        mc_free(misses);
+    }
+
+    return status;
+}
+
+/*
+ * Compare hash lookups in the chained and the tagged hash table, both of
+ * BENCH_ASSOC_TABLE_SIZE bytes, at different loads
+ */
+static rstatus_t
+bench_assoc(void)
+{
+    rstatus_t status;
+    uint32_t i, j;
+
+    log_stderr("hash table lookups, %d MB tables, %d byte items, %d byte "
+               "keys", BENCH_ASSOC_TABLE_SIZE / MB, BENCH_ASSOC_ITEM_SIZE,
+               BENCH_ASSOC_KEY_LEN);
+    log_stderr("%-8s %6s %10s %7s %10s %10s", "layout", "load", "items",
+               "power", "hit ns", "miss ns");
+
+    srand(1);
+
+    for (i = 0; i < NELEMS(bench_assoc_tables); i++) {
+        for (j = 0; j < NELEMS(bench_assoc_load); j++) {
+            if (bench_assoc_load[j] > bench_assoc_tables[i].load_max) {
+                continue;
+            }
+
+            status = bench_assoc_table(&bench_assoc_tables[i],
+                                       bench_assoc_load[j]);
+            if (status != MC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Fill key with a key of nkey bytes that ends in the number i, so that
+ * keys of a run only differ in their last digits, as keys of an
+ * application often do.
+ */
+static void
+bench_hash_key(char *key, uint32_t nkey, uint32_t i)
+{
+    char buf[16];
+    int n;
+
+    memset(key, 'k', nkey);
+    memcpy(key, "user:", MIN(nkey, 5));
+
+    n = mc_snprintf(buf, sizeof(buf), "%07"PRIu32, i);
+    n = MIN(n, (int)nkey);
+    memcpy(key + nkey - n, buf + strlen(buf) - n, n);
+}
+
+/*
+ * Time hashes of BENCH_HASH_NKEY keys of nkey bytes. Returns the time per
+ * hash in nsec.
+ */
+static double
+bench_hash_speed(hash_t h, const char *keys, uint32_t nkey)
+{
+    int64_t start, usec;
+    uint32_t i, j, sum;
+
+    start = bench_usec();
+
+    for (i = 0, j = 0, sum = 0; i < BENCH_HASH_NHASH; i++) {
+        sum += h(keys + (size_t)j * nkey, nkey, 0);
+        j = (j + 1) & (BENCH_HASH_NKEY - 1);
+    }
+
+    usec = bench_usec() - start;
+
+    /* use the hashes, so that they are not optimized away */
+    if (sum == 0) {
+        usec++;
+    }
+
+    return usec * 1000.0 / BENCH_HASH_NHASH;
+}
+
+/*
+ * Hash BENCH_HASH_DIST_NKEY sequential keys of nkey bytes into buckets by
+ * their low bits, as the hash table does, and return the chi-square of
+ * the bucket counts over its degrees of freedom, which is about 1 for a
+ * uniform hash, and the most keys in a bucket.
+ */
+static double
+bench_hash_dist(hash_t h, uint32_t nkey, uint32_t *count, uint32_t *max)
+{
+    char key[KEY_MAX_LEN];
+    uint32_t nbucket, i;
+    double expected, chi2, d;
+
+    nbucket = 1U << BENCH_HASH_DIST_POWER;
+    memset(count, 0, nbucket * sizeof(*count));
+
+    for (i = 0; i < BENCH_HASH_DIST_NKEY; i++) {
+        bench_hash_key(key, nkey, i);
+        count[h(key, nkey, 0) & (nbucket - 1)]++;
+    }
+
+    expected = (double)BENCH_HASH_DIST_NKEY / nbucket;
+    for (i = 0, chi2 = 0.0, *max = 0; i < nbucket; i++) {
+        d = count[i] - expected;
+        chi2 += d * d / expected;
+        *max = MAX(*max, count[i]);
+    }
+
+    return chi2 / (nbucket - 1);
+}
+
+/*
+ * Compare the speed and the bucket distribution of the key hashes over
+ * keys of different lengths
+ */
+static rstatus_t
+bench_hash(void)
+{
+    rstatus_t status;
+    hash_t h;
+    char *keys;
+    uint32_t *count, i, j, k, nkey, max;
+    double ns, chi2;
+
+    status = MC_OK;
+
+    keys = mc_alloc((size_t)BENCH_HASH_NKEY * KEY_MAX_LEN);
+    count = mc_alloc(sizeof(*count) << BENCH_HASH_DIST_POWER);
+    if (keys == NULL || count == NULL) {
+        status = MC_ENOMEM;
+        goto done;
+    }
+
+    log_stderr("key hashes, %d hashes over %d keys per length, %d keys "
+               "into %d buckets", BENCH_HASH_NHASH, BENCH_HASH_NKEY,
+               BENCH_HASH_DIST_NKEY, 1 << BENCH_HASH_DIST_POWER);
+    log_stderr("%-8s %6s %8s %8s %8s %6s", "hash", "keylen", "ns", "MB/s",
+               "chi2/df", "max");
+
+    for (i = 0; i < HASH_INVALID; i++) {
+        h = hash_func(i);
+
+        for (j = 0; j < NELEMS(bench_hash_klen); j++) {
+            nkey = MIN(bench_hash_klen[j], KEY_MAX_LEN);
+
+            for (k = 0; k < BENCH_HASH_NKEY; k++) {
+                bench_hash_key(keys + (size_t)k * nkey, nkey, k);
+            }
+
+            ns = bench_hash_speed(h, keys, nkey);
+            chi2 = bench_hash_dist(h, nkey, count, &max);
+
+            log_stderr("%-8s %6"PRIu32" %8.1f %8.0f %8.3f %6"PRIu32,
+                       hash_name(i), nkey, ns, nkey * 1000.0 / ns, chi2, max);
+        }
+    }
+
+done:
+    if (keys != NULL) {
+        mc_free(keys);
+    }
+    if (count != NULL) {
+        mc_free(count);
+    }
+
+    return status;
+}
+
+static const struct bench benches[] = {
+    { "assoc", bench_assoc },
+    { "hash", bench_hash },
+};
+
+/*
+ * Run the microbenchmark name
+ */
+rstatus_t
+bench_run(const char *name)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    /* the assoc benchmark hashes keys with the hash of -H */
+    status = hash_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < NELEMS(benches); i++) {
+        if (strcmp(name, benches[i].name) == 0) {
+            return benches[i].run();
+        }
+    }
+
+    log_stderr("twemcache: '%s' is not a valid benchmark", name);
+
+    return MC_ERROR;
+}
@@ -0,0 +1,822 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Binary protocol
+ *
+ * The IQ and CO lease commands, framed as a fixed size header followed by
+ * the key, the transaction or session id and the value, if any. Numbers
+ * travel as fixed width integers, so nothing is tokenized or converted to
+ * and from text on either side. A TCP connection speaks binary if the
+ * first byte it sends is BIN_REQ_MAGIC, and ascii otherwise, for as long
+ * as it is open.
+ *
+ * Requests go to the same item_* calls as their ascii counterparts and
+ * return the same results, mapped to a bin_status_t. Values are read
+ * straight into the item, and sent straight from it, as in ascii.
+ */
+
+#define DEFINE_ACTION(_name, _value, _type) [_value] = _type,
+static req_type_t bin_req_type[BIN_OP_SENTINEL] = {
+    BIN_OPCODE( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+static uint64_t
+bin_swap64(uint64_t val)
+{
+#ifdef MC_LITTLE_ENDIAN
+    return ((uint64_t)ntohl((uint32_t)val) << 32) | ntohl((uint32_t)(val >> 32));
+#else
+    return val;
+#endif
+}
+
+static void
+bin_read_header(const char *buf, struct bin_req_header *h)
+{
+    memcpy(h, buf, BIN_REQ_HDR_SIZE);
+
+    h->bodylen = ntohl(h->bodylen);
+    h->config = (int32_t)ntohl((uint32_t)h->config);
+    h->fconfig = (int32_t)ntohl((uint32_t)h->fconfig);
+    h->dataflags = ntohl(h->dataflags);
+    h->exptime = (int32_t)ntohl((uint32_t)h->exptime);
+    h->arg = ntohl(h->arg);
+    h->token = bin_swap64(h->token);
+}
+
+static void
+bin_write_header(struct conn *c, char *buf, bin_status_t status, uint8_t arg8,
+                 uint32_t bodylen, uint32_t dataflags, int32_t config,
+                 uint64_t token)
+{
+    struct bin_rsp_header h;
+
+    h.magic = BIN_RSP_MAGIC;
+    h.opcode = (uint8_t)c->req[1];
+    h.status = (uint8_t)status;
+    h.arg8 = arg8;
+    h.bodylen = htonl(bodylen);
+    h.dataflags = htonl(dataflags);
+    h.config = (int32_t)htonl((uint32_t)config);
+    h.token = bin_swap64(token);
+
+    memcpy(buf, &h, BIN_RSP_HDR_SIZE);
+}
+
+/*
+ * Reply with a header and no body, unless the request asked for no reply
+ */
+static void
+bin_write_status(struct conn *c, bin_status_t status, uint8_t arg8,
+                 uint64_t token)
+{
+    log_debug(LOG_VVERB, "write on c %d noreply %d status %d", c->sd,
+              c->noreply, status);
+
+    if (c->noreply) {
+        c->noreply = 0;
+        conn_set_state(c, CONN_NEW_CMD);
+        return;
+    }
+
+    bin_write_header(c, c->wbuf, status, arg8, 0, 0, 0, token);
+    c->wbytes = BIN_RSP_HDR_SIZE;
+    c->wcurr = c->wbuf;
+
+    conn_set_state(c, CONN_WRITE);
+    c->write_and_go = CONN_NEW_CMD;
+}
+
+void
+bin_write_server_error(struct conn *c)
+{
+    stats_thread_incr(server_error);
+
+    bin_write_status(c, BIN_SERVER_ERROR, 0, 0);
+}
+
+static void
+bin_write_client_error(struct conn *c)
+{
+    stats_thread_incr(cmd_error);
+
+    bin_write_status(c, BIN_CLIENT_ERROR, 0, 0);
+}
+
+/*
+ * Reply with the value of item it, whose reference is dropped once the
+ * reply has been sent. Values are always sent, noreply or not.
+ */
+static void
+bin_write_item(struct conn *c, bin_status_t status, struct item *it,
+               uint8_t arg8, uint64_t token)
+{
+    char *hdr;
+
+    c->noreply = 0;
+
+    hdr = cache_alloc(c->thread->suffix_cache);
+    if (hdr == NULL) {
+        log_warn("server error on c %d for req of type %d with enomem on "
+                 "suffix cache", c->sd, c->req_type);
+
+        item_remove(it);
+        bin_write_server_error(c);
+        return;
+    }
+
+    bin_write_header(c, hdr, status, arg8, it->nbyte, it->dataflags,
+                     it->config_number, token);
+
+    if (conn_add_iov(c, hdr, BIN_RSP_HDR_SIZE) != MC_OK ||
+        conn_add_iov(c, item_data(it), it->nbyte) != MC_OK) {
+        log_warn("server error on c %d for req of type %d with enomem", c->sd,
+                 c->req_type);
+
+        cache_free(c->thread->suffix_cache, hdr);
+        item_remove(it);
+
+        /* drop the partial reply */
+        if (conn_reset_reply(c) != MC_OK) {
+            conn_set_state(c, CONN_CLOSE);
+            return;
+        }
+        bin_write_server_error(c);
+        return;
+    }
+
+    c->slist[0] = hdr;
+    c->scurr = c->slist;
+    c->sleft = 1;
+
+    c->ilist[0] = it;
+    c->icurr = c->ilist;
+    c->ileft = 1;
+
+    conn_set_state(c, CONN_MWRITE);
+    c->msg_curr = 0;
+}
+
+/*
+ * Throw away the nbyte value bytes of a request that is not going to
+ * read them, once its reply is out
+ */
+static void
+bin_swallow(struct conn *c, uint32_t nbyte)
+{
+    if (nbyte == 0) {
+        return;
+    }
+
+    ASSERT(c->state == CONN_WRITE || c->state == CONN_NEW_CMD);
+
+    c->sbytes = (int)nbyte;
+    if (c->state == CONN_WRITE) {
+        c->write_and_go = CONN_SWALLOW;
+    } else {
+        conn_set_state(c, CONN_SWALLOW);
+    }
+}
+
+/*
+ * Check the client configuration against the one of the fragment of key,
+ * or of no fragment if key is NULL. Returns the configuration to stamp
+ * new items with, or -1 after replying BIN_FAIL.
+ */
+static int32_t
+bin_check_config(struct conn *c, int32_t config, const char *key, size_t nkey)
+{
+    int32_t server_config;
+
+    if (!fragment_check(config, key, nkey, &server_config)) {
+        bin_write_status(c, BIN_FAIL, 0, 0);
+        return -1;
+    }
+
+    return server_config;
+}
+
+static void
+bin_process_iqget(struct conn *c, struct bin_req_header *h, char *key,
+                  char *tid)
+{
+    item_iq_result_t exc;
+    struct item *it = NULL;
+    lease_token_t new_lease_token = 0;
+
+    if (bin_check_config(c, h->config, key, h->nkey) == -1) {
+        return;
+    }
+
+    /* msec to wait on a held I lease before a lease reply, see mc_wait.c */
+    c->w_msec = (int)MIN(h->arg, WAIT_MAX_MSEC);
+
+    exc = item_iqget(key, h->nkey, h->token, h->ntid > 0 ? tid : NULL,
+                     h->ntid, c, &it, &new_lease_token, 0, h->arg8);
+    switch (exc) {
+    case IQ_VALUE:
+        bin_write_item(c, BIN_VALUE, it, it->p, 0);
+        return;
+
+    case IQ_NO_VALUE:
+        bin_write_status(c, BIN_NOVALUE, 0, 0);
+        break;
+
+    case IQ_MISS:
+    case IQ_LEASE:
+        bin_write_status(c, BIN_LEASE, it != NULL ? it->p : 0,
+                         new_lease_token);
+        break;
+
+    case IQ_WAIT:
+        conn_set_state(c, CONN_PARK);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+
+    if (it != NULL) {
+        item_remove(it);
+    }
+}
+
+static void
+bin_process_qareg(struct conn *c, struct bin_req_header *h, char *key,
+                  char *tid)
+{
+    uint8_t marked;
+
+    if (bin_check_config(c, h->config, key, h->nkey) == -1) {
+        return;
+    }
+
+    if (item_quarantine_and_register(tid, h->ntid, key, h->nkey, &marked,
+                                     c) == MC_OK) {
+        bin_write_status(c, BIN_LEASE, marked, 0);
+    } else {
+        bin_write_server_error(c);
+    }
+}
+
+static void
+bin_process_qaread(struct conn *c, struct bin_req_header *h, char *key,
+                   char *tid)
+{
+    rstatus_t status;
+    struct item *it = NULL;
+    lease_token_t new_lease_token = 0;
+    uint8_t p = 0;
+
+    if (bin_check_config(c, h->config, key, h->nkey) == -1) {
+        return;
+    }
+
+    status = item_quarantine_and_read(h->ntid > 0 ? tid : NULL, h->ntid, key,
+                                      h->nkey, h->token, &new_lease_token, c,
+                                      &it, &p);
+    switch (status) {
+    case MC_OK:
+        if (it != NULL && h->arg8 != 0) {
+            bin_write_item(c, BIN_LEASE_VALUE, it, p, new_lease_token);
+            return;
+        }
+        bin_write_status(c, BIN_LEASE, p, new_lease_token);
+        break;
+
+    case MC_INVALID:
+        bin_write_status(c, BIN_INVALID, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+
+    if (it != NULL) {
+        item_remove(it);
+    }
+}
+
+static void
+bin_process_commit(struct conn *c, struct bin_req_header *h, char *tid)
+{
+    item_iq_result_t exc;
+
+    if (bin_check_config(c, h->config, NULL, 0) == -1) {
+        return;
+    }
+
+    exc = item_commit(tid, h->ntid, c, (int32_t)h->arg, h->fconfig);
+    switch (exc) {
+    case IQ_OK:
+        bin_write_status(c, BIN_OK, 0, 0);
+        break;
+
+    case IQ_NOT_FOUND:
+        bin_write_status(c, BIN_NOT_FOUND, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+}
+
+static void
+bin_process_release(struct conn *c, struct bin_req_header *h, char *tid)
+{
+    item_iq_result_t exc;
+
+    exc = item_release(tid, h->ntid, c);
+    switch (exc) {
+    case IQ_OK:
+        bin_write_status(c, BIN_OK, 0, 0);
+        break;
+
+    case IQ_NOT_FOUND:
+        bin_write_status(c, BIN_NOT_FOUND, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+}
+
+static void
+bin_process_ciget(struct conn *c, struct bin_req_header *h, char *key,
+                  char *sid)
+{
+    item_co_result_t exc;
+    struct item *it = NULL;
+    lease_token_t new_lease_token = 0;
+
+    exc = item_ciget(sid, h->ntid, key, h->nkey, h->token, c, &it,
+                     &new_lease_token);
+    switch (exc) {
+    case CO_OK:
+        if (new_lease_token != 0) {
+            bin_write_status(c, BIN_LEASE, 0, new_lease_token);
+        } else if (it == NULL || item_data(it) == NULL) {
+            bin_write_status(c, BIN_NOVALUE, 0, 0);
+        } else {
+            bin_write_item(c, BIN_VALUE, it, 0, 0);
+            return;
+        }
+        break;
+
+    case CO_RETRY:
+        bin_write_status(c, BIN_RETRY, 0, 0);
+        break;
+
+    case CO_ABORT:
+        bin_write_status(c, BIN_ABORT, 0, 0);
+        break;
+
+    case CO_INVALID:
+        bin_write_status(c, BIN_INVALID, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+
+    if (it != NULL) {
+        item_remove(it);
+    }
+}
+
+static void
+bin_process_oqread(struct conn *c, struct bin_req_header *h, char *key,
+                   char *sid)
+{
+    item_co_result_t exc;
+    struct item *it = NULL;
+
+    exc = item_oqread(sid, h->ntid, key, h->nkey, c, &it);
+    switch (exc) {
+    case CO_OK:
+        if (it != NULL) {
+            bin_write_item(c, BIN_VALUE, it, 0, 0);
+            return;
+        }
+        bin_write_status(c, BIN_NOVALUE, 0, 0);
+        break;
+
+    case CO_ABORT:
+        bin_write_status(c, BIN_ABORT, 0, 0);
+        break;
+
+    case CO_INVALID:
+        bin_write_status(c, BIN_INVALID, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+
+    if (it != NULL) {
+        item_remove(it);
+    }
+}
+
+/*
+ * Reply to the result of a session command, oqreg, dcommit or validate
+ */
+static void
+bin_write_co_result(struct conn *c, item_co_result_t exc)
+{
+    switch (exc) {
+    case CO_OK:
+        bin_write_status(c, BIN_OK, 0, 0);
+        break;
+
+    case CO_INVALID:
+        bin_write_status(c, BIN_INVALID, 0, 0);
+        break;
+
+    case CO_NOT_FOUND:
+        bin_write_status(c, BIN_NOT_FOUND, 0, 0);
+        break;
+
+    case CO_ABORT:
+        bin_write_status(c, BIN_ABORT, 0, 0);
+        break;
+
+    default:
+        bin_write_server_error(c);
+        break;
+    }
+}
+
+/*
+ * Allocate the item of iqset, sar, swap or oqswap and read its value into
+ * it; the command completes in bin_complete_nread
+ */
+static void
+bin_process_store(struct conn *c, struct bin_req_header *h, char *key,
+                  char *tid, uint32_t vlen)
+{
+    struct item *it;
+    rel_time_t exptime;
+    int32_t server_config;
+    bool rejected;
+    uint8_t id;
+
+    server_config = 0;
+    if (c->req_type != REQ_OQSWAP) {
+        server_config = bin_check_config(c, h->config, key, h->nkey);
+        if (server_config == -1) {
+            bin_swallow(c, vlen);
+            return;
+        }
+        if (h->fconfig != -1) {
+            server_config = h->fconfig;
+        }
+    }
+
+    id = item_slabid(h->nkey, vlen);
+    if (id == SLABCLASS_INVALID_ID) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d and "
+                  "slab id out of range for key size %"PRIu8" and value size "
+                  "%"PRIu32, c->sd, c->req_type, h->nkey, vlen);
+
+        bin_write_client_error(c);
+        bin_swallow(c, vlen);
+        return;
+    }
+
+    exptime = time_reltime((time_t)h->exptime);
+    rejected = false;
+
+    switch (c->req_type) {
+    case REQ_IQSET:
+        it = item_alloc_admit(id, key, h->nkey, h->dataflags, exptime, vlen,
+                              server_config, &rejected);
+        break;
+
+    case REQ_SWAP:
+        it = item_alloc_config(id, key, h->nkey, h->dataflags, exptime, vlen,
+                               server_config);
+        break;
+
+    default:
+        it = item_alloc(id, key, h->nkey, h->dataflags, exptime, vlen);
+        break;
+    }
+
+    if (it == NULL) {
+        if (rejected) {
+            bin_write_status(c, BIN_NOT_STORED, 0, 0);
+        } else {
+            log_warn("server error on c %d for req of type %d because of oom "
+                     "in storing item", c->sd, c->req_type);
+
+            bin_write_server_error(c);
+        }
+        bin_swallow(c, vlen);
+
+        /* avoid stale data persisting in cache because we failed alloc */
+        if (c->req_type != REQ_OQSWAP) {
+            it = item_get(key, h->nkey);
+            if (it != NULL) {
+                item_delete(it);
+            }
+        }
+        return;
+    }
+
+    c->lease_token = h->token;
+    if (c->req_type == REQ_OQSWAP) {
+        c->tid = tid;
+        c->ntid = h->ntid;
+    }
+
+    c->item = it;
+    c->ritem = item_data(it);
+    c->rlbytes = (int)vlen;
+    conn_set_state(c, CONN_NREAD);
+}
+
+/*
+ * We get here after reading the value of iqset, sar, swap or oqswap into
+ * c->item
+ */
+void
+bin_complete_nread(struct conn *c)
+{
+    struct item *it;
+    item_store_result_t ret;
+    item_co_result_t retco;
+
+    it = c->item;
+
+    /* stored items end in crlf whichever protocol they came in on */
+    memcpy(item_data(it) + it->nbyte, CRLF, CRLF_LEN);
+
+    switch (c->req_type) {
+    case REQ_IQSET:
+        ret = item_store(it, c->req_type, c);
+        switch (ret) {
+        case STORED:
+            bin_write_status(c, BIN_STORED, 0, 0);
+            break;
+
+        case EXISTS:
+            bin_write_status(c, BIN_EXISTS, 0, 0);
+            break;
+
+        case NOT_FOUND:
+            bin_write_status(c, BIN_NOT_FOUND, 0, 0);
+            break;
+
+        case NOT_STORED:
+            bin_write_status(c, BIN_NOT_STORED, 0, 0);
+            break;
+
+        default:
+            bin_write_server_error(c);
+            break;
+        }
+        break;
+
+    case REQ_SAR:
+        ret = item_swap_and_release(it, c);
+        bin_write_status(c, ret == STORED ? BIN_STORED :
+                         ret == NOT_STORED ? BIN_NOT_STORED : BIN_INVALID, 0, 0);
+        break;
+
+    case REQ_SWAP:
+        ret = item_swap(it, c);
+        bin_write_status(c, ret == STORED ? BIN_STORED :
+                         ret == NOT_STORED ? BIN_ABORT : BIN_INVALID, 0, 0);
+        break;
+
+    case REQ_OQSWAP:
+        retco = item_oqswap(c->tid, c->ntid, it, c);
+        bin_write_status(c, retco == CO_OK ? BIN_STORED :
+                         retco == CO_ABORT ? BIN_ABORT : BIN_INVALID, 0, 0);
+        break;
+
+    default:
+        NOT_REACHED();
+        break;
+    }
+
+    item_remove(it);
+    c->item = NULL;
+}
+
+static void
+bin_dispatch(struct conn *c)
+{
+    struct bin_req_header h;
+    char *key, *tid;
+    uint32_t vlen;
+
+    bin_read_header(c->req, &h);
+
+    key = c->req + BIN_REQ_HDR_SIZE;
+    tid = key + h.nkey;
+    vlen = h.bodylen - h.nkey - h.ntid;
+
+    c->req_type = h.opcode < BIN_OP_SENTINEL ? bin_req_type[h.opcode] :
+                  REQ_UNKNOWN;
+    c->noreply = (h.flags & BIN_FLAG_NOREPLY) ? 1 : 0;
+
+    if (conn_reset_reply(c) != MC_OK) {
+        log_warn("server error on c %d for req of type %d because of oom in "
+                 "preparing response", c->sd, c->req_type);
+
+        bin_write_server_error(c);
+        bin_swallow(c, vlen);
+        return;
+    }
+
+    if (c->req_type == REQ_UNKNOWN) {
+        log_debug(LOG_INFO, "req on c %d with unknown opcode %"PRIu8, c->sd,
+                  h.opcode);
+
+        stats_thread_incr(cmd_error);
+        bin_write_status(c, BIN_UNKNOWN_COMMAND, 0, 0);
+        bin_swallow(c, vlen);
+        return;
+    }
+
+    if (h.nkey > KEY_MAX_LEN || h.ntid > TID_MAX_LEN) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d and %d "
+                  "length key %d length id", c->sd, c->req_type, h.nkey,
+                  h.ntid);
+
+        bin_write_client_error(c);
+        bin_swallow(c, vlen);
+        return;
+    }
+
+    switch (c->req_type) {
+    case REQ_IQSET:
+    case REQ_SAR:
+    case REQ_SWAP:
+    case REQ_OQSWAP:
+        if (c->req_type == REQ_SWAP) {
+            stats_thread_incr(swap);
+        } else if (c->req_type == REQ_OQSWAP) {
+            stats_thread_incr(oqswap);
+        }
+        bin_process_store(c, &h, key, tid, vlen);
+        return;
+
+    default:
+        break;
+    }
+
+    if (vlen != 0) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+                  "%"PRIu32" unexpected value bytes", c->sd, c->req_type, vlen);
+
+        bin_write_client_error(c);
+        bin_swallow(c, vlen);
+        return;
+    }
+
+    switch (c->req_type) {
+    case REQ_IQGET:
+        bin_process_iqget(c, &h, key, tid);
+        break;
+
+    case REQ_QAREG:
+        bin_process_qareg(c, &h, key, tid);
+        break;
+
+    case REQ_QAREAD:
+        bin_process_qaread(c, &h, key, tid);
+        break;
+
+    case REQ_COMMIT:
+        bin_process_commit(c, &h, tid);
+        break;
+
+    case REQ_RELEASE:
+        bin_process_release(c, &h, tid);
+        break;
+
+    case REQ_CIGET:
+        bin_process_ciget(c, &h, key, tid);
+        break;
+
+    case REQ_OQREG:
+        bin_write_co_result(c, item_oqreg(c, tid, h.ntid, key, h.nkey));
+        break;
+
+    case REQ_OQREAD:
+        stats_thread_incr(oqread);
+        bin_process_oqread(c, &h, key, tid);
+        break;
+
+    case REQ_DCOMMIT:
+        bin_write_co_result(c, item_dcommit(tid, h.ntid, c));
+        break;
+
+    case REQ_VALIDATE:
+        stats_thread_incr(validate);
+        bin_write_co_result(c, item_validate(tid, h.ntid, c));
+        break;
+
+    default:
+        NOT_REACHED();
+        break;
+    }
+}
+
+bool
+bin_is_request(const char *buf)
+{
+    return (uint8_t)buf[0] == BIN_REQ_MAGIC;
+}
+
+rstatus_t
+bin_parse(struct conn *c)
+{
+    struct bin_req_header h;
+    int len;
+
+    if (c->rbytes < BIN_REQ_HDR_SIZE) {
+        return MC_EAGAIN;
+    }
+
+    bin_read_header(c->rcurr, &h);
+
+    /* a frame we cannot make sense of leaves us nowhere to resume from */
+    if (h.magic != BIN_REQ_MAGIC ||
+        h.bodylen < (uint32_t)h.nkey + (uint32_t)h.ntid) {
+        log_hexdump(LOG_NOTICE, c->rcurr, BIN_REQ_HDR_SIZE, "client error on "
+                    "c %d with malformed binary header", c->sd);
+
+        conn_set_state(c, CONN_CLOSE);
+        return MC_ERROR;
+    }
+
+    len = BIN_REQ_HDR_SIZE + h.nkey + h.ntid;
+    if (c->rbytes < len) {
+        return MC_EAGAIN;
+    }
+
+    log_hexdump(LOG_VERB, c->rcurr, len, "recv on c %d binary req with %d "
+                "bytes", c->sd, len);
+
+    c->req = c->rcurr;
+    c->req_len = len;
+
+    bin_dispatch(c);
+
+    c->rbytes -= len;
+    c->rcurr += len;
+
+    return MC_OK;
+}
+
+/*
+ * Replay the request a parked connection was waiting on; c->req still
+ * points at it because nothing is read off a parked connection.
+ */
+void
+bin_resume(struct conn *c)
+{
+    bin_dispatch(c);
+}
@@ -0,0 +1,126 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_BINARY_H_
+#define _MC_BINARY_H_
+
+/*
+ * Binary framing of the IQ and CO lease commands; the wire format is
+ * described in notes/binary_protocol.md. All fields are in network byte
+ * order.
+ */
+
+#define BIN_REQ_MAGIC       0x80
+#define BIN_RSP_MAGIC       0x81
+
+#define BIN_REQ_HDR_SIZE    40
+#define BIN_RSP_HDR_SIZE    24
+
+#define BIN_FLAG_NOREPLY    0x01
+
+/*
+ *           opcode     value   request type
+ */
+#define BIN_OPCODE(ACTION)                      \
+    ACTION( IQGET,      0x01,   REQ_IQGET     ) \
+    ACTION( IQSET,      0x02,   REQ_IQSET     ) \
+    ACTION( QAREG,      0x03,   REQ_QAREG     ) \
+    ACTION( QAREAD,     0x04,   REQ_QAREAD    ) \
+    ACTION( SAR,        0x05,   REQ_SAR       ) \
+    ACTION( SWAP,       0x06,   REQ_SWAP      ) \
+    ACTION( COMMIT,     0x07,   REQ_COMMIT    ) \
+    ACTION( RELEASE,    0x08,   REQ_RELEASE   ) \
+    ACTION( CIGET,      0x09,   REQ_CIGET     ) \
+    ACTION( OQREG,      0x0a,   REQ_OQREG     ) \
+    ACTION( OQREAD,     0x0b,   REQ_OQREAD    ) \
+    ACTION( OQSWAP,     0x0c,   REQ_OQSWAP    ) \
+    ACTION( DCOMMIT,    0x0d,   REQ_DCOMMIT   ) \
+    ACTION( VALIDATE,   0x0e,   REQ_VALIDATE  ) \
+
+#define DEFINE_ACTION(_name, _value, _type) BIN_OP_##_name = _value,
+typedef enum bin_opcode {
+    BIN_OPCODE( DEFINE_ACTION )
+    BIN_OP_SENTINEL
+} bin_opcode_t;
+#undef DEFINE_ACTION
+
+typedef enum bin_status {
+    BIN_OK              = 0x00,
+    BIN_STORED          = 0x01,
+    BIN_NOT_STORED      = 0x02,
+    BIN_EXISTS          = 0x03,
+    BIN_NOT_FOUND       = 0x04,
+    BIN_VALUE           = 0x05, /* value in the body */
+    BIN_NOVALUE         = 0x06,
+    BIN_LEASE           = 0x07, /* lease token, no value */
+    BIN_LEASE_VALUE     = 0x08, /* lease token and value in the body */
+    BIN_ABORT           = 0x09,
+    BIN_INVALID         = 0x0a,
+    BIN_RETRY           = 0x0b,
+    BIN_FAIL            = 0x0c, /* stale configuration */
+    BIN_CLIENT_ERROR    = 0x0d,
+    BIN_SERVER_ERROR    = 0x0e,
+    BIN_UNKNOWN_COMMAND = 0x0f
+} bin_status_t;
+
+struct bin_req_header {
+    uint8_t  magic;     /* BIN_REQ_MAGIC */
+    uint8_t  opcode;    /* bin_opcode_t */
+    uint8_t  flags;     /* BIN_FLAG_* */
+    uint8_t  nkey;      /* # key bytes */
+    uint8_t  ntid;      /* # transaction or session id bytes */
+    uint8_t  arg8;      /* read value? (qaread), foreground? (iqget) */
+    uint16_t reserved;
+    uint32_t bodylen;   /* # key, id and value bytes after the header */
+    int32_t  config;    /* client configuration id */
+    int32_t  fconfig;   /* fragment configuration id to stamp, or -1 */
+    uint32_t dataflags; /* item flags */
+    int32_t  exptime;   /* item expiry */
+    uint32_t arg;       /* pending (commit), msec to wait (iqget) */
+    uint64_t token;     /* lease token */
+};
+
+struct bin_rsp_header {
+    uint8_t  magic;     /* BIN_RSP_MAGIC */
+    uint8_t  opcode;    /* opcode of the request */
+    uint8_t  status;    /* bin_status_t */
+    uint8_t  arg8;      /* pending bit of a lease, or marked value (qareg) */
+    uint32_t bodylen;   /* # value bytes after the header */
+    uint32_t dataflags; /* item flags */
+    int32_t  config;    /* configuration id of the item */
+    uint64_t token;     /* lease token */
+};
+
+bool bin_is_request(const char *buf);
+rstatus_t bin_parse(struct conn *c);
+void bin_complete_nread(struct conn *c);
+void bin_resume(struct conn *c);
+void bin_write_server_error(struct conn *c);
+
+#endif
@@ -123,6 +123,18 @@ conn_free(struct conn *c)
         mc_free(c->iov);
     }
 
+    if (c->obuf != NULL) {
+        mc_free(c->obuf);
+    }
+
+    if (c->hilist != NULL) {
+        mc_free(c->hilist);
+    }
+
+    if (c->hslist != NULL) {
+        mc_free(c->hslist);
+    }
+
     mc_free(c);
 }
 
@@ -197,8 +209,17 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
         c->msg_size = MSG_SIZE;
         c->msg = mc_alloc(sizeof(*c->msg) * c->msg_size);
 
+        c->obuf = mc_alloc(TCP_BUFFER_SIZE);
+
+        c->hisize = ILIST_SIZE;
+        c->hilist = mc_alloc(sizeof(*c->hilist) * c->hisize);
+
+        c->hssize = SLIST_SIZE;
+        c->hslist = mc_alloc(sizeof(*c->hslist) * c->hssize);
+
         if (c->rbuf == NULL || c->wbuf == NULL || c->ilist == NULL ||
-            c->iov == NULL || c->msg == NULL || c->slist == NULL) {
+            c->iov == NULL || c->msg == NULL || c->slist == NULL ||
+            c->obuf == NULL || c->hilist == NULL || c->hslist == NULL) {
             conn_free(c);
             return NULL;
         }
@@ -232,6 +253,9 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
     c->item = NULL;
     c->sbytes = 0;
 
+    c->m_buf = NULL;
+    c->m_nbyte = 0;
+
     ASSERT(c->iov != NULL && c->iov_size > 0);
     c->iov_used = 0;
 
@@ -248,6 +272,21 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
     c->scurr = c->slist;
     c->sleft = 0;
 
+    c->obytes = 0;
+    c->hold_iov = 0;
+    c->hold_msg = 0;
+    c->hold_bytes = 0;
+    c->hold_nbyte = 0;
+    c->hiused = 0;
+    c->hsused = 0;
+
+    c->u_head = -1;
+    c->u_tail = -1;
+    c->u_inflight = 0;
+    c->u_err = 0;
+    c->u_res = 0;
+    c->u_next = NULL;
+
     c->stats.buffer = NULL;
     c->stats.size = 0;
     c->stats.offset = 0;
@@ -256,7 +295,22 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
     c->req = NULL;
     c->req_len = 0;
 
+    c->w_msec = 0;
+    c->w_until = 0;
+    c->w_parked = false;
+
     c->udp = udp;
+    c->binary = 0;
+    c->negotiated = 0;
+    c->flushing = 0;
+    c->uring = 0;
+    c->u_recv = 0;
+    c->u_send = 0;
+    c->u_sent = 0;
+    c->u_nop = 0;
+    c->u_eof = 0;
+    c->u_starved = 0;
+    c->u_closing = 0;
     c->udp_rid = 0;
     c->udp_hbuf = NULL;
     c->udp_hsize = 0;
@@ -297,6 +351,10 @@ conn_cleanup(struct conn *c)
         c->item = NULL;
     }
 
+    if (c->m_buf != NULL) {
+        mc_free(c->m_buf);
+    }
+
     while (c->ileft > 0) {
         item_remove(*(c->icurr));
         c->ileft--;
@@ -309,6 +367,8 @@ conn_cleanup(struct conn *c)
         c->scurr++;
     }
 
+    conn_release_hold(c);
+
     if (c->write_and_free != NULL) {
         mc_free(c->write_and_free);
     }
@@ -321,8 +381,15 @@ conn_cleanup(struct conn *c)
 void
 conn_close(struct conn *c)
 {
+    /* operations in flight on the ring close the conn once they complete */
+    if (c->uring && !uring_drain(c)) {
+        return;
+    }
+
     /* delete the event, the socket and the conn */
-    event_del(&c->event);
+    if (!c->uring) {
+        event_del(&c->event);
+    }
 
     log_debug(LOG_VVERB, "<%d connection closed", c->sd);
 
@@ -354,6 +421,11 @@ conn_shrink(struct conn *c)
         return;
     }
 
+    /* held replies point into the read buffer and the iov and msg lists */
+    if (c->hold_iov > 0) {
+        return;
+    }
+
     if (c->rsize > RSIZE_HIGHWAT && c->rbytes < TCP_BUFFER_SIZE) {
         char *newbuf;
 
@@ -404,6 +476,146 @@ conn_shrink(struct conn *c)
     }
 }
 
+/*
+ * Starts a new reply on a connection, dropping whatever the current one
+ * has added to the iov and msg lists, but keeping the replies held back
+ * in front of it.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+rstatus_t
+conn_reset_reply(struct conn *c)
+{
+    struct msghdr *m;
+
+    c->msg_curr = 0;
+
+    if (c->hold_iov == 0) {
+        c->msg_used = 0;
+        c->iov_used = 0;
+        return conn_add_msghdr(c);
+    }
+
+    c->msg_used = c->hold_msg;
+    c->iov_used = c->hold_iov;
+
+    m = &c->msg[c->msg_used - 1];
+    m->msg_iovlen = c->hold_iov - (int)(m->msg_iov - c->iov);
+    c->msg_bytes = c->hold_bytes;
+
+    return MC_OK;
+}
+
+/*
+ * Holds back the reply just built on a connection, instead of writing it
+ * out, so that it goes out in the same sendmsg as the replies to the
+ * requests pipelined behind it. Parts of the reply in the write buffer,
+ * which the next reply reuses, are copied to the held reply buffer, and
+ * the items and suffixes the reply points to are moved to the held lists
+ * until the chain is written out.
+ *
+ * Returns 0 if the reply was held, and an error if it has to be written
+ * out now.
+ */
+rstatus_t
+conn_hold_reply(struct conn *c)
+{
+    int i, nbyte, ncopy;
+
+    ASSERT(c->state == CONN_WRITE || c->state == CONN_MWRITE);
+
+    nbyte = 0;
+    ncopy = 0;
+    for (i = c->hold_iov; i < c->iov_used; i++) {
+        char *base = c->iov[i].iov_base;
+
+        nbyte += c->iov[i].iov_len;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize) {
+            ncopy += c->iov[i].iov_len;
+        }
+    }
+
+    if (c->hold_nbyte + nbyte > settings.coalesce_bytes ||
+        c->obytes + ncopy > TCP_BUFFER_SIZE) {
+        return MC_ERROR;
+    }
+
+    if (c->state == CONN_MWRITE) {
+        if (c->hiused + c->ileft > c->hisize) {
+            struct item **hilist;
+            int hisize = MAX(c->hisize * 2, c->hiused + c->ileft);
+
+            hilist = mc_realloc(c->hilist, sizeof(*c->hilist) * hisize);
+            if (hilist == NULL) {
+                return MC_ENOMEM;
+            }
+            c->hilist = hilist;
+            c->hisize = hisize;
+        }
+
+        if (c->hsused + c->sleft > c->hssize) {
+            char **hslist;
+            int hssize = MAX(c->hssize * 2, c->hsused + c->sleft);
+
+            hslist = mc_realloc(c->hslist, sizeof(*c->hslist) * hssize);
+            if (hslist == NULL) {
+                return MC_ENOMEM;
+            }
+            c->hslist = hslist;
+            c->hssize = hssize;
+        }
+
+        for (; c->ileft > 0; c->ileft--, c->icurr++) {
+            if (*(c->icurr) != NULL) {
+                c->hilist[c->hiused++] = *(c->icurr);
+            }
+        }
+
+        for (; c->sleft > 0; c->sleft--, c->scurr++) {
+            c->hslist[c->hsused++] = *(c->scurr);
+        }
+    }
+
+    for (i = c->hold_iov; i < c->iov_used; i++) {
+        char *base = c->iov[i].iov_base;
+
+        if (base >= c->wbuf && base < c->wbuf + c->wsize) {
+            memcpy(c->obuf + c->obytes, base, c->iov[i].iov_len);
+            c->iov[i].iov_base = c->obuf + c->obytes;
+            c->obytes += c->iov[i].iov_len;
+        }
+    }
+
+    c->hold_iov = c->iov_used;
+    c->hold_msg = c->msg_used;
+    c->hold_bytes = c->msg_bytes;
+    c->hold_nbyte += nbyte;
+
+    return MC_OK;
+}
+
+/*
+ * Releases the items and suffixes of the replies held back on a
+ * connection, once they are written out or the connection is closed.
+ */
+void
+conn_release_hold(struct conn *c)
+{
+    while (c->hiused > 0) {
+        item_remove(c->hilist[--c->hiused]);
+    }
+
+    while (c->hsused > 0) {
+        cache_free(c->thread->suffix_cache, c->hslist[--c->hsused]);
+    }
+
+    c->obytes = 0;
+    c->hold_iov = 0;
+    c->hold_msg = 0;
+    c->hold_bytes = 0;
+    c->hold_nbyte = 0;
+}
+
 /*
  * Sets a connection's current state in the state machine. Any special
  * processing that needs to happen on certain state transitions can
@@ -63,6 +63,9 @@ typedef enum conn_state {
     CONN_WRITE,         /* writing out a simple response */
     CONN_MWRITE,        /* writing out many items sequentially */
     CONN_SWALLOW,       /* swallowing unnecessary bytes w/o storing */
+    CONN_PARK,          /* parked on a lease wait list */
+    CONN_RESUME,        /* replaying the request it was parked on */
+    CONN_FLUSH,         /* writing out held replies */
     CONN_CLOSE,         /* closing this connection */
     CONN_SENTINEL       /* max state value (used for assertion) */
 } conn_state_t;
@@ -98,6 +101,19 @@ struct conn {
 
     uint64_t			lease_token;		/* lease token (for iqget/iqset/qaread/sar) */
 
+    TAILQ_ENTRY(conn)    w_tqe;            /* link in lease wait list */
+    struct event         w_event;          /* lease wait timer */
+    int                  w_msec;           /* msec iqget may wait for a lease, 0 for no wait */
+    int64_t              w_until;          /* lease wait deadline in usec, 0 if never parked */
+    char                 *w_key;           /* key parked on */
+    size_t               w_nkey;           /* # key parked on bytes */
+    uint32_t             w_hv;             /* hash of key parked on */
+    bool                 w_parked;         /* parked on a lease wait list? */
+
+    char                 *m_buf;           /* bulkset payload being read */
+    uint32_t             m_nbyte;          /* # bulkset payload bytes */
+    int32_t              m_config;         /* config to store bulkset items with */
+
     void                 *item;            /* for commands set / add / replace */
     int                  sbytes;           /* how many bytes to swallow in CONN_SWALLOW state*/
 
@@ -121,6 +137,28 @@ struct conn {
     char                 **scurr;          /* current suffix list */
     int                  sleft;            /* # remaining in suffix list */
 
+    char                 *obuf;            /* copies of held replies built in wbuf */
+    int                  obytes;           /* # used obuf bytes */
+    int                  hold_iov;         /* # iov of held replies */
+    int                  hold_msg;         /* # msg of held replies */
+    int                  hold_bytes;       /* msg_bytes of the last held msg */
+    int                  hold_nbyte;       /* # bytes of held replies */
+
+    struct item          **hilist;         /* items of held replies */
+    int                  hisize;           /* # held item list */
+    int                  hiused;           /* # used held item list */
+
+    char                 **hslist;         /* suffixes of held replies */
+    int                  hssize;           /* # held suffix list */
+    int                  hsused;           /* # used held suffix list */
+
+    int                  u_head;           /* first recv buffer queued, -1 for none */
+    int                  u_tail;           /* last recv buffer queued, -1 for none */
+    int                  u_inflight;       /* # io_uring operations in flight */
+    int                  u_err;            /* errno the recv stopped with */
+    ssize_t              u_res;            /* result of the sendmsg completed */
+    struct conn          *u_next;          /* next conn starved of recv buffers */
+
     struct {
         char             *buffer;          /* stats buffer */
         size_t           size;             /* stats buffer size */
@@ -141,6 +179,17 @@ struct conn {
 
     unsigned             noreply:1;        /* noreply? */
     unsigned             udp:1;            /* udp? */
+    unsigned             binary:1;         /* binary protocol? */
+    unsigned             negotiated:1;     /* protocol known? */
+    unsigned             flushing:1;       /* reply transmit started? */
+    unsigned             uring:1;          /* driven through io_uring? */
+    unsigned             u_recv:1;         /* recv armed? */
+    unsigned             u_send:1;         /* sendmsg in flight? */
+    unsigned             u_sent:1;         /* sendmsg completed, result not seen? */
+    unsigned             u_nop:1;          /* nop in flight? */
+    unsigned             u_eof:1;          /* recv hit end of stream? */
+    unsigned             u_starved:1;      /* recv stopped on no buffers? */
+    unsigned             u_closing:1;      /* closing once operations complete? */
 };
 
 STAILQ_HEAD(conn_tqh, conn);
@@ -165,6 +214,10 @@ void conn_cleanup(struct conn *c);
 void conn_close(struct conn *c);
 void conn_shrink(struct conn *c);
 
+rstatus_t conn_reset_reply(struct conn *c);
+rstatus_t conn_hold_reply(struct conn *c);
+void conn_release_hold(struct conn *c);
+
 rstatus_t conn_add_iov(struct conn *c, const void *buf, int len);
 rstatus_t conn_add_msghdr(struct conn *c);
 
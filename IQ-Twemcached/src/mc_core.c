@@ -58,6 +58,8 @@ core_reset_cmd_handler(struct conn *c)
     c->req_type = REQ_UNKNOWN;
     c->req = NULL;
     c->req_len = 0;
+    c->w_msec = 0;
+    c->w_until = 0;
 
     if (c->item != NULL) {
         item_remove(c->item);
@@ -76,7 +78,11 @@ core_reset_cmd_handler(struct conn *c)
 static void
 core_complete_nread(struct conn *c)
 {
-    asc_complete_nread(c);
+    if (c->binary) {
+        bin_complete_nread(c);
+    } else {
+        asc_complete_nread(c);
+    }
 }
 
 /*
@@ -106,7 +112,13 @@ core_parse(struct conn *c)
 {
     rstatus_t status;
 
-    status = asc_parse(c);
+    /* a tcp connection speaks the protocol of its first request */
+    if (!c->negotiated && !c->udp && c->rbytes > 0) {
+        c->binary = bin_is_request(c->rcurr) ? 1 : 0;
+        c->negotiated = 1;
+    }
+
+    status = c->binary ? bin_parse(c) : asc_parse(c);
     switch (status) {
     case MC_EAGAIN:
         conn_set_state(c, CONN_WAIT);
@@ -156,6 +168,20 @@ core_read_udp(struct conn *c)
     return READ_NO_DATA_RECEIVED;
 }
 
+/*
+ * Read up to size bytes from a tcp connection into buf, the way read does
+ * on a nonblocking socket
+ */
+static ssize_t
+core_recv(struct conn *c, void *buf, size_t size)
+{
+    if (c->uring) {
+        return uring_recv(c, buf, size);
+    }
+
+    return read(c->sd, buf, size);
+}
+
 /*
  * Read from network as much as we can, handle buffer overflow and connection
  * close. Before reading, move the remaining incomplete fragment of a command
@@ -200,7 +226,11 @@ core_read_tcp(struct conn *c)
                          "oom alloc buf for new req", c->sd, c->req_type);
 
                 c->rbytes = 0; /* ignore what we read */
-                asc_write_server_error(c);
+                if (c->binary) {
+                    bin_write_server_error(c);
+                } else {
+                    asc_write_server_error(c);
+                }
                 c->write_and_go = CONN_CLOSE;
                 return READ_MEMORY_ERROR;
             }
@@ -209,7 +239,7 @@ core_read_tcp(struct conn *c)
         }
 
         size = c->rsize - c->rbytes;
-        n = read(c->sd, c->rbuf + c->rbytes, size);
+        n = core_recv(c, c->rbuf + c->rbytes, size);
 
         log_debug(LOG_VERB, "recv on c %d %zd of %zu", c->sd, n, size);
 
@@ -275,6 +305,10 @@ core_update(struct conn *c, int new_flags)
     int status;
     struct event_base *base;
 
+    if (c->uring) {
+        return uring_update(c, new_flags);
+    }
+
     base = c->event.ev_base;
 
     if (c->ev_flags == new_flags) {
@@ -374,7 +408,14 @@ core_transmit(struct conn *c)
         ssize_t res;
         struct msghdr *m = &c->msg[c->msg_curr];
 
-        res = sendmsg(c->sd, m, 0);
+        if (!c->uring) {
+            res = sendmsg(c->sd, m, 0);
+            stats_thread_incr(data_sendmsg);
+        } else if (uring_sendmsg(c, m, &res) != MC_OK) {
+            /* in flight; its completion drives the conn again */
+            return TRANSMIT_SOFT_ERROR;
+        }
+
         if (res > 0) {
             stats_thread_incr_by(data_written, res);
 
@@ -429,6 +470,49 @@ core_transmit(struct conn *c)
     }
 }
 
+/*
+ * Decide if the reply just built on a connection can wait to go out with
+ * the replies to the requests already read in behind it, and hold it back
+ * if so. Replies are held only while this event will go on to process
+ * another request, so the chain is flushed before the connection waits
+ * for more input or yields.
+ */
+static bool
+core_hold(struct conn *c, int nreqs)
+{
+    if (c->udp || c->flushing || settings.coalesce_bytes == 0) {
+        return false;
+    }
+
+    if (c->rbytes == 0 || nreqs <= 0) {
+        return false;
+    }
+
+    if (c->state == CONN_WRITE &&
+        (c->write_and_free != NULL || c->write_and_go != CONN_NEW_CMD)) {
+        return false;
+    }
+
+    if (conn_hold_reply(c) != MC_OK) {
+        return false;
+    }
+
+    stats_thread_incr(reply_held);
+
+    return true;
+}
+
+/*
+ * Write out the replies held back on a connection, and then go on to
+ * state, which waits on the socket or yields
+ */
+static void
+core_flush(struct conn *c, conn_state_t state)
+{
+    c->write_and_go = state;
+    conn_set_state(c, CONN_FLUSH);
+}
+
 static void
 core_close(struct conn *c)
 {
@@ -444,7 +528,6 @@ core_close(struct conn *c)
 static void
 core_accept(struct conn *c)
 {
-    rstatus_t status;
     int sd;
 
     ASSERT(c->state == CONN_LISTEN);
@@ -475,6 +558,18 @@ core_accept(struct conn *c)
         break;
     }
 
+    core_accepted(c, sd);
+}
+
+/*
+ * Set up socket sd, just accepted on listening conn c, and hand it to a
+ * worker thread
+ */
+void
+core_accepted(struct conn *c, int sd)
+{
+    rstatus_t status;
+
     status = mc_set_nonblocking(sd);
     if (status != MC_OK) {
         log_error("set nonblock on c %d from s %d failed: %s", sd, c->sd,
@@ -495,7 +590,7 @@ core_accept(struct conn *c)
                  c->sd, strerror(errno));
     }
 
-    status = thread_dispatch(sd, CONN_NEW_CMD, EV_READ | EV_PERSIST, 0);
+    status = thread_accept(c, sd);
     if (status != MC_OK) {
         log_error("dispatch c %d from s %d failed: %s", sd, c->sd,
                   strerror(errno));
@@ -511,6 +606,7 @@ core_drive_machine(struct conn *c)
     ssize_t n;
     bool stop = false;
     int nreqs = settings.reqs_per_event;
+    struct uring *ring = c->uring ? c->thread->ring : NULL;
 
     while (!stop) {
 
@@ -522,6 +618,11 @@ core_drive_machine(struct conn *c)
             break;
 
         case CONN_WAIT:
+            if (c->hold_iov > 0) {
+                core_flush(c, CONN_WAIT);
+                break;
+            }
+
             status = core_update(c, EV_READ | EV_PERSIST);
             if (status != MC_OK) {
                 log_error("update on c %d failed: %s", c->sd, strerror(errno));
@@ -546,6 +647,11 @@ core_drive_machine(struct conn *c)
              * Only process nreqs at a time to avoid starving other
              * connection
              */
+            if (nreqs <= 0 && c->hold_iov > 0) {
+                core_flush(c, CONN_NEW_CMD);
+                break;
+            }
+
             --nreqs;
             if (nreqs >= 0) {
                 core_reset_cmd_handler(c);
@@ -592,8 +698,13 @@ core_drive_machine(struct conn *c)
                 }
             }
 
+            if (c->hold_iov > 0) {
+                core_flush(c, CONN_NREAD);
+                break;
+            }
+
             /* now try reading from the socket */
-            n = read(c->sd, c->ritem, c->rlbytes);
+            n = core_recv(c, c->ritem, c->rlbytes);
             if (n > 0) {
                 stats_thread_incr_by(data_read, n);
 
@@ -648,8 +759,13 @@ core_drive_machine(struct conn *c)
                 break;
             }
 
+            if (c->hold_iov > 0) {
+                core_flush(c, CONN_SWALLOW);
+                break;
+            }
+
             /* now try reading from the socket */
-            n = read(c->sd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            n = core_recv(c, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (n > 0) {
                 stats_thread_incr_by(data_read, n);
 
@@ -686,7 +802,7 @@ core_drive_machine(struct conn *c)
              * assemble it into a msgbuf list (this will be a single-entry
              * list for TCP or a two-entry list for UDP).
              */
-            if (c->iov_used == 0 || (c->udp && c->iov_used == 1)) {
+            if (c->iov_used == c->hold_iov || (c->udp && c->iov_used == 1)) {
                 status = conn_add_iov(c, c->wcurr, c->wbytes);
                 if (status != MC_OK) {
                     log_debug(LOG_INFO, "couldn't build response: %s",
@@ -699,6 +815,14 @@ core_drive_machine(struct conn *c)
             /* fall through */
 
         case CONN_MWRITE:
+            if (core_hold(c, nreqs)) {
+                conn_set_state(c, CONN_NEW_CMD);
+                break;
+            }
+
+            /* fall through */
+
+        case CONN_FLUSH:
             if (c->udp && c->msg_curr == 0 && conn_build_udp_headers(c) != MC_OK) {
                 log_debug(LOG_INFO, "failed to build UDP headers: %s",
                       strerror(errno));
@@ -706,8 +830,12 @@ core_drive_machine(struct conn *c)
                 break;
             }
 
+            c->flushing = 1;
             switch (core_transmit(c)) {
             case TRANSMIT_COMPLETE:
+                c->flushing = 0;
+                conn_release_hold(c);
+
                 if (c->state == CONN_MWRITE) {
                     while (c->ileft > 0) {
                         struct item *it = *(c->icurr);
@@ -735,6 +863,13 @@ core_drive_machine(struct conn *c)
                         c->write_and_free = 0;
                     }
                     conn_set_state(c, c->write_and_go);
+                } else if (c->state == CONN_FLUSH) {
+                    /* the request in progress builds its reply afresh */
+                    if (conn_reset_reply(c) != MC_OK) {
+                        conn_set_state(c, CONN_CLOSE);
+                        break;
+                    }
+                    conn_set_state(c, c->write_and_go);
                 } else {
                     log_debug(LOG_INFO, "unexpected state %d", c->state);
                     conn_set_state(c, CONN_CLOSE);
@@ -752,6 +887,41 @@ core_drive_machine(struct conn *c)
             }
             break;
 
+        case CONN_PARK:
+            /*
+             * Replies held for the requests ahead of the parked one go out
+             * first; wait_park left c off the wait list for them, so the
+             * request is replayed, and parks for real, once they are out
+             */
+            if (c->hold_iov > 0) {
+                core_flush(c, CONN_RESUME);
+                break;
+            }
+
+            /*
+             * Parked on a lease wait list, the socket is left alone until
+             * core_resume is called
+             */
+            if (c->uring) {
+                status = uring_update(c, 0);
+            } else {
+                status = event_del(&c->event);
+            }
+            if (status < 0) {
+                log_error("event del on c %d failed: %s", c->sd, strerror(errno));
+            }
+            c->ev_flags = 0;
+            stop = true;
+            break;
+
+        case CONN_RESUME:
+            if (c->binary) {
+                bin_resume(c);
+            } else {
+                asc_resume(c);
+            }
+            break;
+
         case CONN_CLOSE:
             core_close(c);
             stop = true;
@@ -762,6 +932,24 @@ core_drive_machine(struct conn *c)
             break;
         }
     }
+
+    /* c may be gone by now; the ring outlives it */
+    if (ring != NULL) {
+        uring_submit(ring);
+    }
+}
+
+/*
+ * Resume a connection parked on a lease wait list, by replaying the
+ * request it was parked on. Must be called on its worker thread.
+ */
+void
+core_resume(struct conn *c)
+{
+    ASSERT(c->state == CONN_PARK);
+
+    conn_set_state(c, CONN_RESUME);
+    core_drive_machine(c);
 }
 
 void
@@ -780,6 +968,166 @@ core_event_handler(int sd, short which, void *arg)
     core_drive_machine(c);
 }
 
+/*
+ * Create a socket bound to address ai, in the SO_REUSEPORT group of the
+ * address if reuseport is set. Returns the socket, or -1 if the address
+ * cannot be used, with fatal set if that must stop the server.
+ */
+static int
+core_bind_socket(struct addrinfo *ai, int udp, bool reuseport, bool *fatal)
+{
+    rstatus_t status;
+    int sd;
+    int error;
+
+    *fatal = false;
+
+    sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sd < 0) {
+        return -1;
+    }
+
+    status = mc_set_nonblocking(sd);
+    if (status != MC_OK) {
+        log_error("set nonblock on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
+        return -1;
+    }
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        int flags = 1;
+        error = setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            log_error("set ipv6 on sd %d failed: %s", sd,
+                      strerror(errno));
+            close(sd);
+            return -1;
+        }
+    }
+#endif
+    status = mc_set_reuseaddr(sd);
+    if (status != MC_OK) {
+        log_warn("set reuse addr on sd %d failed, ignored: %s", sd,
+                  strerror(errno));
+    }
+
+    if (reuseport) {
+        status = mc_set_reuseport(sd);
+        if (status != MC_OK) {
+            log_error("set reuse port on sd %d failed: %s", sd,
+                      strerror(errno));
+            close(sd);
+            *fatal = true;
+            return -1;
+        }
+    }
+
+    if (udp) {
+        mc_maximize_sndbuf(sd);
+    }
+
+    status = bind(sd, ai->ai_addr, ai->ai_addrlen);
+    if (status != MC_OK) {
+        if (errno != EADDRINUSE) {
+            log_error("bind on sd %d failed: %s", sd, strerror(errno));
+            *fatal = true;
+        }
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+/*
+ * Listen on tcp socket sd, bound with core_bind_socket, with worker tid
+ * accepting on it, or the dispatcher for a tid of -1
+ */
+static rstatus_t
+core_listen_socket(int sd, int tid)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    if (listen(sd, settings.backlog) == -1) {
+        log_error("listen on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
+        return MC_ERROR;
+    }
+
+    conn = conn_get(sd, CONN_LISTEN, EV_READ | EV_PERSIST, 1, 0);
+    if (conn == NULL) {
+        log_error("listen on sd %d failed: %s", sd, strerror(errno));
+        return MC_ERROR;
+    }
+    STAILQ_INSERT_HEAD(&listen_connq, conn, c_tqe);
+
+    status = thread_listen(conn, tid);
+    if (status != MC_OK) {
+        return status;
+    }
+
+    log_debug(LOG_NOTICE, "s %d listening", conn->sd);
+
+    return MC_OK;
+}
+
+/*
+ * Listen on the tcp address ai, that socket sd is bound to, with a socket
+ * of its own for every worker. The sockets join the reuseport group in the
+ * order of the workers, which the cpu steering program relies on.
+ *
+ * sd is bound without SO_REUSEPORT, so that an address some other process
+ * listens on, with SO_REUSEPORT or not, fails the bind instead of having
+ * us join its group. It is closed once the group takes over its address.
+ */
+static rstatus_t
+core_listen_reuseport(struct addrinfo *ai, int sd)
+{
+    rstatus_t status;
+    struct sockaddr_storage addr;
+    struct addrinfo bound;
+    bool fatal;
+    int tid;
+
+    /* the group binds to the address of sd, with any port it picked */
+    bound = *ai;
+    bound.ai_addr = (struct sockaddr *)&addr;
+    bound.ai_addrlen = sizeof(addr);
+    if (getsockname(sd, bound.ai_addr, &bound.ai_addrlen) < 0) {
+        log_error("getsockname on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
+        return MC_ERROR;
+    }
+    close(sd);
+
+    for (tid = 0; tid < settings.num_workers; tid++) {
+        sd = core_bind_socket(&bound, 0, true, &fatal);
+        if (sd < 0) {
+            log_error("bind of worker %d listening socket failed: %s",
+                      tid, strerror(errno));
+            return MC_ERROR;
+        }
+
+        status = core_listen_socket(sd, tid);
+        if (status != MC_OK) {
+            return status;
+        }
+
+        if (tid == 0 && settings.accept_mode == THREAD_ACCEPT_CPU) {
+            status = mc_set_reuseport_cpu(sd, settings.num_workers);
+            if (status != MC_OK) {
+                log_error("attach of cpu steering to sd %d failed: %s", sd,
+                          strerror(errno));
+                return MC_ERROR;
+            }
+        }
+    }
+
+    return MC_OK;
+}
+
 static rstatus_t
 core_create_inet_socket(int port, int udp)
 {
@@ -791,6 +1139,7 @@ core_create_inet_socket(int port, int udp)
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
+    bool fatal;
 
     hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
 
@@ -805,67 +1154,21 @@ core_create_inet_socket(int port, int udp)
     }
 
     for (next = ai; next != NULL; next = next->ai_next) {
-        struct conn *conn;
-
-        sd = socket(next->ai_family, next->ai_socktype, next->ai_protocol);
+        /*
+         * getaddrinfo can return "junk" addresses, we make sure at
+         * least one works before erroring.
+         */
+        sd = core_bind_socket(next, udp, false, &fatal);
         if (sd < 0) {
-            /*
-             * getaddrinfo can return "junk" addresses, we make sure at
-             * least one works before erroring.
-             */
-            continue;
-        }
-
-        status = mc_set_nonblocking(sd);
-        if (status != MC_OK) {
-            log_error("set nonblock on sd %d failed: %s", sd, strerror(errno));
-            close(sd);
-            continue;
-        }
-
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            int flags = 1;
-            error = setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                log_error("set ipv6 on sd %d failed: %s", sd,
-                          strerror(errno));
-                close(sd);
-                continue;
-            }
-        }
-#endif
-        status = mc_set_reuseaddr(sd);
-        if (status != MC_OK) {
-            log_warn("set reuse addr on sd %d failed, ignored: %s", sd,
-                      strerror(errno));
-        }
-
-        if (udp) {
-            mc_maximize_sndbuf(sd);
-        }
-
-        status = bind(sd, next->ai_addr, next->ai_addrlen);
-        if (status != MC_OK) {
-            if (errno != EADDRINUSE) {
-                log_error("bind on sd %d failed: %s", sd, strerror(errno));
-                close(sd);
+            if (fatal) {
                 freeaddrinfo(ai);
                 return MC_ERROR;
             }
-            close(sd);
             continue;
         }
 
         success++;
 
-        if (!udp && listen(sd, settings.backlog) == -1) {
-            log_error("listen on sd %d failed: %s", sd, strerror(errno));
-            close(sd);
-            freeaddrinfo(ai);
-            return MC_ERROR;
-        }
-
         if (udp) {
             int c;
 
@@ -876,20 +1179,18 @@ core_create_inet_socket(int port, int udp)
                     return status;
                 }
             }
-        } else {
-            conn = conn_get(sd, CONN_LISTEN, EV_READ | EV_PERSIST, 1, 0);
-            if (conn == NULL) {
-                log_error("listen on sd %d failed: %s", sd, strerror(errno));
-                return MC_ERROR;
+        } else if (settings.accept_mode != THREAD_ACCEPT_DISPATCHER) {
+            status = core_listen_reuseport(next, sd);
+            if (status != MC_OK) {
+                freeaddrinfo(ai);
+                return status;
             }
-            STAILQ_INSERT_HEAD(&listen_connq, conn, c_tqe);
-
-            status = conn_set_event(conn, main_base);
+        } else {
+            status = core_listen_socket(sd, -1);
             if (status != MC_OK) {
+                freeaddrinfo(ai);
                 return status;
             }
-
-            log_debug(LOG_NOTICE, "s %d listening", conn->sd);
         }
    }
 
@@ -976,7 +1277,7 @@ core_create_unix_socket(char *path, int mask)
         return MC_ERROR;
     }
 
-    status = conn_set_event(c, main_base);
+    status = thread_listen(c, -1);
     if (status != MC_OK) {
         conn_put(c);
         return status;
@@ -1037,6 +1338,11 @@ core_init(void)
         return MC_ERROR;
     }
 
+    status = hash_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     status = assoc_init();
     if (status != MC_OK) {
         return status;
@@ -1044,15 +1350,33 @@ core_init(void)
 
     conn_init();
 
-    item_init();
-    
+    status = item_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     lease_init();
 
+    status = wait_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = fragment_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     status = slab_init();
     if (status != MC_OK) {
         return status;
     }
 
+    status = admit_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     stats_init();
 
     status = klog_init();
@@ -1069,13 +1393,58 @@ core_init(void)
         return status;
     }
 
+    /* start up the timer wheel, which expires leases from a background thread */
+    status = timer_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* start up the stale fragment reaper, which runs as a background thread */
+    status = reaper_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* start up segment storage, which expires segments from a background thread */
+    status = segment_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* start up the slab rebalancer, which moves slabs from a background thread */
+    status = rebalance_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* start up the expired item crawler, which runs as a background thread */
+    status = crawler_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* start up fragment migration, which streams from a background thread */
+    status = migrate_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     return MC_OK;
 }
 
 void
 core_deinit(void)
 {
+    migrate_deinit();
+    crawler_deinit();
+    rebalance_deinit();
+    segment_deinit();
+    reaper_deinit();
+    timer_deinit();
     klog_deinit();
+    fragment_deinit();
+    wait_deinit();
+    admit_deinit();
     item_deinit();
 }
 
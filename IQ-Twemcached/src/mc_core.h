@@ -69,6 +69,12 @@
 # define MC_DISABLE_KLOG 0
 #endif
 
+#ifdef HAVE_COMPACT_ITEM
+# define MC_COMPACT_ITEM 1
+#else
+# define MC_COMPACT_ITEM 0
+#endif
+
 #ifdef HAVE_LITTLE_ENDIAN
 # define MC_LITTLE_ENDIAN 1
 #endif
@@ -190,6 +196,13 @@ struct slabclass;
 	ACTION( OQWRITE,	    7,	  		7, 		  8,  		8   )	\
 	ACTION( UPDATECONFIG,        3,          INT_MAX,        3,        INT_MAX  )   \
 	ACTION( ISET,      4,    INT_MAX,        4,  INT_MAX   )   \
+	ACTION( DROPFRAG,  3,          3,        4,        4   )   \
+	ACTION( MIGRATE,   5,          6,        6,        7   )   \
+	ACTION( BULKSET,   4,          4,        5,        5   )   \
+	ACTION( MIQGET,    4,    INT_MAX,        4,  INT_MAX   )   \
+	ACTION( MQAREG,    5,    INT_MAX,        5,  INT_MAX   )   \
+	ACTION( MQAREAD,   6,    INT_MAX,        6,  INT_MAX   )   \
+	ACTION( MCOMMIT,   6,    INT_MAX,        6,  INT_MAX   )   \
 
 /*
  *          response type
@@ -238,7 +251,8 @@ struct slabclass;
 #define EVICT_RS      0x02 /* random slab eviction */
 #define EVICT_AS      0x04 /* lra (least recently accessed) slab eviction */
 #define EVICT_CS      0x08 /* lrc (least recently created) slab eviction */
-#define EVICT_INVALID 0x10 /* go no further! */
+#define EVICT_CLOCK   0x10 /* per-slab clock eviction, a hit only marks the item */
+#define EVICT_INVALID 0x20 /* go no further! */
 
 #define DEFINE_ACTION(_type, _min, _max, _nmin, _nmax) REQ_##_type,
 typedef enum req_type {
@@ -260,10 +274,23 @@ typedef enum rsp_type {
 #include <mc_stats.h>
 #include <mc_klog.h>
 #include <mc_assoc.h>
+#include <mc_fragment.h>
+#include <mc_reaper.h>
+#include <mc_rebalance.h>
+#include <mc_admit.h>
+#include <mc_crawler.h>
+#include <mc_segment.h>
+#include <mc_migrate.h>
+#include <mc_trans.h>
+#include <mc_wait.h>
+#include <mc_timer.h>
+#include <mc_bench.h>
 #include <mc_items.h>
 #include <mc_signal.h>
 #include <mc_ascii.h>
+#include <mc_binary.h>
 #include <mc_connection.h>
+#include <mc_uring.h>
 
 struct settings {
                                                   /* options with no argument */
@@ -273,6 +300,7 @@ struct settings {
     bool            daemonize;                    /* process : daemonized or not */
     bool            max_corefile;                 /* process : maximize core core file limit */
     bool            use_cas;                      /* protocol: whether cas is supported */
+    bool            lockfree_get;                 /* protocol: whether gets skip item locks */
 
                                                   /* options with required argument */
 
@@ -291,6 +319,9 @@ struct settings {
     char            *username;                    /* process : run as another user */
 
     int             reqs_per_event;               /* network : max # of requests to process per io event */
+    int             coalesce_bytes;               /* network : max # bytes of replies held back for one write */
+    int             io_engine;                    /* network : engine driving tcp sockets, libevent or io_uring */
+    int             accept_mode;                  /* network : tcp accepts by the dispatcher or per worker reuseport sockets */
     int             maxconns;                     /* network : max connections */
     int             backlog;                      /* network : tcp backlog */
     int             port;                         /* network : tcp listening port */
@@ -308,6 +339,16 @@ struct settings {
     size_t          max_chunk_size;               /* memory  : maximum item chunk size */
     size_t          slab_size;                    /* memory  : slab size */
     int             hash_power;                   /* memory  : hash table size, 0 for autotune */
+    int             hash_table;                   /* memory  : hash table layout */
+    int             hash_type;                    /* memory  : key hash function */
+    int             lock_power;                   /* memory  : # item lock stripes as a power of 2 */
+    int             reaper_rate;                  /* memory  : # items the stale fragment reaper scans per sec */
+    int             rebalance_interval;           /* memory  : secs between slab rebalancer decisions */
+    int             storage;                      /* memory  : item storage, slab classes or segments */
+    int             admit_sketch;                 /* memory  : per mille of maxbytes for the admission sketch */
+    int             crawler_duty;                 /* memory  : % of time the expired item crawler runs */
+    int             migrate_rate;                 /* network : # bytes per sec fragment migration streams */
+    size_t          trans_maxbytes;               /* memory  : maximum bytes for transaction and session key sets */
 
                                                   /* global state */
 
@@ -328,7 +369,9 @@ struct settings {
 
 void core_write_and_free(struct conn *c, char *buf, int bytes);
 void core_event_handler(int fd, short which, void *arg);
+void core_resume(struct conn *c);
 void core_accept_conns(bool do_accept);
+void core_accepted(struct conn *c, int sd);
 
 rstatus_t core_init(void);
 void core_deinit(void);
@@ -0,0 +1,242 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+extern uint8_t slabclass_max_id;
+
+/*
+ * Expired item crawler
+ *
+ * An expired item is only reclaimed when it is asked for, or when it gets
+ * to the head of its lru q, so items with short ttls that are never read
+ * again hold on to memory that could have kept live items from eviction.
+ * Expired leases and transaction items in the reserved lru q are no
+ * different, and fill up the reserved heap.
+ *
+ * The crawler thread starts a pass every CRAWLER_PASS_INTERVAL secs, and
+ * walks the lru q, and then the reserved lru q, of every class, unlinking
+ * the expired items it comes across so that their chunks go back to the
+ * free q. The walk is incremental: a batch of at most CRAWLER_BATCH items
+ * is scanned under the lru lock of the class, and its place in the q is
+ * kept by holding a reference on the next item. The thread sleeps after
+ * every batch, so that it is busy for at most settings.crawler_duty
+ * percent of the time.
+ */
+
+static pthread_mutex_t crawler_lock;     /* crawler thread and stats lock */
+static pthread_cond_t crawler_cond;      /* crawler thread condvar */
+static pthread_t crawler_tid;            /* crawler thread id */
+static volatile int run_crawler_thread;  /* run crawler thread? */
+static bool crawler_started;             /* crawler thread started? */
+
+static struct crawler_stats cstats;      /* crawler stats */
+
+static int64_t
+crawler_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Crawl the lru q of class id, or its reserved lru q if reserved, to its
+ * end. Returns false if the crawl was cut short by shutdown.
+ */
+static bool
+crawler_crawl(uint8_t id, bool reserved)
+{
+    struct item *cursor;
+    uint32_t n;
+    uint64_t nreclaim, nbyte;
+    int64_t start, busy;
+
+    cursor = NULL;
+
+    do {
+        if (!run_crawler_thread) {
+            if (cursor != NULL) {
+                item_remove(cursor);
+            }
+            return false;
+        }
+
+        nreclaim = 0;
+        nbyte = 0;
+
+        start = crawler_usec();
+        n = item_crawl(id, reserved, &cursor, CRAWLER_BATCH, &nreclaim,
+                       &nbyte);
+        busy = crawler_usec() - start;
+
+        pthread_mutex_lock(&crawler_lock);
+        cstats.item_scanned += n;
+        cstats.item_reclaimed += nreclaim;
+        cstats.byte_reclaimed += nbyte;
+        if (reserved) {
+            cstats.lease_reclaimed += nreclaim;
+        }
+        pthread_mutex_unlock(&crawler_lock);
+
+        /* duty cycle: sleep (100 - duty)% for every duty% of work */
+        if (n > 0 && settings.crawler_duty < 100) {
+            usleep((useconds_t)(MAX(busy, 1) * (100 - settings.crawler_duty) /
+                                settings.crawler_duty));
+        }
+    } while (cursor != NULL);
+
+    return true;
+}
+
+/*
+ * Crawl all classes once. Returns false if the pass was cut short by
+ * shutdown.
+ */
+static bool
+crawler_pass(void)
+{
+    uint8_t id;
+
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        pthread_mutex_lock(&crawler_lock);
+        cstats.class = id;
+        pthread_mutex_unlock(&crawler_lock);
+
+        if (!crawler_crawl(id, false)) {
+            return false;
+        }
+
+        if (slab_has_reserved_slabs() && !crawler_crawl(id, true)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void *
+crawler_thread(void *arg)
+{
+    struct timespec ts;
+    bool done;
+
+    if (thread_bind_background(THREAD_BACKGROUND_CRAWLER) != MC_OK) {
+        log_error("crawler thread bind failed");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&crawler_lock);
+    while (run_crawler_thread) {
+        cstats.running = true;
+        cstats.pass++;
+        cstats.class = SLABCLASS_MIN_ID;
+        cstats.pass_start_ts = time_now();
+        pthread_mutex_unlock(&crawler_lock);
+
+        done = crawler_pass();
+
+        pthread_mutex_lock(&crawler_lock);
+        cstats.running = false;
+        if (done) {
+            cstats.pass_done++;
+            cstats.pass_end_ts = time_now();
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CRAWLER_PASS_INTERVAL;
+        while (run_crawler_thread &&
+               pthread_cond_timedwait(&crawler_cond, &crawler_lock,
+                                      &ts) != ETIMEDOUT) {
+            /* woken up early, but only deinit signals us */
+        }
+    }
+    pthread_mutex_unlock(&crawler_lock);
+
+    return NULL;
+}
+
+void
+crawler_get_stats(struct crawler_stats *stats)
+{
+    pthread_mutex_lock(&crawler_lock);
+    *stats = cstats;
+    pthread_mutex_unlock(&crawler_lock);
+}
+
+rstatus_t
+crawler_init(void)
+{
+    err_t err;
+
+    pthread_mutex_init(&crawler_lock, NULL);
+    pthread_cond_init(&crawler_cond, NULL);
+    memset(&cstats, 0, sizeof(cstats));
+
+    if (settings.crawler_duty == 0) {
+        /* crawler is disabled */
+        return MC_OK;
+    }
+
+    if (settings.storage == STORAGE_SEGMENT) {
+        /* expired segments are cleared as a whole */
+        return MC_OK;
+    }
+
+    run_crawler_thread = 1;
+
+    err = pthread_create(&crawler_tid, NULL, crawler_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    crawler_started = true;
+
+    return MC_OK;
+}
+
+void
+crawler_deinit(void)
+{
+    if (!crawler_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&crawler_lock);
+    run_crawler_thread = 0;
+    pthread_cond_signal(&crawler_cond);
+    pthread_mutex_unlock(&crawler_lock);
+
+    /* wait for the crawler thread to stop */
+    pthread_join(crawler_tid, NULL);
+    crawler_started = false;
+}
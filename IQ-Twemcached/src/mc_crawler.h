@@ -0,0 +1,54 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_CRAWLER_H_
+#define _MC_CRAWLER_H_
+
+#define CRAWLER_DEFAULT_DUTY   0    /* % of time spent crawling, 0 for off */
+#define CRAWLER_BATCH          256  /* items scanned between duty cycle checks */
+#define CRAWLER_PASS_INTERVAL  1    /* secs between passes */
+
+struct crawler_stats {
+    bool       running;         /* pass in progress? */
+    uint64_t   pass;            /* # passes started */
+    uint64_t   pass_done;       /* # passes run to completion */
+    uint8_t    class;           /* class being crawled by the current pass */
+    uint64_t   item_scanned;    /* # items scanned */
+    uint64_t   item_reclaimed;  /* # expired items reclaimed */
+    uint64_t   byte_reclaimed;  /* # bytes of expired items reclaimed */
+    uint64_t   lease_reclaimed; /* # expired lease items reclaimed */
+    rel_time_t pass_start_ts;   /* start time of the last pass */
+    rel_time_t pass_end_ts;     /* end time of the last completed pass */
+};
+
+rstatus_t crawler_init(void);
+void crawler_deinit(void);
+void crawler_get_stats(struct crawler_stats *stats);
+
+#endif
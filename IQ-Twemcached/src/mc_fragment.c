@@ -0,0 +1,408 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <mc_core.h>
+
+/*
+ * Rejig configuration table
+ *
+ * The server keeps the latest configuration number it has been told about
+ * together with an optional table of per-fragment configuration numbers. A
+ * key belongs to fragment hash(key) % nfragment, where companion keys
+ * (leases, pending versions) map to the fragment of the key they shadow.
+ * The fragment configuration is the configuration in which the fragment
+ * was last assigned to this server; a client with configuration c may
+ * touch a key in fragment f as long as fconfig[f] <= c <= config, i.e.
+ * the fragment has not moved since the client refreshed its view and the
+ * client has not seen a configuration newer than the server. Without a
+ * table every key is in the global configuration and the rule degenerates
+ * to an exact match.
+ *
+ * Readers look the table up on every request, so it is published RCU
+ * style: readers snapshot the pointer inside an epoch read-side section,
+ * and the writer swaps in a new table and waits for a grace period before
+ * freeing the old one.
+ *
+ * Items stamped with a configuration, and companion items, are also
+ * threaded onto one of FRAGMENT_NSLOT index slots by the same hash
+ * fragments are derived from; a companion by the key it was built from.
+ * Slots do not depend on the table: when the # fragments n divides
+ * FRAGMENT_NSLOT, fragment f is exactly the slots s with s % n == f, so a
+ * fragment can be enumerated, dropped or accounted for in time
+ * proportional to its size, and no update ever has to re-index items. For
+ * other fragment counts a slot mixes fragments and walkers filter its
+ * items by fragment id.
+ */
+
+struct fragment_table {
+    int32_t  config;            /* latest configuration number */
+    uint32_t nfragment;         /* # fragments, 0 if no table */
+    int32_t  fconfig[1];        /* per fragment configuration number */
+};
+
+static pthread_mutex_t fragment_lock;           /* serializes updates */
+static struct fragment_table *volatile ftable;  /* current table */
+static uint64_t fragment_generation;            /* # updates so far */
+
+struct fragment_slot {
+    pthread_mutex_t lock;       /* protects itemq and counters */
+    struct item_tqh itemq;      /* items in slot */
+    uint32_t        nitem;      /* # items */
+    uint64_t        nbyte;      /* # bytes of items */
+};
+
+static struct fragment_slot *fslot; /* fragment index */
+
+static struct fragment_table *
+fragment_table_create(int32_t config, uint32_t nfragment, const int32_t *fconfig)
+{
+    struct fragment_table *table;
+    size_t size;
+
+    size = sizeof(*table) + sizeof(table->fconfig[0]) * nfragment;
+    table = mc_alloc(size);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->config = config;
+    table->nfragment = nfragment;
+    if (nfragment > 0) {
+        memcpy(table->fconfig, fconfig, sizeof(table->fconfig[0]) * nfragment);
+    }
+
+    return table;
+}
+
+uint32_t
+fragment_id(const char *key, size_t nkey, uint32_t nfragment)
+{
+    ASSERT(nfragment > 0);
+
+    return hash(key, nkey, 0) % nfragment;
+}
+
+/*
+ * Index slot of key; it is fixed for the lifetime of the item
+ */
+uint16_t
+fragment_slot(const char *key, size_t nkey)
+{
+    return (uint16_t)fragment_id(key, nkey, FRAGMENT_NSLOT);
+}
+
+/*
+ * Return true if every index slot holds items of a single fragment, for
+ * a table of nfragment fragments.
+ */
+bool
+fragment_slot_exact(uint32_t nfragment)
+{
+    return nfragment > 0 && FRAGMENT_NSLOT % nfragment == 0;
+}
+
+/*
+ * Index slots that may hold items of fragment fid are enumerated with
+ *
+ *   for (s = fragment_slot_first(fid, n); s < FRAGMENT_NSLOT;
+ *        s = fragment_slot_next(s, n))
+ */
+uint32_t
+fragment_slot_first(uint32_t fid, uint32_t nfragment)
+{
+    return fragment_slot_exact(nfragment) ? fid : 0;
+}
+
+uint32_t
+fragment_slot_next(uint32_t slot, uint32_t nfragment)
+{
+    return slot + (fragment_slot_exact(nfragment) ? nfragment : 1);
+}
+
+void
+fragment_slot_lock(uint32_t slot)
+{
+    ASSERT(slot < FRAGMENT_NSLOT);
+
+    pthread_mutex_lock(&fslot[slot].lock);
+}
+
+void
+fragment_slot_unlock(uint32_t slot)
+{
+    ASSERT(slot < FRAGMENT_NSLOT);
+
+    pthread_mutex_unlock(&fslot[slot].lock);
+}
+
+/*
+ * First item in slot; the rest follow through f_tqe. The slot lock must
+ * be held, or all item locks, which keep items from being linked into or
+ * unlinked from the index.
+ */
+struct item *
+fragment_slot_head(uint32_t slot)
+{
+    ASSERT(slot < FRAGMENT_NSLOT);
+
+    return ITEM_TAILQ_FIRST(&fslot[slot].itemq);
+}
+
+void
+fragment_slot_stats(uint32_t slot, uint32_t *nitem, uint64_t *nbyte)
+{
+    struct fragment_slot *fs;
+
+    ASSERT(slot < FRAGMENT_NSLOT);
+
+    fs = &fslot[slot];
+
+    pthread_mutex_lock(&fs->lock);
+    *nitem = fs->nitem;
+    *nbyte = fs->nbyte;
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ * Add a linked item to the index; called with the item stripe held.
+ */
+void
+fragment_link(struct item *it)
+{
+    struct fragment_slot *fs;
+
+    if (it->fslot == FRAGMENT_SLOT_NONE) {
+        return;
+    }
+
+    ASSERT(it->fslot < FRAGMENT_NSLOT);
+
+    fs = &fslot[it->fslot];
+
+    pthread_mutex_lock(&fs->lock);
+    ITEM_TAILQ_INSERT_TAIL(&fs->itemq, it, f_tqe);
+    fs->nitem++;
+    fs->nbyte += item_size(it);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void
+fragment_unlink(struct item *it)
+{
+    struct fragment_slot *fs;
+
+    if (it->fslot == FRAGMENT_SLOT_NONE) {
+        return;
+    }
+
+    ASSERT(it->fslot < FRAGMENT_NSLOT);
+
+    fs = &fslot[it->fslot];
+
+    pthread_mutex_lock(&fs->lock);
+    ASSERT(fs->nitem > 0);
+    ITEM_TAILQ_REMOVE(&fs->itemq, it, f_tqe);
+    fs->nitem--;
+    fs->nbyte -= item_size(it);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+rstatus_t
+fragment_init(void)
+{
+    uint32_t i;
+
+    pthread_mutex_init(&fragment_lock, NULL);
+
+    fslot = mc_alloc(sizeof(*fslot) * FRAGMENT_NSLOT);
+    if (fslot == NULL) {
+        return MC_ENOMEM;
+    }
+
+    for (i = 0; i < FRAGMENT_NSLOT; i++) {
+        pthread_mutex_init(&fslot[i].lock, NULL);
+        ITEM_TAILQ_INIT(&fslot[i].itemq);
+        fslot[i].nitem = 0;
+        fslot[i].nbyte = 0;
+    }
+
+    ftable = fragment_table_create(0, 0, NULL);
+    if (ftable == NULL) {
+        return MC_ENOMEM;
+    }
+
+    return MC_OK;
+}
+
+void
+fragment_deinit(void)
+{
+    mc_free(ftable);
+    ftable = NULL;
+
+    mc_free(fslot);
+    fslot = NULL;
+}
+
+/*
+ * Install a new configuration. With nfragment of zero the per-fragment
+ * table is dropped and all keys follow the global configuration number.
+ */
+rstatus_t
+fragment_update(int32_t config, uint32_t nfragment, const int32_t *fconfig)
+{
+    struct fragment_table *table, *old;
+
+    ASSERT(nfragment <= FRAGMENT_MAX);
+
+    table = fragment_table_create(config, nfragment, fconfig);
+    if (table == NULL) {
+        return MC_ENOMEM;
+    }
+
+    pthread_mutex_lock(&fragment_lock);
+    old = ftable;
+    /* make the table contents visible before the pointer */
+    __sync_synchronize();
+    ftable = table;
+    fragment_generation++;
+    /* wait for readers that may still hold the old table */
+    thread_epoch_synchronize();
+    pthread_mutex_unlock(&fragment_lock);
+
+    mc_free(old);
+
+    /* items of fragments that moved on are now stale */
+    reaper_wakeup();
+
+    return MC_OK;
+}
+
+/*
+ * Copy the per-fragment configuration numbers into fconfig, which must
+ * hold FRAGMENT_MAX entries, for threads that cannot use epoch read-side
+ * sections for as long as they need the table. Returns the generation of
+ * the table, which changes on every update.
+ */
+uint64_t
+fragment_snapshot(int32_t *fconfig, uint32_t *nfragment)
+{
+    uint64_t generation;
+
+    pthread_mutex_lock(&fragment_lock);
+    *nfragment = ftable->nfragment;
+    memcpy(fconfig, ftable->fconfig, sizeof(*fconfig) * ftable->nfragment);
+    generation = fragment_generation;
+    pthread_mutex_unlock(&fragment_lock);
+
+    return generation;
+}
+
+/*
+ * Validate the client configuration number for key, or for a request
+ * that carries no key (e.g. commit of a transaction id) when key is NULL.
+ * Keyless requests only refer to keys that were validated when they were
+ * registered, so they are only required not to be ahead of the server.
+ * On success, server_config is set to the configuration number new items
+ * for key should be stamped with.
+ */
+bool
+fragment_check(int32_t client_config, const char *key, size_t nkey,
+               int32_t *server_config)
+{
+    struct fragment_table *table;
+    int32_t config, fconfig;
+    bool valid;
+
+    thread_epoch_enter();
+    table = ftable;
+    config = table->config;
+    if (key != NULL && table->nfragment > 0) {
+        fconfig = table->fconfig[fragment_id(key, nkey, table->nfragment)];
+    } else {
+        fconfig = config;
+    }
+
+    if (client_config == -1) {
+        valid = true;
+    } else if (table->nfragment == 0) {
+        valid = (client_config == config);
+    } else {
+        valid = (fconfig <= client_config && client_config <= config);
+    }
+    thread_epoch_exit();
+
+    *server_config = fconfig;
+
+    return valid;
+}
+
+int32_t
+fragment_config(const char *key, size_t nkey)
+{
+    struct fragment_table *table;
+    int32_t config;
+
+    thread_epoch_enter();
+    table = ftable;
+    if (table->nfragment > 0) {
+        config = table->fconfig[fragment_id(key, nkey, table->nfragment)];
+    } else {
+        config = table->config;
+    }
+    thread_epoch_exit();
+
+    return config;
+}
+
+int32_t
+fragment_global_config(void)
+{
+    int32_t config;
+
+    thread_epoch_enter();
+    config = ftable->config;
+    thread_epoch_exit();
+
+    return config;
+}
+
+uint32_t
+fragment_count(void)
+{
+    uint32_t nfragment;
+
+    thread_epoch_enter();
+    nfragment = ftable->nfragment;
+    thread_epoch_exit();
+
+    return nfragment;
+}
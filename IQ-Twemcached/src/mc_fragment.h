@@ -0,0 +1,62 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_FRAGMENT_H_
+#define _MC_FRAGMENT_H_
+
+#define FRAGMENT_MAX        8192        /* max # fragments in a configuration */
+#define FRAGMENT_NSLOT      FRAGMENT_MAX    /* # fragment index slots */
+#define FRAGMENT_SLOT_NONE  UINT16_MAX      /* slot of items not indexed */
+
+struct item;
+
+rstatus_t fragment_init(void);
+void fragment_deinit(void);
+
+rstatus_t fragment_update(int32_t config, uint32_t nfragment, const int32_t *fconfig);
+bool fragment_check(int32_t client_config, const char *key, size_t nkey, int32_t *server_config);
+int32_t fragment_config(const char *key, size_t nkey);
+int32_t fragment_global_config(void);
+uint32_t fragment_count(void);
+
+uint32_t fragment_id(const char *key, size_t nkey, uint32_t nfragment);
+uint64_t fragment_snapshot(int32_t *fconfig, uint32_t *nfragment);
+
+uint16_t fragment_slot(const char *key, size_t nkey);
+bool fragment_slot_exact(uint32_t nfragment);
+uint32_t fragment_slot_first(uint32_t fid, uint32_t nfragment);
+uint32_t fragment_slot_next(uint32_t slot, uint32_t nfragment);
+void fragment_slot_lock(uint32_t slot);
+void fragment_slot_unlock(uint32_t slot);
+struct item *fragment_slot_head(uint32_t slot);
+void fragment_slot_stats(uint32_t slot, uint32_t *nitem, uint64_t *nbyte);
+void fragment_link(struct item *it);
+void fragment_unlink(struct item *it);
+
+#endif
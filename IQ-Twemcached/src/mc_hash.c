@@ -30,15 +30,27 @@
 /*
  * Hash table
  *
- * The hash function used here is by Bob Jenkins, 1996:
+ * The default hash function used here is by Bob Jenkins, 1996:
  *   <http://burtleburtle.net/bob/hash/doobs.html>
  *   "By Bob Jenkins, 1996.  bob_jenkins@burtleburtle.net.
  *   You may use this code any way you wish, private, educational,
  *   or commercial.  It's free."
  *
+ * crc32c and wyhash can be picked instead with -H. wyhash is by Wang Yi
+ * and is in the public domain:
+ *   <https://github.com/wangyi-fudan/wyhash>
  */
 #include <mc_core.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <nmmintrin.h>
+# define HASH_HAVE_SSE42 1
+#else
+# define HASH_HAVE_SSE42 0
+#endif
+
+extern struct settings settings;
+
 /*
  * Since the hash function does bit manipulation, it needs to know
  * whether it's big or little-endian. HAVE_LITTLE_ENDIAN and HAVE_BIG_ENDIAN
@@ -148,7 +160,7 @@ and these came close:
 }
 
 #if HASH_LITTLE_ENDIAN == 1
-uint32_t hash(
+static uint32_t hash_lookup3(
   const void *key,       /* the key to hash */
   size_t      length,    /* length of the key */
   const uint32_t    initval)   /* initval */
@@ -329,7 +341,7 @@ uint32_t hash(
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t hash( const void *key, size_t length, const uint32_t initval)
+static uint32_t hash_lookup3( const void *key, size_t length, const uint32_t initval)
 {
   uint32_t a,b,c;
   union { const void *ptr; size_t i; } u; /* to cast key to (size_t) happily */
@@ -455,3 +467,275 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+/*
+ * crc32c (Castagnoli) of the key, with the murmur3 finalizer on top, as a
+ * crc alone leaves the low bits that pick a bucket of keys that differ in
+ * a digit or two poorly mixed.
+ */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t
+hash_fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static void
+hash_crc32c_init(void)
+{
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t
+hash_crc32c_sw(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *p = key;
+    uint32_t crc = ~initval;
+
+    while (length-- > 0) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return hash_fmix32(~crc);
+}
+
+#if HASH_HAVE_SSE42 == 1
+static uint32_t __attribute__((target("sse4.2")))
+hash_crc32c_sse42(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *p = key;
+    uint64_t crc = ~initval, v;
+    uint32_t w;
+
+    for (; length >= 8; p += 8, length -= 8) {
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u64(crc, v);
+    }
+
+    if (length >= 4) {
+        memcpy(&w, p, sizeof(w));
+        crc = _mm_crc32_u32((uint32_t)crc, w);
+        p += 4;
+        length -= 4;
+    }
+
+    while (length-- > 0) {
+        crc = _mm_crc32_u8((uint32_t)crc, *p++);
+    }
+
+    return hash_fmix32(~(uint32_t)crc);
+}
+#endif
+
+/*
+ * wyhash of the key folded to 32 bits. It reads the key 8 bytes at a time
+ * and mixes with 64x64->128-bit multiplies, which makes it the cheapest of
+ * the three on keys of a few dozen bytes.
+ */
+static const uint64_t wyhash_secret[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL,
+};
+
+static void
+hash_wymum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static uint64_t
+hash_wymix(uint64_t a, uint64_t b)
+{
+    hash_wymum(&a, &b);
+
+    return a ^ b;
+}
+
+static uint64_t
+hash_wyr8(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static uint64_t
+hash_wyr4(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static uint32_t
+hash_wyhash(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *p = key;
+    const uint64_t *s = wyhash_secret;
+    uint64_t seed, a, b, see1, see2;
+    size_t i;
+
+    seed = initval ^ hash_wymix(initval ^ s[0], s[1]);
+
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (hash_wyr4(p) << 32) | hash_wyr4(p + ((length >> 3) << 2));
+            b = (hash_wyr4(p + length - 4) << 32) |
+                hash_wyr4(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+                p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = length;
+        if (i > 48) {
+            see1 = seed;
+            see2 = seed;
+            do {
+                seed = hash_wymix(hash_wyr8(p) ^ s[1], hash_wyr8(p + 8) ^ seed);
+                see1 = hash_wymix(hash_wyr8(p + 16) ^ s[2],
+                                  hash_wyr8(p + 24) ^ see1);
+                see2 = hash_wymix(hash_wyr8(p + 32) ^ s[3],
+                                  hash_wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = hash_wymix(hash_wyr8(p) ^ s[1], hash_wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hash_wyr8(p + i - 16);
+        b = hash_wyr8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    hash_wymum(&a, &b);
+    a = hash_wymix(a ^ s[0] ^ length, b ^ s[1]);
+
+    return (uint32_t)(a ^ (a >> 32));
+}
+
+static const char *hash_names[] = {
+    "lookup3",
+    "crc32c",
+    "wyhash",
+};
+
+static hash_t hash_funcs[] = {
+    hash_lookup3,
+    hash_crc32c_sw,
+    hash_wyhash,
+};
+
+static hash_t hash_fn = hash_lookup3;   /* hash of settings.hash_type */
+
+/*
+ * Pick the key hash. Every server of a cluster must use the same one, as
+ * it also maps keys to fragments.
+ */
+rstatus_t
+hash_init(void)
+{
+    hash_crc32c_init();
+
+#if HASH_HAVE_SSE42 == 1
+    if (__builtin_cpu_supports("sse4.2")) {
+        hash_funcs[HASH_CRC32C] = hash_crc32c_sse42;
+    }
+#endif
+
+    if (settings.hash_type < 0 || settings.hash_type >= HASH_INVALID) {
+        log_error("hash type %d is invalid", settings.hash_type);
+        return MC_ERROR;
+    }
+
+    hash_fn = hash_funcs[settings.hash_type];
+
+    log_debug(LOG_INFO, "key hash is %s%s", hash_names[settings.hash_type],
+              hash_fn == hash_crc32c_sw ? " without sse4.2" : "");
+
+    return MC_OK;
+}
+
+hash_t
+hash_func(hash_type_t type)
+{
+    ASSERT(type >= 0 && type < HASH_INVALID);
+
+    return hash_funcs[type];
+}
+
+const char *
+hash_name(hash_type_t type)
+{
+    ASSERT(type >= 0 && type < HASH_INVALID);
+
+    return hash_names[type];
+}
+
+/*
+ * Return the hash type of name, or HASH_INVALID
+ */
+hash_type_t
+hash_type(const char *name)
+{
+    hash_type_t type;
+
+    for (type = 0; type < HASH_INVALID; type++) {
+        if (strcmp(name, hash_names[type]) == 0) {
+            break;
+        }
+    }
+
+    return type;
+}
+
+uint32_t
+hash(const void *key, size_t length, const uint32_t initval)
+{
+    return hash_fn(key, length, initval);
+}
@@ -30,6 +30,20 @@
 #ifndef _MC_HASH_H_
 #define _MC_HASH_H_
 
+typedef enum hash_type {
+    HASH_LOOKUP3,           /* Bob Jenkins' lookup3 */
+    HASH_CRC32C,            /* crc32c, with sse4.2 when the cpu has it */
+    HASH_WYHASH,            /* wyhash, 64-bit folded to 32-bit */
+    HASH_INVALID
+} hash_type_t;
+
+typedef uint32_t (*hash_t)(const void *key, size_t length, const uint32_t initval);
+
+rstatus_t hash_init(void);
+hash_t hash_func(hash_type_t type);
+const char *hash_name(hash_type_t type);
+hash_type_t hash_type(const char *name);
+
 uint32_t hash(const void *key, size_t length, const uint32_t initval);
 
 #endif
@@ -43,18 +43,62 @@ extern struct settings settings;
 #define ITEM_UPDATE_INTERVAL    60
 
 #define ITEM_LRUQ_MAX_TRIES     50
+#define ITEM_CLOCK_MAX_PASSES   50
 
 #define ILEASE_MEET_QLEASE 0
 
 /* 2MB is the maximum response size for 'cachedump' command */
 #define ITEM_CACHEDUMP_MEMLIMIT (2 * MB)
 
-pthread_mutex_t cache_lock;                     /* lock protecting lru q and hash */
-pthread_mutex_t configuration_lock;
 struct item_tqh item_lruq[SLABCLASS_MAX_IDS];   /* lru q of items */
 struct item_tqh reserved_item_lruq[SLABCLASS_MAX_IDS];   /* lru q of reserved items */
 static uint64_t cas_id;                         /* unique cas id */
 
+/*
+ * Items are protected by lock stripes that are picked by the hash of
+ * their key (assoc_hash), so companion items (lease, pending, pending
+ * version, ptrans, co lease) always share the stripe of their base key.
+ *
+ * An operation takes item_global_lock for read, followed by the stripes
+ * of all the keys it touches in ascending order. Operations whose key set
+ * is not known upfront (co sessions, flush_all and hash table expansion)
+ * take item_global_lock for write instead, which excludes everyone else.
+ *
+ * Item refcounts are updated atomically, as lock-free gets (see
+ * item_get_lockfree) take references without holding the item stripe.
+ * An unreferenced item is recycled only after it has been claimed, which
+ * moves its refcount from 0 to ITEM_REFCOUNT_CLAIMED and makes any further
+ * lock-free reference attempt fail. With lock-free gets on (-O), claimed
+ * items are not handed out again before all lock-free readers that may
+ * still see them have finished (thread_epoch_synchronize). Without them,
+ * every reader holds the item stripe and the wait is skipped.
+ *
+ * The lru q of every slab class has its own lock. Lock order is item
+ * stripe, then slab_lock, then lru lock; locks taken out of order (lru
+ * item reuse and slab eviction) are only ever trylocked.
+ */
+#define ITEM_LOCKSET_MAX    64
+#define ITEM_BATCH_STRIPE_MAX   (ITEM_LOCKSET_MAX / 2)  /* stripes a batch chunk locks */
+#define ITEM_STRIPE_NONE    UINT32_MAX
+
+#define ITEM_REFCOUNT_CLAIMED   UINT16_MAX
+
+struct item_lockset {
+	bool     exclusive;                 /* holds item_global_lock for write? */
+	uint32_t nstripe;                   /* # stripes held */
+	uint32_t stripe[ITEM_LOCKSET_MAX];  /* stripes held */
+};
+
+static pthread_rwlock_t item_global_lock;              /* lock excluding all item stripes */
+static pthread_mutex_t *item_stripe_lock;              /* item lock stripes */
+static uint32_t item_stripe_mask;                      /* # stripes - 1 */
+static pthread_mutex_t item_lru_lock[SLABCLASS_MAX_IDS]; /* lock protecting lru q */
+static __thread struct item_lockset item_locks;        /* locks held by this thread */
+
+static uint32_t *item_evict_stripe;             /* stripes held by slab eviction */
+static uint32_t item_evict_nstripe;             /* # stripes held by slab eviction */
+static uint8_t *item_evict_held;                /* stripe held by slab eviction? */
+
 /*
  * Returns the next cas id for a new item. Minimum cas value
  * is 1 and the maximum cas value is UINT64_MAX
@@ -63,41 +107,564 @@ static uint64_t
 item_next_cas(void)
 {
 	if (settings.use_cas) {
-		return ++cas_id;
+		return __sync_add_and_fetch(&cas_id, 1);
 	}
 
 	return 0ULL;
 }
 
+/*
+ * Items that live as long as a lease (leases, pending versions, ptrans,
+ * co leases and the items pinned to them) expire at a msec deadline, of
+ * which expms keeps the low 32 bits, or 0 if there is none. Their exptime
+ * is the deadline rounded up to secs, which still bounds their lifetime
+ * for everyone who only looks at exptime.
+ */
+static bool
+item_deadline_passed(struct item *it)
+{
+	return (it->expms != 0 &&
+			(int32_t)((uint32_t)time_now_ms() - it->expms) >= 0) ? true : false;
+}
+
 static bool
 item_expired(struct item *it)
 {
 	ASSERT(it->magic == ITEM_MAGIC);
 
-	return (it->exptime > 0 && it->exptime < time_now()) ? true : false;
+	return ((it->exptime > 0 && it->exptime < time_now()) ||
+			item_deadline_passed(it)) ? true : false;
+}
+
+/*
+ * Count an expired item in the lease stats, if it is a lease
+ */
+static void
+item_count_expired_lease(struct item *it)
+{
+	if(item_has_i_lease(it)) {
+		stats_thread_incr(expired_leases);
+		stats_thread_incr(expired_i_leases);
+	} else if (item_has_q_inv_lease(it) || item_has_q_ref_lease(it) || item_has_q_incr_lease(it)) {
+		stats_thread_incr(expired_leases);
+		stats_thread_incr(expired_q_leases);
+	} else if (item_has_co_lease(it)) {
+		stats_thread_incr(expired_leases);
+		if (item_has_c_lease(it))
+			stats_thread_incr(expired_c_leases);
+		else if (item_has_o_lease(it))
+			stats_thread_incr(expired_o_leases);
+	}
+}
+
+static uint32_t
+item_key_stripe(const char *key, size_t nkey)
+{
+	return assoc_hash(key, nkey) & item_stripe_mask;
+}
+
+static bool
+item_stripe_held(uint32_t stripe)
+{
+	uint32_t i;
+
+	if (item_locks.exclusive) {
+		return true;
+	}
+
+	for (i = 0; i < item_locks.nstripe; i++) {
+		if (item_locks.stripe[i] == stripe) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Add a stripe to a sorted set of n stripes, returning the new set size
+ */
+static uint32_t
+item_stripe_add(uint32_t *stripe, uint32_t n, uint32_t s)
+{
+	uint32_t i;
+
+	for (i = n; i > 0 && stripe[i - 1] >= s; i--) {
+		if (stripe[i - 1] == s) {
+			return n;
+		}
+	}
+
+	memmove(&stripe[i + 1], &stripe[i], (n - i) * sizeof(*stripe));
+	stripe[i] = s;
+
+	return n + 1;
+}
+
+/*
+ * Lock a sorted set of n stripes. The set may be empty, in which case
+ * only item_global_lock is taken, keeping out exclusive operations.
+ */
+static void
+item_lock_stripes(const uint32_t *stripe, uint32_t n)
+{
+	uint32_t i;
+
+	ASSERT(!item_locks.exclusive && item_locks.nstripe == 0);
+	ASSERT(n <= ITEM_LOCKSET_MAX);
+
+	pthread_rwlock_rdlock(&item_global_lock);
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&item_stripe_lock[stripe[i]]);
+		item_locks.stripe[i] = stripe[i];
+	}
+	item_locks.nstripe = n;
+}
+
+static void
+item_lock_key(const char *key, size_t nkey)
+{
+	uint32_t stripe = item_key_stripe(key, nkey);
+
+	item_lock_stripes(&stripe, 1);
+}
+
+/*
+ * Lock the stripes of two keys; the second key is optional (nkey2 = 0)
+ */
+static void
+item_lock_key2(const char *key1, size_t nkey1, const char *key2, size_t nkey2)
+{
+	uint32_t stripe[2], n;
+
+	n = item_stripe_add(stripe, 0, item_key_stripe(key1, nkey1));
+	if (nkey2 > 0) {
+		n = item_stripe_add(stripe, n, item_key_stripe(key2, nkey2));
+	}
+
+	item_lock_stripes(stripe, n);
+}
+
+/*
+ * Collect the stripes of a transaction and of the keys in its keylist.
+ * Returns false if they do not fit in ITEM_LOCKSET_MAX stripes.
+ */
+static bool
+item_keylist_stripes(char *tid, size_t ntid, uint32_t *stripe, uint32_t *n)
+{
+	struct trans *trans;
+	char *key;
+	size_t nkey;
+	uint32_t i;
+
+	*n = item_stripe_add(stripe, 0, item_key_stripe(tid, ntid));
+
+	trans = trans_get(TRANS_TID, tid, ntid);
+	if (trans == NULL) {
+		return true;
+	}
+
+	for (i = 0; i < trans->nkey; i++) {
+		if (*n == ITEM_LOCKSET_MAX) {
+			return false;
+		}
+		trans_key(trans, i, &key, &nkey);
+		*n = item_stripe_add(stripe, *n, item_key_stripe(key, nkey));
+	}
+
+	return true;
+}
+
+/*
+ * Lock the stripes of a transaction and of all the keys in its keylist.
+ * The keylist is first read under the transaction stripe to learn the
+ * stripe set, which is then locked in ascending order. Should the keylist
+ * have changed in between, we start over. Keylists that span more than
+ * ITEM_LOCKSET_MAX stripes fall back to the exclusive lock.
+ */
+static void
+item_lock_keylist(char *tid, size_t ntid)
+{
+	uint32_t stripe[ITEM_LOCKSET_MAX], n, i;
+	bool covered;
+
+	for (;;) {
+		item_lock_key(tid, ntid);
+		covered = item_keylist_stripes(tid, ntid, stripe, &n);
+		item_unlock();
+
+		if (!covered) {
+			item_lock_global();
+			return;
+		}
+
+		item_lock_stripes(stripe, n);
+
+		covered = item_keylist_stripes(tid, ntid, stripe, &n);
+		for (i = 0; covered && i < n; i++) {
+			covered = item_stripe_held(stripe[i]);
+		}
+
+		if (covered) {
+			return;
+		}
+
+		item_unlock();
+	}
+}
+
+/*
+ * Merge a sorted set of nadd stripes into the sorted set of *n stripes.
+ * Returns false, leaving the set as it was, if the union has more than
+ * max stripes.
+ */
+static bool
+item_stripe_merge(uint32_t *stripe, uint32_t *n, const uint32_t *add,
+		uint32_t nadd, uint32_t max)
+{
+	uint32_t merged[ITEM_LOCKSET_MAX], nmerged, i, j;
+
+	ASSERT(max <= ITEM_LOCKSET_MAX);
+
+	for (i = 0, j = 0, nmerged = 0; i < *n || j < nadd; nmerged++) {
+		if (nmerged == max) {
+			return false;
+		}
+		if (j == nadd || (i < *n && stripe[i] < add[j])) {
+			merged[nmerged] = stripe[i++];
+		} else {
+			if (i < *n && stripe[i] == add[j]) {
+				i++;
+			}
+			merged[nmerged] = add[j++];
+		}
+	}
+
+	memcpy(stripe, merged, nmerged * sizeof(*stripe));
+	*n = nmerged;
+
+	return true;
+}
+
+/*
+ * Lock the stripes of the longest prefix of the n batch keys that fits
+ * in ITEM_BATCH_STRIPE_MAX stripes, together with the stripe of the
+ * transaction, if any (ntid > 0). The rest of ITEM_LOCKSET_MAX is left
+ * for the stripes of the lru items reused while the batch runs. Returns
+ * the # keys covered, which is at least one.
+ */
+static uint32_t
+item_lock_batch(struct item_batch *batch, uint32_t n, char *tid, size_t ntid)
+{
+	uint32_t stripe[ITEM_LOCKSET_MAX], nstripe, s, i;
+
+	ASSERT(n > 0);
+
+	nstripe = 0;
+	if (ntid > 0) {
+		s = item_key_stripe(tid, ntid);
+		item_stripe_merge(stripe, &nstripe, &s, 1, ITEM_BATCH_STRIPE_MAX);
+	}
+
+	for (i = 0; i < n; i++) {
+		s = item_key_stripe(batch[i].key, batch[i].nkey);
+		if (!item_stripe_merge(stripe, &nstripe, &s, 1, ITEM_BATCH_STRIPE_MAX)) {
+			break;
+		}
+	}
+
+	item_lock_stripes(stripe, nstripe);
+	stats_thread_incr(batch_lock);
+
+	return i;
+}
+
+/*
+ * Lock the stripes of the longest prefix of the n batch transactions,
+ * and of the keys in their keylists, that fits in ITEM_BATCH_STRIPE_MAX
+ * stripes, the way item_lock_keylist does for one transaction. A first
+ * transaction that does not fit on its own is locked by itself, with
+ * item_lock_keylist. Returns the # transactions covered, at least one.
+ */
+static uint32_t
+item_lock_keylists(struct item_batch *batch, uint32_t n)
+{
+	uint32_t stripe[ITEM_LOCKSET_MAX], nstripe;
+	uint32_t keylist[ITEM_LOCKSET_MAX], nkeylist;
+	uint32_t ntrans, i, j;
+	bool covered;
+
+	ASSERT(n > 0);
+
+	for (;;) {
+		nstripe = 0;
+		for (ntrans = 0; ntrans < n; ntrans++) {
+			item_lock_key(batch[ntrans].key, batch[ntrans].nkey);
+			covered = item_keylist_stripes(batch[ntrans].key,
+					batch[ntrans].nkey, keylist, &nkeylist);
+			item_unlock();
+
+			if (!covered || !item_stripe_merge(stripe, &nstripe, keylist,
+					nkeylist, ITEM_BATCH_STRIPE_MAX)) {
+				break;
+			}
+		}
+
+		if (ntrans == 0) {
+			item_lock_keylist(batch[0].key, batch[0].nkey);
+			stats_thread_incr(batch_lock);
+			return 1;
+		}
+
+		item_lock_stripes(stripe, nstripe);
+
+		covered = true;
+		for (i = 0; covered && i < ntrans; i++) {
+			covered = item_keylist_stripes(batch[i].key, batch[i].nkey,
+					keylist, &nkeylist);
+			for (j = 0; covered && j < nkeylist; j++) {
+				covered = item_stripe_held(keylist[j]);
+			}
+		}
+
+		if (covered) {
+			stats_thread_incr(batch_lock);
+			return ntrans;
+		}
+
+		item_unlock();
+	}
 }
 
+/*
+ * Lock the stripe of the keys whose hash is hash
+ */
 void
+item_lock_hash(uint32_t hash)
+{
+	uint32_t stripe = hash & item_stripe_mask;
+
+	item_lock_stripes(&stripe, 1);
+}
+
+/*
+ * Does this thread hold the stripe of the keys whose hash is hash?
+ */
+bool
+item_hash_locked(uint32_t hash)
+{
+	return item_stripe_held(hash & item_stripe_mask);
+}
+
+/*
+ * Take item_global_lock for write, excluding all other item operations
+ */
+void
+item_lock_global(void)
+{
+	ASSERT(!item_locks.exclusive && item_locks.nstripe == 0);
+
+	pthread_rwlock_wrlock(&item_global_lock);
+	item_locks.exclusive = true;
+}
+
+/*
+ * Release all the item locks held by this thread
+ */
+void
+item_unlock(void)
+{
+	uint32_t i;
+
+	if (item_locks.exclusive) {
+		item_locks.exclusive = false;
+		pthread_rwlock_unlock(&item_global_lock);
+		return;
+	}
+
+	for (i = item_locks.nstripe; i > 0; i--) {
+		pthread_mutex_unlock(&item_stripe_lock[item_locks.stripe[i - 1]]);
+	}
+	item_locks.nstripe = 0;
+
+	pthread_rwlock_unlock(&item_global_lock);
+}
+
+void
+item_lock_lruq(uint8_t id)
+{
+	pthread_mutex_lock(&item_lru_lock[id]);
+}
+
+void
+item_unlock_lruq(uint8_t id)
+{
+	pthread_mutex_unlock(&item_lru_lock[id]);
+}
+
+/*
+ * Trylock the stripe of an item we would like to reuse. On success, the
+ * stripe is returned in stripe, or ITEM_STRIPE_NONE if it was already
+ * held by this thread, and must be released with item_unlock_victim.
+ */
+static bool
+item_trylock_victim(struct item *it, uint32_t *stripe)
+{
+	uint32_t s = item_key_stripe(item_key(it), it->nkey);
+
+	if (item_stripe_held(s)) {
+		*stripe = ITEM_STRIPE_NONE;
+		return true;
+	}
+
+	if (item_locks.nstripe == ITEM_LOCKSET_MAX ||
+			pthread_mutex_trylock(&item_stripe_lock[s]) != 0) {
+		return false;
+	}
+
+	item_locks.stripe[item_locks.nstripe++] = s;
+	*stripe = s;
+
+	return true;
+}
+
+static void
+item_unlock_victim(uint32_t stripe)
+{
+	uint32_t i;
+
+	if (stripe == ITEM_STRIPE_NONE) {
+		return;
+	}
+
+	for (i = 0; i < item_locks.nstripe; i++) {
+		if (item_locks.stripe[i] == stripe) {
+			item_locks.stripe[i] = item_locks.stripe[--item_locks.nstripe];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&item_stripe_lock[stripe]);
+}
+
+/*
+ * Trylock the stripe of a linked item in a slab that is being evicted.
+ * Must be called with the slab_lock held, which protects the eviction
+ * stripe set. Returns false if the stripe is busy, or if the item key
+ * no longer maps to the stripe we locked.
+ */
+bool
+item_evict_trylock(struct item *it)
+{
+	uint32_t s = item_key_stripe(item_key(it), it->nkey);
+
+	if (!item_stripe_held(s) && !item_evict_held[s]) {
+		if (pthread_mutex_trylock(&item_stripe_lock[s]) != 0) {
+			return false;
+		}
+		item_evict_held[s] = 1;
+		item_evict_stripe[item_evict_nstripe++] = s;
+	}
+
+	return item_key_stripe(item_key(it), it->nkey) == s ? true : false;
+}
+
+/*
+ * Release all the stripes taken by item_evict_trylock
+ */
+void
+item_evict_unlock(void)
+{
+	uint32_t i, s;
+
+	for (i = 0; i < item_evict_nstripe; i++) {
+		s = item_evict_stripe[i];
+		item_evict_held[s] = 0;
+		pthread_mutex_unlock(&item_stripe_lock[s]);
+	}
+	item_evict_nstripe = 0;
+}
+
+rstatus_t
 item_init(void)
 {
 	uint8_t i;
+	uint32_t j, nstripe;
+	pthread_rwlockattr_t attr;
 
 	log_debug(LOG_DEBUG, "item hdr size %d", ITEM_HDR_SIZE);
 
-	pthread_mutex_init(&cache_lock, NULL);
-	pthread_mutex_init(&configuration_lock, NULL);
+	/* one stripe per hash bucket at most, see assoc_hash */
+	nstripe = 1U << MIN((uint32_t)settings.lock_power, assoc_hash_power());
+	item_stripe_mask = nstripe - 1;
+
+	item_stripe_lock = mc_alloc(sizeof(*item_stripe_lock) * nstripe);
+	item_evict_stripe = mc_alloc(sizeof(*item_evict_stripe) * nstripe);
+	item_evict_held = mc_zalloc(sizeof(*item_evict_held) * nstripe);
+	if (item_stripe_lock == NULL || item_evict_stripe == NULL ||
+			item_evict_held == NULL) {
+		return MC_ENOMEM;
+	}
+	item_evict_nstripe = 0;
+
+	for (j = 0; j < nstripe; j++) {
+		pthread_mutex_init(&item_stripe_lock[j], NULL);
+	}
+
+	/* transactions and sessions are guarded by the stripe of their id */
+	if (trans_init(nstripe) != MC_OK) {
+		return MC_ENOMEM;
+	}
+
+	/* prefer writers so that exclusive operations are not starved */
+	pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&item_global_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 
 	for (i = SLABCLASS_MIN_ID; i <= SLABCLASS_MAX_ID; i++) {
-		TAILQ_INIT(&item_lruq[i]);
-		TAILQ_INIT(&reserved_item_lruq[i]);
+		ITEM_TAILQ_INIT(&item_lruq[i]);
+		ITEM_TAILQ_INIT(&reserved_item_lruq[i]);
+		pthread_mutex_init(&item_lru_lock[i], NULL);
 	}
 
 	cas_id = 0ULL;
+
+	return MC_OK;
 }
 
 void
 item_deinit(void)
 {
+	trans_deinit();
+}
+
+/*
+ * Was this item appended to a segment, rather than carved out of a slab
+ * class? See mc_segment.c
+ */
+bool
+item_in_segment(struct item *it)
+{
+	return settings.storage == STORAGE_SEGMENT && item_2_slab(it)->sid != 0;
+}
+
+/*
+ * Get the size of the chunk holding this item: the item size of its slab
+ * class, or its own size for an item in a segment
+ */
+static size_t
+item_chunk_size(struct item *it)
+{
+	if (item_in_segment(it)) {
+		return MC_ALIGN(item_size(it), MC_ALIGNMENT);
+	}
+
+	return slab_item_size(it->id);
 }
 
 /*
@@ -111,7 +678,7 @@ item_data(struct item *it)
 	ASSERT(it->magic == ITEM_MAGIC);
 
 	if (item_is_raligned(it)) {
-		data = (char *)it + slab_item_size(it->id) - it->nbyte;
+		data = (char *)it + item_chunk_size(it) - it->nbyte;
 	} else {
 		data = it->end + it->nkey + 1; /* 1 for terminal '\0' in key */
 		if (item_has_cas(it)) {
@@ -143,34 +710,99 @@ item_2_slab(struct item *it)
 static void
 item_acquire_refcount(struct item *it)
 {
-	ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
 	ASSERT(it->magic == ITEM_MAGIC);
+	ASSERT(it->refcount != ITEM_REFCOUNT_CLAIMED);
 
-	it->refcount++;
+	__sync_fetch_and_add(&it->refcount, 1);
 	slab_acquire_refcount(item_2_slab(it));
 }
 
 static void
 item_release_refcount(struct item *it)
 {
-	ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
 	ASSERT(it->magic == ITEM_MAGIC);
-	ASSERT(it->refcount > 0);
+	ASSERT(it->refcount > 0 && it->refcount != ITEM_REFCOUNT_CLAIMED);
 
-	it->refcount--;
+	__sync_fetch_and_sub(&it->refcount, 1);
 	slab_release_refcount(item_2_slab(it));
 }
 
+/*
+ * Try to take a reference on an item that is not protected by its item
+ * lock. Fails if the item has been claimed for reuse.
+ */
+static bool
+item_tryacquire_refcount(struct item *it)
+{
+	uint16_t refcount;
+
+	do {
+		refcount = it->refcount;
+		if (refcount == ITEM_REFCOUNT_CLAIMED) {
+			return false;
+		}
+	} while (!__sync_bool_compare_and_swap(&it->refcount, refcount,
+				refcount + 1));
+
+	slab_acquire_refcount(item_2_slab(it));
+
+	return true;
+}
+
+/*
+ * Claim an unreferenced item for reuse. Only one of the threads racing to
+ * free or reuse an item can claim it.
+ */
+bool
+item_claim(struct item *it)
+{
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	return __sync_bool_compare_and_swap(&it->refcount, 0,
+			ITEM_REFCOUNT_CLAIMED);
+}
+
+/*
+ * Give up the claim on an item that is not going to be reused after all
+ */
+void
+item_unclaim(struct item *it)
+{
+	ASSERT(it->refcount == ITEM_REFCOUNT_CLAIMED);
+
+	__sync_bool_compare_and_swap(&it->refcount, ITEM_REFCOUNT_CLAIMED, 0);
+}
+
+/*
+ * Hand a claimed item, that was reused in place, to its new owner
+ */
+static void
+item_acquire_claimed(struct item *it)
+{
+	ASSERT(it->refcount == ITEM_REFCOUNT_CLAIMED);
+
+	/* readers that could still find the item in the hash must be gone */
+	if (settings.lockfree_get) {
+		thread_epoch_synchronize();
+	}
+
+	it->refcount = 1;
+	slab_acquire_refcount(item_2_slab(it));
+}
+
 void
 item_hdr_init(struct item *it, uint32_t offset, uint8_t id)
 {
 	ASSERT(offset >= SLAB_HDR_SIZE && offset < settings.slab_size);
 
+#if ITEM_HAS_MAGIC == 1
 	it->magic = ITEM_MAGIC;
+#endif
 	it->offset = offset;
 	it->id = id;
 	it->refcount = 0;
 	it->flags = 0;
+	it->accessed = 0;
 }
 
 /*
@@ -199,12 +831,23 @@ item_link_q(struct item *it, bool allocated)
 			it->flags, it->id);
 
 	it->atime = time_now();
-	if (item_is_lease_holder(it)) {
-		TAILQ_INSERT_TAIL(&reserved_item_lruq[id], it, i_tqe);
-		slab_reserved_lruq_touch(item_2_slab(it), allocated);
-	} else {
-		TAILQ_INSERT_TAIL(&item_lruq[id], it, i_tqe);
-		slab_lruq_touch(item_2_slab(it), allocated);
+
+	/* items in a segment go along with it, and need no lru q */
+	if (!item_in_segment(it)) {
+		pthread_mutex_lock(&item_lru_lock[id]);
+		if (item_is_lease_holder(it)) {
+			ITEM_TAILQ_INSERT_TAIL(&reserved_item_lruq[id], it, i_tqe);
+		} else {
+			ITEM_TAILQ_INSERT_TAIL(&item_lruq[id], it, i_tqe);
+		}
+		pthread_mutex_unlock(&item_lru_lock[id]);
+
+		/* slab lruq is touched outside the lru lock, which nests in slab_lock */
+		if (item_is_lease_holder(it)) {
+			slab_reserved_lruq_touch(item_2_slab(it), allocated);
+		} else {
+			slab_lruq_touch(item_2_slab(it), allocated);
+		}
 	}
 
 	stats_slab_incr(id, item_curr);
@@ -227,21 +870,24 @@ item_unlink_q(struct item *it)
 			"%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
 			it->flags, it->id);
 
-	if(item_is_lease_holder(it)) {
-		TAILQ_REMOVE(&reserved_item_lruq[id], it, i_tqe);
-	} else {
-		TAILQ_REMOVE(&item_lruq[id], it, i_tqe);
+	if (!item_in_segment(it)) {
+		pthread_mutex_lock(&item_lru_lock[id]);
+		if(item_is_lease_holder(it)) {
+			ITEM_TAILQ_REMOVE(&reserved_item_lruq[id], it, i_tqe);
+		} else {
+			ITEM_TAILQ_REMOVE(&item_lruq[id], it, i_tqe);
+		}
+		pthread_mutex_unlock(&item_lru_lock[id]);
 	}
 
-
 	stats_slab_decr(id, item_curr);
 	stats_slab_decr_by(id, data_curr, item_size(it));
 	stats_slab_decr_by(id, data_value_curr, it->nbyte);
 }
 
 /*
- * Make an item with zero refcount available for reuse by unlinking
- * it from the lru q and hash.
+ * Make a claimed item available for reuse by unlinking it from the
+ * lru q and hash.
  *
  * Don't free the item yet because that would make it unavailable
  * for reuse.
@@ -249,21 +895,18 @@ item_unlink_q(struct item *it)
 void
 item_reuse(struct item *it)
 {
-	ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
 	ASSERT(it->magic == ITEM_MAGIC);
 	ASSERT(!item_is_slabbed(it));
 	ASSERT(item_is_linked(it));
 
-	if (item_is_lease_holder(it)) {
-		ASSERT(it->refcount == 1);
-		item_unset_pinned(it);
-	} else
-		ASSERT(it->refcount == 0);
+	/* pinned items are never unreferenced, so never claimed */
+	ASSERT(it->refcount == ITEM_REFCOUNT_CLAIMED);
 
 	it->flags &= ~ITEM_LINKED;
 
 	assoc_delete(item_key(it), it->nkey);
 	item_unlink_q(it);
+	fragment_unlink(it);
 
 	stats_slab_incr(it->id, item_remove);
 	stats_slab_settime(it->id, item_reclaim_ts, time_now());
@@ -275,6 +918,25 @@ item_reuse(struct item *it)
 					it->nkey, item_key(it), it->offset, it->id, it->refcount);
 }
 
+/*
+ * Reuse a claimed item of a segment that is being cleared, counting it
+ * as expired or evicted. Items that outlive the expiry of their segment,
+ * as their expiry was pushed out after they were stored, are evicted.
+ */
+void
+item_segment_reuse(struct item *it)
+{
+	if (item_expired(it)) {
+		stats_slab_incr(it->id, item_expire);
+		stats_slab_settime(it->id, item_expire_ts, it->exptime);
+	} else {
+		stats_slab_incr(it->id, item_evict);
+		stats_slab_settime(it->id, item_evict_ts, time_now());
+	}
+
+	item_reuse(it);
+}
+
 /*
  * Find an unused (unreferenced) item from lru q.
  *
@@ -284,22 +946,39 @@ item_reuse(struct item *it)
  *
  * We bound the search for an expired item in lru q, by only
  * traversing the oldest ITEM_LRUQ_MAX_TRIES items.
+ *
+ * With clock eviction, an unexpired item that had a hit since the hand
+ * last passed it has its bit cleared and goes to the tail instead. Such
+ * items don't count as tries, but only ITEM_CLOCK_MAX_PASSES of them are
+ * passed over, after which the search is the plain lru one.
+ *
+ * The returned item is claimed and has its lock stripe held, which is
+ * handed back in stripe and must be released with item_unlock_victim.
+ * Items whose stripe is busy are in use by another thread and skipped.
  */
 static struct item *
-item_get_from_lruq(uint8_t id, struct item_tqh *lruq)
+item_get_from_lruq(uint8_t id, struct item_tqh *lruq, uint32_t *stripe)
 {
-	struct item *it;  /* expired item */
-	struct item *uit; /* unexpired item */
-	uint32_t tries;
+	struct item *it;   /* expired item */
+	struct item *uit;  /* unexpired item */
+	struct item *next; /* next item, as clock may move this one */
+	uint32_t tries, npass, nleft;
 
 	if (!settings.use_lruq) {
 		return NULL;
 	}
 
-	for (tries = ITEM_LRUQ_MAX_TRIES, it = TAILQ_FIRST(&lruq[id]),
+	npass = 0;
+	nleft = (settings.evict_opt & EVICT_CLOCK) ? ITEM_CLOCK_MAX_PASSES : 0;
+
+	pthread_mutex_lock(&item_lru_lock[id]);
+
+	for (tries = ITEM_LRUQ_MAX_TRIES, it = ITEM_TAILQ_FIRST(&lruq[id]),
 			uit = NULL;
 			it != NULL && tries > 0;
-			tries--, it = TAILQ_NEXT(it, i_tqe)) {
+			tries--, it = next) {
+
+		next = ITEM_TAILQ_NEXT(it, i_tqe);
 
 		//    	log_debug(LOG_VERB, "|| get it '%.*s' from LRU slab %"PRIu8, it->nkey, item_key(it), it->id);
 
@@ -324,9 +1003,35 @@ item_get_from_lruq(uint8_t id, struct item_tqh *lruq)
 			continue;
 		}
 
+		if (it->accessed && nleft > 0 && !item_expired(it)) {
+			/* clock: give the item another pass at the tail */
+			it->accessed = 0;
+			it->atime = time_now();
+			ITEM_TAILQ_REMOVE(&lruq[id], it, i_tqe);
+			ITEM_TAILQ_INSERT_TAIL(&lruq[id], it, i_tqe);
+			if (next == NULL) {
+				next = it;
+			}
+			nleft--;
+			npass++;
+			tries++;
+			continue;
+		}
+
+		if (!item_trylock_victim(it, stripe)) {
+			continue;
+		}
+
+		/* lock-free readers can still take a reference until we claim it */
+		if (!item_claim(it)) {
+			item_unlock_victim(*stripe);
+			continue;
+		}
+
 		if (item_expired(it)) {
 			/* first expired item wins */
-			return it;
+			uit = it;
+			break;
 		} else if (uit == NULL) {
 			/* otherwise, get the lru unexpired item */
 			uit = it;
@@ -334,6 +1039,12 @@ item_get_from_lruq(uint8_t id, struct item_tqh *lruq)
 		}
 	}
 
+	pthread_mutex_unlock(&item_lru_lock[id]);
+
+	if (npass > 0) {
+		stats_slab_incr_by(id, item_clock_pass, npass);
+	}
+
 	return uit;
 }
 
@@ -363,16 +1074,36 @@ uint8_t item_slabid(uint8_t nkey, uint32_t nbyte)
  * is refcounted so that it is not deleted under callers nose. It is the
  * callers responsibilty to release this refcount when the item is inserted
  * into the hash + lru q or freed.
+ *
+ * With a non-NULL rejected, the item goes through the admission filter
+ * (see mc_admit.c) before an lru item is reused for it, and rejected is
+ * set if the filter kept it out.
  */
 static struct item *
 _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags, rel_time_t
-		exptime, uint32_t nbyte, bool lock_slab, bool reserved_item, int32_t config_num)
+		exptime, uint32_t nbyte, bool lock_slab, bool reserved_item, int32_t config_num,
+		bool *rejected)
 {
 	struct item *it;  /* item */
 	struct item *uit; /* unexpired lru item */
+	uint32_t stripe;  /* lock stripe of lru item */
 
 	ASSERT(id >= SLABCLASS_MIN_ID && id <= SLABCLASS_MAX_ID);
 
+	if (settings.storage == STORAGE_SEGMENT && !reserved_item) {
+		/* a segment makes room by clearing segments, not from an lru q */
+		it = segment_get_item(id, nkey, nbyte, exptime);
+		if (it == NULL) {
+			log_warn("server error on allocating item in segment for class "
+					"%"PRIu8" key '%.*s'", id, nkey, key);
+			stats_thread_incr(server_error);
+			return NULL;
+		}
+		/* slab refcount was taken by the segment allocator */
+		it->refcount++;
+		goto done;
+	}
+
 	/*
 	 * We try to obtain an item in the following order:
 	 *  1)  by acquiring an expired item;
@@ -381,9 +1112,9 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 	 *  4)  by evicting an item, if item lru eviction is enabled.
 	 */
 	if(reserved_item) {
-		it = item_get_from_lruq(id, reserved_item_lruq); /* expired / unexpired lru item */
+		it = item_get_from_lruq(id, reserved_item_lruq, &stripe); /* expired / unexpired lru item */
 	} else {
-		it = item_get_from_lruq(id, item_lruq); /* expired / unexpired lru item */
+		it = item_get_from_lruq(id, item_lruq, &stripe); /* expired / unexpired lru item */
 	}
 
 	if (it == NULL) {
@@ -398,26 +1129,19 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 		stats_slab_incr(id, item_expire);
 		stats_slab_settime(id, item_expire_ts, it->exptime);
 
-		/* Count expired leases */
-		if(item_has_i_lease(it)) {
-			stats_thread_incr(expired_leases);
-			stats_thread_incr(expired_i_leases);
-		} else if (item_has_q_inv_lease(it) || item_has_q_ref_lease(it) || item_has_q_incr_lease(it)) {
-			stats_thread_incr(expired_leases);
-			stats_thread_incr(expired_q_leases);
-		} else if (item_has_co_lease(it)) {
-			stats_thread_incr(expired_leases);
-			if (item_has_c_lease(it))
-				stats_thread_incr(expired_c_leases);
-			else if (item_has_o_lease(it))
-				stats_thread_incr(expired_o_leases);
-		}
+		item_count_expired_lease(it);
 
 		item_reuse(it);
+		item_unlock_victim(stripe);
+		item_acquire_claimed(it);
 		goto done;
 	}
 
-	uit = (settings.evict_opt & EVICT_LRU)? it : NULL; /* keep if can be used */
+	uit = (settings.evict_opt & (EVICT_LRU | EVICT_CLOCK))? it : NULL; /* keep if can be used */
+	if (it != NULL && uit == NULL) {
+		item_unclaim(it);
+		item_unlock_victim(stripe);
+	}
 
 	if (reserved_item) {
 		it = slab_get_reserved_item(id, lock_slab);
@@ -426,9 +1150,27 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 	}
 	if (it != NULL) {
 		/* 2) or 3) either we allow random eviction a free item is found */
+		if (uit != NULL) {
+			item_unclaim(uit);
+			item_unlock_victim(stripe);
+		}
+		/* slab refcount was taken by the slab allocator */
+		it->refcount++;
 		goto done;
 	}
 
+	if (uit != NULL && rejected != NULL && admit_enabled()) {
+		/* keep the lru item if it is asked for more often than the new one */
+		if (!admit_accept(key, nkey, uit)) {
+			item_unclaim(uit);
+			item_unlock_victim(stripe);
+			stats_slab_incr(id, item_admit_reject);
+			*rejected = true;
+			return NULL;
+		}
+		stats_slab_incr(id, item_admit);
+	}
+
 	if (uit != NULL) {
 		/* 4) this is an lru item and we can reuse it */
 		it = uit;
@@ -436,6 +1178,8 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 		stats_slab_settime(id, item_evict_ts, time_now());
 
 		item_reuse(it);
+		item_unlock_victim(stripe);
+		item_acquire_claimed(it);
 		goto done;
 	}
 
@@ -449,8 +1193,11 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 	else
 		it = slab_get_item_by_evict_reserved_slab(id);
 
-	if (it != NULL)
+	if (it != NULL) {
+		/* slab refcount was taken by the slab allocator */
+		it->refcount++;
 		goto done;
+	}
 
 	if (reserved_item == true)
 		log_warn("server error on allocating item in slab %"PRIu8" key '%.*s', reserveditem=true", id, nkey, key, reserved_item);
@@ -467,23 +1214,24 @@ _item_alloc_config(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags
 	ASSERT(!item_is_linked(it));
 	ASSERT(!item_is_slabbed(it));
 	ASSERT(it->offset != 0);
-	ASSERT(it->refcount == 0);
-
-	item_acquire_refcount(it);
+	ASSERT(it->refcount == 1);
 
 	it->flags = settings.use_cas ? ITEM_CAS : 0;
 	it->dataflags = dataflags;
 	it->nbyte = nbyte;
 	it->exptime = exptime;
+	it->expms = 0;
 	it->nkey = nkey;
-	it->sess_status = ALIVE;
 	it->coflags = 0;
 	it->p = 0;
+	it->accessed = 0;
 	it->config_number = config_num;
+	it->fslot = (config_num == -1) ? FRAGMENT_SLOT_NONE :
+			fragment_slot(key, nkey);
 //	printf("XXXXX%s-%dXXXXX\n", key, config_num);
 
 #if defined MC_MEM_SCRUB && MC_MEM_SCRUB == 1
-	memset(it->end, 0xff, slab_item_size(it->id) - ITEM_HDR_SIZE);
+	memset(it->end, 0xff, item_chunk_size(it) - ITEM_HDR_SIZE);
 #endif
 	memcpy(item_key(it), key, nkey);
 
@@ -500,7 +1248,7 @@ static struct item *
 _item_alloc(uint8_t id, const char *key, uint8_t nkey, uint32_t dataflags,
 		rel_time_t exptime, uint32_t nbyte, bool lock_slab, bool reserved_item) {
 	return _item_alloc_config(id, key, nkey, dataflags, exptime, nbyte,
-			lock_slab, reserved_item, -1);
+			lock_slab, reserved_item, -1, NULL);
 }
 
 
@@ -510,9 +1258,9 @@ item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags,
 {
 	struct item *it;
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_stripes(NULL, 0);
 	it = _item_alloc(id, key, nkey, dataflags, exptime, nbyte, true, false);
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return it;
 }
@@ -522,22 +1270,54 @@ item_alloc_config(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags,
 		rel_time_t exptime, uint32_t nbyte, int32_t config_num)
 {
 	struct item *it;
-	pthread_mutex_lock(&cache_lock);
-	it = _item_alloc_config(id, key, nkey, dataflags, exptime, nbyte, true, false, config_num);
-	pthread_mutex_unlock(&cache_lock);
+
+	item_lock_stripes(NULL, 0);
+	it = _item_alloc_config(id, key, nkey, dataflags, exptime, nbyte, true, false, config_num, NULL);
+	item_unlock();
 
 	return it;
 }
 
+/*
+ * Allocate an item for a client write of key, like item_alloc_config, that
+ * the admission filter may keep out in favour of the lru item it would
+ * reuse. Sets rejected and returns NULL if it does.
+ */
+struct item *
+item_alloc_admit(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags,
+		rel_time_t exptime, uint32_t nbyte, int32_t config_num, bool *rejected)
+{
+	struct item *it;
+
+	*rejected = false;
+
+	admit_record(key, nkey);
+
+	item_lock_stripes(NULL, 0);
+	it = _item_alloc_config(id, key, nkey, dataflags, exptime, nbyte, true, false, config_num,
+			rejected);
+	item_unlock();
+
+	return it;
+}
+
+/*
+ * Put a claimed, unlinked item back into the free q
+ */
 static void
 item_free(struct item *it, bool lock_slab)
 {
 	ASSERT(it->magic == ITEM_MAGIC);
-	if(item_is_lease_holder(it) || item_has_co_lease(it) || item_is_sess(it)) {
-		slab_put_reserved_item(it, lock_slab);
-	} else {
-		slab_put_item(it);
+	ASSERT(it->refcount == ITEM_REFCOUNT_CLAIMED);
+
+	/*
+	 * The item may be reallocated as soon as it is back in the free q,
+	 * so wait for lock-free readers that may still be looking at it
+	 */
+	if (settings.lockfree_get) {
+		thread_epoch_synchronize();
 	}
+	it->refcount = 0;
 
 	if(item_has_q_lease(it)) {
 		stats_thread_decr(active_q_lease);
@@ -548,6 +1328,14 @@ item_free(struct item *it, bool lock_slab)
 	}
 
 	stats_thread_incr(items_free);
+
+	if (item_in_segment(it)) {
+		segment_put_item(it);
+	} else if(item_is_lease_holder(it) || item_has_co_lease(it)) {
+		slab_put_reserved_item(it, lock_slab);
+	} else {
+		slab_put_item(it);
+	}
 }
 
 /*
@@ -569,6 +1357,7 @@ _item_link(struct item *it)
 
 	assoc_insert(it);
 	item_link_q(it, true);
+	fragment_link(it);
 }
 
 /*
@@ -597,11 +1386,22 @@ _item_unlink(struct item *it)
 	if (item_is_linked(it)) {
 		it->flags &= ~ITEM_LINKED;
 
+		/* iqgets parked on the lease of the key may go ahead */
+		if (item_has_i_lease(it)) {
+			uint8_t nkey;
+			char *key = item_base_key(it, &nkey);
+
+			wait_wake(key, nkey);
+		}
+
 		assoc_delete(item_key(it), it->nkey);
 
 		item_unlink_q(it);
+		fragment_unlink(it);
 
-		if (it->refcount == 0) {
+		/* pairs with the barrier in _item_remove2 */
+		__sync_synchronize();
+		if (item_claim(it)) {
 			item_free(it, true);
 		}
 
@@ -619,6 +1419,8 @@ _item_unlink(struct item *it)
 static void
 _item_remove2(struct item *it, bool lock_slab)
 {
+	struct slab *slab;
+
 	ASSERT(it->magic == ITEM_MAGIC);
 	ASSERT(!item_is_slabbed(it));
 
@@ -626,13 +1428,28 @@ _item_remove2(struct item *it, bool lock_slab)
 			"%02x id %"PRId8" refcount %"PRIu16"", it->nkey, item_key(it),
 			it->offset, it->flags, it->id, it->refcount);
 
-	if (it->refcount != 0) {
-		item_release_refcount(it);
+	if (it->refcount == 0) {
+		if (!item_is_linked(it) && item_claim(it)) {
+			item_free(it, lock_slab);
+		}
+		return;
 	}
 
-	if (it->refcount == 0 && !item_is_linked(it)) {
+	/*
+	 * Free the item before releasing its slab refcount, so that the slab
+	 * cannot be evicted while the item is on its way to the free q. The
+	 * decrement is a full barrier, which pairs with the one in _item_unlink,
+	 * so that either we or the unlinking thread see the item unreferenced
+	 * and unlinked.
+	 */
+	slab = item_2_slab(it);
+
+	if (__sync_sub_and_fetch(&it->refcount, 1) == 0 &&
+			!item_is_linked(it) && item_claim(it)) {
 		item_free(it, lock_slab);
 	}
+
+	slab_release_refcount(slab);
 }
 
 
@@ -645,40 +1462,283 @@ _item_remove(struct item *it)
 /*
  * Decrement the refcount on an item. Free an unliked item if its refcount
  * drops to zero.
+ *
+ * This does not need the item lock, since the item is referenced by the
+ * caller and an unlinked item is freed only by the thread that claims it.
  */
 void
 item_remove(struct item *it)
 {
-	pthread_mutex_lock(&cache_lock);
 	_item_remove(it);
-	pthread_mutex_unlock(&cache_lock);
 }
 
-//static void
-//_item_unlink_by_key(const char *key, size_t nkey) {
-//	struct item* it = assoc_find(key, nkey);
-//
-//	if (it != NULL)
-//		_item_unlink(it);
-//}
+//static void
+//_item_unlink_by_key(const char *key, size_t nkey) {
+//	struct item* it = assoc_find(key, nkey);
+//
+//	if (it != NULL)
+//		_item_unlink(it);
+//}
+
+/*
+ * Unlink an item and remove it (if its recount drops to zero).
+ */
+void
+item_delete(struct item *it)
+{
+	item_lock_key(item_key(it), it->nkey);
+
+	_item_unlink(it);
+	_item_remove(it);
+
+	item_unlock();
+}
+
+/*
+ * Unlink an item if stale() says it is stale; used by the stale fragment
+ * reaper. The caller holds no reference on the item, only a pin on its
+ * slab, so the item may be freed and reused under us at any time. Only
+ * linked items whose key maps to the stripe we lock are looked at, as
+ * neither their key nor their linked state can change while we hold it.
+ * Items that hold leases are left to their transactions.
+ */
+bool
+item_reap(struct item *it, item_stale_t stale, void *arg)
+{
+	uint8_t nkey;
+
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	if (!item_is_linked(it) || it->config_number == -1) {
+		return false;
+	}
+
+	/* a chunk that was never allocated may carry a bogus key length */
+	nkey = it->nkey;
+	if (ITEM_HDR_SIZE + nkey > slab_chunk_size(item_2_slab(it))) {
+		return false;
+	}
+
+	item_lock_key(item_key(it), nkey);
+
+	if (!item_is_linked(it) ||
+			!item_stripe_held(item_key_stripe(item_key(it), it->nkey)) ||
+			item_is_lease_holder(it) ||
+			item_is_co_lease_holder(it) || !stale(it, arg)) {
+		item_unlock();
+		return false;
+	}
+
+	_item_unlink(it);
+
+	item_unlock();
+
+	return true;
+}
+
+/*
+ * Unlink the stale items of fragment index slot slot, passing over the
+ * same items item_reap does; used by the stale fragment reaper with
+ * segment storage, which has no slabs carved in items to walk. The slot
+ * is walked under the global item lock, as in item_drop_fragment. Returns
+ * the # items scanned and adds the # items and bytes reaped to nreap and
+ * nbyte.
+ */
+uint32_t
+item_reap_slot(uint32_t slot, item_stale_t stale, void *arg, uint64_t *nreap,
+		uint64_t *nbyte)
+{
+	struct item *it, *next;
+	uint32_t nscan;
+
+	nscan = 0;
+
+	item_lock_global();
+
+	for (it = fragment_slot_head(slot); it != NULL; it = next) {
+		next = ITEM_TAILQ_NEXT(it, f_tqe);
+		nscan++;
+
+		ASSERT(item_is_linked(it));
+
+		if (it->config_number == -1 || item_is_lease_holder(it) ||
+				item_is_co_lease_holder(it) || !stale(it, arg)) {
+			continue;
+		}
+
+		*nreap += 1;
+		*nbyte += item_size(it);
+
+		_item_unlink(it);
+	}
+
+	item_unlock();
+
+	return nscan;
+}
+
+/*
+ * Reclaim the expired items among a batch of at most nscan items of the
+ * lru q of class id, the reserved lru q if reserved, starting at *cursor,
+ * or at the head of the q if it is NULL; used by the expired item crawler.
+ * The lru lock is only held while the batch is walked; the expired items
+ * are referenced and unlinked under their item lock after it is released.
+ *
+ * The cursor is referenced, so that it is not reused between batches, and
+ * set to the item after the batch, or to NULL at the end of the q. A
+ * cursor that was unlinked or moved in the meantime starts the q over.
+ * Returns the # items scanned and adds the # items and bytes reclaimed
+ * to nreclaim and nbyte.
+ */
+uint32_t
+item_crawl(uint8_t id, bool reserved, struct item **cursor, uint32_t nscan,
+		uint64_t *nreclaim, uint64_t *nbyte)
+{
+	struct item_tqh *lruq;
+	struct item *it, *next, *last;
+	struct item *expired[ITEM_CRAWL_MAX_EXPIRED];
+	uint32_t i, n, nexpired;
+
+	ASSERT(id >= SLABCLASS_MIN_ID && id <= SLABCLASS_MAX_ID);
+
+	lruq = reserved ? reserved_item_lruq : item_lruq;
+	last = *cursor;
+	nexpired = 0;
+
+	pthread_mutex_lock(&item_lru_lock[id]);
+
+	it = (last != NULL && item_is_linked(last) &&
+			item_is_lease_holder(last) == reserved) ? last :
+			ITEM_TAILQ_FIRST(&lruq[id]);
+
+	for (n = 0; it != NULL && n < nscan && nexpired < ITEM_CRAWL_MAX_EXPIRED;
+			n++, it = next) {
+		next = ITEM_TAILQ_NEXT(it, i_tqe);
+
+		if (item_expired(it) && item_tryacquire_refcount(it)) {
+			expired[nexpired++] = it;
+		}
+	}
+
+	/* an item that is being reused cannot hold the cursor, which ends the q */
+	if (it != NULL && !item_tryacquire_refcount(it)) {
+		it = NULL;
+	}
+	*cursor = it;
+
+	pthread_mutex_unlock(&item_lru_lock[id]);
+
+	if (last != NULL) {
+		_item_remove(last);
+	}
+
+	for (i = 0; i < nexpired; i++) {
+		it = expired[i];
+
+		item_lock_key(item_key(it), it->nkey);
+
+		if (item_is_linked(it) && item_expired(it)) {
+			item_count_expired_lease(it);
+
+			stats_slab_incr(it->id, item_expire);
+			stats_slab_settime(it->id, item_reclaim_ts, time_now());
+			stats_slab_settime(it->id, item_expire_ts, it->exptime);
+
+			*nreclaim += 1;
+			*nbyte += item_size(it);
+
+			_item_unlink(it);
+		}
+
+		item_unlock();
+
+		_item_remove(it);
+	}
+
+	return n;
+}
+
+/*
+ * Fragment of a table of nfragment fragments that it belongs to;
+ * companion items go with the key they were built from
+ */
+uint32_t
+item_fragment_id(struct item *it, uint32_t nfragment)
+{
+	uint8_t nkey;
+	char *key = item_base_key(it, &nkey);
+
+	return fragment_id(key, nkey, nfragment);
+}
+
+/*
+ * Unlink all items of fragment fid of a table of nfragment fragments,
+ * companions (leases, pending versions, ptrans) of its keys included,
+ * walking only the index slots the fragment maps to.
+ * Each slot is emptied under the global item lock, so no item of the
+ * slot can be linked, unlinked or handed out while we walk it. Returns
+ * the # items dropped.
+ */
+uint32_t
+item_drop_fragment(uint32_t fid, uint32_t nfragment)
+{
+	struct item *it, *next;
+	uint32_t slot, ndrop;
+	bool exact;
+
+	ASSERT(fid < nfragment);
+
+	exact = fragment_slot_exact(nfragment);
+	ndrop = 0;
+
+	for (slot = fragment_slot_first(fid, nfragment); slot < FRAGMENT_NSLOT;
+			slot = fragment_slot_next(slot, nfragment)) {
+		item_lock_global();
+
+		for (it = fragment_slot_head(slot); it != NULL; it = next) {
+			next = ITEM_TAILQ_NEXT(it, f_tqe);
+
+			ASSERT(item_is_linked(it));
+
+			if (!exact && item_fragment_id(it, nfragment) != fid) {
+				continue;
+			}
+
+			_item_unlink(it);
+			ndrop++;
+		}
+
+		item_unlock();
+	}
+
+	return ndrop;
+}
 
 /*
- * Unlink an item and remove it (if its recount drops to zero).
+ * Mark the item, and for lra slab eviction its slab, as accessed for clock
+ * eviction. This only stores a byte, and needs no lock.
  */
-void
-item_delete(struct item *it)
+static void
+item_clock_touch(struct item *it)
 {
-	pthread_mutex_lock(&cache_lock);
+	struct slab *slab;
 
-	_item_unlink(it);
-	_item_remove(it);
+	if (!it->accessed) {
+		it->accessed = 1;
+	}
 
-	pthread_mutex_unlock(&cache_lock);
+	if (settings.evict_opt & EVICT_AS) {
+		slab = item_2_slab(it);
+		if (!slab->accessed) {
+			slab->accessed = 1;
+		}
+	}
 }
 
 /*
  * Touch the item by moving it to the tail of lru q only if it wasn't
- * touched ITEM_UPDATE_INTERVAL secs back.
+ * touched ITEM_UPDATE_INTERVAL secs back. With clock eviction the item
+ * is only marked.
  */
 static void
 _item_touch(struct item *it)
@@ -686,6 +1746,15 @@ _item_touch(struct item *it)
 	ASSERT(it->magic == ITEM_MAGIC);
 	ASSERT(!item_is_slabbed(it));
 
+	if (settings.evict_opt & EVICT_CLOCK) {
+		item_clock_touch(it);
+		return;
+	}
+
+	if (item_in_segment(it)) {
+		return;
+	}
+
 	if (it->atime >= (time_now() - ITEM_UPDATE_INTERVAL)) {
 		return;
 	}
@@ -703,13 +1772,19 @@ _item_touch(struct item *it)
 void
 item_touch(struct item *it)
 {
-	if (it->atime >= (time_now() - ITEM_UPDATE_INTERVAL)) {
+	if (settings.evict_opt & EVICT_CLOCK) {
+		item_clock_touch(it);
+		return;
+	}
+
+	if (it->atime >= (time_now() - ITEM_UPDATE_INTERVAL) ||
+			item_in_segment(it)) {
 		return;
 	}
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(item_key(it), it->nkey);
 	_item_touch(it);
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 }
 
 /*
@@ -750,9 +1825,9 @@ _item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
 		return NULL;
 	}
 
-	for (bufcurr = 0, it = TAILQ_FIRST(&item_lruq[id]);
+	for (bufcurr = 0, it = ITEM_TAILQ_FIRST(&item_lruq[id]);
 			it != NULL && (limit == 0 || shown < limit);
-			it = TAILQ_NEXT(it, i_tqe)) {
+			it = ITEM_TAILQ_NEXT(it, i_tqe)) {
 
 		ASSERT(it->nkey <= KEY_MAX_LEN);
 		/* copy the key since it may not be null-terminated in the struct */
@@ -785,9 +1860,9 @@ item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
 {
 	char *ret;
 
-	pthread_mutex_lock(&cache_lock);
+	pthread_mutex_lock(&item_lru_lock[id]);
 	ret = _item_cache_dump(id, limit, bytes);
-	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&item_lru_lock[id]);
 
 	return ret;
 }
@@ -800,40 +1875,20 @@ item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
  * release refcount on the item
  */
 static struct item *
-_item_get(const char *key, size_t nkey)
+_item_get_found(struct item *it)
 {
-	struct item *it;
-
-	it = assoc_find(key, nkey);
-	if (it == NULL) {
-		log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
-		return NULL;
-	}
-
 	log_debug(LOG_VERB, "get it Time: %d; Exptime: %d",
 			time_now(), it->exptime);
 
-	if (it->exptime != 0 && it->exptime <= time_now()) {
-		/* Count expired leases */
-		if(item_has_i_lease(it)) {
-			stats_thread_incr(expired_leases);
-			stats_thread_incr(expired_i_leases);
-		} else if (item_has_q_inv_lease(it) || item_has_q_ref_lease(it) || item_has_q_incr_lease(it)) {
-			stats_thread_incr(expired_leases);
-			stats_thread_incr(expired_q_leases);
-		} else if (item_has_co_lease(it)) {
-			stats_thread_incr(expired_leases);
-			if (item_has_c_lease(it))
-				stats_thread_incr(expired_c_leases);
-			else if (item_has_o_lease(it))
-				stats_thread_incr(expired_o_leases);
-		}
+	if ((it->exptime != 0 && it->exptime <= time_now()) ||
+			item_deadline_passed(it)) {
+		item_count_expired_lease(it);
 
 		_item_unlink(it);
 		stats_slab_incr(it->id, item_expire);
 		stats_slab_settime(it->id, item_reclaim_ts, time_now());
 		stats_slab_settime(it->id, item_expire_ts, it->exptime);
-		log_debug(LOG_VERB, "get it '%.*s' expired and nuked", nkey, key);
+		log_debug(LOG_VERB, "get it '%.*s' expired and nuked", it->nkey, item_key(it));
 		return NULL;
 	}
 
@@ -842,7 +1897,7 @@ _item_get(const char *key, size_t nkey)
 		_item_unlink(it);
 		stats_slab_incr(it->id, item_evict);
 		stats_slab_settime(it->id, item_evict_ts, time_now() );
-		log_debug(LOG_VERB, "it '%.*s' nuked", nkey, key);
+		log_debug(LOG_VERB, "it '%.*s' nuked", it->nkey, item_key(it));
 		return NULL;
 	}
 
@@ -855,28 +1910,218 @@ _item_get(const char *key, size_t nkey)
 	return it;
 }
 
-/* Allocate an item with value size 0 that will act as the lease holder */
-static struct item*
-_item_create_reserved_item(const char* key, uint8_t nkey, uint32_t vlen, bool lock_slab)
+static struct item *
+_item_get(const char *key, size_t nkey)
 {
-	uint32_t flags = 0;
-	time_t exptime = settings.lease_token_expiry / 1000;
 	struct item *it;
-	uint8_t id;
 
-	if(exptime == 0) {
-		/* Minimum 1 second expiry time */
-		exptime = 1;
+	it = assoc_find(key, nkey);
+	if (it == NULL) {
+		log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
+		return NULL;
+	}
+
+	return _item_get_found(it);
+}
+
+/*
+ * Get companion item member of key, e.g. its lease, like _item_get
+ */
+static struct item *
+_item_get_companion(assoc_family_t member, const char *key, size_t nkey)
+{
+	struct item *it;
+
+	it = assoc_find_companion(member, key, nkey);
+	if (it == NULL) {
+		log_debug(LOG_VERB, "get companion %d of it '%.*s' not found", member,
+				nkey, key);
+		return NULL;
+	}
+
+	return _item_get_found(it);
+}
+
+/*
+ * Get key and all of its companion items with a single hash lookup, like
+ * _item_get. The caller must release every non-NULL member, e.g. with
+ * _item_put_family.
+ */
+static void
+_item_get_family(const char *key, size_t nkey, struct item **family)
+{
+	uint32_t m;
+
+	assoc_find_family(key, nkey, family);
+
+	for (m = 0; m < ASSOC_NFAMILY; m++) {
+		if (family[m] != NULL) {
+			family[m] = _item_get_found(family[m]);
+		}
+	}
+}
+
+static void
+_item_put_family(struct item **family)
+{
+	uint32_t m;
+
+	for (m = 0; m < ASSOC_NFAMILY; m++) {
+		if (family[m] != NULL) {
+			_item_remove(family[m]);
+			family[m] = NULL;
+		}
+	}
+}
+
+/*
+ * Returns the msec deadline of a lease created now. A lease expiry of 0
+ * keeps the minimum lifetime of 1 sec it always had.
+ */
+static uint64_t
+item_lease_deadline(void)
+{
+	uint64_t expiry = settings.lease_token_expiry;
+
+	return time_now_ms() + (expiry > 0 ? expiry : 1000);
+}
+
+/*
+ * Returns the msec deadline of an item, or 0 if it has none
+ */
+static uint64_t
+item_deadline(struct item *it)
+{
+	uint64_t now = time_now_ms();
+
+	if (it->expms == 0) {
+		return 0;
+	}
+
+	return now + (int64_t)(int32_t)(it->expms - (uint32_t)now);
+}
+
+/*
+ * Timer handler of an item deadline. The timer is never cancelled, so the
+ * item may have been unlinked, given another deadline or even reused for
+ * another key since it was armed; as in item_reap, we only look at linked
+ * items whose key maps to the stripe we lock, and only if they are still
+ * due at the deadline the timer was armed with.
+ */
+static void
+item_deadline_timeout(void *arg, uint32_t expms)
+{
+	struct item *it = arg;
+	uint8_t nkey;
+
+	if (!item_is_linked(it) || it->expms != expms) {
+		return;
+	}
+
+	/* a chunk that was never allocated may carry a bogus key length */
+	nkey = it->nkey;
+	if (ITEM_HDR_SIZE + nkey > slab_chunk_size(item_2_slab(it))) {
+		return;
+	}
+
+	item_lock_key(item_key(it), nkey);
+
+	if (!item_is_linked(it) ||
+			!item_stripe_held(item_key_stripe(item_key(it), it->nkey)) ||
+			it->expms != expms || !item_deadline_passed(it)) {
+		item_unlock();
+		return;
+	}
+
+	item_count_expired_lease(it);
+
+	_item_unlink(it);
+	stats_slab_incr(it->id, item_expire);
+	stats_slab_settime(it->id, item_reclaim_ts, time_now());
+	stats_slab_settime(it->id, item_expire_ts, it->exptime);
+	log_debug(LOG_VERB, "timer it '%.*s' expired and nuked", it->nkey,
+			item_key(it));
+
+	item_unlock();
+}
+
+/*
+ * Make an item expire at msec deadline, or never if deadline is 0, and arm
+ * a timer that unlinks it right then rather than when it is next looked up
+ */
+static void
+item_set_deadline(struct item *it, uint64_t deadline)
+{
+	if (deadline == 0) {
+		it->exptime = 0;
+		it->expms = 0;
+		return;
+	}
+
+	it->exptime = (rel_time_t)((deadline + 999) / 1000);
+	it->expms = (uint32_t)deadline != 0 ? (uint32_t)deadline : 1;
+
+	/*
+	 * A segment is cleared with no regard for pending timers, which would
+	 * then point into whatever was appended in place of the item
+	 */
+	if (item_in_segment(it)) {
+		return;
 	}
 
-	if(exptime > 0) {
-		/* Add 1 second to account for rounding errors */
-		exptime++;
+	/* without a timer the item still expires when it is looked up */
+	timer_add((uint32_t)((uintptr_t)it >> 6), deadline, item_deadline_timeout,
+			it, it->expms);
+}
+
+/*
+ * Make an item expire along with a lease item
+ */
+static void
+item_copy_deadline(struct item *it, struct item *lease_it)
+{
+	if (lease_it->expms == 0) {
+		it->exptime = lease_it->exptime;
+		it->expms = 0;
+		return;
 	}
 
+	item_set_deadline(it, item_deadline(lease_it));
+}
+
+/*
+ * Mark it, just allocated, as a companion item. Companions are allocated
+ * outside any configuration, but are indexed under the fragment slot of
+ * the key they were built from, so that dropping a fragment drops them too.
+ */
+static void
+_item_set_companion(struct item *it)
+{
+	uint8_t nkey;
+	char *key;
+
+	item_set_companion(it);
+
+	key = item_base_key(it, &nkey);
+	it->fslot = fragment_slot(key, nkey);
+}
+
+/*
+ * Allocate an item with value size 0 that will act as the lease holder.
+ * key is a companion key, built by one of the mc_get_*_key helpers.
+ */
+static struct item*
+_item_create_reserved_item(const char* key, uint8_t nkey, uint32_t vlen, bool lock_slab)
+{
+	uint32_t flags = 0;
+	struct item *it;
+	uint8_t id;
+
 	id = item_slabid(nkey, vlen);
-	it = _item_alloc(id, key, nkey, flags, time_reltime(exptime), vlen, lock_slab, true);
+	it = _item_alloc(id, key, nkey, flags, 0, vlen, lock_slab, true);
 	if (it != NULL) {
+		item_set_deadline(it, item_lease_deadline());
+		_item_set_companion(it);
 		item_set_pinned(it);
 	}
 
@@ -885,20 +2130,11 @@ _item_create_reserved_item(const char* key, uint8_t nkey, uint32_t vlen, bool lo
 
 struct item*
 _item_get_pending_version(char* key, size_t nkey) {
-	size_t pv_nkey = nkey + PREFIX_KEY_LEN;
-	char pv_key[pv_nkey];
-	struct item* pv_it;
-
-	mc_get_version_key(key, nkey, &pv_key);
-
-	pv_it = _item_get(pv_key, pv_nkey);
-
-	return pv_it;
+	return _item_get_companion(ASSOC_FAMILY_VERSION, key, nkey);
 }
 
 struct item*
 _item_create_pending_version(struct item*it) {
-	time_t exptime = settings.lease_token_expiry / 1000;
 	struct item* pv_it = NULL;
 	uint8_t id;
 	size_t pv_nkey = it->nkey + PREFIX_KEY_LEN;
@@ -906,84 +2142,55 @@ _item_create_pending_version(struct item*it) {
 
 	mc_get_version_key(item_key(it), it->nkey, &pv_key);
 
-	if(exptime == 0) {
-		/* Minimum 1 second expiry time */
-		exptime = 1;
-	}
-
-	if(exptime > 0) {
-		/* Add 1 second to account for rounding errors */
-		exptime++;
-	}
-
 	id = item_slabid(pv_nkey, it->nbyte);
-	pv_it = _item_alloc(id, pv_key, pv_nkey, it->dataflags, time_reltime(exptime),
-			it->nbyte, true, false);
+	pv_it = _item_alloc(id, pv_key, pv_nkey, it->dataflags, 0, it->nbyte,
+			true, false);
+	if (pv_it != NULL) {
+		item_set_deadline(pv_it, item_lease_deadline());
+		_item_set_companion(pv_it);
+	}
 
 	return pv_it;
 }
 
 struct item*
 _item_get_lease(char* key, size_t nkey) {
-	size_t lease_nkey = nkey + PREFIX_KEY_LEN;
-	char lease_key[lease_nkey];
-
-	mc_get_lease_key(key, nkey, &lease_key);
-
-	return _item_get(lease_key, lease_nkey);
+	return _item_get_companion(ASSOC_FAMILY_LEASE, key, nkey);
 }
 
 struct item*
 _item_get_pending(char* key, size_t nkey) {
-	size_t pending_nkey = nkey + PREFIX_KEY_LEN;
-	char pending_key[pending_nkey];
-
-	mc_get_pending_key(key, nkey, &pending_key);
-
-	return _item_get(pending_key, pending_nkey);
+	return _item_get_companion(ASSOC_FAMILY_PENDING, key, nkey);
 }
 
 struct item*
 _item_get_ptrans(char* key, size_t nkey) {
-	size_t ptrans_nkey = nkey + PREFIX_KEY_LEN;
-	char ptrans_key[ptrans_nkey];
-	mc_get_ptrans_key(key, nkey, &ptrans_key);
-	return _item_get(ptrans_key, ptrans_nkey);
+	return _item_get_companion(ASSOC_FAMILY_PTRANS, key, nkey);
 }
 
 struct item*
 _item_create_lease(char* key, size_t nkey, lease_token_t* token) {
-	time_t exptime = settings.lease_token_expiry / 1000;
 	struct item* lease_it = NULL;
 	uint8_t id;
 	size_t lease_nkey = nkey + PREFIX_KEY_LEN;
 	char lease_key[lease_nkey];
-	int res;
-	char buf[INCR_MAX_STORAGE_LEN];
 
 	mc_get_lease_key(key, nkey, &lease_key);
 
 	*token = 0;
 
-	if(exptime == 0) {
-		/* Minimum 1 second expiry time */
-		exptime = 1;
-	}
-
-	if(exptime > 0) {
-		/* Add 1 second to account for rounding errors */
-		exptime++;
-	}
-
+	/* the token is kept in binary, see _item_lease_value */
 	*token = lease_next_token();
-	res = snprintf(buf, INCR_MAX_STORAGE_LEN, "%"PRIu64, *token);
-	id = item_slabid(lease_nkey, res);
+	id = item_slabid(lease_nkey, sizeof(*token));
 
-	lease_it = _item_alloc(id, lease_key, lease_nkey, 0,
-			time_reltime(exptime), res, true, true);
+	lease_it = _item_alloc(id, lease_key, lease_nkey, 0, 0, sizeof(*token),
+			true, true);
 
 	if (lease_it != NULL) {
-		memcpy(item_data(lease_it), buf, res);
+		item_set_deadline(lease_it, item_lease_deadline());
+		memcpy(item_data(lease_it), token, sizeof(*token));
+		item_set_lease_token(lease_it);
+		_item_set_companion(lease_it);
 		item_set_pinned(lease_it);
 	}
 
@@ -992,7 +2199,6 @@ _item_create_lease(char* key, size_t nkey, lease_token_t* token) {
 
 struct item*
 _item_create_ptrans(char* key, size_t nkey, int64_t token) {
-	time_t exptime = settings.lease_token_expiry / 1000;
 	struct item* ptrans_it = NULL;
 	uint8_t id;
 	size_t ptrans_nkey = nkey + PREFIX_KEY_LEN;
@@ -1002,24 +2208,15 @@ _item_create_ptrans(char* key, size_t nkey, int64_t token) {
 
 	mc_get_ptrans_key(key, nkey, &ptrans_key);
 
-	if(exptime == 0) {
-		/* Minimum 1 second expiry time */
-		exptime = 1;
-	}
-
-	if(exptime > 0) {
-		/* Add 1 second to account for rounding errors */
-		exptime++;
-	}
-
 	res = snprintf(buf, INCR_MAX_STORAGE_LEN, "%"PRIu64, token);
 	id = item_slabid(ptrans_nkey, res);
 
-	ptrans_it = _item_alloc(id, ptrans_key, ptrans_nkey, 0, time_reltime(exptime),
-			res, true, true);
+	ptrans_it = _item_alloc(id, ptrans_key, ptrans_nkey, 0, 0, res, true, true);
 
 	if (ptrans_it != NULL) {
+		item_set_deadline(ptrans_it, item_lease_deadline());
 		memcpy(item_data(ptrans_it), buf, res);
+		_item_set_companion(ptrans_it);
 		item_set_pinned(ptrans_it);
 	}
 
@@ -1028,10 +2225,64 @@ _item_create_ptrans(char* key, size_t nkey, int64_t token) {
 
 struct item*
 _item_get_co_lease(char* key, size_t nkey) {
-	size_t lease_nkey = nkey + PREFIX_KEY_LEN;
-	char lease_key[lease_nkey];
-	mc_get_co_lease_key(key, nkey, &lease_key);
-	return _item_get(lease_key, lease_nkey);
+	return _item_get_companion(ASSOC_FAMILY_COLEASE, key, nkey);
+}
+
+/*
+ * Look up an item without taking any lock. On a hit the returned item is
+ * referenced, exactly like with _item_get.
+ *
+ * Returns false if the lookup is inconclusive, because it raced with a
+ * hash table expansion or with the item being reused, or because the
+ * item has expired and needs to be unlinked. The caller should then fall
+ * back to _item_get under the item lock.
+ */
+static bool
+item_get_lockfree(const char *key, size_t nkey, struct item **itp)
+{
+	struct item *it;
+
+	thread_epoch_enter();
+
+	if (!assoc_find_lockfree(key, nkey, &it)) {
+		thread_epoch_exit();
+		return false;
+	}
+
+	if (it != NULL && !item_tryacquire_refcount(it)) {
+		thread_epoch_exit();
+		return false;
+	}
+
+	thread_epoch_exit();
+
+	if (it == NULL) {
+		log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
+		*itp = NULL;
+		return true;
+	}
+
+	/*
+	 * The item may have been unlinked, or even reused for another key,
+	 * between the lookup and taking our reference
+	 */
+	if (!item_is_linked(it) || it->nkey != nkey ||
+			memcmp(item_key(it), key, nkey) != 0 ||
+			(it->exptime != 0 && it->exptime <= time_now()) ||
+			item_deadline_passed(it) ||
+			(settings.oldest_live != 0 && settings.oldest_live <= time_now() &&
+			 it->atime <= settings.oldest_live)) {
+		_item_remove(it);
+		return false;
+	}
+
+	log_debug(LOG_VERB, "get it '%.*s' found at offset %"PRIu32" with flags "
+			"%02x id %"PRIu8" refcount %"PRIu32" without lock", it->nkey,
+			item_key(it), it->offset, it->flags, it->id, it->refcount);
+
+	*itp = it;
+
+	return true;
 }
 
 struct item *
@@ -1039,13 +2290,54 @@ item_get(const char *key, size_t nkey)
 {
 	struct item *it;
 
-	pthread_mutex_lock(&cache_lock);
+	admit_record(key, nkey);
+
+	if (settings.lockfree_get && item_get_lockfree(key, nkey, &it)) {
+		stats_thread_incr(get_lockfree);
+		return it;
+	}
+
+	item_lock_key(key, nkey);
 	it = _item_get(key, nkey);
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return it;
 }
 
+/*
+ * Call visit on the item of key under its item lock, so that its value
+ * cannot change while visit looks at it. Items that are not stamped with
+ * a configuration, hold leases or are pending are skipped, as are keys
+ * with a lease on them. Returns true if visit was called.
+ */
+bool
+item_visit(const char *key, size_t nkey, item_visit_t visit, void *arg)
+{
+	struct item *it, *lease_it;
+	bool visited;
+
+	visited = false;
+
+	item_lock_key(key, nkey);
+
+	it = _item_get(key, nkey);
+	if (it != NULL) {
+		lease_it = _item_get_lease((char *)key, nkey);
+		if (lease_it != NULL) {
+			_item_remove(lease_it);
+		} else if (it->config_number != -1 && it->p == 0 &&
+				!item_is_lease_holder(it) && !item_is_co_lease_holder(it)) {
+			visit(it, arg);
+			visited = true;
+		}
+		_item_remove(it);
+	}
+
+	item_unlock();
+
+	return visited;
+}
+
 /*
  * Flushes expired items after a "flush_all" call. Expires items that
  * are more recent than the oldest_live setting
@@ -1071,7 +2363,7 @@ _item_flush_expired(void)
 		 * an item older than oldest_live. Older items in this queue are then
 		 * lazily expired by oldest_live check in item_get.
 		 */
-		TAILQ_FOREACH_REVERSE_SAFE(it, &item_lruq[i], item_tqh, i_tqe, next) {
+		ITEM_TAILQ_FOREACH_REVERSE_SAFE(it, &item_lruq[i], i_tqe, next) {
 			ASSERT(!item_is_slabbed(it));
 
 			if (it->atime < settings.oldest_live) {
@@ -1089,9 +2381,9 @@ _item_flush_expired(void)
 void
 item_flush_expired(void)
 {
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 	_item_flush_expired();
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 }
 
 /*
@@ -1440,9 +2732,35 @@ item_store(struct item *it, req_type_t type, struct conn *c)
 {
 	item_store_result_t ret = NOT_STORED;
 
-	pthread_mutex_lock(&cache_lock);
-	ret = _item_store(it, type, c, true);
-	pthread_mutex_unlock(&cache_lock);
+	item_lock_key(item_key(it), it->nkey);
+	ret = _item_store(it, type, c, true);
+	item_unlock();
+
+	return ret;
+}
+
+/*
+ * Store an item streamed from another server unless the key is cached or
+ * leased here already, both of which mean this server has seen newer
+ * activity on the key than the stream.
+ */
+item_store_result_t
+item_import(struct item *it)
+{
+	item_store_result_t ret;
+	struct item *lease_it;
+
+	item_lock_key(item_key(it), it->nkey);
+
+	lease_it = _item_get_lease(item_key(it), it->nkey);
+	if (lease_it != NULL) {
+		_item_remove(lease_it);
+		ret = NOT_STORED;
+	} else {
+		ret = _item_store(it, REQ_ADD, NULL, true);
+	}
+
+	item_unlock();
 
 	return ret;
 }
@@ -1457,6 +2775,12 @@ lease_token_t _item_lease_value(struct item* it) {
 
 	ptr = item_data(it);
 
+	if (item_has_lease_token(it)) {
+		ASSERT(it->nbyte == sizeof(lease_token_t));
+		memcpy(&value, ptr, sizeof(value));
+		return (lease_token_t)value;
+	}
+
 	if (!mc_strtoull_len(ptr, &value, it->nbyte)) {
 		return -1;
 	}
@@ -1504,7 +2828,8 @@ _item_add_delta(struct conn *c, char *key, size_t nkey, bool incr,
 
 	res = mc_snprintf(buf, INCR_MAX_STORAGE_LEN, "%"PRIu64, value);
 	ASSERT(res < INCR_MAX_STORAGE_LEN);
-	if (res > it->nbyte) { /* need to realloc */
+	/* segments are walked by item size, so their items never shrink */
+	if (res > it->nbyte || (res < it->nbyte && item_in_segment(it))) {
 		struct item *new_it;
 		uint8_t id;
 
@@ -1558,9 +2883,9 @@ item_add_delta(struct conn *c, char *key, size_t nkey, int incr,
 {
 	item_delta_result_t ret;
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(key, nkey);
 	ret = _item_add_delta(c, key, nkey, incr, delta, buf);
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return ret;
 }
@@ -1573,7 +2898,7 @@ item_get_and_unlease(char* key, uint8_t nkey, lease_token_t token_val, struct co
 	rstatus_t status = MC_OK;
 	struct item* lease_it = NULL;
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(key, nkey);
 
 	log_debug(LOG_VERB, "get_and_unlease for '%.*s'", nkey, key);
 
@@ -1596,7 +2921,7 @@ item_get_and_unlease(char* key, uint8_t nkey, lease_token_t token_val, struct co
 			_item_remove(lease_it);
 	}
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
@@ -1605,18 +2930,22 @@ item_get_and_unlease(char* key, uint8_t nkey, lease_token_t token_val, struct co
  * Get I lease for a key. If it fails because someone is holding lease for this key,
  * markedVal is set to 0. Otherwise, markedVal = 1
  */
-rstatus_t
-item_quarantine_and_register(char* tid, size_t ntid, char* key,
+static rstatus_t
+_item_quarantine_and_register(char* tid, size_t ntid, char* key,
 		size_t nkey, u_int8_t *markedVal,struct conn *c) {
-	struct item *trans_it = NULL;
+	struct trans *trans = NULL;
 	struct item* lease_it = NULL;
 	struct item* it = NULL;
+	rstatus_t status;
 
 	log_debug(LOG_VERB, "quarantine_and_register for '%.*s'", nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	trans = trans_get(TRANS_TID, tid, ntid); 		// get transaction
+	status = _item_assoc_key_tid(trans, key, nkey, tid, ntid);
+	if (status != MC_OK) {
+		return status;
+	}
 
-	trans_it = _item_get(tid, ntid); 		// get transaction
 	lease_it = _item_get_lease(key, nkey);	// get lease item
 
 	if (lease_it != NULL && item_has_i_lease(lease_it)) {
@@ -1626,7 +2955,6 @@ item_quarantine_and_register(char* tid, size_t ntid, char* key,
 	}
 
 	_item_assoc_tid_lease(c, lease_it, key, nkey, tid, ntid);
-	_item_assoc_key_tid(c, trans_it, key, nkey, tid, ntid);
 
 	// at this time, transaction item for this session should be ready
 	// now it's time to reason about the lease item
@@ -1643,56 +2971,58 @@ item_quarantine_and_register(char* tid, size_t ntid, char* key,
 	lease_it = _item_get_lease(key, nkey);
 	if (it != NULL) {
 		if (lease_it != NULL)
-			it->exptime = lease_it->exptime;
+			item_copy_deadline(it, lease_it);
 		_item_remove(it);
 	}
 
 	if (lease_it != NULL)
 		_item_remove(lease_it);
 
-	if (trans_it != NULL) {
-		_item_remove(trans_it);
-	}
-
-	pthread_mutex_unlock(&cache_lock);
-
 	*markedVal = 1;
 	return MC_OK;
 }
 
+rstatus_t
+item_quarantine_and_register(char* tid, size_t ntid, char* key,
+		size_t nkey, u_int8_t *markedVal,struct conn *c) {
+	rstatus_t status;
+
+	item_lock_key2(key, nkey, tid, ntid);
+	status = _item_quarantine_and_register(tid, ntid, key, nkey, markedVal, c);
+	item_unlock();
+
+	return status;
+}
+
 item_co_result_t
 item_ciget(char* sid, size_t nsid, char *key, size_t nkey, lease_token_t lease_token, struct conn *c, struct item** item, lease_token_t* new_lease_token) {
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	struct item* iqlease_it = NULL;
 	struct item* it = NULL;
 
 	rstatus_t status = CO_OK;
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
 	stats_thread_incr(ciget);
+	admit_record(key, nkey);
 
 	log_debug(LOG_VERB, "ciget for sess '%.*s', key '%.*s'", nsid, sid, nkey, key);
 
 	// get session entry from ActiveSessions
-	sess_it = _item_get(sid, nsid);
+	sess = trans_get(TRANS_SID, sid, nsid);
 
 	// session already aborted
 	// clean the session from ActiveSessions
-	if (sess_it != NULL && sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
 		stats_thread_incr(sess_abort);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
-
 	// check the O lease status
 	colease_it = _item_get_co_lease(key, nkey);
 	if (colease_it != NULL && item_has_o_lease(colease_it)) {
@@ -1705,14 +3035,14 @@ item_ciget(char* sid, size_t nsid, char *key, size_t nkey, lease_token_t lease_t
 
 			status = CO_OK;
 			_item_remove(colease_it);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 
 			return status;
 		} else {
 			status = CO_ABORT;
 			_item_remove(colease_it);
 			clean_session(sid, nsid, c);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 
 			return status;
 		}
@@ -1732,39 +3062,37 @@ item_ciget(char* sid, size_t nsid, char *key, size_t nkey, lease_token_t lease_t
 			if (colease_it != NULL) {
 				_item_remove(colease_it);
 			}
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return status;
 		} else if (item_has_q_lease(iqlease_it)) {
-			sess_it = _item_get(sid, nsid);
-			if (sess_it != NULL &&
-					trig_check_keylist(item_data(sess_it), nsid, key, nkey) == TRIG_OK) {
+			if (sess != NULL && trans_has(sess, key, nkey)) {
 				*item = _item_get(key, nkey);
 
 				if (*item != NULL)
 					stats_thread_incr(get_hit);
 
 				status = CO_OK;
-				_item_remove(sess_it);
 			} else {
 				status = CO_RETRY;
-				if (sess_it != NULL)
-					_item_remove(sess_it);
 			}
 
 			_item_remove(iqlease_it);
 			if (colease_it != NULL)
 				_item_remove(colease_it);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return status;
 		}
 	}
 
-	// get session entry from ActiveSessions
-	sess_it = _item_get(sid, nsid);
-
-	// associate the key with this session
-	_item_assoc_key_sid(c, sess_it, key, nkey, sid, nsid);
-	if (sess_it == NULL)
+	// associate the key with this session, a session that cannot be
+	// tracked is aborted
+	if (_item_assoc_key_sid(sess, key, nkey, sid, nsid) != MC_OK) {
+		if (colease_it != NULL)
+			_item_remove(colease_it);
+		item_unlock();
+		return CO_ABORT;
+	}
+	if (sess == NULL)
 		stats_thread_incr(total_sess);
 
 	// at this point, the key is able to be granted a C lease
@@ -1799,40 +3127,37 @@ item_ciget(char* sid, size_t nsid, char *key, size_t nkey, lease_token_t lease_t
 	if (colease_it != NULL)
 		_item_remove(colease_it);
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
-
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
 
 rstatus_t
 item_delete_and_release(char* tid, u_int32_t ntid, struct conn *c) {
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	struct item* it = NULL;
-	trig_cursor_t cursor;
+	uint32_t i;
 	struct item* lease_it = NULL;
 
 	log_debug(LOG_VERB, "delete_and_release for '%.*s'", ntid, tid);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_keylist(tid, ntid);
 
-	trans_it = _item_get(tid, ntid);
-	if (trans_it == NULL) {
+	trans = trans_get(TRANS_TID, tid, ntid);
+	if (trans == NULL) {
 		log_debug(LOG_VERB, "delete_and_release trans item not found '%.*s", tid);
 
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return MC_INVALID;
 	}
 
-	char *data = item_data(trans_it);
 	char *key;
 	size_t nkey;
 
 	// loop through keys and delete
-	cursor = NULL;
-	while (trig_keylist_next(data, trans_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
+	for (i = 0; i < trans->nkey; i++) {
+		trans_key(trans, i, &key, &nkey);
+
 		it = _item_get(key, nkey);
 
 		if (it == NULL) {
@@ -1858,47 +3183,50 @@ item_delete_and_release(char* tid, u_int32_t ntid, struct conn *c) {
 		}
 	}
 
-	_item_unlink(trans_it);
-	item_unset_pinned(trans_it);
-	_item_remove(trans_it);
+	trans_remove(trans);
 
 	stats_thread_incr(trans_remove);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return MC_OK;
 }
 
-item_iq_result_t
-item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t server_cfg_id) {
-	struct item* trans_it = NULL;
+static item_iq_result_t
+_item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t server_cfg_id) {
+	struct trans* trans = NULL;
 	struct item* it = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
-	trig_cursor_t cursor;
+	struct item* family[ASSOC_NFAMILY];
+	uint32_t i;
 
 	log_debug(LOG_VERB, "commit for transaction '%.*s'", ntid, tid);
 
-	pthread_mutex_lock(&cache_lock);
-
 	// if tid does not exist, return
-	trans_it = _item_get(tid, ntid);
-	if (trans_it == NULL) {
+	trans = trans_get(TRANS_TID, tid, ntid);
+	if (trans == NULL) {
 		log_debug(LOG_VERB, "commit transaction item not found %s", tid);
 
-		pthread_mutex_unlock(&cache_lock);
 		return IQ_NOT_FOUND;
 	}
 
-	char *data = item_data(trans_it);
 	char *key;
 	size_t nkey;
+	int32_t cfg_id;
 
 	// loop through keys and perform changes
-	cursor = NULL;
-	while (trig_keylist_next(data, trans_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
-		lease_it = _item_get_lease(key, nkey);
-		pv_it = _item_get_pending_version(key, nkey);
+	for (i = 0; i < trans->nkey; i++) {
+		trans_key(trans, i, &key, &nkey);
+
+		// the value and pending marker change below, so only the lease
+		// and pending version are taken from the lookup
+		_item_get_family(key, nkey, family);
+		lease_it = family[ASSOC_FAMILY_LEASE];
+		pv_it = family[ASSOC_FAMILY_VERSION];
+		family[ASSOC_FAMILY_LEASE] = NULL;
+		family[ASSOC_FAMILY_VERSION] = NULL;
+		_item_put_family(family);
 
 		if (lease_it == NULL) {
 			log_debug(LOG_VERB, "commit cannot find lease item of key '%.*s'", nkey, key);
@@ -1924,12 +3252,14 @@ item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t
 
 		_item_remove(lease_it);
 
+		cfg_id = (server_cfg_id != -1) ? server_cfg_id : fragment_config(key, nkey);
+
 		// apply changes
 		if (pv_it != NULL) {
 			int id = item_slabid(nkey, pv_it->nbyte);
 
 			struct item *new_it = _item_alloc_config(id, key, nkey, pv_it->dataflags,
-					0, pv_it->nbyte, true, false, server_cfg_id);
+					0, pv_it->nbyte, true, false, cfg_id, NULL);
 			memcpy(item_data(new_it), item_data(pv_it), pv_it->nbyte);
 
 			new_it->p = pending;
@@ -1953,7 +3283,10 @@ item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t
 				char pending_key[pending_nkey];
 				mc_get_pending_key(key, nkey, &pending_key);
 				int id = item_slabid(pending_nkey, 1);
-				pending_it = _item_alloc_config(id, pending_key, pending_nkey, 0, 0, 1, true, false, server_cfg_id);
+				pending_it = _item_alloc_config(id, pending_key, pending_nkey, 0, 0, 1, true, false, cfg_id, NULL);
+				if (pending_it != NULL) {
+					_item_set_companion(pending_it);
+				}
 				_item_store(pending_it, REQ_SET, c, true);
 			} else if (pending == 0 && pending_it != NULL) {
 				_item_unlink(pending_it);
@@ -1982,44 +3315,51 @@ item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t
 		}
 	}
 
-	item_unset_pinned(trans_it);
-	_item_unlink(trans_it);
-	_item_remove(trans_it);
+	trans_remove(trans);
 
 	stats_thread_incr(trans_remove);
 
-	pthread_mutex_unlock(&cache_lock);
-
 	return IQ_OK;
 }
 
+item_iq_result_t
+item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t server_cfg_id) {
+	item_iq_result_t status;
+
+	item_lock_keylist(tid, ntid);
+	status = _item_commit(tid, ntid, c, pending, server_cfg_id);
+	item_unlock();
+
+	return status;
+}
+
 item_iq_result_t
 item_release(char* tid, u_int32_t ntid, struct conn *c) {
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
-	trig_cursor_t cursor;
+	uint32_t i;
 
 	log_debug(LOG_VERB, "release for transaction '%.*s'", ntid, tid);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_keylist(tid, ntid);
 
 	// if tid does not exist, return
-	trans_it = _item_get(tid, ntid);
-	if (trans_it == NULL) {
+	trans = trans_get(TRANS_TID, tid, ntid);
+	if (trans == NULL) {
 		log_debug(LOG_VERB, "release transaction item not found %s", tid);
 
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return IQ_NOT_FOUND;
 	}
 
-	char *data = item_data(trans_it);
 	char *key;
 	size_t nkey;
 
 	// loop through keys and perform changes
-	cursor = NULL;
-	while (trig_keylist_next(data, trans_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
+	for (i = 0; i < trans->nkey; i++) {
+		trans_key(trans, i, &key, &nkey);
+
 		lease_it = _item_get_lease(key, nkey);
 		pv_it = _item_get_pending_version(key, nkey);
 
@@ -2038,7 +3378,6 @@ item_release(char* tid, u_int32_t ntid, struct conn *c) {
 
 		if (item_has_q_inv_lease(lease_it)) {	// this lease is for invalidate transaction
 			ASSERT(pv_it == NULL);
-			_item_remove_tid_lease(c, trans_it, key, nkey, tid, ntid);
 		} else if (item_has_q_incr_lease(lease_it) || item_has_q_ref_lease(lease_it)) {
 			stats_thread_incr(released_q_lease);
 		}
@@ -2053,13 +3392,11 @@ item_release(char* tid, u_int32_t ntid, struct conn *c) {
 		}
 	}
 
-	item_unset_pinned(trans_it);
-	_item_unlink(trans_it);
-	_item_remove(trans_it);
+	trans_remove(trans);
 
 	stats_thread_incr(trans_remove);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return IQ_OK;
 }
@@ -2068,19 +3405,17 @@ item_release(char* tid, u_int32_t ntid, struct conn *c) {
  * Try to quarantine and read the item.
  * Return MC_OK if it successfully quarantine and read the item
  */
-rstatus_t
-item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
+static rstatus_t
+_item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
 		lease_token_t lease_token, lease_token_t * new_lease_token,
 		struct conn *c, struct item ** it, uint8_t *pending) {
 	struct item* lease_it = NULL;
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	rstatus_t status = MC_OK;
 
 	log_debug(LOG_VERB, "quarantine_and_read for '%.*s'", nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
-
-	trans_it = _item_get(tid, tid_size); 		// get transaction
+	trans = trans_get(TRANS_TID, tid, tid_size); 		// get transaction
 	lease_it = _item_get_lease(key, nkey);
 
 	if (lease_it != NULL && (item_has_q_lease(lease_it))) {	// there is a pending Q lease on the key
@@ -2113,7 +3448,7 @@ item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
 
 		lease_it = _item_create_lease(key, nkey, new_lease_token);
 		item_set_q_ref_lease(lease_it);
-		_item_store(lease_it, c->req_type, c, true);
+		_item_store(lease_it, REQ_QAREAD, c, true);
 
 		struct item* orig_it = _item_get(key, nkey);
 		if (orig_it != NULL) {
@@ -2122,7 +3457,7 @@ item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
 			// create a pending key-value pair
 			struct item* pv_it = _item_create_pending_version(orig_it);
 			pv_it->p = (orig_it)->p;
-			pv_it->exptime = lease_it->exptime;
+			item_copy_deadline(pv_it, lease_it);
 			memcpy(item_data(pv_it), item_data(orig_it), (orig_it)->nbyte);
 			_item_store(pv_it, REQ_SET, c, true);
 			_item_remove(orig_it);
@@ -2141,25 +3476,37 @@ item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
 		stats_thread_incr(total_q_lease);
 
 		if (*it != NULL && lease_it != NULL) {
-			(*it)->exptime = lease_it->exptime;
+			item_copy_deadline((*it), lease_it);
 		}
 
-		_item_assoc_key_tid(c, trans_it, key, nkey, tid, tid_size);
-
-		status = MC_OK;
+		status = _item_assoc_key_tid(trans, key, nkey, tid, tid_size);
 	}
 
 	if (status == MC_INVALID) {
 		stats_thread_incr(qlease_aborts);
 	}
 
+	if (status != MC_OK && *it != NULL) {
+		_item_remove(*it);
+		*it = NULL;
+	}
+
 	if (lease_it != NULL)
 		_item_remove(lease_it);
 
-	if (trans_it != NULL)
-		_item_remove(trans_it);
+	return status;
+}
+
+rstatus_t
+item_quarantine_and_read(char* tid, size_t tid_size, char* key, uint8_t nkey,
+		lease_token_t lease_token, lease_token_t * new_lease_token,
+		struct conn *c, struct item ** it, uint8_t *pending) {
+	rstatus_t status;
 
-	pthread_mutex_unlock(&cache_lock);
+	item_lock_key2(key, nkey, tid, tid_size);
+	status = _item_quarantine_and_read(tid, tid_size, key, nkey, lease_token,
+			new_lease_token, c, it, pending);
+	item_unlock();
 
 	return status;
 }
@@ -2172,17 +3519,18 @@ void abort_sessions(struct conn* c, struct item* colease_it,
 	size_t npsid = 0;
 	while (trig_keylist_next(item_data(colease_it), colease_it->nbyte,
 			&cursor, &psid, &npsid) == TRIG_OK) {
-		struct item* psess_it = _item_get(psid, npsid);
+		struct trans* psess = trans_get(TRANS_SID, psid, npsid);
 
-		if (psess_it != NULL) {
+		if (psess != NULL) {
 			if (memcmp(sid, psid, nsid) != 0) {	// different session, mark it as aborted
-				psess_it->sess_status = ABORT;
+				psess->status = TRANS_ABORT;
 				char* tkey = NULL;
 				size_t ntkey = 0;
-				trig_cursor_t kcursor = NULL;
+				uint32_t i;
 				struct item* tcolease_it = NULL;
 				struct item* tlease_it = NULL;
-				while (trig_keylist_next(item_data(psess_it), psess_it->nbyte, &kcursor, &tkey, &ntkey) == TRIG_OK) {
+				for (i = 0; i < psess->nkey; i++) {
+					trans_key(psess, i, &tkey, &ntkey);
 					tcolease_it = _item_get_co_lease(tkey, ntkey);
 					if (tcolease_it != NULL) {
 						if (tcolease_it != colease_it &&
@@ -2205,8 +3553,6 @@ void abort_sessions(struct conn* c, struct item* colease_it,
 				// no need to do anything here
 				// the colease item will be deleted and then replace by a new one
 			}
-
-			_item_remove(psess_it);
 		}
 	}
 }
@@ -2214,27 +3560,26 @@ void abort_sessions(struct conn* c, struct item* colease_it,
 void clean_session(char* sid, size_t nsid, struct conn* c) {
 	char* key;
 	size_t nkey = 0;
-	struct item* sess_it;
+	struct trans* sess;
 	struct item* lease_it;
 	struct item* colease_it;
 	struct item* pv_it;
-	trig_cursor_t cursor = NULL;
+	uint32_t i;
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it == NULL)
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess == NULL)
 		return;
 
-	if (sess_it->sess_status == ABORT) {	// session has been aborted
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
+	if (sess->status == TRANS_ABORT) {	// session has been aborted
+		trans_remove(sess);
 		stats_thread_incr(sess_abort);
-		pthread_mutex_unlock(&cache_lock);
 		return;
 	}
 
 	// loop through keys and delete
-	while (trig_keylist_next(item_data(sess_it), sess_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
+	for (i = 0; i < sess->nkey; i++) {
+		trans_key(sess, i, &key, &nkey);
+
 		lease_it = _item_get_lease(key, nkey);
 		if (lease_it != NULL) {
 			_item_unlink(lease_it);
@@ -2255,9 +3600,7 @@ void clean_session(char* sid, size_t nsid, struct conn* c) {
 		}
 	}
 
-	_item_unlink(sess_it);
-	item_unset_pinned(sess_it);
-	_item_remove(sess_it);
+	trans_remove(sess);
 
 	stats_thread_incr(sess_unlease);
 }
@@ -2265,26 +3608,23 @@ void clean_session(char* sid, size_t nsid, struct conn* c) {
 /** Grant O and Q leases and get the value **/
 item_co_result_t
 item_oqread(char* sid, size_t nsid, char* key, uint8_t nkey, struct conn *c, struct item ** it) {
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* lease_it = NULL;
 	struct item* colease_it = NULL;
 	item_co_result_t status = CO_OK;
 
 	log_debug(LOG_VERB, "oqread for '%.*s'", nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	admit_record(key, nkey);
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL) {
-		if (sess_it->sess_status == ABORT) {
-			_item_unlink(sess_it);
-			item_unset_pinned(sess_it);
-			_item_remove(sess_it);
-			stats_thread_incr(sess_abort);
-			pthread_mutex_unlock(&cache_lock);
-			return CO_ABORT;
-		}
-		_item_remove(sess_it);
+	item_lock_global();
+
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
+		stats_thread_incr(sess_abort);
+		item_unlock();
+		return CO_ABORT;
 	}
 
 	colease_it = _item_get_co_lease(key, nkey);
@@ -2299,13 +3639,13 @@ item_oqread(char* sid, size_t nsid, char* key, uint8_t nkey, struct conn *c, str
 			if (trig_check_keylist(item_data(colease_it), colease_it->nbyte, sid, nsid) == TRIG_OK) {	// same session
 				*it = _item_get(key, nkey);
 				_item_remove(colease_it);
-				pthread_mutex_unlock(&cache_lock);
+				item_unlock();
 				return CO_OK;
 			} else {
 				// clean up session
 				_item_remove(colease_it);
 				clean_session(sid, nsid, c);
-				pthread_mutex_unlock(&cache_lock);
+				item_unlock();
 				return CO_ABORT;
 			}
 		}
@@ -2336,7 +3676,7 @@ item_oqread(char* sid, size_t nsid, char* key, uint8_t nkey, struct conn *c, str
 		stats_thread_incr(total_q_lease);
 
 		if (*it != NULL && lease_it != NULL) {
-			(*it)->exptime = lease_it->exptime;
+			item_copy_deadline((*it), lease_it);
 		}
 
 		status = CO_OK;
@@ -2346,20 +3686,28 @@ item_oqread(char* sid, size_t nsid, char* key, uint8_t nkey, struct conn *c, str
 		_item_remove(lease_it);
 
 	if (status == CO_OK) {
-		sess_it = _item_get(sid, nsid);
-		_item_assoc_key_sid(c, sess_it, key, nkey, sid, nsid);
+		// a session that cannot be tracked is aborted
+		sess = trans_get(TRANS_SID, sid, nsid);
+		if (_item_assoc_key_sid(sess, key, nkey, sid, nsid) != MC_OK) {
+			if (*it != NULL) {
+				_item_remove(*it);
+				*it = NULL;
+			}
+			item_unlock();
+			return CO_ABORT;
+		}
 		colease_it = _item_get_co_lease(key, nkey);
 		_item_assoc_sid_colease(c, colease_it, key, nkey, sid, nsid, O_LEASE_REF);
 	}
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
 
 item_co_result_t
 item_oqswap(char* sid, size_t nsid, struct item* it, struct conn* c) {
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	item_co_result_t status = CO_OK;
 	struct item* lease_it = NULL;
@@ -2367,38 +3715,34 @@ item_oqswap(char* sid, size_t nsid, struct item* it, struct conn* c) {
 
 	log_debug(LOG_VERB, "oq_swap_and_release for '%.*s'", it->nkey, item_key(it));
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL && sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
-		pthread_mutex_unlock(&cache_lock);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
+		item_unlock();
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
 
 	colease_it = _item_get_co_lease(item_key(it), it->nkey);
 	if (colease_it == NULL || item_has_c_lease(colease_it)) {
 		if (colease_it != NULL)
 			_item_remove(colease_it);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_ABORT;
 	} else if (item_has_o_lease(colease_it)) {
 		if (trig_check_keylist(item_data(colease_it), colease_it->nbyte, sid, nsid) != TRIG_OK) {
 			_item_unlink(colease_it);
 			_item_remove(colease_it);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return CO_ABORT;
 		}
 		_item_remove(colease_it);
 	} else {
 		_item_unlink(colease_it);
 		_item_remove(colease_it);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_INVALID;
 	}
 
@@ -2412,7 +3756,7 @@ item_oqswap(char* sid, size_t nsid, struct item* it, struct conn* c) {
 		if (lease_it != NULL)
 			_item_remove(lease_it);
 
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return status;
 	} else {
 		_item_unlink(lease_it);
@@ -2421,7 +3765,7 @@ item_oqswap(char* sid, size_t nsid, struct item* it, struct conn* c) {
 	}
 
 	if (it == NULL || it->nbyte == 0) {
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_INVALID;
 	}
 
@@ -2435,13 +3779,13 @@ item_oqswap(char* sid, size_t nsid, struct item* it, struct conn* c) {
 	// no need to remove ref count for it because it is handled at
 	// the function asc_complete_nread
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 	return status;
 }
 
 item_co_result_t
 item_oqwrite(char* sid, size_t nsid, struct item* it, struct conn* c) {
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	item_co_result_t status = CO_OK;
 	struct item* lease_it = NULL;
@@ -2449,19 +3793,15 @@ item_oqwrite(char* sid, size_t nsid, struct item* it, struct conn* c) {
 
 	log_debug(LOG_VERB, "oq_write for '%.*s'", it->nkey, item_key(it));
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL && sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
-		pthread_mutex_unlock(&cache_lock);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
+		item_unlock();
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
 
 	colease_it = _item_get_co_lease(item_key(it), it->nkey);
 
@@ -2485,7 +3825,7 @@ item_oqwrite(char* sid, size_t nsid, struct item* it, struct conn* c) {
 		if (trig_check_keylist(item_data(colease_it), colease_it->nbyte, sid, nsid) != TRIG_OK) {
 			_item_remove(colease_it);
 			clean_session(sid, nsid, c);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return CO_ABORT;
 		}
 		_item_remove(colease_it);
@@ -2506,7 +3846,7 @@ item_oqwrite(char* sid, size_t nsid, struct item* it, struct conn* c) {
 			if (lease_it != NULL)
 				_item_remove(lease_it);
 
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return status;
 		} else {
 			if (lease_it != NULL) {
@@ -2533,15 +3873,13 @@ item_oqwrite(char* sid, size_t nsid, struct item* it, struct conn* c) {
 		_item_remove(pv_it);
 	}
 
-	sess_it = _item_get(sid, nsid);
-	_item_assoc_key_sid(c, sess_it, item_key(it), it->nkey, sid, nsid);
-	if (sess_it != NULL)
-		_item_remove(sess_it);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	_item_assoc_key_sid(sess, item_key(it), it->nkey, sid, nsid);
 
 	// no need to remove ref count for it because it is handled at
 	// the function asc_complete_nread
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 	return status;
 }
 
@@ -2553,7 +3891,7 @@ item_swap_and_release(struct item* it, struct conn *c) {
 
 	log_debug(LOG_VERB, "swap_and_release for '%.*s'", it->nkey, item_key(it));
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(item_key(it), it->nkey);
 
 	// delete the lease first
 	lease_it = _item_get_lease(item_key(it), it->nkey);
@@ -2565,7 +3903,7 @@ item_swap_and_release(struct item* it, struct conn *c) {
 		if (lease_it != NULL)
 			_item_remove(lease_it);
 
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return status;
 	} else {
 		_item_unlink(lease_it);
@@ -2575,7 +3913,7 @@ item_swap_and_release(struct item* it, struct conn *c) {
 	}
 
 	if (it == NULL || it->nbyte == 0) {
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return STORE_ERROR;
 	}
 
@@ -2599,7 +3937,7 @@ item_swap_and_release(struct item* it, struct conn *c) {
 	// no need to remove ref count for it because it is handled at
 	// the function asc_complete_nread
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
@@ -2613,7 +3951,7 @@ item_swap(struct item* it, struct conn *c) {
 
 	log_debug(LOG_VERB, "swap for '%.*s'", it->nkey, item_key(it));
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(item_key(it), it->nkey);
 
 	// delete the lease first
 	lease_it = _item_get_lease(item_key(it), it->nkey);
@@ -2625,14 +3963,14 @@ item_swap(struct item* it, struct conn *c) {
 		if (lease_it != NULL)
 			_item_remove(lease_it);
 
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return status;
 	} else {
 		_item_remove(lease_it);
 	}
 
 	if (it == NULL || it->nbyte == 0) {
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return STORED;
 	}
 
@@ -2663,67 +4001,63 @@ item_swap(struct item* it, struct conn *c) {
 	// no need to remove ref count for it because it is handled at
 	// the function asc_complete_nread
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
 
 void item_ftrans(char*tid, size_t tid_size, char*key, size_t key_size, struct conn* c) {
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(key, key_size);
 	struct item* ptrans_it = _item_get_ptrans(key, key_size);
 	_item_remove_tid_ptrans(c, ptrans_it, key, key_size, tid, tid_size);
 	if (ptrans_it != NULL) {
 		_item_remove(ptrans_it);
 	}
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 }
 
-item_iq_result_t
-item_iqget(char *key, size_t nkey, lease_token_t lease_token,
+static item_iq_result_t
+_item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 		char* tid, size_t tid_size, struct conn *c,
 		struct item** item, lease_token_t* new_lease_token, int override, int foreground) {
 	struct item* it = NULL;
 	struct item* pv_it = NULL;	// new version of the item
 	item_iq_result_t status = IQ_NO_VALUE;
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	struct item* lease_it = NULL;
-
-	pthread_mutex_lock(&cache_lock);
+	struct item* family[ASSOC_NFAMILY];
 
 	log_debug(LOG_VERB, "iqget for '%.*s'", nkey, key);
 
 	if (foreground == 1) {
 		stats_thread_incr(iqget);
+		admit_record(key, nkey);
 	}
 	*item = NULL;
 
-	// get trans and it item
+	// get transaction, and it item with all its iq state in one lookup
 	if (tid_size > 0)
-		trans_it = _item_get(tid, tid_size);
-	it = _item_get(key, nkey);
+		trans = trans_get(TRANS_TID, tid, tid_size);
+	_item_get_family(key, nkey, family);
+	it = family[ASSOC_FAMILY_KEY];
+	family[ASSOC_FAMILY_KEY] = NULL;
 
 	// get pending information
 	uint8_t pending = 0;
 	if (it == NULL) {
-		struct item* pending_it = _item_get_pending(key, nkey);
-		if (pending_it != NULL) {
-			pending = 1;
-			_item_remove(pending_it);
-		} else {
-			pending = 0;
-		}
+		pending = (family[ASSOC_FAMILY_PENDING] != NULL) ? 1 : 0;
 	} else {
 		pending = it->p;
 	}
 
 	// transaction does not exist or the key does not belong to this transaction
-	if (trans_it == NULL || trig_check_keylist(item_data(trans_it), trans_it->nbyte, key,
-			(trig_keylen_t) nkey) != TRIG_OK) {
+	if (trans == NULL || !trans_has(trans, key, nkey)) {
 		if (it != NULL) {
 			ASSERT (it->nbyte != 0);
 
 			// check if there is a q lease on the item
-			lease_it = _item_get_lease(key, nkey);
+			lease_it = family[ASSOC_FAMILY_LEASE];
+			family[ASSOC_FAMILY_LEASE] = NULL;
 			if (lease_it != NULL && item_has_q_ref_lease(lease_it) &&
 					_item_lease_value(lease_it) == lease_token) {
 				status = IQ_NO_VALUE;
@@ -2761,7 +4095,11 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 
 							if (token == lease_token)
 								status = IQ_NO_VALUE;
-							else {
+							else if (item_has_i_lease(lease_it) &&
+									wait_park(c, key, nkey, lease_it->exptime)) {
+								*item = NULL;
+								status = IQ_WAIT;
+							} else {
 								stats_thread_incr(ilease_aborts);
 								*new_lease_token = LEASE_HOTMISS;
 								status = IQ_MISS;
@@ -2782,7 +4120,8 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 			}
 		} else {
 			stats_thread_incr(iqget_miss);
-			lease_it = _item_get_lease(key, nkey);
+			lease_it = family[ASSOC_FAMILY_LEASE];
+			family[ASSOC_FAMILY_LEASE] = NULL;
 
 			if (lease_it == NULL) {	// no lease
 				lease_it = _item_create_lease(key, nkey, new_lease_token);
@@ -2792,7 +4131,7 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 					_item_store(lease_it, REQ_SET, c, true);
 
 					if (it != NULL)
-						it->exptime = lease_it->exptime;
+						item_copy_deadline(it, lease_it);
 
 					stats_thread_incr(total_lease);
 					stats_thread_incr(total_i_lease);
@@ -2810,7 +4149,11 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 
 				if (token == lease_token)
 					status = IQ_NO_VALUE;
-				else {
+				else if (item_has_i_lease(lease_it) &&
+						wait_park(c, key, nkey, lease_it->exptime)) {
+					*item = NULL;
+					status = IQ_WAIT;
+				} else {
 					stats_thread_incr(ilease_aborts);
 					*new_lease_token = LEASE_HOTMISS;
 
@@ -2819,7 +4162,8 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 			}
 		}
 	} else {
-		lease_it = _item_get_lease(key, nkey);
+		lease_it = family[ASSOC_FAMILY_LEASE];
+		family[ASSOC_FAMILY_LEASE] = NULL;
 
 		if (lease_it == NULL) {
 			// lease item not found for some reasons (for example, delete is called)
@@ -2834,7 +4178,8 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 				// do not try to read the value because we want read ops
 				// of the same session to update its own update.
 			} else if (item_has_q_incr_lease(lease_it)) {
-				pv_it = _item_get_pending_version(key, nkey);
+				pv_it = family[ASSOC_FAMILY_VERSION];
+				family[ASSOC_FAMILY_VERSION] = NULL;
 
 				if (pv_it != NULL) {
 					ASSERT (pv_it->nbyte != 0);
@@ -2857,10 +4202,6 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 		item_acquire_refcount(*item);
 	}
 
-	if (trans_it != NULL) {
-		_item_remove(trans_it);
-	}
-
 //	if (pv_it != NULL) {
 //		_item_remove(pv_it);
 //	}
@@ -2873,20 +4214,131 @@ item_iqget(char *key, size_t nkey, lease_token_t lease_token,
 		_item_remove(lease_it);
 	}
 
-	pthread_mutex_unlock(&cache_lock);
+	_item_put_family(family);
+
+	return status;
+}
+
+item_iq_result_t
+item_iqget(char *key, size_t nkey, lease_token_t lease_token,
+		char* tid, size_t tid_size, struct conn *c,
+		struct item** item, lease_token_t* new_lease_token, int override, int foreground) {
+	item_iq_result_t status;
+
+	item_lock_key2(key, nkey, tid, tid_size);
+	status = _item_iqget(key, nkey, lease_token, tid, tid_size, c, item,
+			new_lease_token, override, foreground);
+	item_unlock();
 
 	return status;
 }
 
+/*
+ * Batched iq commands run their single key counterpart on every key of
+ * the batch, locking the stripes of as many keys as item_lock_batch (or,
+ * for commit, item_lock_keylists) covers at once, so a batch takes the
+ * item locks once per chunk of keys instead of once per key. Each key's
+ * result is left in its batch entry; items read are referenced there and
+ * the caller must remove them.
+ */
+void
+item_iqget_batch(struct item_batch *batch, uint32_t n, struct conn *c)
+{
+	uint32_t i, j, nlock;
+
+	stats_thread_incr(batch);
+	stats_thread_incr_by(batch_key, n);
+
+	for (i = 0; i < n; i += nlock) {
+		nlock = item_lock_batch(&batch[i], n - i, NULL, 0);
+		for (j = i; j < i + nlock; j++) {
+			batch[j].it = NULL;
+			batch[j].token = 0;
+			batch[j].p = 0;
+			batch[j].status = _item_iqget(batch[j].key, batch[j].nkey,
+					DEFAULT_TOKEN, NULL, 0, c, &batch[j].it, &batch[j].token,
+					0, 1);
+		}
+		item_unlock();
+	}
+}
+
+void
+item_quarantine_and_register_batch(char *tid, size_t ntid,
+		struct item_batch *batch, uint32_t n, struct conn *c)
+{
+	uint32_t i, j, nlock;
+
+	stats_thread_incr(batch);
+	stats_thread_incr_by(batch_key, n);
+
+	for (i = 0; i < n; i += nlock) {
+		nlock = item_lock_batch(&batch[i], n - i, tid, ntid);
+		for (j = i; j < i + nlock; j++) {
+			batch[j].it = NULL;
+			batch[j].token = 0;
+			batch[j].p = 0;
+			batch[j].status = _item_quarantine_and_register(tid, ntid,
+					batch[j].key, batch[j].nkey, &batch[j].p, c);
+		}
+		item_unlock();
+	}
+}
+
+void
+item_quarantine_and_read_batch(char *tid, size_t ntid,
+		struct item_batch *batch, uint32_t n, struct conn *c)
+{
+	uint32_t i, j, nlock;
+
+	stats_thread_incr(batch);
+	stats_thread_incr_by(batch_key, n);
+
+	for (i = 0; i < n; i += nlock) {
+		nlock = item_lock_batch(&batch[i], n - i, tid, ntid);
+		for (j = i; j < i + nlock; j++) {
+			batch[j].it = NULL;
+			batch[j].token = 0;
+			batch[j].p = 0;
+			batch[j].status = _item_quarantine_and_read(tid, ntid,
+					batch[j].key, batch[j].nkey, DEFAULT_TOKEN,
+					&batch[j].token, c, &batch[j].it, &batch[j].p);
+		}
+		item_unlock();
+	}
+}
+
+void
+item_commit_batch(struct item_batch *batch, uint32_t n, struct conn *c,
+		int32_t pending, int32_t server_cfg_id)
+{
+	uint32_t i, j, nlock;
+
+	stats_thread_incr(batch);
+	stats_thread_incr_by(batch_key, n);
+
+	for (i = 0; i < n; i += nlock) {
+		nlock = item_lock_keylists(&batch[i], n - i);
+		for (j = i; j < i + nlock; j++) {
+			batch[j].it = NULL;
+			batch[j].token = 0;
+			batch[j].p = 0;
+			batch[j].status = _item_commit(batch[j].key, batch[j].nkey, c,
+					pending, server_cfg_id);
+		}
+		item_unlock();
+	}
+}
+
 item_iq_result_t
 item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 		int64_t delta, char *tid, size_t ntid, uint8_t *pending, uint64_t *new_lease_token) {
 	item_iq_result_t ret;
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key2(key, nkey, tid, ntid);
 	ret = _item_iqincr_iqdecr(c, key, nkey, incr, delta, tid, ntid,
 			pending, new_lease_token);
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return ret;
 }
@@ -2897,7 +4349,7 @@ item_oqincr_oqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 	struct item* pv_it;
 	item_co_result_t ret;
 	char* ptr;
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 	ret = _item_oqincr_oqdecr(c, key, nkey, incr, delta, sid, nsid);
 	pv_it = _item_get_pending_version(key, nkey);
 	if (ret == CO_OK && pv_it != NULL) {
@@ -2911,7 +4363,7 @@ item_oqincr_oqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 	if (pv_it != NULL) {
 		_item_remove(pv_it);
 	}
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 	return ret;
 }
 
@@ -2919,7 +4371,7 @@ item_iq_result_t
 item_iqappend_iqprepend(struct conn *c,
 		struct item* item, uint8_t *pending, uint64_t *new_lease_token) {
 	struct item* it = NULL;
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
 	item_iq_result_t ret = IQ_LEASE;
@@ -2930,7 +4382,7 @@ item_iqappend_iqprepend(struct conn *c,
 
 	log_debug(LOG_VERB, "iq_iqappend_iqprepend for tid '%.*s' key '%.*s'", ntid, tid, nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key2(key, nkey, tid, ntid);
 
 	switch (c->req_type) {
 	case REQ_IQAPPEND:
@@ -2945,7 +4397,7 @@ item_iqappend_iqprepend(struct conn *c,
 
 	// get trans and it item
 	it = _item_get(key, nkey);
-	trans_it = _item_get(tid, ntid);
+	trans = trans_get(TRANS_TID, tid, ntid);
 	lease_it = _item_get_lease(key, nkey);
 
 	if (lease_it == NULL || item_has_i_lease(lease_it)) {
@@ -2971,9 +4423,9 @@ item_iqappend_iqprepend(struct conn *c,
 				stats_thread_incr(total_q_lease);
 
 				// associate the key with the tid
-				_item_assoc_key_tid(c, trans_it, key, nkey, tid, ntid);
-
-				if (it != NULL) {
+				if (_item_assoc_key_tid(trans, key, nkey, tid, ntid) != MC_OK) {
+					ret = IQ_SERVER_ERROR;
+				} else if (it != NULL) {
 					ASSERT (it->nbyte != 0);
 
 //					it->exptime = lease_it->exptime;
@@ -2981,7 +4433,7 @@ item_iqappend_iqprepend(struct conn *c,
 					// create a pending version of the key
 					pv_it = _item_create_pending_version(it);
 					pv_it->p = it->p;
-					pv_it->exptime = lease_it->exptime;
+					item_copy_deadline(pv_it, lease_it);
 					*pending = it->p;
 					memcpy(item_data(pv_it), item_data(it), it->nbyte);
 					_item_store(pv_it, REQ_SET, c, true);
@@ -3004,9 +4456,7 @@ item_iqappend_iqprepend(struct conn *c,
 	} else {
 		ASSERT (item_has_q_lease(lease_it));
 
-		trig_keylen_t key_len = nkey;
-
-		if (trans_it == NULL || trig_check_keylist(item_data(trans_it), trans_it->nbyte, key, key_len) == TRIG_NOTFOUND) {
+		if (trans == NULL || !trans_has(trans, key, nkey)) {
 
 			stats_thread_incr(qlease_aborts);
 
@@ -3040,16 +4490,13 @@ item_iqappend_iqprepend(struct conn *c,
 	if (it != NULL)
 		_item_remove(it);
 
-	if (trans_it != NULL)
-		_item_remove(trans_it);
-
 	if (pv_it != NULL)
 		_item_remove(pv_it);
 
 	if (lease_it != NULL)
 		_item_remove(lease_it);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return ret;
 }
@@ -3057,7 +4504,7 @@ item_iqappend_iqprepend(struct conn *c,
 item_co_result_t
 item_oqappend_oqprepend(struct conn *c, struct item* item) {
 	struct item* it = NULL;
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
 	struct item* colease_it = NULL;
@@ -3069,7 +4516,7 @@ item_oqappend_oqprepend(struct conn *c, struct item* item) {
 
 	log_debug(LOG_VERB, "item_coappend_coprepend for sid '%.*s' key '%.*s'", nsid, sid, nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
 	switch (c->req_type) {
 	case REQ_OQAPPEND:
@@ -3082,18 +4529,12 @@ item_oqappend_oqprepend(struct conn *c, struct item* item) {
 		break;
 	}
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL) {
-		if (sess_it->sess_status == ABORT) {
-			_item_unlink(sess_it);
-			item_unset_pinned(sess_it);
-			_item_remove(sess_it);
-			stats_thread_incr(sess_abort);
-			pthread_mutex_unlock(&cache_lock);
-			return CO_ABORT;
-		}
-		_item_remove(sess_it);
-		sess_it = NULL;
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
+		stats_thread_incr(sess_abort);
+		item_unlock();
+		return CO_ABORT;
 	}
 
 	colease_it = _item_get_co_lease(key, nkey);
@@ -3109,7 +4550,7 @@ item_oqappend_oqprepend(struct conn *c, struct item* item) {
 				// clean up session
 				_item_remove(colease_it);
 				clean_session(sid, nsid, c);
-				pthread_mutex_unlock(&cache_lock);
+				item_unlock();
 				return CO_ABORT;
 			}
 		}
@@ -3142,10 +4583,8 @@ item_oqappend_oqprepend(struct conn *c, struct item* item) {
 		_item_assoc_sid_colease(c, colease_it, key, nkey, sid, nsid, O_LEASE_REF);
 	}
 
-	sess_it = _item_get(sid, nsid);
-	_item_assoc_key_sid(c, sess_it, key, nkey, sid, nsid);
-	if (sess_it != NULL)
-		_item_remove(sess_it);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	_item_assoc_key_sid(sess, key, nkey, sid, nsid);
 
 	if (it != NULL && item_is_linked(it))
 		_item_remove(it);
@@ -3159,7 +4598,7 @@ item_oqappend_oqprepend(struct conn *c, struct item* item) {
 	if (colease_it != NULL)
 		_item_remove(colease_it);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return ret;
 }
@@ -3168,27 +4607,22 @@ item_co_result_t
 item_oqreg(struct conn *c, char *sid, size_t nsid, char *key, size_t nkey) {
 	struct item* lease_it = NULL;
 	struct item* it = NULL;
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	item_co_result_t status = CO_OK;
 
 	log_debug(LOG_VERB, "oqreg for '%.*s'", nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL && sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
 		stats_thread_incr(sess_abort);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
-
 	lease_it = _item_get_lease(key, nkey);	// get lease item
 
 	// at this time, transaction item for this session should be ready
@@ -3240,18 +4674,16 @@ item_oqreg(struct conn *c, char *sid, size_t nsid, char *key, size_t nkey) {
 	}
 
 	// get session from ActiveSessions
-	sess_it = _item_get(sid, nsid);
-	_item_assoc_key_sid(c, sess_it, key, nkey, sid, nsid);
-	if (sess_it == NULL) {
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess == NULL) {
 		stats_thread_incr(total_sess);
-	} else {
-		_item_remove(sess_it);
 	}
+	_item_assoc_key_sid(sess, key, nkey, sid, nsid);
 
 	if (colease_it != NULL)
 		_item_remove(colease_it);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return status;
 }
@@ -3260,104 +4692,99 @@ item_co_result_t
 item_dcommit(char *sid, size_t nsid, struct conn *c) {
 	struct item* it = NULL;
 	struct item* pv_it = NULL;
-	trig_cursor_t cursor = NULL;
+	uint32_t i;
 	struct item* lease_it = NULL;
-	struct item *sess_it = NULL;
+	struct trans *sess = NULL;
 	struct item *colease_it = NULL;
 	char *key = NULL;
 	size_t nkey = 0;
 
 	log_debug(LOG_VERB, "dcommit for '%.*s'", nsid, sid);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
+	sess = trans_get(TRANS_SID, sid, nsid);
 
-	if (sess_it == NULL) {
+	if (sess == NULL) {
 		log_debug(LOG_VERB, "dcommit session not found '%.*s'", nsid, sid);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_NOT_FOUND;
 	}
 
 	// session has been aborted
-	if (sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
+	if (sess->status == TRANS_ABORT) {
+		trans_remove(sess);
 		stats_thread_incr(sess_abort);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL) {
-		while (trig_keylist_next(item_data(sess_it), sess_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
-			// delete key if exists
-			it = _item_get(key, nkey);
+	for (i = 0; i < sess->nkey; i++) {
+		trans_key(sess, i, &key, &nkey);
 
-			// delete lease if exists
-			lease_it = _item_get_lease(key, nkey);
+		// delete key if exists
+		it = _item_get(key, nkey);
 
-			if (lease_it != NULL) {
-				if (item_has_q_lease(lease_it)) {
-					stats_thread_incr(released_q_lease);
-				}
+		// delete lease if exists
+		lease_it = _item_get_lease(key, nkey);
 
-				_item_unlink(lease_it);
-				_item_remove(lease_it);
+		if (lease_it != NULL) {
+			if (item_has_q_lease(lease_it)) {
+				stats_thread_incr(released_q_lease);
 			}
 
-			colease_it = _item_get_co_lease(key, nkey);
-			if (colease_it != NULL) {
-				if (item_has_o_lease_inv(colease_it)) {
-					if (it != NULL) {
-						_item_unlink(it);
-					}
-				} else if (item_has_o_lease_ref(colease_it)) {
-					pv_it = _item_get_pending_version(key, nkey);
-					if (pv_it != NULL) {
-						int id = item_slabid(nkey, pv_it->nbyte);
-						struct item *new_it = _item_alloc(id, key, nkey, pv_it->dataflags,
-								0, pv_it->nbyte, true, false);
-						memcpy(item_data(new_it), item_data(pv_it), pv_it->nbyte);
-						_item_store(new_it, REQ_SET, c, true);
-						_item_remove(new_it);
-
-						_item_unlink(pv_it);
-						_item_remove(pv_it);
-					} else {
-						if (it != NULL)
-							_item_unlink(it);
-					}
-				} else if (item_has_c_lease(colease_it)) {
+			_item_unlink(lease_it);
+			_item_remove(lease_it);
+		}
+
+		colease_it = _item_get_co_lease(key, nkey);
+		if (colease_it != NULL) {
+			if (item_has_o_lease_inv(colease_it)) {
+				if (it != NULL) {
+					_item_unlink(it);
+				}
+			} else if (item_has_o_lease_ref(colease_it)) {
+				pv_it = _item_get_pending_version(key, nkey);
+				if (pv_it != NULL) {
+					int id = item_slabid(nkey, pv_it->nbyte);
+					struct item *new_it = _item_alloc(id, key, nkey, pv_it->dataflags,
+							0, pv_it->nbyte, true, false);
+					memcpy(item_data(new_it), item_data(pv_it), pv_it->nbyte);
+					_item_store(new_it, REQ_SET, c, true);
+					_item_remove(new_it);
+
+					_item_unlink(pv_it);
+					_item_remove(pv_it);
+				} else {
 					if (it != NULL)
-						it->exptime = 0;
+						_item_unlink(it);
 				}
-
-				// remote sid from CO lease item
-				_item_remove_sid_colease(c, colease_it, key, nkey, sid, nsid);
-				_item_remove(colease_it);
+			} else if (item_has_c_lease(colease_it)) {
+				if (it != NULL)
+					item_set_deadline(it, 0);
 			}
 
-			if (it != NULL)
-				_item_remove(it);
+			// remote sid from CO lease item
+			_item_remove_sid_colease(c, colease_it, key, nkey, sid, nsid);
+			_item_remove(colease_it);
 		}
+
+		if (it != NULL)
+			_item_remove(it);
 	}
 
 	stats_thread_incr(sess_commit);
-	if (sess_it != NULL) {
-		_item_unlink(sess_it);
-		_item_remove(sess_it);
-	}
+	trans_remove(sess);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return CO_OK;
 }
 
 item_co_result_t
 item_validate(char *sid, size_t nsid, struct conn *c) {
-	trig_cursor_t cursor = NULL;
-	struct item* sess_it = NULL;
+	uint32_t i;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	char *key = NULL;
 	size_t nkey = 0;
@@ -3365,30 +4792,25 @@ item_validate(char *sid, size_t nsid, struct conn *c) {
 
 	log_debug(LOG_VERB, "validate for '%.*s'", nsid, sid);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it == NULL) {
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess == NULL) {
 		log_debug(LOG_VERB, "validate session not found '%.*s'", nsid, sid);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_ABORT;
 	}
 
 	// session has been aborted
-	if (sess_it->sess_status == ABORT) {
-		_item_unlink(sess_it);
-		item_unset_pinned(sess_it);
-		_item_remove(sess_it);
+	if (sess->status == TRANS_ABORT) {
+		trans_remove(sess);
 		stats_thread_incr(sess_abort);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_ABORT;
 	}
 
-	if (sess_it != NULL)
-		_item_remove(sess_it);
-
-	while (trig_keylist_next(item_data(sess_it),
-			sess_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
+	for (i = 0; i < sess->nkey; i++) {
+		trans_key(sess, i, &key, &nkey);
 		colease_it = _item_get_co_lease(key, nkey);
 		if (colease_it != NULL) {
 			if (trig_check_keylist(item_data(colease_it), colease_it->nbyte,
@@ -3402,15 +4824,15 @@ item_validate(char *sid, size_t nsid, struct conn *c) {
 	if (status == CO_ABORT)
 		clean_session(sid, nsid, c);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 	return status;
 }
 
 item_iq_result_t
 item_co_unlease(char *sid, size_t nsid, struct conn *c) {
-	trig_cursor_t cursor = NULL;
+	uint32_t i;
 	struct item* lease_it = NULL;
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* colease_it = NULL;
 	struct item* pv_it = NULL;
 	char* key;
@@ -3418,25 +4840,24 @@ item_co_unlease(char *sid, size_t nsid, struct conn *c) {
 
 	log_debug(LOG_VERB, "co_unlease for sid '%.*s'", nsid, sid);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_global();
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it == NULL) {
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess == NULL) {
 		log_debug(LOG_VERB, "co_unlease sess item not found '%.*s", nsid, sid);
-		pthread_mutex_unlock(&cache_lock);
+		item_unlock();
 		return CO_NOT_FOUND;
 	} else {
-		if (sess_it->sess_status == ABORT) {	// session has been aborted
-			_item_unlink(sess_it);
-			item_unset_pinned(sess_it);
-			_item_remove(sess_it);
+		if (sess->status == TRANS_ABORT) {	// session has been aborted
+			trans_remove(sess);
 			stats_thread_incr(sess_abort);
-			pthread_mutex_unlock(&cache_lock);
+			item_unlock();
 			return CO_ABORT;
 		}
 
 		// loop through keys and delete
-		while (trig_keylist_next(item_data(sess_it), sess_it->nbyte, &cursor, &key, &nkey) == TRIG_OK) {
+		for (i = 0; i < sess->nkey; i++) {
+			trans_key(sess, i, &key, &nkey);
 			lease_it = _item_get_lease(key, nkey);
 			if (lease_it != NULL) {
 				_item_unlink(lease_it);
@@ -3458,13 +4879,11 @@ item_co_unlease(char *sid, size_t nsid, struct conn *c) {
 		}
 	}
 
-	_item_unlink(sess_it);
-	item_unset_pinned(sess_it);
-	_item_remove(sess_it);
+	trans_remove(sess);
 
 	stats_thread_incr(sess_unlease);
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 	return CO_OK;
 }
 
@@ -3545,7 +4964,7 @@ item_co_result_t
 _item_oqincr_oqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 		long delta, char *sid, size_t nsid) {
 	struct item* it = NULL;
-	struct item* sess_it = NULL;
+	struct trans* sess = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
 	struct item* colease_it = NULL;
@@ -3564,17 +4983,11 @@ _item_oqincr_oqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 		break;
 	}
 
-	sess_it = _item_get(sid, nsid);
-	if (sess_it != NULL) {
-		if (sess_it->sess_status == ABORT) {
-			_item_unlink(sess_it);
-			item_unset_pinned(sess_it);
-			_item_remove(sess_it);
-			stats_thread_incr(sess_abort);
-			return CO_ABORT;
-		}
-		_item_remove(sess_it);
-		sess_it = NULL;
+	sess = trans_get(TRANS_SID, sid, nsid);
+	if (sess != NULL && sess->status == TRANS_ABORT) {
+		trans_remove(sess);
+		stats_thread_incr(sess_abort);
+		return CO_ABORT;
 	}
 
 	colease_it = _item_get_co_lease(key, nkey);
@@ -3620,10 +5033,8 @@ _item_oqincr_oqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 		_item_assoc_sid_colease(c, colease_it, key, nkey, sid, nsid, O_LEASE_REF);
 	}
 
-	sess_it = _item_get(sid, nsid);
-	_item_assoc_key_sid(c, sess_it, key, nkey, sid, nsid);
-	if (sess_it != NULL)
-		_item_remove(sess_it);
+	sess = trans_get(TRANS_SID, sid, nsid);
+	_item_assoc_key_sid(sess, key, nkey, sid, nsid);
 
 	if (it != NULL && item_is_linked(it))
 		_item_remove(it);
@@ -3644,7 +5055,7 @@ item_iq_result_t
 _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 		long delta, char *tid, size_t ntid, uint8_t *pending, uint64_t *new_lease_token) {
 	struct item* it = NULL;
-	struct item* trans_it = NULL;
+	struct trans* trans = NULL;
 	struct item* pv_it = NULL;
 	struct item* lease_it = NULL;
 	item_iq_result_t ret = IQ_LEASE;
@@ -3664,7 +5075,7 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 
 	// get trans and it item
 	it = _item_get(key, nkey);
-	trans_it = _item_get(tid, ntid);
+	trans = trans_get(TRANS_TID, tid, ntid);
 	lease_it = _item_get_lease(key, nkey);
 
 	if (lease_it == NULL || item_has_i_lease(lease_it)) {
@@ -3687,9 +5098,9 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 			stats_thread_incr(total_q_lease);
 
 			// associate the key with the tid
-			_item_assoc_key_tid(c, trans_it, key, nkey, tid, ntid);
-
-			if (it != NULL) {
+			if (_item_assoc_key_tid(trans, key, nkey, tid, ntid) != MC_OK) {
+				ret = IQ_SERVER_ERROR;
+			} else if (it != NULL) {
 				ASSERT (it->nbyte != 0);
 
 //				it->exptime = lease_it->exptime;
@@ -3697,7 +5108,7 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 				// create a pending version of the key
 				pv_it = _item_create_pending_version(it);
 				pv_it->p = it->p;
-				pv_it->exptime = lease_it->exptime;
+				item_copy_deadline(pv_it, lease_it);
 				*pending = it->p;
 				memcpy(item_data(pv_it), item_data(it), it->nbyte);
 				_item_store(pv_it, REQ_SET, c, true);
@@ -3714,9 +5125,7 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 			}
 		}
 	} else if (item_has_q_lease(lease_it)) {
-		trig_keylen_t key_len = nkey;
-
-		if (trans_it == NULL || trig_check_keylist(item_data(trans_it), trans_it->nbyte, key, key_len) == TRIG_NOTFOUND) {
+		if (trans == NULL || !trans_has(trans, key, nkey)) {
 
 			stats_thread_incr(qlease_aborts);
 
@@ -3745,9 +5154,6 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 	if (it != NULL)
 		_item_remove(it);
 
-	if (trans_it != NULL)
-		_item_remove(trans_it);
-
 	if (pv_it != NULL)
 		_item_remove(pv_it);
 
@@ -3757,79 +5163,58 @@ _item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr,
 	return ret;
 }
 
-void
-_item_assoc_key_tid(struct conn* c, struct item* trans_it, char *key, size_t nkey, char *tid, size_t ntid) {
-	u_int32_t old_keylistlen = 0;
-
-	trig_keylen_t key_len = nkey;
-	if (trans_it == NULL || trig_check_keylist(item_data(trans_it), trans_it->nbyte, key, key_len) == TRIG_NOTFOUND) {
-		if (trans_it == NULL) {
-			old_keylistlen = 0;
-		} else {
-			old_keylistlen = trans_it->nbyte;
-		}
-
-		u_int32_t num_of_bytes = old_keylistlen + trig_new_keylist_size(key, key_len);
-		trig_listlen_t new_listlen = 0;
-
-		// allocate memory for new item
-		struct item* new_trans_it = _item_create_reserved_item(tid, ntid, num_of_bytes, true);
-		item_set_sess(new_trans_it);
-
-		if (trans_it != NULL) {
-			trig_keylist_addkey(item_data(new_trans_it), &new_listlen, new_trans_it->nbyte,
-					item_data(trans_it), trans_it->nbyte, key, nkey);
+/*
+ * Timer handler of a transaction or session deadline
+ */
+static void
+item_trans_timeout(void *arg, uint32_t hash)
+{
+	item_lock_hash(hash);
+	trans_expire(hash);
+	item_unlock();
+}
 
-			item_unset_pinned(trans_it);
-		} else {
-			// There was no old keylist so create a new one with just the new key.
-			trig_keylist_addkey(item_data(new_trans_it), &new_listlen, new_trans_it->nbyte,
-					NULL, 0, key, nkey);
+static void
+item_set_trans_timer(struct trans *t)
+{
+	/* without a timer the entry still expires when it is looked up */
+	timer_add(t->hash, t->exptime, item_trans_timeout, NULL, t->hash);
+}
 
-			stats_thread_incr(total_trans);
+/*
+ * Register a key to a transaction, creating the transaction if need be
+ */
+rstatus_t
+_item_assoc_key_tid(struct trans* trans, char *key, size_t nkey, char *tid, size_t ntid) {
+	if (trans == NULL) {
+		trans = trans_create(TRANS_TID, tid, ntid);
+		if (trans == NULL) {
+			log_warn("server error on allocating transaction '%.*s'", ntid, tid);
+			return MC_ENOMEM;
 		}
+		item_set_trans_timer(trans);
 
-		_item_store(new_trans_it, REQ_SET, c, true);
-
-		_item_remove(new_trans_it);
+		stats_thread_incr(total_trans);
 	}
-}
-
-void
-_item_assoc_key_sid(struct conn* c, struct item* sess_it, char *key, size_t nkey,
-		char *sid, size_t nsid) {
-	u_int32_t old_keylistlen = 0;
 
-	trig_keylen_t key_len = nkey;
-	if (sess_it == NULL || trig_check_keylist(item_data(sess_it), sess_it->nbyte, key, key_len) == TRIG_NOTFOUND) {
-		if (sess_it == NULL) {
-			old_keylistlen = 0;
-		} else {
-			old_keylistlen = sess_it->nbyte;
-		}
-
-		u_int32_t num_of_bytes = old_keylistlen + trig_new_keylist_size(key, key_len);
-		trig_listlen_t new_listlen = 0;
+	return trans_add(trans, key, nkey);
+}
 
-		// allocate memory for new item
-		struct item* new_trans_it = _item_create_reserved_item(sid, nsid, num_of_bytes, true);
-		new_trans_it->sess_status = ALIVE;
-		item_set_sess(new_trans_it);
-
-		if (sess_it != NULL) {
-			trig_keylist_addkey(item_data(new_trans_it), &new_listlen, new_trans_it->nbyte,
-					item_data(sess_it), sess_it->nbyte, key, nkey);
-			item_unset_pinned(sess_it);
-		} else {
-			// There was no old keylist so create a new one with just the new key.
-			trig_keylist_addkey(item_data(new_trans_it), &new_listlen, new_trans_it->nbyte,
-					NULL, 0, key, nkey);
+/*
+ * Register a key to a session, creating the session if need be
+ */
+rstatus_t
+_item_assoc_key_sid(struct trans* sess, char *key, size_t nkey, char *sid, size_t nsid) {
+	if (sess == NULL) {
+		sess = trans_create(TRANS_SID, sid, nsid);
+		if (sess == NULL) {
+			log_warn("server error on allocating session '%.*s'", nsid, sid);
+			return MC_ENOMEM;
 		}
-
-		_item_store(new_trans_it, REQ_SET, c, true);
-
-		_item_remove(new_trans_it);
+		item_set_trans_timer(sess);
 	}
+
+	return trans_add(sess, key, nkey);
 }
 
 /* associate sid with the colease item if sid has not been associated with this lease before */
@@ -3919,7 +5304,7 @@ _item_assoc_tid_ptrans(struct conn* c, struct item* ptrans_it,
 		char ptrans_key[ptrans_nkey];
 		mc_get_ptrans_key(key, nkey, &ptrans_key);
 		struct item* new_ptrans_it = _item_create_reserved_item(ptrans_key, ptrans_nkey, num_of_bytes, true);
-		new_ptrans_it->exptime = 0;
+		item_set_deadline(new_ptrans_it, 0);
 		item_set_ptrans(new_ptrans_it);
 
 		if (ptrans_it != NULL) {
@@ -3984,41 +5369,6 @@ _item_assoc_tid_lease(struct conn* c, struct item* lease_it,
 	}
 }
 
-void
-_item_assoc_entry_to_list(struct conn* c, struct item* it, char *entry_id, size_t entry_nid,
-		char *key, size_t nkey) {
-	u_int32_t old_keylistlen = 0;
-
-	trig_keylen_t key_len = entry_nid;
-	if (it == NULL || trig_check_keylist(item_data(it), it->nbyte, entry_id, key_len) == TRIG_NOTFOUND) {
-		if (it == NULL) {
-			old_keylistlen = 0;
-		} else {
-			old_keylistlen = it->nbyte;
-		}
-
-		u_int32_t num_of_bytes = old_keylistlen + trig_new_keylist_size(entry_id, key_len);
-		trig_listlen_t new_listlen = 0;
-
-		// allocate memory for new item
-		struct item* new_it = _item_create_reserved_item(key, nkey, num_of_bytes, true);
-
-		if (it != NULL) {
-			trig_keylist_addkey(item_data(new_it), &new_listlen, new_it->nbyte,
-					item_data(it), it->nbyte, entry_id, key_len);
-			item_unset_pinned(it);
-		} else {
-			// There was no old keylist so create a new one with just the new key.
-			trig_keylist_addkey(item_data(new_it), &new_listlen, new_it->nbyte,
-					NULL, 0, entry_id, key_len);
-		}
-
-		_item_store(new_it, REQ_SET, c, true);
-
-		_item_remove(new_it);
-	}
-}
-
 void
 _item_remove_entry_from_list(struct conn *c, struct item* it, char* key, size_t nkey, char *entry_id, size_t entry_nid) {
 	if (it == NULL)
@@ -4106,7 +5456,7 @@ _item_remove_tid_ptrans(struct conn* c, struct item* ptrans_it, char* key, size_
 
 		// allocate memory for new item
 		struct item* new_ptrans_it = _item_create_reserved_item(ptrans_key, ptrans_nkey, num_of_bytes, true);
-		new_ptrans_it->exptime = 0;
+		item_set_deadline(new_ptrans_it, 0);
 		new_ptrans_it->coflags = ptrans_it->coflags;
 
 		trig_keylist_rmvkey(item_data(new_ptrans_it), &new_listlen, new_ptrans_it->nbyte,
@@ -4195,7 +5545,7 @@ item_get_and_delete(char* key, uint8_t nkey, struct conn *c, int delete_lease)
 
 	log_debug(LOG_VERB, "get_and_delete for '%.*s'", nkey, key);
 
-	pthread_mutex_lock(&cache_lock);
+	item_lock_key(key, nkey);
 
 	if (delete_lease == 1) {
 		lease_it = _item_get_lease(key, nkey);
@@ -4231,7 +5581,7 @@ item_get_and_delete(char* key, uint8_t nkey, struct conn *c, int delete_lease)
 		stats_thread_incr(delete_miss);
 	}
 
-	pthread_mutex_unlock(&cache_lock);
+	item_unlock();
 
 	return found;
 }
@@ -31,13 +31,22 @@
 #define _MC_ITEMS_H_
 
 #include <mc_lease.h>
+#include <mc_trans.h>
 
 #define DEFAULT_TOKEN 0
 
 #define PREFIX_KEY_LEN 3
 
-#define ALIVE 0
-#define ABORT 1
+/*
+ * Item locks are striped by key hash; lock_power picks the number of
+ * stripes. Stripes are capped to the initial hash table size so that
+ * every hash bucket is covered by exactly one stripe.
+ */
+#define ITEM_LOCK_DEFAULT_POWER 10
+#define ITEM_LOCK_MAX_POWER     16
+
+/* max # expired items an item_crawl batch reclaims */
+#define ITEM_CRAWL_MAX_EXPIRED  64
 
 typedef enum item_flags {
     ITEM_LINKED  = 1,  	/* item in lru q and hash */
@@ -55,8 +64,9 @@ typedef enum item_coflags {
 	O_LEASE_INV = 2,
 	PTRANS = 4,
 	HK = 8,
-	SESS = 16,
-	O_LEASE_REF = 32
+	COMPANION = 16,	/* key was built from a base key by a mc_get_*_key helper */
+	O_LEASE_REF = 32,
+	LEASE_TOKEN = 64	/* data is a binary lease token */
 } item_coflags_t;
 
 typedef enum item_store_result {
@@ -79,6 +89,7 @@ typedef enum item_iq_result {
 	IQ_SERVER_ERROR,
 	IQ_OK,
 	IQ_NOT_FOUND,
+	IQ_WAIT,		/* parked on the lease of another client */
 } item_iq_result_t;
 
 typedef enum item_co_result {
@@ -138,15 +149,85 @@ typedef enum item_lease_result {
  * - key with terminating '\0', length = item->nkey + 1
  * - data with no terminating '\0'
  */
+/*
+ * With --enable-compact-item the item header shrinks for small values:
+ * - items link to each other by a 32-bit item_ref_t, the index of their
+ *   slab in the slab ref table and their offset in it in MC_ALIGNMENT
+ *   units, instead of by pointers (see item_ref and item_deref)
+ * - the magic is only kept in builds with asserts, its only readers
+ * - flags, coflags and p share one 16-bit word; the clock bit stays a
+ *   byte of its own, as hits set it without the item lock
+ *
+ * The lru q link stays under clock eviction, as clock walks the lru q.
+ */
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+
+typedef uint32_t item_ref_t;
+
+struct item_tqe {
+    item_ref_t tqe_next;    /* next item, 0 if last */
+    item_ref_t tqe_prev;    /* prev item, 0 if first */
+};
+
+struct item_tqh {
+    item_ref_t tqh_first;   /* first item */
+    item_ref_t tqh_last;    /* last item */
+};
+
+struct item_sle {
+    item_ref_t sle_next;    /* next item, 0 if last */
+};
+
+struct item_slh {
+    item_ref_t slh_first;   /* first item */
+};
+
+#define ITEM_TAILQ_ENTRY    struct item_tqe
+#define ITEM_SLIST_ENTRY    struct item_sle
+
+#else
+
+#define ITEM_TAILQ_ENTRY    TAILQ_ENTRY(item)
+#define ITEM_SLIST_ENTRY    SLIST_ENTRY(item)
+
+SLIST_HEAD(item_slh, item);
+
+TAILQ_HEAD(item_tqh, item);
+
+#endif
+
+#if !(defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1) || \
+    (defined MC_ASSERT_PANIC && MC_ASSERT_PANIC == 1) || \
+    (defined MC_ASSERT_LOG && MC_ASSERT_LOG == 1)
+# define ITEM_HAS_MAGIC 1
+#else
+# define ITEM_HAS_MAGIC 0
+#endif
+
 struct item {
+#if ITEM_HAS_MAGIC == 1
     uint32_t          magic;      /* item magic (const) */
-    TAILQ_ENTRY(item) i_tqe;      /* link in lru q or free q */
-    SLIST_ENTRY(item) h_sle;      /* link in hash */
+#endif
+    uint32_t          expms;      /* expiry deadline in msec, see item_set_deadline */
+    ITEM_TAILQ_ENTRY  i_tqe;      /* link in lru q or free q */
+    ITEM_SLIST_ENTRY  h_sle;      /* link in hash */
+    ITEM_TAILQ_ENTRY  f_tqe;      /* link in fragment index */
     rel_time_t        atime;      /* last access time in secs */
     rel_time_t        exptime;    /* expiry time in secs */
     uint32_t          nbyte;      /* date size */
     uint32_t          offset;     /* offset of item in slab */
     uint32_t          dataflags;  /* data flags opaque to the server */
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+    int32_t           config_number; /* configuration number when the item is stored */
+    uint16_t          refcount;   /* # concurrent users of item */
+    uint16_t          flags:8;    /* item flags */
+    uint16_t          coflags:7;  /* item flags exclusively for CO leases */
+    uint16_t          p:1;        /* a flag to define whether the value is a pending value */
+    uint16_t          fslot;      /* fragment index slot */
+    uint8_t           id;         /* slab class id */
+    uint8_t           nkey;       /* key length */
+    uint8_t           accessed;   /* clock bit, set on a hit */
+#else
     uint16_t          refcount;   /* # concurrent users of item */
     uint8_t           flags;      /* item flags */
 
@@ -156,14 +237,185 @@ struct item {
 
     uint8_t           id;         /* slab class id */
     uint8_t           nkey;       /* key length */
-    uint8_t 		sess_status;		/* status of a session */
+    uint8_t           accessed;   /* clock bit, set on a hit */
+    uint16_t          fslot;      /* fragment index slot */
     int32_t     config_number;   /* configuration number when the item is stored */
+#endif
     char              end[1];     /* item data */
 };
 
-SLIST_HEAD(item_slh, item);
+/*
+ * One key of a batched iq command (one transaction id, for commit), with
+ * the result of its single key counterpart
+ */
+struct item_batch {
+    char              *key;       /* key, or tid of a commit */
+    size_t            nkey;       /* # key bytes */
+    struct item       *it;        /* value or lease item read, if any */
+    lease_token_t     token;      /* lease token granted */
+    uint8_t           p;          /* pending flag; marked value of qareg */
+    int               status;     /* result of the single key command */
+};
 
-TAILQ_HEAD(item_tqh, item);
+/*
+ * Item lists, the lru q, free q, fragment index and hash chains, are
+ * used through the ITEM_TAILQ and ITEM_SLIST macros, which work on
+ * pointer links or compact links alike.
+ *
+ * ITEM_SLIST_INSERT_HEAD publishes the item only after its next link is
+ * set, so lock-free readers that walk a list with ITEM_SLIST_FIRST_VOLATILE
+ * and ITEM_SLIST_NEXT_VOLATILE never see a partial list.
+ */
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+
+#define ITEM_TAILQ_INIT(head) do {                                      \
+    (head)->tqh_first = 0;                                              \
+    (head)->tqh_last = 0;                                               \
+} while (0)
+
+#define ITEM_TAILQ_EMPTY(head)      ((head)->tqh_first == 0)
+#define ITEM_TAILQ_FIRST(head)      item_deref((head)->tqh_first)
+#define ITEM_TAILQ_LAST(head)       item_deref((head)->tqh_last)
+#define ITEM_TAILQ_NEXT(elm, field) item_deref((elm)->field.tqe_next)
+#define ITEM_TAILQ_PREV(elm, field) item_deref((elm)->field.tqe_prev)
+
+#define ITEM_TAILQ_INSERT_HEAD(head, elm, field) do {                   \
+    item_ref_t _ref = item_ref(elm);                                    \
+    (elm)->field.tqe_next = (head)->tqh_first;                          \
+    (elm)->field.tqe_prev = 0;                                          \
+    if ((head)->tqh_first != 0) {                                       \
+        ITEM_TAILQ_FIRST(head)->field.tqe_prev = _ref;                  \
+    } else {                                                            \
+        (head)->tqh_last = _ref;                                        \
+    }                                                                   \
+    (head)->tqh_first = _ref;                                           \
+} while (0)
+
+#define ITEM_TAILQ_INSERT_TAIL(head, elm, field) do {                   \
+    item_ref_t _ref = item_ref(elm);                                    \
+    (elm)->field.tqe_next = 0;                                          \
+    (elm)->field.tqe_prev = (head)->tqh_last;                           \
+    if ((head)->tqh_last != 0) {                                        \
+        ITEM_TAILQ_LAST(head)->field.tqe_next = _ref;                   \
+    } else {                                                            \
+        (head)->tqh_first = _ref;                                       \
+    }                                                                   \
+    (head)->tqh_last = _ref;                                            \
+} while (0)
+
+#define ITEM_TAILQ_REMOVE(head, elm, field) do {                        \
+    if ((elm)->field.tqe_next != 0) {                                   \
+        ITEM_TAILQ_NEXT(elm, field)->field.tqe_prev =                   \
+            (elm)->field.tqe_prev;                                      \
+    } else {                                                            \
+        (head)->tqh_last = (elm)->field.tqe_prev;                       \
+    }                                                                   \
+    if ((elm)->field.tqe_prev != 0) {                                   \
+        ITEM_TAILQ_PREV(elm, field)->field.tqe_next =                   \
+            (elm)->field.tqe_next;                                      \
+    } else {                                                            \
+        (head)->tqh_first = (elm)->field.tqe_next;                      \
+    }                                                                   \
+} while (0)
+
+#define ITEM_TAILQ_FOREACH(var, head, field)                            \
+    for ((var) = ITEM_TAILQ_FIRST(head);                                \
+        (var);                                                          \
+        (var) = ITEM_TAILQ_NEXT(var, field))
+
+#define ITEM_TAILQ_FOREACH_REVERSE_SAFE(var, head, field, tvar)         \
+    for ((var) = ITEM_TAILQ_LAST(head);                                 \
+        (var) && ((tvar) = ITEM_TAILQ_PREV(var, field), 1);             \
+        (var) = (tvar))
+
+#define ITEM_SLIST_INIT(head) do {                                      \
+    (head)->slh_first = 0;                                              \
+} while (0)
+
+#define ITEM_SLIST_FIRST(head)      item_deref((head)->slh_first)
+#define ITEM_SLIST_NEXT(elm, field) item_deref((elm)->field.sle_next)
+
+#define ITEM_SLIST_FIRST_VOLATILE(head)                                 \
+    item_deref(*(volatile item_ref_t *)&(head)->slh_first)
+#define ITEM_SLIST_NEXT_VOLATILE(elm, field)                            \
+    item_deref(*(volatile item_ref_t *)&(elm)->field.sle_next)
+
+#define ITEM_SLIST_INSERT_HEAD(head, elm, field) do {                   \
+    (elm)->field.sle_next = (head)->slh_first;                          \
+    __sync_synchronize();                                               \
+    (head)->slh_first = item_ref(elm);                                  \
+} while (0)
+
+#define ITEM_SLIST_REMOVE_HEAD(head, field) do {                        \
+    (head)->slh_first = ITEM_SLIST_FIRST(head)->field.sle_next;         \
+} while (0)
+
+#define ITEM_SLIST_REMOVE_AFTER(elm, field) do {                        \
+    (elm)->field.sle_next = ITEM_SLIST_NEXT(elm, field)->field.sle_next; \
+} while (0)
+
+#else
+
+#define ITEM_TAILQ_INIT(head)       TAILQ_INIT(head)
+#define ITEM_TAILQ_EMPTY(head)      TAILQ_EMPTY(head)
+#define ITEM_TAILQ_FIRST(head)      TAILQ_FIRST(head)
+#define ITEM_TAILQ_LAST(head)       TAILQ_LAST(head, item_tqh)
+#define ITEM_TAILQ_NEXT(elm, field) TAILQ_NEXT(elm, field)
+#define ITEM_TAILQ_PREV(elm, field) TAILQ_PREV(elm, item_tqh, field)
+
+#define ITEM_TAILQ_INSERT_HEAD(head, elm, field)                        \
+    TAILQ_INSERT_HEAD(head, elm, field)
+#define ITEM_TAILQ_INSERT_TAIL(head, elm, field)                        \
+    TAILQ_INSERT_TAIL(head, elm, field)
+#define ITEM_TAILQ_REMOVE(head, elm, field)                             \
+    TAILQ_REMOVE(head, elm, field)
+
+#define ITEM_TAILQ_FOREACH(var, head, field)                            \
+    TAILQ_FOREACH(var, head, field)
+#define ITEM_TAILQ_FOREACH_REVERSE_SAFE(var, head, field, tvar)         \
+    TAILQ_FOREACH_REVERSE_SAFE(var, head, item_tqh, field, tvar)
+
+#define ITEM_SLIST_INIT(head)       SLIST_INIT(head)
+#define ITEM_SLIST_FIRST(head)      SLIST_FIRST(head)
+#define ITEM_SLIST_NEXT(elm, field) SLIST_NEXT(elm, field)
+
+#define ITEM_SLIST_FIRST_VOLATILE(head)                                 \
+    (*(struct item * volatile *)&SLIST_FIRST(head))
+#define ITEM_SLIST_NEXT_VOLATILE(elm, field)                            \
+    (*(struct item * volatile *)&SLIST_NEXT(elm, field))
+
+#define ITEM_SLIST_INSERT_HEAD(head, elm, field) do {                   \
+    SLIST_NEXT(elm, field) = SLIST_FIRST(head);                         \
+    __sync_synchronize();                                               \
+    SLIST_FIRST(head) = (elm);                                          \
+} while (0)
+
+#define ITEM_SLIST_REMOVE_HEAD(head, field) SLIST_REMOVE_HEAD(head, field)
+#define ITEM_SLIST_REMOVE_AFTER(elm, field) SLIST_REMOVE_AFTER(elm, field)
+
+#endif
+
+#define ITEM_SLIST_REMOVE(head, elm, field) do {                        \
+    if (ITEM_SLIST_FIRST(head) == (elm)) {                              \
+        ITEM_SLIST_REMOVE_HEAD(head, field);                            \
+    } else {                                                            \
+        struct item *_curelm = ITEM_SLIST_FIRST(head);                  \
+        while (ITEM_SLIST_NEXT(_curelm, field) != (elm)) {              \
+            _curelm = ITEM_SLIST_NEXT(_curelm, field);                  \
+        }                                                               \
+        ITEM_SLIST_REMOVE_AFTER(_curelm, field);                        \
+    }                                                                   \
+} while (0)
+
+#define ITEM_SLIST_FOREACH(var, head, field)                            \
+    for ((var) = ITEM_SLIST_FIRST(head);                                \
+        (var);                                                          \
+        (var) = ITEM_SLIST_NEXT(var, field))
+
+#define ITEM_SLIST_FOREACH_SAFE(var, head, field, tvar)                 \
+    for ((var) = ITEM_SLIST_FIRST(head);                                \
+        (var) && ((tvar) = ITEM_SLIST_NEXT(var, field), 1);             \
+        (var) = (tvar))
 
 #define ITEM_MAGIC      0xfeedface
 #define ITEM_HDR_SIZE   offsetof(struct item, end)
@@ -260,13 +512,6 @@ item_has_q_inv_lease(struct item *it) {
 	return (it->flags & ITEM_Q_INV_LEASE);
 }
 
-static inline bool
-item_is_sess(struct item *it) {
-    ASSERT(it->magic == ITEM_MAGIC);
-
-	return (it->coflags & SESS);
-}
-
 static inline uint64_t
 item_cas(struct item *it)
 {
@@ -279,6 +524,20 @@ item_cas(struct item *it)
     return 0;
 }
 
+static inline bool
+item_has_lease_token(struct item *it) {
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	return (it->coflags & LEASE_TOKEN);
+}
+
+static inline void
+item_set_lease_token(struct item *it) {
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	it->coflags |= LEASE_TOKEN;
+}
+
 static inline void
 item_set_ptrans(struct item *it) {
 	ASSERT(it->magic == ITEM_MAGIC);
@@ -293,6 +552,20 @@ item_unset_ptrans(struct item *it) {
 	it->coflags &= ~PTRANS;
 }
 
+static inline bool
+item_is_companion(struct item *it) {
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	return (it->coflags & COMPANION);
+}
+
+static inline void
+item_set_companion(struct item *it) {
+	ASSERT(it->magic == ITEM_MAGIC);
+
+	it->coflags |= COMPANION;
+}
+
 static inline void
 item_set_hotkeys(struct item *it) {
 	ASSERT(it->magic == ITEM_MAGIC);
@@ -415,13 +688,6 @@ item_is_hotkeys(struct item *it) {
 	return (it->coflags & HK);
 }
 
-static inline void
-item_set_sess(struct item *it) {
-	ASSERT(it->magic == ITEM_MAGIC);
-
-	it->coflags |= SESS;
-}
-
 static inline bool
 item_is_co_lease_holder(struct item *it) {
 	ASSERT(it->magic == ITEM_MAGIC);
@@ -465,6 +731,22 @@ item_key(struct item *it)
     return key;
 }
 
+/*
+ * Key that it belongs to. A companion item (lease, pending, pending
+ * version, ptrans or co lease) belongs to the key it was built from.
+ */
+static inline char *
+item_base_key(struct item *it, uint8_t *nkey)
+{
+    if (item_is_companion(it)) {
+        *nkey = it->nkey - PREFIX_KEY_LEN;
+        return item_key(it) + PREFIX_KEY_LEN;
+    }
+
+    *nkey = it->nkey;
+    return item_key(it);
+}
+
 static inline size_t
 item_ntotal(uint8_t nkey, uint32_t nbyte, bool use_cas)
 {
@@ -485,22 +767,43 @@ item_size(struct item *it)
     return item_ntotal(it->nkey, it->nbyte, item_has_cas(it));
 }
 
-void item_init(void);
+rstatus_t item_init(void);
 void item_deinit(void);
 
+void item_lock_hash(uint32_t hash);
+bool item_hash_locked(uint32_t hash);
+void item_lock_global(void);
+void item_unlock(void);
+void item_lock_lruq(uint8_t id);
+void item_unlock_lruq(uint8_t id);
+bool item_evict_trylock(struct item *it);
+void item_evict_unlock(void);
+
 char * item_data(struct item *it);
 struct slab *item_2_slab(struct item *it);
+bool item_in_segment(struct item *it);
 
 void item_hdr_init(struct item *it, uint32_t offset, uint8_t id);
 
 uint8_t item_slabid(uint8_t nkey, uint32_t nbyte);
 struct item *item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime, uint32_t nbyte);
 struct item *item_alloc_config(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime, uint32_t nbyte, int32_t config_num);
+struct item *item_alloc_admit(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime, uint32_t nbyte, int32_t config_num, bool *rejected);
 
 void item_reuse(struct item *it);
+void item_segment_reuse(struct item *it);
 
 void item_delete(struct item *it);
 
+typedef bool (*item_stale_t)(struct item *it, void *arg);
+bool item_reap(struct item *it, item_stale_t stale, void *arg);
+uint32_t item_reap_slot(uint32_t slot, item_stale_t stale, void *arg, uint64_t *nreap, uint64_t *nbyte);
+uint32_t item_crawl(uint8_t id, bool reserved, struct item **cursor, uint32_t nscan, uint64_t *nreclaim, uint64_t *nbyte);
+uint32_t item_fragment_id(struct item *it, uint32_t nfragment);
+uint32_t item_drop_fragment(uint32_t fid, uint32_t nfragment);
+typedef void (*item_visit_t)(struct item *it, void *arg);
+bool item_visit(const char *key, size_t nkey, item_visit_t visit, void *arg);
+
 void item_remove(struct item *it);
 void item_touch(struct item *it);
 char *item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes);
@@ -508,6 +811,9 @@ char *item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes);
 struct item *item_get(const char *key, size_t nkey);
 void item_flush_expired(void);
 
+bool item_claim(struct item *it);
+void item_unclaim(struct item *it);
+
 void item_unset_pinned(struct item *it);
 void item_set_pinned(struct item *it);
 
@@ -523,6 +829,7 @@ item_co_result_t item_ciget(char* sid, size_t nsid, char *key, size_t nkey,
 rstatus_t item_get_and_unlease(char* key, uint8_t nkey, lease_token_t token_val, struct conn *c);
 
 item_store_result_t item_store(struct item *it, req_type_t type, struct conn *c);
+item_store_result_t item_import(struct item *it);
 item_delta_result_t item_add_delta(struct conn *c, char *key, size_t nkey, int incr, int64_t delta, char *buf);
 
 rstatus_t
@@ -547,6 +854,14 @@ item_co_result_t item_validate(char *sid, size_t nsid, struct conn *c);
 item_iq_result_t item_commit(char* tid, u_int32_t ntid, struct conn *c, int32_t pending, int32_t server_cfg_id);
 item_iq_result_t item_release(char* tid, u_int32_t ntid, struct conn *c);
 
+void item_iqget_batch(struct item_batch *batch, uint32_t n, struct conn *c);
+void item_quarantine_and_register_batch(char *tid, size_t ntid,
+		struct item_batch *batch, uint32_t n, struct conn *c);
+void item_quarantine_and_read_batch(char *tid, size_t ntid,
+		struct item_batch *batch, uint32_t n, struct conn *c);
+void item_commit_batch(struct item_batch *batch, uint32_t n, struct conn *c,
+		int32_t pending, int32_t server_cfg_id);
+
 void clean_session(char* sid, size_t nsid, struct conn* c);
 void abort_sessions(struct conn* c, struct item* colease_it, char* sid, size_t nsid);
 
@@ -559,11 +874,11 @@ _item_add_delta_iq(struct conn* c, char*key, size_t nkey, long delta);
 item_co_result_t
 _item_add_delta_co(struct conn* c, char*key, size_t nkey, long delta);
 
-void
-_item_assoc_key_tid(struct conn* c, struct item* trans_it, char *key, size_t nkey, char *tid, size_t ntid);
+rstatus_t
+_item_assoc_key_tid(struct trans* trans, char *key, size_t nkey, char *tid, size_t ntid);
 
-void
-_item_assoc_key_sid(struct conn* c, struct item* sess_it, char *key, size_t nkey, char *sid, size_t nsid);
+rstatus_t
+_item_assoc_key_sid(struct trans* sess, char *key, size_t nkey, char *sid, size_t nsid);
 
 item_iq_result_t
 item_iqincr_iqdecr(struct conn *c, char *key, size_t nkey, bool incr, int64_t delta, char *tid, size_t ntid,
@@ -613,9 +928,6 @@ void _item_assoc_tid_lease(struct conn* c, struct item* lease_it,
 void _item_remove_tid_lease(struct conn* c, struct item* lease_it,
 		char* key, size_t nkey, char *tid, size_t ntid);
 
-void _item_assoc_entry_to_list(struct conn* c, struct item* it,
-		char *entry_id, size_t entry_nid, char *key, size_t nkey);
-
 void _item_remove_entry_from_list(struct conn *c, struct item* it,
 		char* key, size_t nkey, char *entry_id, size_t entry_nid);
 
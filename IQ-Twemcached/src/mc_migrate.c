@@ -0,0 +1,621 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Fragment migration
+ *
+ * When a fragment is assigned to a new server, the server starts out cold
+ * and the backing store takes the misses. "migrate" streams every live item
+ * of a fragment from the server that used to own it to the new owner,
+ * which stores the items with "bulkset" unless it already cached or leased
+ * the key, both of which mean it has seen newer activity on the key.
+ *
+ * The stream runs on a background thread so that it never stalls an event
+ * loop. The keys of one fragment index slot at a time are copied out under
+ * the slot lock, and each item is then encoded under its item lock into a
+ * chunk of about MIGRATE_CHUNK bytes. A chunk goes out as one bulkset
+ * request, and the thread sleeps after each to keep within
+ * settings.migrate_rate bytes per second. Items that hold leases or are
+ * pending are left out, as their value is about to change.
+ *
+ * A bulkset payload is a sequence of records, all integers in network byte
+ * order:
+ *
+ *   uint8_t  nkey
+ *   uint32_t flags
+ *   uint32_t exptime, absolute unix time or 0 for no expiry
+ *   int32_t  configuration number the item was stored with
+ *   uint32_t nbyte
+ *   key, nkey bytes
+ *   data, nbyte bytes
+ */
+
+static pthread_mutex_t migrate_lock;    /* migrate thread and stats lock */
+static pthread_cond_t migrate_cond;     /* migrate thread condvar */
+static pthread_t migrate_tid;           /* migrate thread id */
+static volatile int run_migrate_thread; /* run migrate thread? */
+static volatile int migrate_wanted;     /* migration requested? */
+static bool migrate_started;            /* migrate thread started? */
+
+static struct migrate_stats mstats;     /* migrate stats */
+
+static uint32_t migrate_fid;                    /* fragment to migrate */
+static uint32_t migrate_nfragment;              /* # fragments in its table */
+static int32_t migrate_config;                  /* configuration of the peer */
+static char migrate_host[MIGRATE_HOST_LEN];     /* peer host */
+static char migrate_port[NI_MAXSERV];           /* peer port */
+
+static char *migrate_chunk;             /* chunk being filled */
+static size_t migrate_chunk_size;       /* chunk buffer size */
+static size_t migrate_chunk_len;        /* # bytes in chunk */
+static uint32_t migrate_chunk_nitem;    /* # items in chunk */
+
+static char *migrate_keys;              /* keys of a slot */
+static size_t migrate_keys_size;        /* key buffer size */
+
+static int
+migrate_connect(void)
+{
+    struct addrinfo hints, *ai, *next;
+    struct timeval tv;
+    int sd, error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    error = getaddrinfo(migrate_host, migrate_port, &hints, &ai);
+    if (error != 0) {
+        log_error("getaddrinfo '%s:%s' failed: %s", migrate_host,
+                  migrate_port, gai_strerror(error));
+        return -1;
+    }
+
+    sd = -1;
+    for (next = ai; next != NULL; next = next->ai_next) {
+        sd = socket(next->ai_family, next->ai_socktype, next->ai_protocol);
+        if (sd < 0) {
+            continue;
+        }
+
+        if (connect(sd, next->ai_addr, next->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(sd);
+        sd = -1;
+    }
+    freeaddrinfo(ai);
+
+    if (sd < 0) {
+        log_error("connect to '%s:%s' failed: %s", migrate_host, migrate_port,
+                  strerror(errno));
+        return -1;
+    }
+
+    /* a stuck peer must not hold up the migrate thread forever */
+    tv.tv_sec = MIGRATE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    mc_set_tcpnodelay(sd);
+
+    return sd;
+}
+
+static rstatus_t
+migrate_write(int sd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(sd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("write to '%s:%s' failed: %s", migrate_host, migrate_port,
+                      strerror(errno));
+            return MC_ERROR;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Read the peer's reply line and check that the chunk was taken
+ */
+static rstatus_t
+migrate_read_reply(int sd)
+{
+    char buf[128];
+    size_t len;
+    ssize_t n;
+
+    for (len = 0; len < sizeof(buf) - 1;) {
+        n = read(sd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            log_error("read from '%s:%s' failed: %s", migrate_host,
+                      migrate_port, n == 0 ? "eof" : strerror(errno));
+            return MC_ERROR;
+        }
+        len += (size_t)n;
+        buf[len] = '\0';
+
+        if (strstr(buf, CRLF) != NULL) {
+            break;
+        }
+    }
+
+    if (strncmp(buf, "STORED" CRLF, sizeof("STORED" CRLF) - 1) != 0) {
+        log_error("peer '%s:%s' refused chunk: %.*s", migrate_host,
+                  migrate_port, (int)len, buf);
+        return MC_ERROR;
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Send the chunk as one bulkset request and throttle
+ */
+static rstatus_t
+migrate_flush(int sd)
+{
+    char hdr[64];
+    int n;
+    rstatus_t status;
+
+    if (migrate_chunk_len == 0) {
+        return MC_OK;
+    }
+
+    n = snprintf(hdr, sizeof(hdr), "bulkset %"PRId32" %zu" CRLF,
+                 migrate_config, migrate_chunk_len);
+
+    status = migrate_write(sd, hdr, (size_t)n);
+    if (status == MC_OK) {
+        status = migrate_write(sd, migrate_chunk, migrate_chunk_len);
+    }
+    if (status == MC_OK) {
+        status = migrate_write(sd, CRLF, CRLF_LEN);
+    }
+    if (status == MC_OK) {
+        status = migrate_read_reply(sd);
+    }
+    if (status != MC_OK) {
+        return status;
+    }
+
+    pthread_mutex_lock(&migrate_lock);
+    mstats.item_sent += migrate_chunk_nitem;
+    mstats.byte_sent += migrate_chunk_len;
+    mstats.chunk_sent++;
+    pthread_mutex_unlock(&migrate_lock);
+
+    /* rate limit */
+    if (settings.migrate_rate > 0) {
+        usleep((useconds_t)((uint64_t)migrate_chunk_len * 1000000 /
+                            settings.migrate_rate));
+    }
+
+    migrate_chunk_len = 0;
+    migrate_chunk_nitem = 0;
+
+    return MC_OK;
+}
+
+/*
+ * Append a record for it to the chunk; called under the item lock. The
+ * chunk is flushed before it reaches MIGRATE_CHUNK bytes and has room for
+ * one more item of any size beyond that.
+ */
+static void
+migrate_record(struct item *it, void *arg)
+{
+    char *p;
+    uint32_t val;
+
+    ASSERT(migrate_chunk_len + MIGRATE_RECORD_HDR_SIZE + it->nkey +
+           it->nbyte <= migrate_chunk_size);
+
+    p = migrate_chunk + migrate_chunk_len;
+
+    *p++ = (char)it->nkey;
+    val = htonl(it->dataflags);
+    memcpy(p, &val, sizeof(val));
+    p += sizeof(val);
+    val = htonl(it->exptime == 0 ? 0 : (uint32_t)(time_started() + it->exptime));
+    memcpy(p, &val, sizeof(val));
+    p += sizeof(val);
+    val = htonl((uint32_t)it->config_number);
+    memcpy(p, &val, sizeof(val));
+    p += sizeof(val);
+    val = htonl(it->nbyte);
+    memcpy(p, &val, sizeof(val));
+    p += sizeof(val);
+    memcpy(p, item_key(it), it->nkey);
+    p += it->nkey;
+    memcpy(p, item_data(it), it->nbyte);
+    p += it->nbyte;
+
+    migrate_chunk_len = (size_t)(p - migrate_chunk);
+    migrate_chunk_nitem++;
+}
+
+/*
+ * Copy the keys of the fragment being migrated out of slot into
+ * migrate_keys as <nkey><key> pairs. Returns the # bytes copied, or -1 if
+ * the key buffer could not be grown.
+ */
+static ssize_t
+migrate_slot_keys(uint32_t slot, bool exact)
+{
+    struct item *it;
+    size_t len;
+    char *keys;
+
+    for (;;) {
+        fragment_slot_lock(slot);
+        for (len = 0, it = fragment_slot_head(slot); it != NULL;
+             it = ITEM_TAILQ_NEXT(it, f_tqe)) {
+            if (len + 1 + it->nkey > migrate_keys_size) {
+                break;
+            }
+
+            if (item_is_companion(it)) {
+                continue;
+            }
+
+            if (!exact && item_fragment_id(it, migrate_nfragment) !=
+                migrate_fid) {
+                continue;
+            }
+
+            migrate_keys[len] = (char)it->nkey;
+            memcpy(migrate_keys + len + 1, item_key(it), it->nkey);
+            len += 1 + it->nkey;
+        }
+        fragment_slot_unlock(slot);
+
+        if (it == NULL) {
+            return (ssize_t)len;
+        }
+
+        keys = mc_realloc(migrate_keys, 2 * migrate_keys_size);
+        if (keys == NULL) {
+            return -1;
+        }
+        migrate_keys = keys;
+        migrate_keys_size *= 2;
+    }
+}
+
+static rstatus_t
+migrate_fragment(void)
+{
+    uint32_t slot;
+    ssize_t len, i;
+    uint8_t nkey;
+    bool exact;
+    int sd;
+    rstatus_t status;
+
+    sd = migrate_connect();
+    if (sd < 0) {
+        return MC_ERROR;
+    }
+
+    exact = fragment_slot_exact(migrate_nfragment);
+    migrate_chunk_len = 0;
+    migrate_chunk_nitem = 0;
+    status = MC_OK;
+
+    for (slot = fragment_slot_first(migrate_fid, migrate_nfragment);
+         slot < FRAGMENT_NSLOT && status == MC_OK;
+         slot = fragment_slot_next(slot, migrate_nfragment)) {
+        if (!run_migrate_thread) {
+            status = MC_ERROR;
+            break;
+        }
+
+        len = migrate_slot_keys(slot, exact);
+        if (len < 0) {
+            status = MC_ENOMEM;
+            break;
+        }
+
+        for (i = 0; i < len; i += 1 + nkey) {
+            nkey = (uint8_t)migrate_keys[i];
+
+            if (migrate_chunk_len >= MIGRATE_CHUNK) {
+                status = migrate_flush(sd);
+                if (status != MC_OK) {
+                    break;
+                }
+            }
+
+            item_visit(migrate_keys + i + 1, nkey, migrate_record, NULL);
+        }
+    }
+
+    if (status == MC_OK) {
+        status = migrate_flush(sd);
+    }
+
+    close(sd);
+
+    return status;
+}
+
+static void *
+migrate_thread(void *arg)
+{
+    rstatus_t status;
+
+    if (thread_bind_background(THREAD_BACKGROUND_MIGRATOR) != MC_OK) {
+        log_error("migrate thread bind failed");
+        return NULL;
+    }
+
+    while (run_migrate_thread) {
+        pthread_mutex_lock(&migrate_lock);
+        while (run_migrate_thread && !migrate_wanted) {
+            pthread_cond_wait(&migrate_cond, &migrate_lock);
+        }
+        migrate_wanted = 0;
+        mstats.running = true;
+        mstats.fragment = migrate_fid;
+        mstats.nfragment = migrate_nfragment;
+        mstats.migration++;
+        mstats.start_ts = time_now();
+        pthread_mutex_unlock(&migrate_lock);
+
+        if (!run_migrate_thread) {
+            break;
+        }
+
+        loga("migrating fragment %"PRIu32" of %"PRIu32" to '%s:%s'",
+             migrate_fid, migrate_nfragment, migrate_host, migrate_port);
+
+        status = migrate_fragment();
+
+        pthread_mutex_lock(&migrate_lock);
+        mstats.running = false;
+        mstats.end_ts = time_now();
+        if (status == MC_OK) {
+            mstats.migration_done++;
+        } else {
+            mstats.migration_fail++;
+        }
+        pthread_mutex_unlock(&migrate_lock);
+
+        loga("migration of fragment %"PRIu32" to '%s:%s' %s", migrate_fid,
+             migrate_host, migrate_port, status == MC_OK ? "done" : "failed");
+    }
+
+    return NULL;
+}
+
+/*
+ * Start streaming fragment fid of a table of nfragment fragments to the
+ * peer at host:port, which is to store the items with configuration
+ * number config, or with its own configuration of each key if config is
+ * -1. Only one migration runs at a time.
+ */
+rstatus_t
+migrate_start(uint32_t fid, uint32_t nfragment, int32_t config,
+              const char *host, size_t nhost, const char *port, size_t nport)
+{
+    rstatus_t status;
+
+    ASSERT(fid < nfragment);
+
+    if (!migrate_started || nhost >= sizeof(migrate_host) ||
+        nport >= sizeof(migrate_port)) {
+        return MC_ERROR;
+    }
+
+    pthread_mutex_lock(&migrate_lock);
+    if (mstats.running || migrate_wanted) {
+        status = MC_ERROR;
+    } else {
+        migrate_fid = fid;
+        migrate_nfragment = nfragment;
+        migrate_config = config;
+        memcpy(migrate_host, host, nhost);
+        migrate_host[nhost] = '\0';
+        memcpy(migrate_port, port, nport);
+        migrate_port[nport] = '\0';
+        migrate_wanted = 1;
+        pthread_cond_signal(&migrate_cond);
+        status = MC_OK;
+    }
+    pthread_mutex_unlock(&migrate_lock);
+
+    return status;
+}
+
+/*
+ * Largest bulkset payload: room for a full chunk plus the largest item
+ */
+size_t
+migrate_chunk_max(void)
+{
+    return MIGRATE_CHUNK + MIGRATE_RECORD_HDR_SIZE + settings.slab_size;
+}
+
+/*
+ * Store the records of a bulkset payload with configuration number
+ * config, or with the configuration of each key if config is -1. Records
+ * that cannot be stored are skipped; a malformed payload is an error.
+ */
+rstatus_t
+migrate_import(const char *buf, uint32_t nbyte, int32_t config)
+{
+    const char *p, *key, *data;
+    uint32_t dataflags, exptime, nrecord, nimport, vlen, val;
+    uint8_t nkey, id;
+    struct item *it;
+    rstatus_t status;
+
+    status = MC_OK;
+    nrecord = 0;
+    nimport = 0;
+
+    for (p = buf; p < buf + nbyte; p = data + vlen) {
+        if ((size_t)(buf + nbyte - p) < MIGRATE_RECORD_HDR_SIZE) {
+            status = MC_ERROR;
+            break;
+        }
+
+        nkey = (uint8_t)*p++;
+        memcpy(&val, p, sizeof(val));
+        dataflags = ntohl(val);
+        p += sizeof(val);
+        memcpy(&val, p, sizeof(val));
+        exptime = ntohl(val);
+        /* the configuration the item was stored with is not needed here */
+        p += 2 * sizeof(val);
+        memcpy(&val, p, sizeof(val));
+        vlen = ntohl(val);
+        p += sizeof(val);
+
+        key = p;
+        data = key + nkey;
+        if (nkey == 0 || (size_t)(buf + nbyte - key) < (size_t)nkey + vlen) {
+            status = MC_ERROR;
+            break;
+        }
+
+        nrecord++;
+
+        if (exptime != 0 && time_reltime(exptime) <= time_now()) {
+            continue;
+        }
+
+        id = item_slabid(nkey, vlen);
+        if (id == SLABCLASS_INVALID_ID) {
+            continue;
+        }
+
+        it = item_alloc_config(id, (char *)key, nkey, dataflags,
+                               time_reltime(exptime), vlen,
+                               config != -1 ? config : fragment_config(key, nkey));
+        if (it == NULL) {
+            continue;
+        }
+
+        memcpy(item_data(it), data, vlen);
+        if (item_import(it) == STORED) {
+            nimport++;
+        }
+        item_remove(it);
+    }
+
+    pthread_mutex_lock(&migrate_lock);
+    mstats.item_received += nrecord;
+    mstats.item_imported += nimport;
+    pthread_mutex_unlock(&migrate_lock);
+
+    return status;
+}
+
+void
+migrate_get_stats(struct migrate_stats *stats)
+{
+    pthread_mutex_lock(&migrate_lock);
+    *stats = mstats;
+    pthread_mutex_unlock(&migrate_lock);
+}
+
+rstatus_t
+migrate_init(void)
+{
+    err_t err;
+
+    pthread_mutex_init(&migrate_lock, NULL);
+    pthread_cond_init(&migrate_cond, NULL);
+    memset(&mstats, 0, sizeof(mstats));
+
+    migrate_chunk_size = migrate_chunk_max();
+    migrate_chunk = mc_alloc(migrate_chunk_size);
+    if (migrate_chunk == NULL) {
+        return MC_ENOMEM;
+    }
+
+    migrate_keys_size = MIGRATE_CHUNK;
+    migrate_keys = mc_alloc(migrate_keys_size);
+    if (migrate_keys == NULL) {
+        return MC_ENOMEM;
+    }
+
+    run_migrate_thread = 1;
+    migrate_wanted = 0;
+
+    err = pthread_create(&migrate_tid, NULL, migrate_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    migrate_started = true;
+
+    return MC_OK;
+}
+
+void
+migrate_deinit(void)
+{
+    if (!migrate_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&migrate_lock);
+    run_migrate_thread = 0;
+    pthread_cond_signal(&migrate_cond);
+    pthread_mutex_unlock(&migrate_lock);
+
+    /* wait for the migrate thread to stop */
+    pthread_join(migrate_tid, NULL);
+    migrate_started = false;
+
+    mc_free(migrate_chunk);
+    mc_free(migrate_keys);
+}
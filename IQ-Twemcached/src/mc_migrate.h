@@ -0,0 +1,64 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_MIGRATE_H_
+#define _MC_MIGRATE_H_
+
+#define MIGRATE_DEFAULT_RATE    (32 * MB)   /* bytes streamed per sec */
+#define MIGRATE_CHUNK           (64 * KB)   /* bytes per bulkset chunk */
+#define MIGRATE_TIMEOUT         5           /* peer send/recv timeout in sec */
+#define MIGRATE_HOST_LEN        256         /* max peer host name length */
+#define MIGRATE_RECORD_HDR_SIZE 17          /* nkey, flags, exptime, config, nbyte */
+
+struct migrate_stats {
+    bool       running;         /* migration in progress? */
+    uint32_t   fragment;        /* fragment being migrated */
+    uint32_t   nfragment;       /* # fragments in its table */
+    uint64_t   migration;       /* # migrations started */
+    uint64_t   migration_done;  /* # migrations run to completion */
+    uint64_t   migration_fail;  /* # migrations cut short by an error */
+    uint64_t   item_sent;       /* # items streamed to peers */
+    uint64_t   byte_sent;       /* # bytes streamed to peers */
+    uint64_t   chunk_sent;      /* # bulkset chunks streamed to peers */
+    uint64_t   item_received;   /* # items received from peers */
+    uint64_t   item_imported;   /* # received items stored */
+    rel_time_t start_ts;        /* start time of the last migration */
+    rel_time_t end_ts;          /* end time of the last migration */
+};
+
+rstatus_t migrate_init(void);
+void migrate_deinit(void);
+rstatus_t migrate_start(uint32_t fid, uint32_t nfragment, int32_t config,
+                        const char *host, size_t nhost, const char *port,
+                        size_t nport);
+size_t migrate_chunk_max(void);
+rstatus_t migrate_import(const char *buf, uint32_t nbyte, int32_t config);
+void migrate_get_stats(struct migrate_stats *stats);
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Stale fragment reaper
+ *
+ * After a Rejig reconfiguration, items stored under an older configuration
+ * than the current configuration of their fragment are never served again,
+ * yet they hold on to memory until LRU pressure gets to them. The reaper
+ * thread is woken up on every configuration update and walks all slabs,
+ * unlinking such items so that their chunks go back to the free q right
+ * away rather than pushing hot items out.
+ *
+ * The walk is incremental: a batch of at most REAPER_BATCH items is
+ * scanned with only its slab pinned, and the thread sleeps between batches
+ * to keep within settings.reaper_rate items per second. Segments are not
+ * carved in items that can be walked this way, so with segment storage
+ * the reaper walks the fragment index instead, one index slot at a time
+ * under the global item lock. A configuration
+ * update that arrives in the middle of a pass restarts it with the new
+ * table. Items that are not stamped with a configuration (leases,
+ * transactions and sessions) are never reaped.
+ */
+
+static pthread_mutex_t reaper_lock;     /* reaper thread and stats lock */
+static pthread_cond_t reaper_cond;      /* reaper thread condvar */
+static pthread_t reaper_tid;            /* reaper thread id */
+static volatile int run_reaper_thread;  /* run reaper thread? */
+static volatile int reaper_wanted;      /* pass requested by an update? */
+static bool reaper_started;             /* reaper thread started? */
+
+static struct reaper_stats rstats;      /* reaper stats */
+
+static int32_t reaper_fconfig[FRAGMENT_MAX]; /* fragment table being reaped */
+static uint32_t reaper_nfragment;            /* # fragments in that table */
+
+/*
+ * An item is stale if it was stored before its fragment last moved to
+ * this server
+ */
+static bool
+reaper_item_stale(struct item *it, void *arg)
+{
+    uint32_t fid;
+
+    fid = item_fragment_id(it, reaper_nfragment);
+
+    return it->config_number < reaper_fconfig[fid];
+}
+
+/*
+ * Reap a batch of items of the sidx'th slab, starting at its idx'th item,
+ * and advance idx past the batch. Returns the # items scanned, which is 0
+ * once the slab has been scanned to its end, or -1 if there is no such
+ * slab, which ends the pass.
+ */
+static int
+reaper_batch(uint32_t sidx, uint32_t *idx)
+{
+    struct slab *slab;
+    uint32_t nitem, start, end, i, nreaped;
+    size_t size;
+
+    slab = slab_pin(sidx, &nitem);
+    if (slab == NULL) {
+        return -1;
+    }
+
+    start = *idx;
+    end = MIN(nitem, start + REAPER_BATCH);
+
+    if (start >= end) {
+        /* done, or a segment, which is not carved in items */
+        slab_release_refcount(slab);
+        return 0;
+    }
+
+    size = slab_item_size(slab->id);
+
+    for (nreaped = 0, i = start; i < end; i++) {
+        if (item_reap(slab_item(slab, i), reaper_item_stale, NULL)) {
+            nreaped++;
+        }
+    }
+
+    slab_release_refcount(slab);
+
+    pthread_mutex_lock(&reaper_lock);
+    rstats.item_scanned += end - start;
+    rstats.item_reaped += nreaped;
+    rstats.byte_reaped += nreaped * size;
+    pthread_mutex_unlock(&reaper_lock);
+
+    *idx = end;
+
+    return (int)(end - start);
+}
+
+/*
+ * Walk all the non-empty slots of the fragment index once; used instead
+ * of the slab walk with segment storage. Returns as reaper_pass.
+ */
+static bool
+reaper_pass_index(void)
+{
+    uint32_t slot, nitem, nscan, n;
+    uint64_t nbyte, nreaped, nbyte_reaped;
+
+    for (slot = 0, n = 0; slot < FRAGMENT_NSLOT; slot++) {
+        if (!run_reaper_thread || reaper_wanted) {
+            return false;
+        }
+
+        fragment_slot_stats(slot, &nitem, &nbyte);
+        if (nitem == 0) {
+            continue;
+        }
+
+        nreaped = 0;
+        nbyte_reaped = 0;
+        nscan = item_reap_slot(slot, reaper_item_stale, NULL, &nreaped,
+                               &nbyte_reaped);
+
+        pthread_mutex_lock(&reaper_lock);
+        rstats.item_scanned += nscan;
+        rstats.item_reaped += nreaped;
+        rstats.byte_reaped += nbyte_reaped;
+        pthread_mutex_unlock(&reaper_lock);
+
+        /* rate limit, a batch at a time */
+        n += nscan;
+        if (n >= REAPER_BATCH) {
+            usleep((useconds_t)((uint64_t)n * 1000000 / settings.reaper_rate));
+            n = 0;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Walk all slabs once. Returns false if the pass was cut short, either by
+ * a newer configuration or by shutdown.
+ */
+static bool
+reaper_pass(void)
+{
+    uint32_t sidx, idx;
+    int n;
+
+    fragment_snapshot(reaper_fconfig, &reaper_nfragment);
+    if (reaper_nfragment == 0) {
+        /* without a fragment table no item is stale */
+        return true;
+    }
+
+    if (settings.storage == STORAGE_SEGMENT) {
+        return reaper_pass_index();
+    }
+
+    for (sidx = 0, idx = 0;;) {
+        if (!run_reaper_thread || reaper_wanted) {
+            return false;
+        }
+
+        n = reaper_batch(sidx, &idx);
+        if (n < 0) {
+            break;
+        }
+
+        if (n == 0) {
+            sidx++;
+            idx = 0;
+
+            pthread_mutex_lock(&reaper_lock);
+            rstats.slab = sidx;
+            pthread_mutex_unlock(&reaper_lock);
+            continue;
+        }
+
+        /* rate limit */
+        usleep((useconds_t)((uint64_t)n * 1000000 / settings.reaper_rate));
+    }
+
+    return true;
+}
+
+static void *
+reaper_thread(void *arg)
+{
+    bool done;
+
+    if (thread_bind_background(THREAD_BACKGROUND_REAPER) != MC_OK) {
+        log_error("reaper thread bind failed");
+        return NULL;
+    }
+
+    while (run_reaper_thread) {
+        pthread_mutex_lock(&reaper_lock);
+        while (run_reaper_thread && !reaper_wanted) {
+            /* nothing is stale until the next configuration update */
+            pthread_cond_wait(&reaper_cond, &reaper_lock);
+        }
+        reaper_wanted = 0;
+        rstats.running = true;
+        rstats.pass++;
+        rstats.slab = 0;
+        rstats.pass_start_ts = time_now();
+        pthread_mutex_unlock(&reaper_lock);
+
+        if (!run_reaper_thread) {
+            break;
+        }
+
+        done = reaper_pass();
+
+        pthread_mutex_lock(&reaper_lock);
+        rstats.running = false;
+        if (done) {
+            rstats.pass_done++;
+            rstats.pass_end_ts = time_now();
+        } else if (reaper_wanted) {
+            rstats.pass_restart++;
+        }
+        pthread_mutex_unlock(&reaper_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Ask the reaper for a pass over all slabs; called on every configuration
+ * update. A pass in progress starts over with the new configuration.
+ */
+void
+reaper_wakeup(void)
+{
+    if (!reaper_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    reaper_wanted = 1;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+void
+reaper_get_stats(struct reaper_stats *stats)
+{
+    pthread_mutex_lock(&reaper_lock);
+    *stats = rstats;
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+rstatus_t
+reaper_init(void)
+{
+    err_t err;
+
+    pthread_mutex_init(&reaper_lock, NULL);
+    pthread_cond_init(&reaper_cond, NULL);
+    memset(&rstats, 0, sizeof(rstats));
+
+    if (settings.reaper_rate == 0) {
+        /* reaper is disabled */
+        return MC_OK;
+    }
+
+    run_reaper_thread = 1;
+    reaper_wanted = 0;
+
+    err = pthread_create(&reaper_tid, NULL, reaper_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    reaper_started = true;
+
+    return MC_OK;
+}
+
+void
+reaper_deinit(void)
+{
+    if (!reaper_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    run_reaper_thread = 0;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+
+    /* wait for the reaper thread to stop */
+    pthread_join(reaper_tid, NULL);
+    reaper_started = false;
+}
@@ -0,0 +1,365 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+extern uint8_t slabclass_max_id;
+
+/*
+ * Slab rebalancer
+ *
+ * A slab belongs to the class that first used it, and is only taken away
+ * by whole slab eviction, which picks slabs at random or in lru order and
+ * pays no heed to which classes are short of memory. When the mix of item
+ * sizes shifts, the classes of the old sizes keep their slabs while the
+ * new ones evict.
+ *
+ * The rebalancer thread wakes up every settings.rebalance_interval secs
+ * and looks at how many items each class evicted, or failed to allocate,
+ * since the last time. A class that had the most of those for
+ * REBALANCE_NWINDOW windows in a row gets one slab per window from a
+ * class that had none for as long, the one with the fewest hits per slab
+ * of those. A donor keeps at least REBALANCE_MIN_NSLAB slabs. Slabs move
+ * through slab_move, which evicts a slab just as memory pressure does.
+ *
+ * The same thread sizes the reserved lease heap against the main heap. A
+ * window in which the reserved heap found itself full, and had to evict
+ * leases or fail them, borrows up to REBALANCE_HEAP_NLEND slabs of the
+ * main heap. Slabs only go back after REBALANCE_NWINDOW windows in a row
+ * without reserved pressure, one per window, and only while the main heap
+ * is full and the reserved heap is less than REBALANCE_HEAP_LOW_PCT used
+ * without the slab. Neither heap goes below REBALANCE_HEAP_FLOOR_PCT of
+ * the slabs it started with. Slabs move through slab_heap_lend.
+ */
+
+static pthread_mutex_t rebalance_lock;      /* rebalancer thread and stats lock */
+static pthread_cond_t rebalance_cond;       /* rebalancer thread condvar */
+static pthread_t rebalance_tid;             /* rebalancer thread id */
+static volatile int run_rebalance_thread;   /* run rebalancer thread? */
+static bool rebalance_started;              /* rebalancer thread started? */
+
+static struct rebalance_stats rbstats;      /* rebalancer stats */
+
+static int64_t rebalance_evict[SLABCLASS_MAX_IDS];   /* item_evict at last window */
+static int64_t rebalance_error[SLABCLASS_MAX_IDS];   /* slab_error at last window */
+static int64_t rebalance_hit[SLABCLASS_MAX_IDS];     /* get_hit at last window */
+static uint32_t rebalance_cold[SLABCLASS_MAX_IDS];   /* # windows without pressure */
+
+static uint64_t rebalance_heap_full[2];     /* nfull of the main and reserved heap at last window */
+static uint32_t rebalance_heap_quiet;       /* # windows without reserved heap pressure */
+
+/*
+ * Take the counters of a window, and return the class that was under the
+ * most pressure in it, or 0 if none was. The hits of every class in the
+ * window are returned in hit.
+ */
+static uint8_t
+rebalance_window(int64_t *hit)
+{
+    int64_t evict[SLABCLASS_MAX_IDS], error[SLABCLASS_MAX_IDS];
+    int64_t get_hit[SLABCLASS_MAX_IDS], pressure, max;
+    uint8_t cid, hot;
+
+    stats_slab_snapshot(SLAB_item_evict, evict);
+    stats_slab_snapshot(SLAB_slab_error, error);
+    stats_slab_snapshot(SLAB_get_hit, get_hit);
+
+    for (hot = 0, max = 0, cid = SLABCLASS_MIN_ID; cid <= slabclass_max_id;
+         cid++) {
+        pressure = (evict[cid] - rebalance_evict[cid]) +
+                   (error[cid] - rebalance_error[cid]);
+        hit[cid] = get_hit[cid] - rebalance_hit[cid];
+
+        rebalance_evict[cid] = evict[cid];
+        rebalance_error[cid] = error[cid];
+        rebalance_hit[cid] = get_hit[cid];
+
+        if (pressure <= 0) {
+            rebalance_cold[cid]++;
+            continue;
+        }
+
+        rebalance_cold[cid] = 0;
+        if (pressure > max) {
+            max = pressure;
+            hot = cid;
+        }
+    }
+
+    return hot;
+}
+
+/*
+ * Return the class to take a slab from for class hot, or 0 if there is
+ * none
+ */
+static uint8_t
+rebalance_donor(uint8_t hot, const int64_t *hit)
+{
+    uint8_t cid, donor;
+    uint32_t nslab, donor_nslab;
+    int64_t donor_hit;
+
+    donor = 0;
+    donor_nslab = 1;
+    donor_hit = 0;
+
+    for (cid = SLABCLASS_MIN_ID; cid <= slabclass_max_id; cid++) {
+        if (cid == hot || rebalance_cold[cid] < REBALANCE_NWINDOW) {
+            continue;
+        }
+
+        nslab = slab_nslab(cid);
+        if (nslab <= REBALANCE_MIN_NSLAB) {
+            continue;
+        }
+
+        /* fewest hits per slab, compared as hit / nslab */
+        if (donor == 0 || hit[cid] * donor_nslab < donor_hit * nslab) {
+            donor = cid;
+            donor_nslab = nslab;
+            donor_hit = hit[cid];
+        }
+    }
+
+    return donor;
+}
+
+static void
+rebalance_run(void)
+{
+    int64_t hit[SLABCLASS_MAX_IDS];
+    uint8_t hot, donor;
+    rstatus_t status;
+
+    hot = rebalance_window(hit);
+
+    pthread_mutex_lock(&rebalance_lock);
+    rbstats.window++;
+    if (hot == 0) {
+        rbstats.hot_window = 0;
+    } else if (hot == rbstats.hot) {
+        rbstats.hot_window++;
+    } else {
+        rbstats.hot_window = 1;
+    }
+    rbstats.hot = hot;
+    pthread_mutex_unlock(&rebalance_lock);
+
+    if (hot == 0 || rbstats.hot_window < REBALANCE_NWINDOW) {
+        return;
+    }
+
+    donor = rebalance_donor(hot, hit);
+    if (donor == 0) {
+        return;
+    }
+
+    status = slab_move(donor, hot);
+    if (status == MC_EAGAIN) {
+        /* the hot class still has room in its current slab */
+        return;
+    }
+
+    pthread_mutex_lock(&rebalance_lock);
+    if (status == MC_OK) {
+        rbstats.move++;
+        rbstats.last_src = donor;
+        rbstats.last_dst = hot;
+        rbstats.last_ts = time_now();
+    } else {
+        rbstats.move_fail++;
+    }
+    pthread_mutex_unlock(&rebalance_lock);
+
+    log_debug(LOG_INFO, "rebalance slab from id %u to id %u %s", donor, hot,
+              status == MC_OK ? "done" : "failed");
+}
+
+static uint32_t
+rebalance_heap_floor(const struct slab_heap_stats *hs)
+{
+    return MAX(1, hs->init_nslab * REBALANCE_HEAP_FLOOR_PCT / 100);
+}
+
+static void
+rebalance_heap_run(void)
+{
+    struct slab_heap_stats main, reserved;
+    bool main_full, reserved_full;
+    uint32_t i, nlent;
+    rstatus_t status;
+
+    slab_heap_get_stats(false, &main);
+    slab_heap_get_stats(true, &reserved);
+
+    main_full = main.nfull > rebalance_heap_full[0];
+    reserved_full = reserved.nfull > rebalance_heap_full[1];
+    rebalance_heap_full[0] = main.nfull;
+    rebalance_heap_full[1] = reserved.nfull;
+
+    status = MC_OK;
+    nlent = 0;
+
+    if (reserved_full) {
+        rebalance_heap_quiet = 0;
+
+        for (i = 0; i < REBALANCE_HEAP_NLEND; i++) {
+            status = slab_heap_lend(true, rebalance_heap_floor(&main));
+            if (status != MC_OK) {
+                break;
+            }
+            nlent++;
+        }
+    } else if (++rebalance_heap_quiet >= REBALANCE_NWINDOW && main_full &&
+               reserved.used < (uint64_t)(reserved.max_nslab - 1) * slab_size() *
+                               REBALANCE_HEAP_LOW_PCT / 100) {
+        status = slab_heap_lend(false, rebalance_heap_floor(&reserved));
+        if (status == MC_OK) {
+            nlent++;
+        }
+    } else {
+        return;
+    }
+
+    pthread_mutex_lock(&rebalance_lock);
+    if (reserved_full) {
+        rbstats.heap_borrow += nlent;
+    } else {
+        rbstats.heap_lend += nlent;
+    }
+    if (status == MC_ERROR) {
+        rbstats.heap_fail++;
+    }
+    pthread_mutex_unlock(&rebalance_lock);
+
+    log_debug(LOG_INFO, "rebalance %"PRIu32" slabs to %s heap", nlent,
+              reserved_full ? "reserved" : "main");
+}
+
+static void *
+rebalance_thread(void *arg)
+{
+    struct timespec ts;
+
+    if (thread_bind_background(THREAD_BACKGROUND_REBALANCER) != MC_OK) {
+        log_error("rebalancer thread bind failed");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rebalance_lock);
+    while (run_rebalance_thread) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += settings.rebalance_interval;
+        while (run_rebalance_thread &&
+               pthread_cond_timedwait(&rebalance_cond, &rebalance_lock,
+                                      &ts) != ETIMEDOUT) {
+            /* woken up early, but only deinit signals us */
+        }
+
+        if (!run_rebalance_thread) {
+            break;
+        }
+
+        pthread_mutex_unlock(&rebalance_lock);
+
+        /* without aggregated stats there is nothing to go by */
+        if (stats_enabled()) {
+            rebalance_run();
+        }
+
+        if (slab_has_reserved_slabs()) {
+            rebalance_heap_run();
+        }
+
+        pthread_mutex_lock(&rebalance_lock);
+    }
+    pthread_mutex_unlock(&rebalance_lock);
+
+    return NULL;
+}
+
+void
+rebalance_get_stats(struct rebalance_stats *stats)
+{
+    pthread_mutex_lock(&rebalance_lock);
+    *stats = rbstats;
+    pthread_mutex_unlock(&rebalance_lock);
+}
+
+rstatus_t
+rebalance_init(void)
+{
+    err_t err;
+
+    pthread_mutex_init(&rebalance_lock, NULL);
+    pthread_cond_init(&rebalance_cond, NULL);
+    memset(&rbstats, 0, sizeof(rbstats));
+    memset(rebalance_heap_full, 0, sizeof(rebalance_heap_full));
+    rebalance_heap_quiet = 0;
+
+    if (settings.rebalance_interval == 0) {
+        /* rebalancer is disabled */
+        return MC_OK;
+    }
+
+    if (settings.storage == STORAGE_SEGMENT) {
+        /* segments belong to no class */
+        return MC_OK;
+    }
+
+    run_rebalance_thread = 1;
+
+    err = pthread_create(&rebalance_tid, NULL, rebalance_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    rebalance_started = true;
+
+    return MC_OK;
+}
+
+void
+rebalance_deinit(void)
+{
+    if (!rebalance_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&rebalance_lock);
+    run_rebalance_thread = 0;
+    pthread_cond_signal(&rebalance_cond);
+    pthread_mutex_unlock(&rebalance_lock);
+
+    /* wait for the rebalancer thread to stop */
+    pthread_join(rebalance_tid, NULL);
+    rebalance_started = false;
+}
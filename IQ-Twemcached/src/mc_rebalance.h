@@ -0,0 +1,58 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_REBALANCE_H_
+#define _MC_REBALANCE_H_
+
+#define REBALANCE_DEFAULT_INTERVAL 0    /* secs between decisions, 0 for off */
+#define REBALANCE_NWINDOW          3    /* # windows a class stays hot or cold */
+#define REBALANCE_MIN_NSLAB        2    /* # slabs a donor class keeps */
+#define REBALANCE_HEAP_NLEND       4    /* max # slabs lent to the reserved heap per window */
+#define REBALANCE_HEAP_LOW_PCT     50   /* reserved heap use below which it lends slabs back */
+#define REBALANCE_HEAP_FLOOR_PCT   25   /* % of its initial slabs a heap keeps */
+
+struct rebalance_stats {
+    uint64_t   window;        /* # decision windows */
+    uint64_t   move;          /* # slabs moved */
+    uint64_t   move_fail;     /* # moves that found no evictable slab */
+    uint8_t    hot;           /* class with the most evictions, 0 if none */
+    uint32_t   hot_window;    /* # windows in a row it has been hottest */
+    uint8_t    last_src;      /* class the last slab moved out of */
+    uint8_t    last_dst;      /* class the last slab moved into */
+    rel_time_t last_ts;       /* time of the last move */
+    uint64_t   heap_borrow;   /* # slabs lent to the reserved heap */
+    uint64_t   heap_lend;     /* # slabs lent back to the main heap */
+    uint64_t   heap_fail;     /* # lends that found no slab to take */
+};
+
+rstatus_t rebalance_init(void);
+void rebalance_deinit(void);
+void rebalance_get_stats(struct rebalance_stats *stats);
+
+#endif
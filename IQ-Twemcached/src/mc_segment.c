@@ -0,0 +1,608 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+extern pthread_mutex_t slab_lock;
+
+/*
+ * Segment storage
+ *
+ * With --storage=segment, items other than lease items are not carved
+ * out of slab classes, but appended, each at its own size rounded up to
+ * MC_ALIGNMENT, to segments. A segment is a slab of the heap that takes
+ * items of one ttl bucket only: bucket 0 takes items that never expire,
+ * and bucket b > 0 items with a ttl in [2^(b-1), 2^b) secs. A segment
+ * takes items until it is full, or for 2^(b-1) secs, whichever comes
+ * first, and is then sealed. So the items of a sealed segment all expire
+ * within a few ttls of each other, and the segment expires as a whole
+ * when the last of them does.
+ *
+ *   ttl bucket q:   +-----------+    +-----------+    +-----------+
+ *                   | sealed    | -> | sealed    | -> | active    |
+ *                   +-----------+    +-----------+    +-----------+
+ *                   ^ oldest, expires first           ^ takes appends
+ *
+ * Items are never freed back into a segment. A freed item only counts
+ * down the live items of its segment, and a sealed segment with none left
+ * is free for reuse right away. Otherwise, space comes back only when a
+ * whole segment is cleared: the expiry thread clears sealed segments at
+ * the head of each bucket q once they expire, and on memory pressure the
+ * oldest segment that has none of its items in use is cleared. Clearing
+ * unlinks all the items of a segment from the hash, just as slab eviction
+ * does for a slab; there is no per-item lru q to keep.
+ *
+ * The hash keeps pointing at items in their segment. Lease items still
+ * come from the reserved slabs (see slab_get_reserved_item), as they have
+ * to stay put for as long as their lease is held.
+ */
+
+TAILQ_HEAD(segment_tqh, segment);
+
+struct segment {
+    struct slab          *slab;    /* backing slab */
+    uint32_t             wpos;     /* offset of the next append into slab data */
+    uint32_t             nlive;    /* # items appended and not yet freed */
+    uint32_t             nbyte;    /* # bytes of those items */
+    rel_time_t           ctime;    /* time the segment took its first item */
+    rel_time_t           exptime;  /* latest expiry of its items */
+    uint8_t              bucket;   /* ttl bucket */
+    bool                 sealed;   /* takes no more items? */
+    TAILQ_ENTRY(segment) b_tqe;    /* link in ttl bucket q or free q */
+    TAILQ_ENTRY(segment) a_tqe;    /* link in age q */
+};
+
+static struct segment *seg_table;                       /* segments by id - 1 */
+static uint32_t seg_max;                                /* max # segments */
+static uint32_t seg_nsegment;                           /* # segments with a slab */
+static struct segment_tqh seg_freeq;                    /* free segments */
+static struct segment_tqh seg_bucketq[SEGMENT_NBUCKET]; /* segments by ttl bucket */
+static struct segment *seg_active[SEGMENT_NBUCKET];     /* segment taking items */
+static struct segment_tqh seg_ageq;                     /* segments in use, oldest first */
+static struct segment_stats segstats;                   /* segment stats */
+
+static pthread_mutex_t segment_expire_lock;     /* expiry thread lock */
+static pthread_cond_t segment_expire_cond;      /* expiry thread condvar */
+static pthread_t segment_expire_tid;            /* expiry thread id */
+static volatile int run_segment_expire_thread;  /* run expiry thread? */
+static bool segment_expire_started;             /* expiry thread started? */
+
+/*
+ * Return the ttl bucket of an item that expires at exptime
+ */
+static uint8_t
+segment_bucket(rel_time_t exptime)
+{
+    rel_time_t now;
+    uint32_t ttl;
+    uint8_t bucket;
+
+    if (exptime == 0) {
+        return 0;
+    }
+
+    now = time_now();
+    ttl = exptime > now ? exptime - now : 1;
+
+    for (bucket = 1; ttl > 1 && bucket < SEGMENT_NBUCKET - 1; ttl >>= 1) {
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/*
+ * Does the segment still take items of size bytes?
+ */
+static bool
+segment_writable(struct segment *seg, size_t size)
+{
+    if (seg->wpos + size > slab_size()) {
+        return false;
+    }
+
+    if (seg->bucket != 0 &&
+        time_now() - seg->ctime >= (rel_time_t)1 << (seg->bucket - 1)) {
+        return false;
+    }
+
+    return true;
+}
+
+static struct segment *
+segment_of(struct item *it)
+{
+    struct slab *slab = item_2_slab(it);
+
+    ASSERT(slab->sid != 0 && slab->sid <= seg_nsegment);
+
+    return &seg_table[slab->sid - 1];
+}
+
+static size_t
+segment_item_size(struct item *it)
+{
+    return MC_ALIGN(item_size(it), MC_ALIGNMENT);
+}
+
+/*
+ * Take a segment out of use and put it on the free q
+ */
+static void
+segment_free(struct segment *seg)
+{
+    ASSERT(seg->nlive == 0);
+
+    if (seg_active[seg->bucket] == seg) {
+        seg_active[seg->bucket] = NULL;
+    }
+
+    TAILQ_REMOVE(&seg_bucketq[seg->bucket], seg, b_tqe);
+    TAILQ_REMOVE(&seg_ageq, seg, a_tqe);
+
+    seg->wpos = 0;
+    seg->nbyte = 0;
+    seg->sealed = false;
+
+    TAILQ_INSERT_TAIL(&seg_freeq, seg, b_tqe);
+    segstats.nfree++;
+}
+
+/*
+ * Seal a segment, freeing it if none of its items is left
+ */
+static void
+segment_seal(struct segment *seg)
+{
+    ASSERT(!seg->sealed);
+
+    seg->sealed = true;
+    if (seg_active[seg->bucket] == seg) {
+        seg_active[seg->bucket] = NULL;
+    }
+
+    if (seg->nlive == 0) {
+        segment_free(seg);
+    }
+}
+
+/*
+ * Lock all the items appended to the segment for clearing. Freed items
+ * are left alone; all the others must be linked, have their stripe held
+ * and be claimed, as in slab_evict_lock.
+ */
+static bool
+segment_clear_lock(struct segment *seg)
+{
+    struct item *it, *end;
+    struct item *jt;
+
+    end = (struct item *)(seg->slab->data + seg->wpos);
+
+    for (it = (struct item *)seg->slab->data; it < end;
+         it = (struct item *)((uint8_t *)it + segment_item_size(it))) {
+        if (item_is_slabbed(it)) {
+            continue;
+        }
+
+        /* unlinked items that are not freed are in transit */
+        if (!item_is_linked(it) || !item_evict_trylock(it) ||
+            !item_is_linked(it)) {
+            return false;
+        }
+    }
+
+    if (seg->slab->refcount != 0) {
+        return false;
+    }
+
+    for (it = (struct item *)seg->slab->data; it < end;
+         it = (struct item *)((uint8_t *)it + segment_item_size(it))) {
+        if (item_is_slabbed(it) || item_claim(it)) {
+            continue;
+        }
+
+        for (jt = (struct item *)seg->slab->data; jt < it;
+             jt = (struct item *)((uint8_t *)jt + segment_item_size(jt))) {
+            if (!item_is_slabbed(jt)) {
+                item_unclaim(jt);
+            }
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Clear a segment by unlinking all its items, and put it on the free q.
+ * Fails, leaving the segment untouched, if any of its items is in use.
+ * Must be called with the slab_lock held.
+ */
+static bool
+segment_clear(struct segment *seg)
+{
+    struct item *it, *end;
+
+    if (!segment_clear_lock(seg)) {
+        item_evict_unlock();
+        return false;
+    }
+
+    end = (struct item *)(seg->slab->data + seg->wpos);
+
+    for (it = (struct item *)seg->slab->data; it < end;
+         it = (struct item *)((uint8_t *)it + segment_item_size(it))) {
+        if (!item_is_slabbed(it)) {
+            item_segment_reuse(it);
+        }
+    }
+
+    item_evict_unlock();
+
+    /* lock-free gets may still be looking at the items we just unlinked */
+    thread_epoch_synchronize();
+
+    seg->nlive = 0;
+    segment_free(seg);
+
+    return true;
+}
+
+/*
+ * Clear the oldest expired segment, or on memory pressure, the oldest
+ * segment whose items are not in use. Must be called with the slab_lock
+ * held.
+ */
+static bool
+segment_evict(void)
+{
+    struct segment *seg, *next;
+    rel_time_t now;
+    uint32_t tries;
+    uint8_t bucket;
+
+    now = time_now();
+
+    for (bucket = 1; bucket < SEGMENT_NBUCKET; bucket++) {
+        seg = TAILQ_FIRST(&seg_bucketq[bucket]);
+        if (seg != NULL && seg->sealed && seg->exptime < now &&
+            segment_clear(seg)) {
+            segstats.expire++;
+            return true;
+        }
+    }
+
+    if (settings.evict_opt == 0) {
+        return false;
+    }
+
+    for (tries = SEGMENT_EVICT_MAX_TRIES, seg = TAILQ_FIRST(&seg_ageq);
+         tries > 0 && seg != NULL; tries--, seg = next) {
+        next = TAILQ_NEXT(seg, a_tqe);
+
+        if (seg->slab->refcount != 0) {
+            continue;
+        }
+
+        log_debug(LOG_DEBUG, "evicting segment %u of bucket %u",
+                  seg->slab->sid, seg->bucket);
+
+        if (segment_clear(seg)) {
+            segstats.evict++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Get a segment for ttl bucket, off the free q, the heap, or by clearing
+ * one. Must be called with the slab_lock held.
+ */
+static struct segment *
+segment_get(uint8_t bucket)
+{
+    struct segment *seg;
+    struct slab *slab;
+
+    if (TAILQ_EMPTY(&seg_freeq) && seg_nsegment < seg_max) {
+        slab = slab_get_segment(seg_nsegment + 1);
+        if (slab != NULL) {
+            seg = &seg_table[seg_nsegment++];
+            seg->slab = slab;
+            TAILQ_INSERT_TAIL(&seg_freeq, seg, b_tqe);
+            segstats.nfree++;
+        }
+    }
+
+    if (TAILQ_EMPTY(&seg_freeq) && !segment_evict()) {
+        segstats.evict_fail++;
+        return NULL;
+    }
+
+    seg = TAILQ_FIRST(&seg_freeq);
+    TAILQ_REMOVE(&seg_freeq, seg, b_tqe);
+    segstats.nfree--;
+
+    seg->wpos = 0;
+    seg->nlive = 0;
+    seg->nbyte = 0;
+    seg->ctime = time_now();
+    seg->exptime = 0;
+    seg->bucket = bucket;
+    seg->sealed = false;
+
+    TAILQ_INSERT_TAIL(&seg_bucketq[bucket], seg, b_tqe);
+    TAILQ_INSERT_TAIL(&seg_ageq, seg, a_tqe);
+    seg_active[bucket] = seg;
+
+    log_debug(LOG_VERB, "new segment %u for bucket %u", seg->slab->sid,
+              bucket);
+
+    return seg;
+}
+
+/*
+ * Append an item with key and value of the given sizes, which expires at
+ * exptime, to the segment of its ttl bucket. The item comes back as
+ * slab_get_item returns it, with the slab refcount of its segment taken,
+ * or NULL if there is no room.
+ */
+struct item *
+segment_get_item(uint8_t id, uint8_t nkey, uint32_t nbyte, rel_time_t exptime)
+{
+    struct segment *seg;
+    struct item *it;
+    size_t size;
+    uint8_t bucket;
+
+    size = MC_ALIGN(item_ntotal(nkey, nbyte, settings.use_cas), MC_ALIGNMENT);
+    bucket = segment_bucket(exptime);
+
+    pthread_mutex_lock(&slab_lock);
+
+    seg = seg_active[bucket];
+    if (seg != NULL && !segment_writable(seg, size)) {
+        segment_seal(seg);
+        seg = NULL;
+    }
+
+    if (seg == NULL) {
+        seg = segment_get(bucket);
+        if (seg == NULL) {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+    }
+
+    it = (struct item *)(seg->slab->data + seg->wpos);
+    item_hdr_init(it, (uint32_t)((uint8_t *)it - (uint8_t *)seg->slab), id);
+
+    /* a segment is walked by item size, so it must be set right away */
+    it->flags = settings.use_cas ? ITEM_CAS : 0;
+    it->nkey = nkey;
+    it->nbyte = nbyte;
+
+    seg->wpos += size;
+    seg->nlive++;
+    seg->nbyte += size;
+    if (bucket != 0) {
+        seg->exptime = MAX(seg->exptime, exptime);
+    }
+
+    slab_acquire_refcount(seg->slab);
+
+    pthread_mutex_unlock(&slab_lock);
+
+    return it;
+}
+
+/*
+ * Free an item of a segment. Its chunk is only reused along with the
+ * whole segment, so it is marked as freed for segment_clear to skip.
+ */
+void
+segment_put_item(struct item *it)
+{
+    struct segment *seg;
+
+    ASSERT(!item_is_linked(it));
+    ASSERT(!item_is_slabbed(it));
+    ASSERT(it->refcount == 0);
+
+    pthread_mutex_lock(&slab_lock);
+
+    seg = segment_of(it);
+
+    ASSERT(seg->nlive > 0);
+
+    it->flags |= ITEM_SLABBED;
+    seg->nlive--;
+    seg->nbyte -= segment_item_size(it);
+
+    stats_slab_incr(it->id, item_remove);
+
+    if (seg->sealed && seg->nlive == 0) {
+        segment_free(seg);
+    }
+
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Seal the segments that stopped taking items, and clear the sealed
+ * segments at the head of each ttl bucket q that have expired
+ */
+static void
+segment_expire_run(void)
+{
+    struct segment *seg;
+    uint8_t bucket;
+    bool cleared;
+
+    for (bucket = 1; bucket < SEGMENT_NBUCKET; bucket++) {
+        do {
+            cleared = false;
+
+            pthread_mutex_lock(&slab_lock);
+
+            seg = seg_active[bucket];
+            if (seg != NULL && !segment_writable(seg, 0)) {
+                segment_seal(seg);
+            }
+
+            seg = TAILQ_FIRST(&seg_bucketq[bucket]);
+            if (seg != NULL && seg->sealed && seg->exptime < time_now() &&
+                segment_clear(seg)) {
+                segstats.expire++;
+                cleared = true;
+            }
+
+            pthread_mutex_unlock(&slab_lock);
+        } while (cleared);
+    }
+}
+
+static void *
+segment_expire_thread(void *arg)
+{
+    struct timespec ts;
+
+    if (thread_bind_background(THREAD_BACKGROUND_SEGMENT) != MC_OK) {
+        log_error("segment expiry thread bind failed");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&segment_expire_lock);
+    while (run_segment_expire_thread) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += SEGMENT_EXPIRE_INTERVAL;
+        while (run_segment_expire_thread &&
+               pthread_cond_timedwait(&segment_expire_cond,
+                                      &segment_expire_lock, &ts) != ETIMEDOUT) {
+            /* woken up early, but only deinit signals us */
+        }
+
+        if (!run_segment_expire_thread) {
+            break;
+        }
+
+        pthread_mutex_unlock(&segment_expire_lock);
+
+        segment_expire_run();
+
+        pthread_mutex_lock(&segment_expire_lock);
+    }
+    pthread_mutex_unlock(&segment_expire_lock);
+
+    return NULL;
+}
+
+void
+segment_get_stats(struct segment_stats *stats)
+{
+    struct segment *seg;
+
+    pthread_mutex_lock(&slab_lock);
+
+    *stats = segstats;
+    stats->nsegment = seg_nsegment;
+    TAILQ_FOREACH(seg, &seg_ageq, a_tqe) {
+        stats->nitem += seg->nlive;
+        stats->nbyte += seg->nbyte;
+        stats->nused += seg->wpos;
+    }
+
+    pthread_mutex_unlock(&slab_lock);
+}
+
+rstatus_t
+segment_init(void)
+{
+    err_t err;
+    uint8_t bucket;
+
+    pthread_mutex_init(&segment_expire_lock, NULL);
+    pthread_cond_init(&segment_expire_cond, NULL);
+    memset(&segstats, 0, sizeof(segstats));
+
+    seg_nsegment = 0;
+    TAILQ_INIT(&seg_freeq);
+    TAILQ_INIT(&seg_ageq);
+    for (bucket = 0; bucket < SEGMENT_NBUCKET; bucket++) {
+        TAILQ_INIT(&seg_bucketq[bucket]);
+        seg_active[bucket] = NULL;
+    }
+
+    if (settings.storage != STORAGE_SEGMENT) {
+        return MC_OK;
+    }
+
+    /* segments take all of the heap that slab classes would */
+    seg_max = settings.maxbytes / settings.slab_size;
+    seg_table = mc_zalloc(sizeof(*seg_table) * MAX(seg_max, 1));
+    if (seg_table == NULL) {
+        log_error("create of segment table with %"PRIu32" entries failed: "
+                  "%s", seg_max, strerror(errno));
+        return MC_ENOMEM;
+    }
+
+    run_segment_expire_thread = 1;
+
+    err = pthread_create(&segment_expire_tid, NULL, segment_expire_thread,
+                         NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    segment_expire_started = true;
+
+    return MC_OK;
+}
+
+void
+segment_deinit(void)
+{
+    if (!segment_expire_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&segment_expire_lock);
+    run_segment_expire_thread = 0;
+    pthread_cond_signal(&segment_expire_cond);
+    pthread_mutex_unlock(&segment_expire_lock);
+
+    /* wait for the expiry thread to stop */
+    pthread_join(segment_expire_tid, NULL);
+    segment_expire_started = false;
+}
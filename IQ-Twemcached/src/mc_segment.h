@@ -0,0 +1,60 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_SEGMENT_H_
+#define _MC_SEGMENT_H_
+
+typedef enum storage_type {
+    STORAGE_SLAB,           /* items in equal sized chunks of slab classes */
+    STORAGE_SEGMENT,        /* items appended to ttl bucketed segments */
+} storage_type_t;
+
+#define SEGMENT_NBUCKET          32     /* # ttl buckets, bucket 0 never expires */
+#define SEGMENT_EVICT_MAX_TRIES  50     /* # oldest segments tried on eviction */
+#define SEGMENT_EXPIRE_INTERVAL  1      /* secs between expiry passes */
+
+struct segment_stats {
+    uint32_t   nsegment;      /* # segments carved out of the heap */
+    uint32_t   nfree;         /* # segments free for reuse */
+    uint64_t   nitem;         /* # items not yet freed in segments */
+    uint64_t   nbyte;         /* # bytes of those items */
+    uint64_t   nused;         /* # bytes appended to segments in use */
+    uint64_t   expire;        /* # segments cleared as they expired */
+    uint64_t   evict;         /* # segments cleared for room */
+    uint64_t   evict_fail;    /* # allocations that found no segment to clear */
+};
+
+rstatus_t segment_init(void);
+void segment_deinit(void);
+void segment_get_stats(struct segment_stats *stats);
+
+struct item *segment_get_item(uint8_t id, uint8_t nkey, uint32_t nbyte, rel_time_t exptime);
+void segment_put_item(struct item *it);
+
+#endif
@@ -32,15 +32,20 @@
 #include <mc_core.h>
 
 extern struct settings settings;
-extern pthread_mutex_t cache_lock;
 
 struct slab_heapinfo {
     uint8_t         *base;       /* prealloc base */
     uint8_t         *curr;       /* prealloc start */
+    uint8_t         *end;        /* prealloc end */
     uint32_t        nslab;       /* # slab allocated */
     uint32_t        max_nslab;   /* max # slab allowed */
+    uint32_t        init_nslab;  /* max # slab allowed at start */
     struct slab     **slab_table;/* table of all slabs */
     struct slab_tqh slab_lruq;   /* lru slab q */
+    uint32_t        nfree_slab;  /* # free slab q */
+    struct slab_tqh free_slabq;  /* slabs lent by the other heap, not used yet */
+    uint64_t        nfull;       /* # slab requests that found the heap full */
+    uint64_t        nerror;      /* # slab requests that failed */
 };
 
 struct slabclass slabclass[SLABCLASS_MAX_IDS];  /* collection of slabs bucketed by slabclass */
@@ -52,8 +57,16 @@ pthread_mutex_t slab_lock;                      /* lock protecting slabclass and
 struct slabclass 			reserved_slabclass[SLABCLASS_MAX_IDS];	/* collection of slabs bucketed by reserved slabclass */
 static struct slab_heapinfo reserved_heapinfo;           			/* info of all allocated reserved slabs */
 
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+struct slab **slab_ref_table;                   /* slabs by ref, see item_ref */
+uint32_t item_ref_shift;                        /* # item offset bits of a ref */
+static uint32_t slab_nref;                      /* # slabs in slab_ref_table */
+static uint32_t slab_max_nref;                  /* max # slabs in slab_ref_table */
+#endif
+
 #define SLAB_RAND_MAX_TRIES         50
 #define SLAB_LRU_MAX_TRIES          50
+#define SLAB_CLOCK_MAX_PASSES       50
 #define SLAB_LRU_UPDATE_INTERVAL    1
 
 /*
@@ -66,7 +79,7 @@ slab_size(void)
     return settings.slab_size - SLAB_HDR_SIZE;
 }
 
-inline bool
+bool
 slab_has_reserved_slabs(void)
 {
 	return settings.reserved_percentage > 0;
@@ -92,21 +105,23 @@ slab_print(void)
     }
 }
 
+/*
+ * Slab refcount is shared by items that hash to different item lock
+ * stripes, so it is updated atomically
+ */
 void
 slab_acquire_refcount(struct slab *slab)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(slab->magic == SLAB_MAGIC);
-    slab->refcount++;
+    __sync_fetch_and_add(&slab->refcount, 1);
 }
 
 void
 slab_release_refcount(struct slab *slab)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(slab->magic == SLAB_MAGIC);
     ASSERT(slab->refcount > 0);
-    slab->refcount--;
+    __sync_fetch_and_sub(&slab->refcount, 1);
 }
 
 /*
@@ -225,9 +240,10 @@ slab_slabclass_init(struct settings *target_settings)
 
         p->nitem = nitem;
         p->size = item_sz;
+        p->nslab = 0;
 
         p->nfree_itemq = 0;
-        TAILQ_INIT(&p->free_itemq);
+        ITEM_TAILQ_INIT(&p->free_itemq);
 
         p->nfree_item = 0;
         p->free_item = NULL;
@@ -242,9 +258,10 @@ slab_slabclass_init(struct settings *target_settings)
 
     	p->nitem = nitem;
     	p->size = item_sz;
+    	p->nslab = 0;
 
     	p->nfree_itemq = 0;
-    	TAILQ_INIT(&p->free_itemq);
+    	ITEM_TAILQ_INIT(&p->free_itemq);
 
     	p->nfree_item = 0;
     	p->free_item = NULL;
@@ -268,8 +285,21 @@ slab_slabclass_deinit(void)
 static rstatus_t
 _slab_heapinfo_init(struct settings* target_settings, size_t maxbytes, struct slab_heapinfo* target_heapinfo)
 {
+    uint32_t max_ntable;
+
     target_heapinfo->nslab = 0;
     target_heapinfo->max_nslab = maxbytes / target_settings->slab_size;
+    target_heapinfo->init_nslab = target_heapinfo->max_nslab;
+    target_heapinfo->nfree_slab = 0;
+    target_heapinfo->nfull = 0;
+    target_heapinfo->nerror = 0;
+    TAILQ_INIT(&target_heapinfo->free_slabq);
+
+    /* slabs lent between the heaps take a slot in the table of the borrower */
+    max_ntable = target_settings->maxbytes / target_settings->slab_size;
+    if (slab_has_reserved_slabs()) {
+        max_ntable += target_settings->reserved_maxbytes / target_settings->slab_size;
+    }
 
     target_heapinfo->base = NULL;
     if (target_settings->prealloc) {
@@ -285,17 +315,19 @@ _slab_heapinfo_init(struct settings* target_settings, size_t maxbytes, struct sl
                   target_settings->maxbytes, target_heapinfo->max_nslab);
     }
     target_heapinfo->curr = target_heapinfo->base;
+    target_heapinfo->end = target_heapinfo->base +
+                           (size_t)target_heapinfo->max_nslab * target_settings->slab_size;
 
-    target_heapinfo->slab_table = mc_alloc(sizeof(*target_heapinfo->slab_table) * target_heapinfo->max_nslab);
+    target_heapinfo->slab_table = mc_alloc(sizeof(*target_heapinfo->slab_table) * max_ntable);
     if (target_heapinfo->slab_table == NULL) {
         log_error("create of slab table with %"PRIu32" entries failed: %s",
-                  target_heapinfo->max_nslab, strerror(errno));
+                  max_ntable, strerror(errno));
         return MC_ENOMEM;
     }
     TAILQ_INIT(&target_heapinfo->slab_lruq);
 
     log_debug(LOG_VVERB, "created slab table with %"PRIu32" entries",
-    		target_heapinfo->max_nslab);
+    		max_ntable);
 
     return MC_OK;
 }
@@ -321,6 +353,71 @@ slab_heapinfo_deinit(void)
 {
 }
 
+/*
+ * Create the slab ref table for up to max_nslab slabs, which compact item
+ * links index. A link splits its 32 bits into a slab slot and an item
+ * offset in MC_ALIGNMENT units, so that fewer slabs fit in the table the
+ * larger a slab is.
+ */
+rstatus_t
+slab_ref_init(uint32_t max_nslab)
+{
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+    uint32_t shift;
+
+    for (shift = 0; ((size_t)1 << shift) * MC_ALIGNMENT < settings.slab_size;
+         shift++) {
+        /* low bits of a ref address every aligned offset of a slab */
+    }
+
+    if (shift >= 32 || max_nslab > (1ULL << (32 - shift))) {
+        log_error("compact items address at most %zu MB with %zu byte slabs",
+                  (size_t)(((1ULL << 32) * MC_ALIGNMENT) / MB),
+                  settings.slab_size);
+        return MC_ERROR;
+    }
+
+    slab_ref_table = mc_alloc(sizeof(*slab_ref_table) * MAX(max_nslab, 1));
+    if (slab_ref_table == NULL) {
+        log_error("create of slab ref table with %"PRIu32" entries failed: "
+                  "%s", max_nslab, strerror(errno));
+        return MC_ENOMEM;
+    }
+    item_ref_shift = shift;
+    slab_nref = 0;
+    slab_max_nref = max_nslab;
+#endif
+
+    return MC_OK;
+}
+
+void
+slab_ref_deinit(void)
+{
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+    if (slab_ref_table != NULL) {
+        mc_free(slab_ref_table);
+        slab_ref_table = NULL;
+    }
+#endif
+}
+
+/*
+ * Give a new slab its slot in the slab ref table; the slot never changes,
+ * as slabs are never freed.
+ */
+void
+slab_ref_add(struct slab *slab)
+{
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+    ASSERT(slab_nref < slab_max_nref);
+
+    slab->ref = slab_nref;
+    slab_ref_table[slab_nref] = slab;
+    slab_nref++;
+#endif
+}
+
 /*
  * Initialize the slab module
  */
@@ -335,6 +432,9 @@ slab_init(void)
     if (status == MC_OK) {
     	status = slab_reserved_heapinfo_init();
     }
+    if (status == MC_OK) {
+        status = slab_ref_init(heapinfo.max_nslab + reserved_heapinfo.max_nslab);
+    }
 
     return status;
 }
@@ -342,6 +442,7 @@ slab_init(void)
 void
 slab_deinit(void)
 {
+    slab_ref_deinit();
     slab_heapinfo_deinit();
     slab_slabclass_deinit();
 }
@@ -353,8 +454,9 @@ slab_hdr_init(struct slab *slab, uint8_t id, uint8_t max_id)
 
     slab->magic = SLAB_MAGIC;
     slab->id = id;
-    slab->unused = 0;
+    slab->accessed = 0;
     slab->refcount = 0;
+    slab->sid = 0;
 }
 
 static bool
@@ -369,6 +471,10 @@ slab_heap_alloc(struct settings* target_settings, struct slab_heapinfo* target_h
     struct slab *slab;
 
     if (target_settings->prealloc) {
+        /* slabs lent out of a preallocated heap are taken from its end */
+        if (target_heapinfo->curr >= target_heapinfo->end) {
+            return NULL;
+        }
         slab = (struct slab *)target_heapinfo->curr;
         target_heapinfo->curr += target_settings->slab_size;
     } else {
@@ -420,7 +526,28 @@ slab_lruq_remove(struct slab *slab, struct slab_heapinfo* target_heapinfo)
 }
 
 /*
- * Get a raw slab from the slab pool.
+ * Remove a slab from the slab table, by moving the last slab into its
+ * slot. Only slabs lent to the other heap leave the table, which a slab
+ * table walker may miss a slab for.
+ */
+static void
+slab_table_remove(struct slab *slab, struct slab_heapinfo* target_heapinfo)
+{
+    uint32_t i;
+
+    for (i = 0; i < target_heapinfo->nslab; i++) {
+        if (target_heapinfo->slab_table[i] == slab) {
+            break;
+        }
+    }
+    ASSERT(i < target_heapinfo->nslab);
+
+    target_heapinfo->nslab--;
+    target_heapinfo->slab_table[i] = target_heapinfo->slab_table[target_heapinfo->nslab];
+}
+
+/*
+ * Get a raw slab from the slab pool, a slab lent by the other heap first.
  */
 static struct slab *
 slab_get_new(struct settings* target_settings, struct slab_heapinfo* target_heapinfo)
@@ -431,11 +558,20 @@ slab_get_new(struct settings* target_settings, struct slab_heapinfo* target_heap
     	return NULL;
     }
 
+    slab = TAILQ_FIRST(&target_heapinfo->free_slabq);
+    if (slab != NULL) {
+        TAILQ_REMOVE(&target_heapinfo->free_slabq, slab, s_tqe);
+        target_heapinfo->nfree_slab--;
+        slab_table_update(slab, target_heapinfo);
+        return slab;
+    }
+
     slab = slab_heap_alloc(target_settings, target_heapinfo);
     if (slab == NULL) {
         return NULL;
     }
 
+    slab_ref_add(slab);
     slab_table_update(slab, target_heapinfo);
 
     return slab;
@@ -457,17 +593,99 @@ _slab_unlink_lruq(struct slab *slab, struct slab_heapinfo* target_heapinfo)
     slab_lruq_remove(slab, target_heapinfo);
 }
 
+/*
+ * Return the # items carved out of a slab so far. Only the current slab
+ * of a class is partially carved, up to its next free item.
+ */
+static uint32_t
+slab_nitem(struct slab *slab, struct slabclass* target_slabclass)
+{
+    struct slabclass *p = &target_slabclass[slab->id];
+
+    if (p->free_item != NULL && slab == item_2_slab(p->free_item)) {
+        return (uint32_t)((uint8_t *)p->free_item - slab->data) / p->size;
+    }
+
+    return p->nitem;
+}
+
+/*
+ * Lock all the items that are carved out of the slab for eviction. Items
+ * in the free Q are protected by the slab_lock, which we hold; linked
+ * items are protected by their item lock stripe, which we trylock (never
+ * wait on, as we already hold the slab_lock). The slab is only evictable
+ * if every carved item is either in the free Q or linked with its stripe
+ * held, and every linked item can be claimed, as lock-free gets may
+ * reference items without holding their stripe.
+ */
+static bool
+slab_evict_lock(struct slab *slab,
+		struct settings* target_settings,
+		struct slabclass* target_slabclass)
+{
+    struct slabclass *p;
+    struct item *it;
+    uint32_t i, j, nitem;
+
+    p = &target_slabclass[slab->id];
+
+    nitem = slab_nitem(slab, target_slabclass);
+
+    for (i = 0; i < nitem; i++) {
+        it = slab_2_item(slab, i, p->size, target_settings);
+
+        if (item_is_slabbed(it)) {
+            continue;
+        }
+
+        /* unlinked items that are not in the free Q are in transit */
+        if (!item_is_linked(it) || !item_evict_trylock(it)) {
+            return false;
+        }
+
+        if (!item_is_linked(it)) {
+            return false;
+        }
+    }
+
+    if (slab->refcount != 0) {
+        return false;
+    }
+
+    for (i = 0; i < nitem; i++) {
+        it = slab_2_item(slab, i, p->size, target_settings);
+
+        if (item_is_slabbed(it) || item_claim(it)) {
+            continue;
+        }
+
+        for (j = 0; j < i; j++) {
+            it = slab_2_item(slab, j, p->size, target_settings);
+            if (!item_is_slabbed(it)) {
+                item_unclaim(it);
+            }
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
 /*
  * Evict a slab by evicting all the items within it. This means that the
  * items that are carved out of the slab must either be deleted from their
  * a) hash + lru Q, or b) free Q. The candidate slab itself must also be
  * delinked from its respective slab pool so that it is available for reuse.
  *
+ * Eviction fails, leaving the slab untouched, if any of its items is in
+ * use by another thread.
+ *
  * Eviction complexity is O(#items/slab).
  *
  * TODO: handle when gumballs and transient items are contained in evicted slab
  */
-static void
+static bool
 slab_evict_one(struct slab *slab,
 		struct settings* target_settings,
 		struct slabclass* target_slabclass,
@@ -479,6 +697,11 @@ slab_evict_one(struct slab *slab,
 
     p = &target_slabclass[slab->id];
 
+    if (!slab_evict_lock(slab, target_settings, target_slabclass)) {
+        item_evict_unlock();
+        return false;
+    }
+
     /* candidate slab is also the current slab */
     if (p->free_item != NULL && slab == item_2_slab(p->free_item)) {
         p->nfree_item = 0;
@@ -490,7 +713,6 @@ slab_evict_one(struct slab *slab,
         it = slab_2_item(slab, i, p->size, target_settings);
 
         ASSERT(it->magic == ITEM_MAGIC);
-        ASSERT(it->refcount == 0);
         ASSERT(it->offset != 0);
 
         if (item_is_linked(it)) {
@@ -505,32 +727,41 @@ slab_evict_one(struct slab *slab,
 //            }
         } else if (item_is_slabbed(it)) {
             ASSERT(slab == item_2_slab(it));
-            ASSERT(!TAILQ_EMPTY(&p->free_itemq));
+            ASSERT(!ITEM_TAILQ_EMPTY(&p->free_itemq));
 
             it->flags &= ~ITEM_SLABBED;
 
             ASSERT(p->nfree_itemq > 0);
             p->nfree_itemq--;
-            TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
+            ITEM_TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
             stats_slab_decr(slab->id, item_free);
         }
     }
 
+    item_evict_unlock();
+
+    /* lock-free gets may still be looking at the items we just unlinked */
+    thread_epoch_synchronize();
+
     /* unlink the slab from its class */
     slab_lruq_remove(slab, target_heapinfo);
+    p->nslab--;
 
     stats_slab_incr(slab->id, slab_evict);
     stats_slab_decr(slab->id, slab_curr);
     stats_slab_settime(slab->id, slab_evict_ts, time_now());
+
+    return true;
 }
 
 /*
  * Get a random slab from all active slabs and evict it for new allocation.
  *
  * Note that the slab_table enables us to have O(1) lookup for every slab in
- * the system. The inserts into the table are just appends - O(1) and there
- * are no deletes from the slab_table. These two constraints allows us to keep
- * our random choice uniform.
+ * the system. The inserts into the table are just appends - O(1) and the
+ * only deletes are swaps with the last slab, when a slab is lent to the
+ * other heap. These two constraints allows us to keep our random choice
+ * uniform.
  */
 static struct slab *
 slab_evict_rand(struct settings* target_settings,
@@ -540,27 +771,32 @@ slab_evict_rand(struct settings* target_settings,
     struct slab *slab;
     uint32_t tries;
 
-    tries = SLAB_RAND_MAX_TRIES;
-    do {
-        slab = slab_table_rand(target_heapinfo);
-        tries--;
-    } while (tries > 0 && slab->refcount != 0);
-
-    if (tries == 0) {
-        /* all randomly chosen slabs are in use */
+    if (target_heapinfo->nslab == 0) {
         return NULL;
     }
 
-    log_debug(LOG_DEBUG, "random-evicting slab %p with id %u", slab, slab->id);
-    //printf("random-evicting slab %p with id %u\n", slab, slab->id);
+    for (tries = SLAB_RAND_MAX_TRIES; tries > 0; tries--) {
+        slab = slab_table_rand(target_heapinfo);
+        if (slab->refcount != 0) {
+            continue;
+        }
 
-    slab_evict_one(slab, target_settings, target_slabclass, target_heapinfo);
+        log_debug(LOG_DEBUG, "random-evicting slab %p with id %u", slab, slab->id);
 
-    return slab;
+        if (slab_evict_one(slab, target_settings, target_slabclass, target_heapinfo)) {
+            return slab;
+        }
+    }
+
+    /* all randomly chosen slabs are in use */
+    return NULL;
 }
 
 /*
  * Evict by looking into least recently used queue of all slabs.
+ *
+ * With clock eviction, hits mark a slab instead of moving it, and a
+ * marked slab is passed over to the tail, as items are in the item lru q.
  */
 static struct slab *
 slab_evict_lru(
@@ -569,28 +805,40 @@ slab_evict_lru(
 		struct slabclass* 		target_slabclass,
 		struct slab_heapinfo* 	target_heapinfo)
 {
-    struct slab *slab;
-    uint32_t tries;
+    struct slab *slab, *next;
+    uint32_t tries, nleft;
 
+    nleft = (target_settings->evict_opt & EVICT_CLOCK) ? SLAB_CLOCK_MAX_PASSES : 0;
 
     for (tries = SLAB_LRU_MAX_TRIES, slab = slab_lruq_head(target_heapinfo);
          tries > 0 && slab != NULL;
-         tries--, slab = TAILQ_NEXT(slab, s_tqe)) {
-        if (slab->refcount == 0) {
-            break;
+         tries--, slab = next) {
+        next = TAILQ_NEXT(slab, s_tqe);
+
+        if (slab->refcount != 0) {
+            continue;
         }
-    }
 
-    if (tries == 0 || slab == NULL) {
-        return NULL;
-    }
+        if (slab->accessed && nleft > 0) {
+            slab->accessed = 0;
+            _slab_unlink_lruq(slab, target_heapinfo);
+            _slab_link_lruq(slab, target_heapinfo);
+            if (next == NULL) {
+                next = slab;
+            }
+            nleft--;
+            tries++;
+            continue;
+        }
 
-    log_debug(LOG_DEBUG, "lru-evicting slab %p with id %u", slab, slab->id);
-    //printf("lru-evicting slab %p with id %u\n", slab, slab->id);
+        log_debug(LOG_DEBUG, "lru-evicting slab %p with id %u", slab, slab->id);
 
-    slab_evict_one(slab, target_settings, target_slabclass, target_heapinfo);
+        if (slab_evict_one(slab, target_settings, target_slabclass, target_heapinfo)) {
+            return slab;
+        }
+    }
 
-    return slab;
+    return NULL;
 }
 
 /*
@@ -628,6 +876,7 @@ slab_add_one(
     }
 
     /* make this slab as the current slab */
+    p->nslab++;
     p->nfree_item = p->nitem;
     p->free_item = (struct item *)&slab->data[0];
 
@@ -657,9 +906,12 @@ slab_get(
     stats_slab_settime(id, slab_req_ts, time_now());
 
     ASSERT(target_slabclass[id].free_item == NULL);
-    ASSERT(TAILQ_EMPTY(&target_slabclass[id].free_itemq));
+    ASSERT(ITEM_TAILQ_EMPTY(&target_slabclass[id].free_itemq));
 
     slab = slab_get_new(target_settings, target_heapinfo);
+    if (slab == NULL) {
+        target_heapinfo->nfull++;
+    }
 
     if (slab == NULL && (target_settings->evict_opt & (EVICT_CS | EVICT_AS))) {
         slab = slab_evict_lru(id, target_settings, target_slabclass, target_heapinfo);
@@ -677,6 +929,7 @@ slab_get(
     } else {
         stats_slab_incr(id, slab_error);
         stats_slab_settime(id, slab_error_ts, time_now());
+        target_heapinfo->nerror++;
 
         status = MC_ENOMEM;
     }
@@ -699,7 +952,9 @@ slab_get_evict(
     stats_slab_settime(id, slab_req_ts, time_now());
 
     ASSERT(target_slabclass[id].free_item == NULL);
-    ASSERT(TAILQ_EMPTY(&target_slabclass[id].free_itemq));
+    ASSERT(ITEM_TAILQ_EMPTY(&target_slabclass[id].free_itemq));
+
+    target_heapinfo->nfull++;
 
 	slab = slab_evict_rand(target_settings, target_slabclass, target_heapinfo);
 
@@ -711,6 +966,7 @@ slab_get_evict(
     } else {
         stats_slab_incr(id, slab_error);
         stats_slab_settime(id, slab_error_ts, time_now());
+        target_heapinfo->nerror++;
 
         status = MC_ENOMEM;
     }
@@ -738,7 +994,7 @@ _slab_get_item_from_freeq(
         return NULL;
     }
 
-    it = TAILQ_FIRST(&p->free_itemq);
+    it = ITEM_TAILQ_FIRST(&p->free_itemq);
 
     ASSERT(it->magic == ITEM_MAGIC);
     ASSERT(item_is_slabbed(it));
@@ -748,7 +1004,7 @@ _slab_get_item_from_freeq(
 
     ASSERT(p->nfree_itemq > 0);
     p->nfree_itemq--;
-    TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
+    ITEM_TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
     stats_slab_decr(id, item_free);
 
     log_debug(LOG_VERB, "get free q it '%.*s' at offset %"PRIu32" with id "
@@ -845,6 +1101,19 @@ _slab_get_item_by_evict_slab(
     return it;
 }
 
+/*
+ * Refcount the slab of an item that is handed out to the item layer. This
+ * is done while holding the slab_lock, so that the slab cannot be evicted
+ * before the item is refcounted by its new owner.
+ */
+static void
+slab_pin_item(struct item *it)
+{
+    if (it != NULL) {
+        slab_acquire_refcount(item_2_slab(it));
+    }
+}
+
 struct item *
 slab_get_item(uint8_t id)
 {
@@ -854,6 +1123,7 @@ slab_get_item(uint8_t id)
 
     pthread_mutex_lock(&slab_lock);
     it = _slab_get_item(id, &settings, slabclass, &heapinfo, slabclass_max_id);
+    slab_pin_item(it);
     pthread_mutex_unlock(&slab_lock);
 
     return it;
@@ -868,6 +1138,7 @@ slab_get_item_by_evict_slab(uint8_t id)
 
     pthread_mutex_lock(&slab_lock);
     it = _slab_get_item_by_evict_slab(id, &settings, slabclass, &heapinfo, slabclass_max_id);
+    slab_pin_item(it);
     pthread_mutex_unlock(&slab_lock);
 
     return it;
@@ -882,6 +1153,7 @@ slab_get_item_by_evict_reserved_slab(uint8_t id)
 
     pthread_mutex_lock(&slab_lock);
     it = _slab_get_item_by_evict_slab(id, &settings, reserved_slabclass, &reserved_heapinfo, slabclass_max_id);
+    slab_pin_item(it);
     pthread_mutex_unlock(&slab_lock);
 
     return it;
@@ -905,6 +1177,7 @@ slab_get_reserved_item(uint8_t id, bool lock_slab)
     } else {
     	it = _slab_get_item(id, &settings, slabclass, &heapinfo, slabclass_max_id);
     }
+    slab_pin_item(it);
 
     if (lock_slab) {
     	pthread_mutex_unlock(&slab_lock);
@@ -914,6 +1187,308 @@ slab_get_reserved_item(uint8_t id, bool lock_slab)
 }
 
 
+/*
+ * Move a slab out of class src into class dst, for the slab rebalancer.
+ * The oldest slab of src that can be evicted is evicted as on memory
+ * pressure, which leaves slabs with items in use alone, pinned lease
+ * items included, and becomes the current slab of dst. Only a class that
+ * has carved all of its current slab takes a slab, so that no partly
+ * carved slab is left behind.
+ */
+rstatus_t
+slab_move(uint8_t src, uint8_t dst)
+{
+    struct slab *slab, *next;
+    uint32_t tries;
+    rstatus_t status;
+
+    ASSERT(src >= SLABCLASS_MIN_ID && src <= slabclass_max_id);
+    ASSERT(dst >= SLABCLASS_MIN_ID && dst <= slabclass_max_id);
+    ASSERT(src != dst);
+
+    pthread_mutex_lock(&slab_lock);
+
+    if (slabclass[dst].free_item != NULL || slabclass[src].nslab <= 1) {
+        pthread_mutex_unlock(&slab_lock);
+        return MC_EAGAIN;
+    }
+
+    status = MC_ERROR;
+
+    for (tries = SLAB_LRU_MAX_TRIES, slab = slab_lruq_head(&heapinfo);
+         tries > 0 && slab != NULL; slab = next) {
+        next = TAILQ_NEXT(slab, s_tqe);
+
+        if (slab->id != src) {
+            continue;
+        }
+
+        tries--;
+
+        if (slab->refcount != 0) {
+            continue;
+        }
+
+        log_debug(LOG_INFO, "rebalance-moving slab %p from id %u to id %u",
+                  slab, src, dst);
+
+        if (slab_evict_one(slab, &settings, slabclass, &heapinfo)) {
+            slab_add_one(slab, dst, &settings, slabclass, &heapinfo,
+                         slabclass_max_id);
+            stats_slab_incr(src, slab_move_out);
+            stats_slab_incr(dst, slab_move_in);
+            status = MC_OK;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&slab_lock);
+
+    return status;
+}
+
+/*
+ * Return the # slabs of class id
+ */
+uint32_t
+slab_nslab(uint8_t id)
+{
+    uint32_t nslab;
+
+    pthread_mutex_lock(&slab_lock);
+    nslab = slabclass[id].nslab;
+    pthread_mutex_unlock(&slab_lock);
+
+    return nslab;
+}
+
+/*
+ * Take a slab out of the lender heap for the borrower heap, from, in
+ * order, the slabs the lender was lent and has not used, the unallocated
+ * part of the lender heap, and the oldest lender slab that can be evicted.
+ * A class is never left without a slab.
+ */
+static struct slab *
+slab_heap_take(struct slabclass *lender_slabclass,
+               struct slab_heapinfo *lender)
+{
+    struct slab *slab, *next;
+    uint32_t tries;
+
+    slab = TAILQ_FIRST(&lender->free_slabq);
+    if (slab != NULL) {
+        TAILQ_REMOVE(&lender->free_slabq, slab, s_tqe);
+        lender->nfree_slab--;
+        return slab;
+    }
+
+    if (lender->nslab < lender->max_nslab) {
+        slab = slab_heap_alloc(&settings, lender);
+        if (slab != NULL) {
+            slab_ref_add(slab);
+            return slab;
+        }
+    }
+
+    for (tries = SLAB_LRU_MAX_TRIES, slab = slab_lruq_head(lender);
+         tries > 0 && slab != NULL; tries--, slab = next) {
+        next = TAILQ_NEXT(slab, s_tqe);
+
+        if (slab->refcount != 0 || lender_slabclass[slab->id].nslab <= 1) {
+            continue;
+        }
+
+        if (slab_evict_one(slab, &settings, lender_slabclass, lender)) {
+            slab_table_remove(slab, lender);
+            return slab;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Lend a slab of the main heap to the reserved lease heap when to_reserved
+ * is true, or the other way around otherwise. The lent slab is kept in the
+ * free slab q of the borrower until the borrower runs out of slabs, and
+ * moves the max # slabs of the two heaps along with it. Heaps never
+ * shrink below the floor # slabs.
+ */
+rstatus_t
+slab_heap_lend(bool to_reserved, uint32_t floor)
+{
+    struct slabclass *lender_slabclass;
+    struct slab_heapinfo *lender, *borrower;
+    struct slab *slab;
+
+    if (!slab_has_reserved_slabs()) {
+        return MC_ERROR;
+    }
+
+    if (to_reserved) {
+        lender_slabclass = slabclass;
+        lender = &heapinfo;
+        borrower = &reserved_heapinfo;
+    } else {
+        lender_slabclass = reserved_slabclass;
+        lender = &reserved_heapinfo;
+        borrower = &heapinfo;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+
+    if (lender->max_nslab <= floor) {
+        pthread_mutex_unlock(&slab_lock);
+        return MC_EAGAIN;
+    }
+
+    slab = slab_heap_take(lender_slabclass, lender);
+    if (slab == NULL) {
+        pthread_mutex_unlock(&slab_lock);
+        return MC_ERROR;
+    }
+
+    lender->max_nslab--;
+    borrower->max_nslab++;
+
+    TAILQ_INSERT_TAIL(&borrower->free_slabq, slab, s_tqe);
+    borrower->nfree_slab++;
+
+    pthread_mutex_unlock(&slab_lock);
+
+    log_debug(LOG_INFO, "lent slab %p to %s heap", slab,
+              to_reserved ? "reserved" : "main");
+
+    return MC_OK;
+}
+
+/*
+ * Get the sizing and pressure of the main heap, or of the reserved lease
+ * heap when reserved is true. Used bytes are the item chunks that are
+ * carved out and not in a free q.
+ */
+void
+slab_heap_get_stats(bool reserved, struct slab_heap_stats *hs)
+{
+    struct slabclass *target_slabclass;
+    struct slab_heapinfo *target_heapinfo;
+    struct slabclass *p;
+    uint8_t id;
+
+    if (reserved) {
+        target_slabclass = reserved_slabclass;
+        target_heapinfo = &reserved_heapinfo;
+    } else {
+        target_slabclass = slabclass;
+        target_heapinfo = &heapinfo;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+
+    hs->nslab = target_heapinfo->nslab;
+    hs->max_nslab = target_heapinfo->max_nslab;
+    hs->init_nslab = target_heapinfo->init_nslab;
+    hs->nfree_slab = target_heapinfo->nfree_slab;
+    hs->nfull = target_heapinfo->nfull;
+    hs->nerror = target_heapinfo->nerror;
+    hs->used = 0;
+
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        p = &target_slabclass[id];
+        if (p->nslab == 0) {
+            continue;
+        }
+        hs->used += ((uint64_t)p->nslab * p->nitem - p->nfree_itemq -
+                     p->nfree_item) * p->size;
+    }
+
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Pin the sidx'th slab of the slab table and return it along with the #
+ * items carved out of it, or NULL if there are not that many slabs. A
+ * pinned slab is never evicted, so its items stay where they are, though
+ * they may still be freed and reused. This lets a background walker visit
+ * items without holding the slab_lock; unpin with slab_release_refcount.
+ */
+struct slab *
+slab_pin(uint32_t sidx, uint32_t *nitem)
+{
+    struct slab *slab;
+
+    pthread_mutex_lock(&slab_lock);
+
+    if (sidx >= heapinfo.nslab) {
+        pthread_mutex_unlock(&slab_lock);
+        return NULL;
+    }
+
+    slab = heapinfo.slab_table[sidx];
+    slab_acquire_refcount(slab);
+    /* segments are not carved in equal sized items */
+    *nitem = slab->sid != 0 ? 0 : slab_nitem(slab, slabclass);
+
+    pthread_mutex_unlock(&slab_lock);
+
+    return slab;
+}
+
+/*
+ * Get the idx'th item of a pinned slab
+ */
+struct item *
+slab_item(struct slab *slab, uint32_t idx)
+{
+    ASSERT(slab->refcount > 0);
+
+    return slab_2_item(slab, idx, slabclass[slab->id].size, &settings);
+}
+
+/*
+ * Return the largest item chunk the slab holds: the item size of its
+ * class, or all of the slab data for a segment
+ */
+size_t
+slab_chunk_size(struct slab *slab)
+{
+    ASSERT(slab->magic == SLAB_MAGIC);
+
+    if (slab->sid != 0) {
+        return slab_size();
+    }
+
+    return slabclass[slab->id].size;
+}
+
+/*
+ * Get a raw slab off the heap to back segment sid of the segment storage
+ * (see mc_segment.c), or NULL once the heap is used up. A segment is not
+ * owned by any class and is never evicted as a slab, so it is kept off
+ * the slab lruq. Must be called with the slab_lock held.
+ */
+struct slab *
+slab_get_segment(uint32_t sid)
+{
+    struct slab *slab;
+
+    ASSERT(sid != 0);
+
+    slab = slab_get_new(&settings, &heapinfo);
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    slab->magic = SLAB_MAGIC;
+    slab->id = SLABCLASS_INVALID_ID;
+    slab->accessed = 0;
+    slab->refcount = 0;
+    slab->utime = time_now();
+    slab->sid = sid;
+
+    return slab;
+}
+
 /*
  * Put an item back into the slab by inserting into the item free Q.
  */
@@ -939,7 +1514,7 @@ slab_put_item_into_freeq(
     it->flags |= ITEM_SLABBED;
 
     p->nfree_itemq++;
-    TAILQ_INSERT_HEAD(&p->free_itemq, it, i_tqe);
+    ITEM_TAILQ_INSERT_HEAD(&p->free_itemq, it, i_tqe);
 
     stats_slab_incr(id, item_free);
     stats_slab_incr(id, item_remove);
@@ -56,11 +56,15 @@
 struct slab {
     uint32_t          magic;    /* slab magic (const) */
     uint8_t           id;       /* slabclass id */
-    uint8_t           unused;   /* unused */
+    uint8_t           accessed; /* clock bit, set on a hit */
     uint16_t          refcount; /* # concurrent users */
     TAILQ_ENTRY(slab) s_tqe;    /* link in slab lruq */
     rel_time_t        utime;    /* last update time in secs */
-    uint32_t          padding;  /* unused */
+    uint32_t          sid;      /* segment id, 0 if not a segment */
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+    uint32_t          ref;      /* index in slab ref table (const) */
+    uint32_t          padding;  /* keep data 8-byte aligned */
+#endif
     uint8_t           data[1];  /* opaque data */
 };
 
@@ -72,6 +76,48 @@ TAILQ_HEAD(slab_tqh, slab);
 #define SLAB_MAX_SIZE   ((size_t) (128 * MB))
 #define SLAB_SIZE       MB
 
+#if defined MC_COMPACT_ITEM && MC_COMPACT_ITEM == 1
+
+/*
+ * Every slab of both heaps, and every segment, has a slot in the slab ref
+ * table, so that a compact item link of 32 bits finds the item from the
+ * slab slot in its high bits and the item offset in its low item_ref_shift
+ * bits. Link 0 is no item, as no item starts at offset 0 of a slab.
+ */
+extern struct slab **slab_ref_table;
+extern uint32_t item_ref_shift;
+
+static inline item_ref_t
+item_ref(struct item *it)
+{
+    struct slab *slab;
+
+    if (it == NULL) {
+        return 0;
+    }
+
+    slab = (struct slab *)((uint8_t *)it - it->offset);
+
+    return (slab->ref << item_ref_shift) | (it->offset / MC_ALIGNMENT);
+}
+
+static inline struct item *
+item_deref(item_ref_t ref)
+{
+    uint8_t *slab;
+
+    if (ref == 0) {
+        return NULL;
+    }
+
+    slab = (uint8_t *)slab_ref_table[ref >> item_ref_shift];
+
+    return (struct item *)(slab + (size_t)(ref & ((1U << item_ref_shift) - 1)) *
+                           MC_ALIGNMENT);
+}
+
+#endif
+
 /*
  * Every class (struct slabclass) is a collection of slabs that can serve
  * items of a given maximum size. Every slab in twemcache is identified by a
@@ -130,6 +176,7 @@ TAILQ_HEAD(slab_tqh, slab);
 struct slabclass {
     uint32_t        nitem;       /* # item per slab (const) */
     size_t          size;        /* item size (const) */
+    uint32_t        nslab;       /* # slabs of the class */
 
     uint32_t        nfree_itemq; /* # free item q */
     struct item_tqh free_itemq;  /* free item q */
@@ -146,6 +193,19 @@ struct slabclass {
  * that we can have at most 254 usable slab classes
  */
 #define SLABCLASS_MIN_ID        1
+/*
+ * Sizing and pressure of a slab heap, see slab_heap_get_stats()
+ */
+struct slab_heap_stats {
+    uint32_t nslab;      /* # slab allocated */
+    uint32_t max_nslab;  /* max # slab allowed */
+    uint32_t init_nslab; /* max # slab allowed at start */
+    uint32_t nfree_slab; /* # slab lent and not used yet */
+    uint64_t used;       /* # bytes of items in use */
+    uint64_t nfull;      /* # slab requests that found the heap full */
+    uint64_t nerror;     /* # slab requests that failed */
+};
+
 #define SLABCLASS_MAX_ID        (UCHAR_MAX - 1)
 #define SLABCLASS_INVALID_ID    UCHAR_MAX
 #define SLABCLASS_MAX_IDS       UCHAR_MAX
@@ -168,7 +228,20 @@ void slab_put_item(struct item *it);
 //void slab_put_item_no_lock(struct item *it);
 void slab_lruq_touch(struct slab *slab, bool allocated);
 
-inline bool slab_has_reserved_slabs(void);
+struct slab *slab_pin(uint32_t sidx, uint32_t *nitem);
+rstatus_t slab_move(uint8_t src, uint8_t dst);
+uint32_t slab_nslab(uint8_t id);
+struct item *slab_item(struct slab *slab, uint32_t idx);
+size_t slab_chunk_size(struct slab *slab);
+struct slab *slab_get_segment(uint32_t sid);
+rstatus_t slab_heap_lend(bool to_reserved, uint32_t floor);
+void slab_heap_get_stats(bool reserved, struct slab_heap_stats *hs);
+
+rstatus_t slab_ref_init(uint32_t max_nslab);
+void slab_ref_deinit(void);
+void slab_ref_add(struct slab *slab);
+
+bool slab_has_reserved_slabs(void);
 
 uint8_t slab_reserved_id(size_t size);
 struct item *slab_get_reserved_item(uint8_t id, bool lock_slab);
@@ -40,7 +40,6 @@ extern struct thread_key keys;
 extern struct item_tqh item_lruq[];
 extern uint8_t slabclass_max_id;
 extern struct slabclass slabclass[];
-extern pthread_mutex_t cache_lock;
 
 #define STATS_KEY_LEN       128
 #define STATS_VAL_LEN       128
@@ -482,7 +481,8 @@ stats_init(void)
 {
     stats_template_init();
     stats_slab_getstatic(aggregator.stats_slabs_const);
-    num_updaters = settings.num_workers + 1; /* +1 to include dispatcher */
+    /* +1 to include dispatcher, and the background threads */
+    num_updaters = settings.num_workers + 1 + THREAD_NBACKGROUND;
 }
 
 void
@@ -518,7 +518,7 @@ _stats_aggregate(void)
         stats_slab_reset(aggregator.stats_slabs[cid]);
     }
 
-    /* aggregate over workers and dispatcher */
+    /* aggregate over workers, dispatcher and background threads */
     for (i = 0; i < num_updaters; ++i) {
         struct stats_metric *stats_thread = threads[i].stats_thread;
         pthread_mutex_lock(threads[i].stats_mutex);
@@ -555,12 +555,34 @@ _stats_aggregate(void)
     }
 }
 
+/*
+ * Copy the aggregated value of slab metric name of every class into val,
+ * which is indexed by class id
+ */
+void
+stats_slab_snapshot(stats_smetric_t name, int64_t *val)
+{
+    uint8_t cid;
+
+    sem_wait(&aggregator.stats_sem);
+
+    for (cid = SLABCLASS_MIN_ID; cid <= slabclass_max_id; ++cid) {
+        val[cid] = stats_metric_val(&aggregator.stats_slabs[cid][name]);
+    }
+
+    sem_post(&aggregator.stats_sem);
+}
+
 /*
  * Process command "stats slabs\r\n"
  */
 void
 stats_slabs(struct conn *c)
 {
+    struct rebalance_stats rs;
+    struct admit_stats as;
+    struct slab_heap_stats hs;
+    struct segment_stats ss;
     uint32_t i;
     uint8_t cid;
 
@@ -592,50 +614,116 @@ stats_slabs(struct conn *c)
     }
 
     sem_post(&aggregator.stats_sem);
+
+    rebalance_get_stats(&rs);
+
+    stats_print(c, "rebalance_interval", "%d", settings.rebalance_interval);
+    stats_print(c, "rebalance_window", "%"PRIu64, rs.window);
+    stats_print(c, "rebalance_hot", "%u", rs.hot);
+    stats_print(c, "rebalance_hot_window", "%u", rs.hot_window);
+    stats_print(c, "rebalance_move", "%"PRIu64, rs.move);
+    stats_print(c, "rebalance_move_fail", "%"PRIu64, rs.move_fail);
+    stats_print(c, "rebalance_last_src", "%u", rs.last_src);
+    stats_print(c, "rebalance_last_dst", "%u", rs.last_dst);
+    stats_print(c, "rebalance_last_ts", "%u", rs.last_ts);
+    stats_print(c, "rebalance_heap_borrow", "%"PRIu64, rs.heap_borrow);
+    stats_print(c, "rebalance_heap_lend", "%"PRIu64, rs.heap_lend);
+    stats_print(c, "rebalance_heap_fail", "%"PRIu64, rs.heap_fail);
+
+    admit_get_stats(&as);
+
+    stats_print(c, "admit_sketch_bytes", "%zu", as.nbyte);
+    stats_print(c, "admit_sketch_width", "%u", as.width);
+    stats_print(c, "admit_sketch_sample", "%"PRIu64, as.sample);
+    stats_print(c, "admit_sketch_age", "%"PRIu64, as.age);
+
+    slab_heap_get_stats(false, &hs);
+
+    stats_print(c, "heap_slab", "%u", hs.nslab);
+    stats_print(c, "heap_max_slab", "%u", hs.max_nslab);
+    stats_print(c, "heap_free_slab", "%u", hs.nfree_slab);
+    stats_print(c, "heap_used_bytes", "%"PRIu64, hs.used);
+    stats_print(c, "heap_full", "%"PRIu64, hs.nfull);
+    stats_print(c, "heap_error", "%"PRIu64, hs.nerror);
+
+    if (slab_has_reserved_slabs()) {
+        slab_heap_get_stats(true, &hs);
+
+        stats_print(c, "reserved_heap_slab", "%u", hs.nslab);
+        stats_print(c, "reserved_heap_max_slab", "%u", hs.max_nslab);
+        stats_print(c, "reserved_heap_free_slab", "%u", hs.nfree_slab);
+        stats_print(c, "reserved_heap_used_bytes", "%"PRIu64, hs.used);
+        stats_print(c, "reserved_heap_full", "%"PRIu64, hs.nfull);
+        stats_print(c, "reserved_heap_error", "%"PRIu64, hs.nerror);
+    }
+
+    segment_get_stats(&ss);
+
+    stats_print(c, "segment_count", "%u", ss.nsegment);
+    stats_print(c, "segment_free", "%u", ss.nfree);
+    stats_print(c, "segment_item", "%"PRIu64, ss.nitem);
+    stats_print(c, "segment_item_bytes", "%"PRIu64, ss.nbyte);
+    stats_print(c, "segment_used_bytes", "%"PRIu64, ss.nused);
+    stats_print(c, "segment_expire", "%"PRIu64, ss.expire);
+    stats_print(c, "segment_evict", "%"PRIu64, ss.evict);
+    stats_print(c, "segment_evict_fail", "%"PRIu64, ss.evict_fail);
+
     stats_append(c, NULL, 0, NULL, 0);
 }
 
 /*
- * Process command "stats sizes\r\n". Dumps a list of objects of each size
- * in 32-byte increments
+ * Process command "stats sizes\r\n". Dumps the item header size, how many
+ * items of the cached sizes a GB of slab memory holds, and a list of objects
+ * of each size in 32-byte increments
  */
 void
 stats_sizes(void *c)
 {
     uint32_t *histogram;
     int num_buckets;
+    uint64_t nitem, nbyte;
 
     num_buckets = settings.slab_size / STATS_BUCKET_SIZE + 1;
     histogram = mc_zalloc(sizeof(int) * num_buckets);
 
-    pthread_mutex_lock(&cache_lock);
     if (histogram != NULL) {
         uint32_t i;
 
         /* build the histogram */
+        nitem = 0;
+        nbyte = 0;
         for (i = SLABCLASS_MIN_ID; i <= slabclass_max_id; i++) {
             struct item *iter;
 
-            TAILQ_FOREACH(iter, &item_lruq[i], i_tqe) {
+            item_lock_lruq(i);
+            ITEM_TAILQ_FOREACH(iter, &item_lruq[i], i_tqe) {
                 int ntotal = item_size(iter);
                 int bucket = (ntotal - 1) / STATS_BUCKET_SIZE + 1;
                 ASSERT(bucket < num_buckets);
                 histogram[bucket]++;
+                nitem++;
+                nbyte += slab_item_size(i);
             }
+            item_unlock_lruq(i);
         }
 
+        /* items per GB of the chunks the cached items take */
+        stats_print(c, "item_hdr_size", "%zu", ITEM_HDR_SIZE);
+        stats_print(c, "item_per_gb", "%"PRIu64,
+                    nbyte == 0 ? 0 : nitem * GB / nbyte);
+
         /* write the buffer */
         for (i = 0; i < num_buckets; i++) {
             if (histogram[i] != 0) {
-                char key[8];
-                ASSERT(snprintf(key, sizeof(key), "%d", i * 32) < sizeof(key));
+                char key[MC_UINT32_MAXLEN];
+
+                mc_snprintf(key, sizeof(key), "%d", i * 32);
                 stats_print(c, key, "%u", histogram[i]);
             }
         }
         mc_free(histogram);
     }
     stats_append(c, NULL, 0, NULL, 0);
-    pthread_mutex_unlock(&cache_lock);
 }
 
 /*
@@ -650,8 +738,16 @@ stats_settings(void *c)
     stats_print(c, "daemonize", "%u", (unsigned int)settings.daemonize);
     stats_print(c, "max_corefile", "%u", (unsigned int)settings.max_corefile);
     stats_print(c, "cas_enabled", "%u", (unsigned int)settings.use_cas);
+    stats_print(c, "lockfree_get", "%u", (unsigned int)settings.lockfree_get);
     stats_print(c, "num_workers", "%d", settings.num_workers);
     stats_print(c, "reqs_per_event", "%d", settings.reqs_per_event);
+    stats_print(c, "coalesce_bytes", "%d", settings.coalesce_bytes);
+    stats_print(c, "io_engine", "%s",
+                settings.io_engine == IO_ENGINE_URING ? "uring" : "libevent");
+    stats_print(c, "accept", "%s",
+                settings.accept_mode == THREAD_ACCEPT_CPU ? "cpu" :
+                settings.accept_mode == THREAD_ACCEPT_REUSEPORT ? "reuseport" :
+                "dispatcher");
     stats_print(c, "oldest", "%u", settings.oldest_live);
     stats_print(c, "log_filename", "%s", settings.log_filename);
     stats_print(c, "verbosity", "%d", settings.verbose);
@@ -672,6 +768,18 @@ stats_settings(void *c)
     stats_print(c, "stats_agg_intvl", "%10.6f", settings.stats_agg_intvl.tv_sec +
                 1.0 * settings.stats_agg_intvl.tv_usec / 1000000);
     stats_print(c, "hash_power", "%d", settings.hash_power);
+    stats_print(c, "hash_table", "%s",
+                settings.hash_table == HASH_TABLE_TAGGED ? "tagged" : "chained");
+    stats_print(c, "hash", "%s", hash_name(settings.hash_type));
+    stats_print(c, "lock_power", "%d", settings.lock_power);
+    stats_print(c, "reaper_rate", "%d", settings.reaper_rate);
+    stats_print(c, "rebalance_interval", "%d", settings.rebalance_interval);
+    stats_print(c, "storage", "%s",
+                settings.storage == STORAGE_SEGMENT ? "segment" : "slab");
+    stats_print(c, "admission_sketch", "%d", settings.admit_sketch);
+    stats_print(c, "crawler_duty", "%d", settings.crawler_duty);
+    stats_print(c, "migrate_rate", "%d", settings.migrate_rate);
+    stats_print(c, "trans_maxbytes", "%zu", settings.trans_maxbytes);
     stats_print(c, "klog_name", "%s", settings.klog_name);
     stats_print(c, "klog_sampling_rate", "%d", settings.klog_sampling_rate);
     stats_print(c, "klog_entry", "%d", settings.klog_entry);
@@ -679,6 +787,219 @@ stats_settings(void *c)
                 1.0 * settings.klog_intvl.tv_usec / 1000000);
 }
 
+/*
+ * Process command "stats reaper\r\n".
+ */
+void
+stats_reaper(void *c)
+{
+    struct reaper_stats rs;
+
+    reaper_get_stats(&rs);
+
+    stats_print(c, "enabled", "%u", settings.reaper_rate > 0 ? 1U : 0U);
+    stats_print(c, "rate", "%d", settings.reaper_rate);
+    stats_print(c, "running", "%u", rs.running ? 1U : 0U);
+    stats_print(c, "slab", "%u", rs.slab);
+    stats_print(c, "pass", "%"PRIu64, rs.pass);
+    stats_print(c, "pass_done", "%"PRIu64, rs.pass_done);
+    stats_print(c, "pass_restart", "%"PRIu64, rs.pass_restart);
+    stats_print(c, "pass_start_ts", "%u", rs.pass_start_ts);
+    stats_print(c, "pass_end_ts", "%u", rs.pass_end_ts);
+    stats_print(c, "item_scanned", "%"PRIu64, rs.item_scanned);
+    stats_print(c, "item_reaped", "%"PRIu64, rs.item_reaped);
+    stats_print(c, "byte_reaped", "%"PRIu64, rs.byte_reaped);
+}
+
+/*
+ * Process command "stats crawler
+".
+ */
+void
+stats_crawler(void *c)
+{
+    struct crawler_stats cs;
+
+    crawler_get_stats(&cs);
+
+    stats_print(c, "enabled", "%u", (settings.crawler_duty > 0 &&
+                settings.storage != STORAGE_SEGMENT) ? 1U : 0U);
+    stats_print(c, "duty", "%d", settings.crawler_duty);
+    stats_print(c, "running", "%u", cs.running ? 1U : 0U);
+    stats_print(c, "class", "%u", cs.class);
+    stats_print(c, "pass", "%"PRIu64, cs.pass);
+    stats_print(c, "pass_done", "%"PRIu64, cs.pass_done);
+    stats_print(c, "pass_start_ts", "%u", cs.pass_start_ts);
+    stats_print(c, "pass_end_ts", "%u", cs.pass_end_ts);
+    stats_print(c, "item_scanned", "%"PRIu64, cs.item_scanned);
+    stats_print(c, "item_reclaimed", "%"PRIu64, cs.item_reclaimed);
+    stats_print(c, "byte_reclaimed", "%"PRIu64, cs.byte_reclaimed);
+    stats_print(c, "lease_reclaimed", "%"PRIu64, cs.lease_reclaimed);
+}
+
+/*
+ * Process command "stats migrate\r\n".
+ */
+void
+stats_migrate(void *c)
+{
+    struct migrate_stats ms;
+
+    migrate_get_stats(&ms);
+
+    stats_print(c, "rate", "%d", settings.migrate_rate);
+    stats_print(c, "running", "%u", ms.running ? 1U : 0U);
+    stats_print(c, "fragment", "%u", ms.fragment);
+    stats_print(c, "fragments", "%u", ms.nfragment);
+    stats_print(c, "migration", "%"PRIu64, ms.migration);
+    stats_print(c, "migration_done", "%"PRIu64, ms.migration_done);
+    stats_print(c, "migration_fail", "%"PRIu64, ms.migration_fail);
+    stats_print(c, "start_ts", "%u", ms.start_ts);
+    stats_print(c, "end_ts", "%u", ms.end_ts);
+    stats_print(c, "item_sent", "%"PRIu64, ms.item_sent);
+    stats_print(c, "byte_sent", "%"PRIu64, ms.byte_sent);
+    stats_print(c, "chunk_sent", "%"PRIu64, ms.chunk_sent);
+    stats_print(c, "item_received", "%"PRIu64, ms.item_received);
+    stats_print(c, "item_imported", "%"PRIu64, ms.item_imported);
+}
+
+/*
+ * Process command "stats trans\r\n".
+ */
+void
+stats_trans(void *c)
+{
+    struct trans_stats ts;
+
+    trans_get_stats(&ts);
+
+    stats_print(c, "maxbytes", "%zu", settings.trans_maxbytes);
+    stats_print(c, "trans", "%"PRIu64, ts.ntrans);
+    stats_print(c, "keys", "%"PRIu64, ts.nkey);
+    stats_print(c, "total_trans", "%"PRIu64, ts.total);
+    stats_print(c, "expired", "%"PRIu64, ts.expired);
+    stats_print(c, "bytes", "%"PRIu64, ts.nbyte);
+    stats_print(c, "pool_bytes", "%"PRIu64, ts.nbyte_pool);
+    stats_print(c, "alloc_fail", "%"PRIu64, ts.alloc_fail);
+}
+
+/*
+ * Process command "stats timer\r\n".
+ */
+void
+stats_timer(void *c)
+{
+    struct timer_stats ts;
+
+    timer_get_stats(&ts);
+
+    stats_print(c, "timers", "%"PRIu64, ts.nentry);
+    stats_print(c, "total_timers", "%"PRIu64, ts.total);
+    stats_print(c, "fired", "%"PRIu64, ts.fired);
+    stats_print(c, "alloc_fail", "%"PRIu64, ts.alloc_fail);
+    stats_print(c, "bytes", "%"PRIu64, ts.nbyte);
+    stats_print(c, "max_tick_lag_ms", "%"PRIu64, ts.tick_lag);
+}
+
+/*
+ * Process command "stats hash\r\n". The bucket histogram is sampled:
+ * bucket_<n> is the # sampled buckets holding n items, where a chained
+ * bucket holds its chain.
+ */
+void
+stats_hash(void *c)
+{
+    struct assoc_stats as;
+    char key_str[STATS_KEY_LEN];
+    uint32_t i;
+
+    assoc_get_stats(&as);
+
+    stats_print(c, "layout", "%s",
+                as.layout == HASH_TABLE_TAGGED ? "tagged" : "chained");
+    stats_print(c, "hash_power", "%"PRIu32, as.power);
+    stats_print(c, "buckets", "%"PRIu64, as.nbucket);
+    stats_print(c, "items", "%"PRIu32, as.nitem);
+    stats_print(c, "load_factor", "%.3f", (double)as.nitem / as.nslot);
+    stats_print(c, "spilled", "%"PRIu32, as.nspill);
+    stats_print(c, "expanding", "%u", as.expanding ? 1U : 0U);
+    stats_print(c, "expand_moved_buckets", "%"PRIu64, as.expand_bucket);
+    stats_print(c, "expand_buckets", "%"PRIu64, as.expand_nbucket);
+    stats_print(c, "expand_progress", "%.3f", as.expanding ?
+                (double)as.expand_bucket / as.expand_nbucket : 1.0);
+    stats_print(c, "expansions", "%"PRIu64, as.nexpand);
+    stats_print(c, "moved_items", "%"PRIu64, as.nmove);
+    stats_print(c, "sampled_buckets", "%"PRIu64, as.nsample);
+    if (as.layout == HASH_TABLE_TAGGED) {
+        stats_print(c, "overflowed_buckets", "%"PRIu64, as.noverflow);
+    }
+
+    for (i = 0; i < ASSOC_STATS_NBIN; i++) {
+        if (as.layout == HASH_TABLE_TAGGED && i > HASH_TAG_NSLOT) {
+            break;
+        }
+        mc_snprintf(key_str, STATS_KEY_LEN, "bucket_%"PRIu32"%s", i,
+                    i == ASSOC_STATS_NBIN - 1 ? "+" : "");
+        stats_print(c, key_str, "%"PRIu64, as.hist[i]);
+    }
+}
+
+/*
+ * Process command "stats fragments\r\n". Per fragment item and byte
+ * counts are only available when the fragment count divides the # index
+ * slots, otherwise just the totals are dumped.
+ */
+void
+stats_fragments(void *c)
+{
+    uint32_t nfragment, fid, slot, nitem, total_nitem;
+    uint64_t nbyte, total_nbyte;
+    char key_str[STATS_KEY_LEN];
+    char val_str[STATS_VAL_LEN];
+    uint32_t klen, vlen;
+    bool exact;
+
+    nfragment = fragment_count();
+    exact = fragment_slot_exact(nfragment);
+
+    stats_print(c, "config", "%d", fragment_global_config());
+    stats_print(c, "fragments", "%u", nfragment);
+    stats_print(c, "exact", "%u", exact ? 1U : 0U);
+
+    total_nitem = 0;
+    total_nbyte = 0;
+    for (slot = 0; slot < FRAGMENT_NSLOT; slot++) {
+        fragment_slot_stats(slot, &nitem, &nbyte);
+        total_nitem += nitem;
+        total_nbyte += nbyte;
+    }
+    stats_print(c, "curr_items", "%u", total_nitem);
+    stats_print(c, "bytes", "%"PRIu64, total_nbyte);
+
+    if (!exact) {
+        return;
+    }
+
+    for (fid = 0; fid < nfragment; fid++) {
+        total_nitem = 0;
+        total_nbyte = 0;
+        for (slot = fragment_slot_first(fid, nfragment); slot < FRAGMENT_NSLOT;
+             slot = fragment_slot_next(slot, nfragment)) {
+            fragment_slot_stats(slot, &nitem, &nbyte);
+            total_nitem += nitem;
+            total_nbyte += nbyte;
+        }
+
+        klen = snprintf(key_str, STATS_KEY_LEN, "%u:%s", fid, "curr_items");
+        vlen = snprintf(val_str, STATS_VAL_LEN, "%u", total_nitem);
+        stats_append(c, key_str, klen, val_str, vlen);
+
+        klen = snprintf(key_str, STATS_KEY_LEN, "%u:%s", fid, "bytes");
+        vlen = snprintf(val_str, STATS_VAL_LEN, "%"PRIu64, total_nbyte);
+        stats_append(c, key_str, klen, val_str, vlen);
+    }
+}
+
 /*
  * Process command "stats\r\n".
  */
@@ -46,6 +46,9 @@
     ACTION( conn_curr,          STATS_GAUGE,        "# active connections")                                 \
     ACTION( data_read,          STATS_COUNTER,      "# bytes read")                                         \
     ACTION( data_written,       STATS_COUNTER,      "# bytes written")                                      \
+    ACTION( data_sendmsg,       STATS_COUNTER,      "# sendmsg calls writing replies")                      \
+    ACTION( reply_held,         STATS_COUNTER,      "# replies held back to go out with a later one")       \
+    ACTION( uring_enter,        STATS_COUNTER,      "# io_uring_enter calls submitting operations")         \
     ACTION( add,                STATS_COUNTER,      "# add requests")                                       \
     ACTION( add_exist,          STATS_COUNTER,      "# add requests that was a hit")                        \
     ACTION( set,                STATS_COUNTER,      "# set requests")                                       \
@@ -97,6 +100,7 @@
     ACTION( iqget_miss,			STATS_COUNTER,		"# number of iqget call that was a miss") \
 	ACTION( iset,				STATS_COUNTER,		"# number of iset call") \
 	ACTION( get_hit,			STATS_COUNTER,		"# number of get hit") \
+	ACTION( get_lockfree,		STATS_COUNTER,		"# number of item gets served without item locks") \
     ACTION( iqset,				STATS_COUNTER,		"# number of iqset call") \
     ACTION( iqappend,			STATS_COUNTER,		"# number of iqappend call") \
     ACTION( iqprepend,			STATS_COUNTER,		"# number of iqprepend call") \
@@ -130,6 +134,13 @@
 	ACTION( oqprepend,			STATS_COUNTER,		"# number of oqprepend call") \
 	ACTION( oqwrite,			STATS_COUNTER,		"# number of oqwrite call") \
 	ACTION( iqget_meet_qlease,	STATS_COUNTER,		"# number of iqget meet q lease") \
+	ACTION( iqget_wait,			STATS_COUNTER,		"# number of iqget parked on a lease held by another client") \
+	ACTION( iqget_wake,			STATS_COUNTER,		"# number of parked iqget woken up as the lease went") \
+	ACTION( iqget_wait_timeout,	STATS_COUNTER,		"# number of parked iqget that ran out of wait time") \
+	ACTION( iqget_waiting,		STATS_GAUGE,		"# iqget currently parked on a lease") \
+	ACTION( batch,				STATS_COUNTER,		"# number of batched iq requests") \
+	ACTION( batch_key,			STATS_COUNTER,		"# keys and tids in batched iq requests") \
+	ACTION( batch_lock,			STATS_COUNTER,		"# item lock acquisitions of batched iq requests") \
 
 #define STATS_SLAB_METRICS(ACTION)                                                                          \
     ACTION( data_curr,          STATS_GAUGE,        "# current item bytes including overhead")              \
@@ -139,6 +150,9 @@
     ACTION( item_remove,        STATS_COUNTER,      "# items removed")                                      \
     ACTION( item_expire,        STATS_COUNTER,      "# items expired")                                      \
     ACTION( item_evict,         STATS_COUNTER,      "# items evicted")                                      \
+    ACTION( item_clock_pass,    STATS_COUNTER,      "# items clock eviction passed over as they had a hit") \
+    ACTION( item_admit,         STATS_COUNTER,      "# new items the admission filter let in over an lru item") \
+    ACTION( item_admit_reject,  STATS_COUNTER,      "# new items the admission filter kept out")            \
     ACTION( item_free,          STATS_GAUGE,        "# items in free q")                                    \
     ACTION( item_expire_ts,     STATS_TIMESTAMP,    "last item expired timestamp")                          \
     ACTION( item_reclaim_ts,    STATS_TIMESTAMP,    "last item reclaimed timestamp")                        \
@@ -153,6 +167,8 @@
     ACTION( slab_alloc_ts,      STATS_TIMESTAMP,    "the last allocated slab timestamp")                    \
     ACTION( slab_new_ts,        STATS_TIMESTAMP,    "the last newly allocated slab timestamp")              \
     ACTION( slab_evict_ts,      STATS_TIMESTAMP,    "the last slab evicted timestamp")                      \
+    ACTION( slab_move_in,       STATS_COUNTER,      "# slabs the rebalancer moved into the class")          \
+    ACTION( slab_move_out,      STATS_COUNTER,      "# slabs the rebalancer moved out of the class")        \
     ACTION( set_success,        STATS_COUNTER,      "# set requests that was a success")                     \
     ACTION( add_success,        STATS_COUNTER,      "# add requests that was a success")                    \
     ACTION( replace_hit,        STATS_COUNTER,      "# replace requests that was a hit")                    \
@@ -285,6 +301,7 @@ void stats_thread_deinit(struct stats_metric *stats_thread);
 struct stats_metric **stats_slabs_init(void);
 
 void _stats_aggregate(void);
+void stats_slab_snapshot(stats_smetric_t name, int64_t *val);
 
 
 void _stats_thread_incr(stats_tmetric_t name);
@@ -300,6 +317,13 @@ void _stats_slab_decr_by(uint8_t cls_id, stats_smetric_t name, int64_t delta);
 
 void stats_default(struct conn *c);
 void stats_settings(void *c);
+void stats_reaper(void *c);
+void stats_crawler(void *c);
+void stats_fragments(void *c);
+void stats_migrate(void *c);
+void stats_trans(void *c);
+void stats_timer(void *c);
+void stats_hash(void *c);
 void stats_slabs(struct conn *c);
 void stats_sizes(void *c);
 void stats_append(struct conn *c, const char *key, uint16_t klen, char *val, uint32_t vlen);
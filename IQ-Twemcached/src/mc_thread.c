@@ -28,6 +28,7 @@
  */
 
 #include <stdlib.h>
+#include <sched.h>
 
 #include <mc_core.h>
 
@@ -43,6 +44,9 @@ static int init_count;               /* # worker threads inited */
 static pthread_mutex_t init_lock;    /* init threads lock */
 static pthread_cond_t init_cond;     /* init threads condvar */
 
+#define THREAD_NOTIFY_RESUME     'r'     /* notify byte for a woken up connection */
+#define THREAD_NOTIFY_RESUME_STR "r"
+
 /*
  * Get the pointer to a member of the current thread-local data.
  */
@@ -148,16 +152,111 @@ thread_setkeys(struct thread_worker *t)
         return MC_ERROR;
     }
 
+    err = pthread_setspecific(keys.epoch, (void *)&t->epoch);
+    if (err != 0) {
+        log_error("pthread setspecific failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
     return MC_OK;
 }
 
+/*
+ * Bind the calling thread to the idx'th background thread descriptor, so
+ * that it can update stats and run epoch read-side sections.
+ */
+rstatus_t
+thread_bind_background(int idx)
+{
+    struct thread_worker *t;
+
+    ASSERT(idx >= 0 && idx < THREAD_NBACKGROUND);
+
+    t = &threads[settings.num_workers + 1 + idx];
+    t->tid = pthread_self();
+
+    return thread_setkeys(t);
+}
+
+/*
+ * Epoch based reclamation:
+ *
+ * Readers that look up items without holding any item lock bracket the
+ * lookup with thread_epoch_enter() and thread_epoch_exit(), which bump
+ * the epoch of the calling thread to an odd and back to an even value.
+ * Before item memory that was reachable from the hash table is recycled,
+ * the writer calls thread_epoch_synchronize(), which waits for every
+ * thread that was inside a read-side section to leave it. Read-side
+ * sections never block, so the wait is bounded by the length of a single
+ * hash lookup.
+ */
+void
+thread_epoch_enter(void)
+{
+    volatile uint64_t *epoch = thread_get(keys.epoch);
+
+    *epoch = *epoch + 1;
+    /* publish the odd epoch before reading any shared pointer */
+    __sync_synchronize();
+}
+
+void
+thread_epoch_exit(void)
+{
+    volatile uint64_t *epoch = thread_get(keys.epoch);
+
+    __sync_synchronize();
+    *epoch = *epoch + 1;
+}
+
+void
+thread_epoch_synchronize(void)
+{
+    uint64_t epoch;
+    int i;
+
+    if (threads == NULL) {
+        return;
+    }
+
+    __sync_synchronize();
+
+    /* dispatcher and background threads take the slices after workers */
+    for (i = 0; i <= settings.num_workers + THREAD_NBACKGROUND; i++) {
+        epoch = threads[i].epoch;
+        if ((epoch & 1) == 0) {
+            continue;
+        }
+
+        while (threads[i].epoch == epoch) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Have worker thread t serve conn c from now on
+ */
+static rstatus_t
+thread_attach(struct thread_worker *t, struct conn *c)
+{
+    c->thread = t;
+
+    if (t->ring != NULL && !c->udp) {
+        return uring_add(c);
+    }
+
+    return conn_set_event(c, t->base);
+}
+
 /*
  * Worker thread new connection event loop
  *
  * Processes an incoming "handle a new connection" item. This is called when
  * input arrives on the libevent wakeup pipe. Each libevent instance has a
  * wakeup pipe, which other threads (dispatcher thread) uses to signal that
- * they've put a new connection on its queue.
+ * they've put a new connection on its queue. Workers use the same pipe to
+ * hand back connections parked on a lease wait list (see thread_resume).
  */
 static void
 thread_libevent_process(int fd, short which, void *arg)
@@ -173,20 +272,54 @@ thread_libevent_process(int fd, short which, void *arg)
         log_warn("read from notify pipe %d failed: %s", fd, strerror(errno));
     }
 
+    if (n == 1 && buf[0] == THREAD_NOTIFY_RESUME) {
+        c = conn_cq_pop(&t->resume_cq);
+        if (c != NULL) {
+            wait_resume(c);
+        }
+        return;
+    }
+
     c = conn_cq_pop(&t->new_cq);
     if (c == NULL) {
         return;
     }
 
-    c->thread = t;
-
-    status = conn_set_event(c, t->base);
+    status = thread_attach(t, c);
     if (status != MC_OK) {
         close(c->sd);
         conn_put(c);
     }
 }
 
+/*
+ * Bind the calling worker thread to the cpu of its index, the one whose
+ * connections the kernel steers to its listening socket
+ */
+static void
+thread_bind_cpu(int tid)
+{
+#ifdef CPU_SETSIZE
+    cpu_set_t set;
+    long ncpu;
+    err_t err;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(tid % ncpu, &set);
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        log_warn("bind of worker %d to cpu %ld failed, ignored: %s", tid,
+                 tid % ncpu, strerror(err));
+    }
+#endif
+}
+
 /*
  * Worker thread main event loop
  */
@@ -206,6 +339,10 @@ thread_worker_main(void *arg)
         exit(1);
     }
 
+    if (settings.accept_mode == THREAD_ACCEPT_CPU) {
+        thread_bind_cpu((int)(t - threads));
+    }
+
     pthread_mutex_lock(&init_lock);
     t->tid = pthread_self();
     init_count++;
@@ -255,6 +392,7 @@ thread_setup(struct thread_worker *t)
     }
 
     conn_cq_init(&t->new_cq);
+    conn_cq_init(&t->resume_cq);
 
     suffix_size = settings.use_cas ? (CAS_SUFFIX_SIZE + SUFFIX_SIZE + 1) :
                   (SUFFIX_SIZE + 1);
@@ -264,6 +402,13 @@ thread_setup(struct thread_worker *t)
         return MC_ENOMEM;
     }
 
+    if (settings.io_engine == IO_ENGINE_URING) {
+        t->ring = uring_create(t, URING_NBUF);
+        if (t->ring == NULL) {
+            return MC_ERROR;
+        }
+    }
+
     return MC_OK;
 }
 
@@ -318,7 +463,8 @@ thread_setup_aggregator(void)
     }
 
     /* +1 because we also aggregate from dispatcher */
-    sem_init(&aggregator.stats_sem, 0, settings.num_workers + 1);
+    sem_init(&aggregator.stats_sem, 0, settings.num_workers + 1 +
+             THREAD_NBACKGROUND);
 
     aggregator.stats_thread = stats_thread_init();
     if (aggregator.stats_thread == NULL) {
@@ -455,6 +601,79 @@ thread_dispatch(int sd, conn_state_t state, int ev_flags, int udp)
     return MC_OK;
 }
 
+/*
+ * Start accepting connections on listening conn c, on worker tid, or on
+ * the dispatcher for a tid of -1
+ */
+rstatus_t
+thread_listen(struct conn *c, int tid)
+{
+    struct thread_worker *t;
+
+    t = &threads[tid < 0 ? settings.num_workers : tid];
+    c->thread = t;
+
+    if (t->ring != NULL) {
+        return uring_listen(c);
+    }
+
+    return conn_set_event(c, t->base);
+}
+
+/*
+ * Hands socket sd, just accepted on listening conn l, to a worker: to the
+ * next one in turn if the dispatcher accepted it, or else to the worker
+ * that did, which serves it straight away.
+ */
+rstatus_t
+thread_accept(struct conn *l, int sd)
+{
+    struct thread_worker *t = l->thread;
+    struct conn *c;
+    rstatus_t status;
+
+    if (t == &threads[settings.num_workers]) {
+        return thread_dispatch(sd, CONN_NEW_CMD, EV_READ | EV_PERSIST, 0);
+    }
+
+    c = conn_get(sd, CONN_NEW_CMD, EV_READ | EV_PERSIST, TCP_BUFFER_SIZE, 0);
+    if (c == NULL) {
+        return MC_ENOMEM;
+    }
+
+    mc_resolve_peer(c->sd, c->peer, sizeof(c->peer));
+
+    status = thread_attach(t, c);
+    if (status != MC_OK) {
+        conn_put(c);
+        return status;
+    }
+
+    log_debug(LOG_NOTICE, "accepted c %d from '%s' on tid %d", c->sd, c->peer,
+              (int)(t - threads));
+
+    return MC_OK;
+}
+
+/*
+ * Hands a connection woken up on a lease wait list back to its worker
+ * thread, which resumes it. May be called from any thread.
+ */
+void
+thread_resume(struct conn *c)
+{
+    struct thread_worker *t = c->thread;
+    ssize_t n;
+
+    conn_cq_push(&t->resume_cq, c);
+
+    n = write(t->notify_send_fd, THREAD_NOTIFY_RESUME_STR, 1);
+    if (n != 1) {
+        log_warn("write to notify pipe %d failed: %s", t->notify_send_fd,
+                 strerror(errno));
+    }
+}
+
 rstatus_t
 thread_init(struct event_base *main_base)
 {
@@ -470,8 +689,12 @@ thread_init(struct event_base *main_base)
 
     last_thread = -1;
 
-    /* dispatcher takes the extra (last) slice of thread descriptor */
-    threads = mc_zalloc(sizeof(*threads) * (1 + nworkers));
+    /*
+     * dispatcher takes the extra slice of thread descriptor after workers,
+     * followed by the background threads
+     */
+    threads = mc_zalloc(sizeof(*threads) *
+                        (1 + nworkers + THREAD_NBACKGROUND));
     if (threads == NULL) {
         return MC_ENOMEM;
     }
@@ -503,6 +726,12 @@ thread_init(struct event_base *main_base)
         return MC_ERROR;
     }
 
+    err = pthread_key_create(&keys.epoch, NULL);
+    if (err != 0) {
+        log_error("pthread key create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
     dispatcher->base = main_base;
     dispatcher->tid = pthread_self();
 
@@ -516,6 +745,22 @@ thread_init(struct event_base *main_base)
         return status;
     }
 
+    /* the dispatcher ring only accepts, and needs no recv buffers */
+    if (settings.io_engine == IO_ENGINE_URING) {
+        dispatcher->ring = uring_create(dispatcher, 0);
+        if (dispatcher->ring == NULL) {
+            return MC_ERROR;
+        }
+    }
+
+    /* background threads bind to their slice once they are running */
+    for (i = 0; i < THREAD_NBACKGROUND; i++) {
+        status = thread_setup_stats(&threads[nworkers + 1 + i]);
+        if (status != MC_OK) {
+            return status;
+        }
+    }
+
     for (i = 0; i < nworkers; i++) {
         int fds[2];
         status = pipe(fds);
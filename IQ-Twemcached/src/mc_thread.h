@@ -42,10 +42,39 @@ struct thread_key {
     pthread_key_t stats_thread; /* thread stats */
     pthread_key_t stats_slabs;  /* slab stats */
     pthread_key_t kbuf;         /* klog buffer */
+    pthread_key_t epoch;        /* read-side epoch */
 };
 
 typedef void * (*thread_func_t)(void *);
 
+/*
+ * Background threads that work on items outside of any request, like the
+ * stale fragment reaper, update stats and enter epoch read-side sections
+ * just as workers do. Each gets a thread descriptor of its own, after the
+ * one of the dispatcher.
+ */
+#define THREAD_BACKGROUND_REAPER     0
+#define THREAD_BACKGROUND_MIGRATOR   1
+#define THREAD_BACKGROUND_TIMER      2
+#define THREAD_BACKGROUND_REBALANCER 3
+#define THREAD_BACKGROUND_SEGMENT    4
+#define THREAD_BACKGROUND_CRAWLER    5
+#define THREAD_NBACKGROUND           6
+
+/*
+ * How tcp connections are accepted: by the dispatcher, which hands them
+ * to the workers in turn, or by every worker on a listening socket of its
+ * own, all bound to the same address with SO_REUSEPORT. The kernel spreads
+ * connections over those sockets by a hash of the connection, or with
+ * THREAD_ACCEPT_CPU by the cpu a connection arrives on, with each worker
+ * bound to the cpu of its index.
+ */
+typedef enum thread_accept {
+    THREAD_ACCEPT_DISPATCHER,
+    THREAD_ACCEPT_REUSEPORT,
+    THREAD_ACCEPT_CPU
+} thread_accept_t;
+
 struct thread_worker {
     pthread_t           tid;               /* thread id */
 
@@ -55,12 +84,15 @@ struct thread_worker {
     int                 notify_send_fd;    /* sending end of notify pipe */
 
     struct conn_q       new_cq;            /* new connection q */
+    struct conn_q       resume_cq;         /* woken up parked connection q */
+    struct uring        *ring;             /* io_uring, with -i uring */
     cache_t             *suffix_cache;     /* suffix cache */
 
     pthread_mutex_t     *stats_mutex;      /* lock for stats update/aggregation */
     struct stats_metric *stats_thread;     /* per-thread thread-level stats */
     struct stats_metric **stats_slabs;     /* per-thread slab-level stats */
     struct kbuf         *kbuf;             /* per-thread klog buffer */
+    volatile uint64_t   epoch;             /* read-side epoch, odd while reading */
 };
 
 /*
@@ -125,8 +157,17 @@ struct thread_klogger {
 
 void *thread_get(pthread_key_t key);
 
+rstatus_t thread_bind_background(int idx);
+
+void thread_epoch_enter(void);
+void thread_epoch_exit(void);
+void thread_epoch_synchronize(void);
+
 rstatus_t thread_init(struct event_base *main_base);
 void thread_deinit(void);
 rstatus_t thread_dispatch(int sd, conn_state_t state, int ev_flags, int udp);
+void thread_resume(struct conn *c);
+rstatus_t thread_listen(struct conn *c, int tid);
+rstatus_t thread_accept(struct conn *l, int sd);
 
 #endif
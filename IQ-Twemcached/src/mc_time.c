@@ -68,6 +68,13 @@ static time_t process_started;
  */
 static volatile rel_time_t now;
 
+/*
+ * Leases and the timers that expire them (see mc_timer.c) need a finer
+ * clock, which the timer thread updates every msec. It counts msec since
+ * the server start time, just like now counts secs.
+ */
+static volatile uint64_t now_ms;
+
 void
 time_update(void)
 {
@@ -89,6 +96,27 @@ time_now(void)
     return now;
 }
 
+void
+time_update_ms(void)
+{
+    int status;
+    struct timeval timer;
+
+    status = gettimeofday(&timer, NULL);
+    if (status < 0) {
+        log_error("gettimeofday failed: %s", strerror(errno));
+        return;
+    }
+    now_ms = (uint64_t)(timer.tv_sec - process_started) * 1000 +
+             (uint64_t)(timer.tv_usec / 1000);
+}
+
+uint64_t
+time_now_ms(void)
+{
+    return now_ms;
+}
+
 time_t
 time_now_abs(void)
 {
@@ -164,6 +192,7 @@ time_init(void)
     process_started = time(NULL) - 2;
 
     time_clock_handler(0, 0, NULL);
+    time_update_ms();
 
     log_debug(LOG_DEBUG, "process started at %"PRId64, (int64_t)process_started);
 }
@@ -42,6 +42,8 @@ typedef unsigned int rel_time_t;
 
 void time_update(void);
 rel_time_t time_now(void);
+void time_update_ms(void);
+uint64_t time_now_ms(void);
 time_t time_now_abs(void);
 time_t time_started(void);
 rel_time_t time_reltime(time_t exptime);
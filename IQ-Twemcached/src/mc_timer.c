@@ -0,0 +1,378 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Timer wheel
+ *
+ * Leases, transactions and co sessions live for settings.lease_token_expiry
+ * msec. Rather than waiting for a lookup or lru reuse to notice that they
+ * have expired, their owners arm a timer that fires at the deadline, so
+ * that abandoned leases give their key and reserved chunk back on time.
+ *
+ * Timers are kept in a hierarchical timing wheel of TIMER_NLEVEL levels of
+ * TIMER_NSLOT slots each. Level 0 has a slot per msec; a slot of level n
+ * spans all of level n - 1. A timer goes into the lowest level whose span
+ * covers its deadline, and is moved one level down (cascaded) each time the
+ * wheel turns over into its slot, so that adding a timer and firing it take
+ * constant time. Timers beyond the span of the top level wait in its last
+ * slot and are cascaded again.
+ *
+ * The wheel is split into TIMER_NSHARD shards, each with a leaf lock, so
+ * that the workers that arm timers under item locks seldom meet. A timer
+ * thread advances every shard to the msec clock (time_update_ms) once a
+ * tick and runs the handlers of the due timers with no lock held. Timers
+ * are never cancelled: a handler is handed back what it was armed with and
+ * must check that its object is still there and still due.
+ */
+
+struct timer_entry {
+    struct timer_entry *next;       /* next in slot or free list */
+    uint64_t           when;        /* deadline in msec */
+    timer_handler_t    handler;     /* handler */
+    void               *arg;        /* handler argument */
+    uint32_t           data;        /* handler data */
+};
+
+struct timer_wheel {
+    pthread_mutex_t    lock;                               /* wheel lock */
+    uint64_t           now;                                /* last tick run */
+    struct timer_entry *slot[TIMER_NLEVEL][TIMER_NSLOT];   /* timer slots */
+    struct timer_entry *free;                              /* free entries */
+    void               **chunk;                            /* entry chunks */
+    uint32_t           nchunk;                             /* # entry chunks */
+    struct timer_stats stats;                              /* wheel stats */
+};
+
+static struct timer_wheel *timer_wheel;   /* wheel shards */
+static pthread_t timer_tid;               /* timer thread id */
+static volatile int run_timer_thread;     /* run timer thread? */
+static bool timer_started;                /* timer thread started? */
+
+static struct timer_entry *
+timer_entry_get(struct timer_wheel *w)
+{
+    struct timer_entry *e, *chunk;
+    void **chunks;
+    uint32_t i;
+
+    if (w->free == NULL) {
+        chunks = mc_realloc(w->chunk, sizeof(*chunks) * (w->nchunk + 1));
+        if (chunks == NULL) {
+            return NULL;
+        }
+        w->chunk = chunks;
+
+        chunk = mc_alloc(sizeof(*chunk) * TIMER_CHUNK_NENTRY);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        w->chunk[w->nchunk++] = chunk;
+        w->stats.nbyte += sizeof(*chunk) * TIMER_CHUNK_NENTRY;
+
+        for (i = 0; i < TIMER_CHUNK_NENTRY; i++) {
+            chunk[i].next = w->free;
+            w->free = &chunk[i];
+        }
+    }
+
+    e = w->free;
+    w->free = e->next;
+
+    return e;
+}
+
+static void
+timer_entry_put(struct timer_wheel *w, struct timer_entry *e)
+{
+    e->next = w->free;
+    w->free = e;
+}
+
+/*
+ * Put an entry into the slot covering its deadline, as seen from tick
+ * base, which is the next tick the wheel is going to run
+ */
+static void
+timer_insert(struct timer_wheel *w, struct timer_entry *e, uint64_t base)
+{
+    struct timer_entry **slot;
+    uint64_t when, delta;
+    uint32_t level, shift;
+
+    when = MAX(e->when, base);
+    delta = when - base;
+
+    for (level = 0; level < TIMER_NLEVEL - 1; level++) {
+        if (delta < (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+            break;
+        }
+    }
+
+    shift = level * TIMER_SLOT_BITS;
+    if (delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+        /* beyond the span of the wheel, wait in the last top level slot */
+        when = base + (1ULL << ((level + 1) * TIMER_SLOT_BITS)) - 1;
+    }
+
+    slot = &w->slot[level][(when >> shift) & (TIMER_NSLOT - 1)];
+    e->next = *slot;
+    *slot = e;
+}
+
+/*
+ * Run the wheel up to tick now, moving the due entries to the fired list
+ */
+static void
+timer_advance(struct timer_wheel *w, uint64_t now, struct timer_entry **fired)
+{
+    struct timer_entry *e, *next, **slot;
+    uint64_t tick;
+    uint32_t level, shift, idx;
+
+    while (w->now < now) {
+        tick = w->now + 1;
+
+        /* cascade the slots of the levels that turned over */
+        for (level = 1; level < TIMER_NLEVEL; level++) {
+            shift = (level - 1) * TIMER_SLOT_BITS;
+            if (((tick >> shift) & (TIMER_NSLOT - 1)) != 0) {
+                break;
+            }
+
+            shift = level * TIMER_SLOT_BITS;
+            slot = &w->slot[level][(tick >> shift) & (TIMER_NSLOT - 1)];
+            e = *slot;
+            *slot = NULL;
+            for (; e != NULL; e = next) {
+                next = e->next;
+                timer_insert(w, e, tick);
+            }
+        }
+
+        idx = tick & (TIMER_NSLOT - 1);
+        for (e = w->slot[0][idx]; e != NULL; e = next) {
+            next = e->next;
+            e->next = *fired;
+            *fired = e;
+            w->stats.nentry--;
+            w->stats.fired++;
+        }
+        w->slot[0][idx] = NULL;
+
+        w->now = tick;
+    }
+}
+
+/*
+ * Arm a timer that calls handler(arg, data) at msec deadline when. The
+ * hint, typically the hash of the key the timer is for, picks the shard.
+ */
+rstatus_t
+timer_add(uint32_t hint, uint64_t when, timer_handler_t handler, void *arg,
+          uint32_t data)
+{
+    struct timer_wheel *w;
+    struct timer_entry *e;
+
+    ASSERT(timer_wheel != NULL);
+
+    w = &timer_wheel[hint & (TIMER_NSHARD - 1)];
+
+    pthread_mutex_lock(&w->lock);
+
+    e = timer_entry_get(w);
+    if (e == NULL) {
+        w->stats.alloc_fail++;
+        pthread_mutex_unlock(&w->lock);
+        return MC_ENOMEM;
+    }
+
+    e->when = when;
+    e->handler = handler;
+    e->arg = arg;
+    e->data = data;
+    timer_insert(w, e, w->now + 1);
+
+    w->stats.nentry++;
+    w->stats.total++;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return MC_OK;
+}
+
+/*
+ * Fire all the timers of a shard that are due at tick now
+ */
+static void
+timer_run(struct timer_wheel *w, uint64_t now)
+{
+    struct timer_entry *fired, *e;
+
+    fired = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (now > w->now + 1) {
+        w->stats.tick_lag = MAX(w->stats.tick_lag, now - w->now - 1);
+    }
+    timer_advance(w, now, &fired);
+    pthread_mutex_unlock(&w->lock);
+
+    for (e = fired; e != NULL; e = e->next) {
+        e->handler(e->arg, e->data);
+    }
+
+    if (fired == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while ((e = fired) != NULL) {
+        fired = e->next;
+        timer_entry_put(w, e);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void *
+timer_thread(void *arg)
+{
+    uint64_t now;
+    uint32_t i;
+
+    if (thread_bind_background(THREAD_BACKGROUND_TIMER) != MC_OK) {
+        log_error("timer thread bind failed");
+        return NULL;
+    }
+
+    while (run_timer_thread) {
+        usleep(TIMER_TICK_USEC);
+
+        time_update_ms();
+        now = time_now_ms();
+
+        for (i = 0; i < TIMER_NSHARD; i++) {
+            timer_run(&timer_wheel[i], now);
+        }
+    }
+
+    return NULL;
+}
+
+void
+timer_get_stats(struct timer_stats *stats)
+{
+    struct timer_wheel *w;
+    uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (timer_wheel == NULL) {
+        return;
+    }
+
+    for (i = 0; i < TIMER_NSHARD; i++) {
+        w = &timer_wheel[i];
+
+        pthread_mutex_lock(&w->lock);
+        stats->nentry += w->stats.nentry;
+        stats->total += w->stats.total;
+        stats->fired += w->stats.fired;
+        stats->alloc_fail += w->stats.alloc_fail;
+        stats->nbyte += w->stats.nbyte;
+        stats->tick_lag = MAX(stats->tick_lag, w->stats.tick_lag);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+rstatus_t
+timer_init(void)
+{
+    struct timer_wheel *w;
+    err_t err;
+    uint32_t i;
+
+    timer_wheel = mc_zalloc(sizeof(*timer_wheel) * TIMER_NSHARD);
+    if (timer_wheel == NULL) {
+        return MC_ENOMEM;
+    }
+
+    for (i = 0; i < TIMER_NSHARD; i++) {
+        w = &timer_wheel[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->now = time_now_ms();
+    }
+
+    run_timer_thread = 1;
+
+    err = pthread_create(&timer_tid, NULL, timer_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    timer_started = true;
+
+    return MC_OK;
+}
+
+void
+timer_deinit(void)
+{
+    struct timer_wheel *w;
+    uint32_t i, j;
+
+    if (timer_started) {
+        run_timer_thread = 0;
+
+        /* wait for the timer thread to stop */
+        pthread_join(timer_tid, NULL);
+        timer_started = false;
+    }
+
+    if (timer_wheel == NULL) {
+        return;
+    }
+
+    for (i = 0; i < TIMER_NSHARD; i++) {
+        w = &timer_wheel[i];
+        for (j = 0; j < w->nchunk; j++) {
+            mc_free(w->chunk[j]);
+        }
+        if (w->chunk != NULL) {
+            mc_free(w->chunk);
+        }
+        pthread_mutex_destroy(&w->lock);
+    }
+    mc_free(timer_wheel);
+    timer_wheel = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_TIMER_H_
+#define _MC_TIMER_H_
+
+#define TIMER_TICK_USEC     1000    /* wheel resolution, 1 msec */
+#define TIMER_SLOT_BITS     6
+#define TIMER_NSLOT         (1 << TIMER_SLOT_BITS)  /* # slots in a level */
+#define TIMER_NLEVEL        4       /* # levels, spanning 2^24 msec */
+#define TIMER_NSHARD        16      /* # independently locked wheels */
+#define TIMER_CHUNK_NENTRY  1024    /* # entries allocated at once */
+
+typedef void (*timer_handler_t)(void *arg, uint32_t data);
+
+struct timer_stats {
+    uint64_t nentry;        /* # pending timers */
+    uint64_t total;         /* # timers added */
+    uint64_t fired;         /* # timers fired */
+    uint64_t alloc_fail;    /* # timers not added for lack of memory */
+    uint64_t nbyte;         /* # bytes held by timer entries */
+    uint64_t tick_lag;      /* max # msec the wheel fell behind the clock */
+};
+
+rstatus_t timer_init(void);
+void timer_deinit(void);
+
+rstatus_t timer_add(uint32_t hint, uint64_t when, timer_handler_t handler, void *arg, uint32_t data);
+
+void timer_get_stats(struct timer_stats *stats);
+
+#endif
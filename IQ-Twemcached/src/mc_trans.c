@@ -0,0 +1,677 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Transaction and session table
+ *
+ * IQ transactions (tid) and CO sessions (sid) remember the keys they
+ * have registered on, so that commit, release and abort can walk them.
+ * The table lives outside the slab heap: entries, key sets and the
+ * arena chunks holding key bytes are carved from a pool of power of 2
+ * blocks, capped at settings.trans_maxbytes, which recycles freed blocks.
+ *
+ * The table is split into one shard per item lock stripe, and an id maps
+ * to the shard of the stripe it hashes to (see item_key_stripe). Callers
+ * hold that stripe, or the exclusive item lock, whenever they touch a
+ * transaction, so shards need no locks of their own; only the pool is
+ * shared and has a leaf lock. Entries expire like the leases they track.
+ * Their owner arms a timer that drops them at their deadline (see
+ * trans_expire); an expired entry is also dropped when it is looked up,
+ * and creating an entry sweeps a few buckets of its shard for abandoned
+ * ones.
+ */
+
+#define TRANS_POOL_MIN_POWER    6           /* smallest pool block, 64 bytes */
+#define TRANS_POOL_MAX_POWER    24          /* largest pool block, 16 MB */
+#define TRANS_POOL_NCLASS       (TRANS_POOL_MAX_POWER - TRANS_POOL_MIN_POWER + 1)
+
+#define TRANS_MIN_NSLOT         8           /* initial # key set slots */
+#define TRANS_MIN_NBUCKET       4           /* initial # buckets in a shard */
+#define TRANS_LOAD_FACTOR       2           /* # entries per bucket before growing */
+#define TRANS_CHUNK_MIN_SIZE    256         /* first arena chunk size */
+#define TRANS_CHUNK_MAX_SIZE    (64 * KB)   /* max arena chunk size */
+#define TRANS_SWEEP_NBUCKET     2           /* # buckets swept per create */
+
+#define TRANS_HDR_SIZE          offsetof(struct trans, id)
+
+struct trans_key {
+    uint32_t hash;                  /* hash of key */
+    uint8_t  nkey;                  /* key length */
+    char     key[1];                /* key */
+};
+
+#define TRANS_KEY_HDR_SIZE      offsetof(struct trans_key, key)
+
+struct trans_chunk {
+    struct trans_chunk *next;       /* next older chunk */
+    uint32_t           size;        /* chunk size, header included */
+    uint32_t           used;        /* # data bytes used */
+    char               data[1];     /* data */
+};
+
+#define TRANS_CHUNK_HDR_SIZE    offsetof(struct trans_chunk, data)
+
+struct trans_shard {
+    struct trans **bucket;          /* hash buckets */
+    uint32_t     nbucket;           /* # buckets, power of 2 */
+    uint32_t     ntrans;            /* # entries */
+    uint32_t     sweep;             /* next bucket to sweep */
+};
+
+static struct trans_shard *tshard;  /* table shards, one per item stripe */
+static uint32_t tshard_mask;        /* # shards - 1 */
+static uint32_t tshard_power;       /* log2 of # shards */
+
+static pthread_mutex_t tpool_lock;               /* pool lock */
+static void *tpool_free[TRANS_POOL_NCLASS];      /* free blocks by class */
+static struct trans_stats tstats;                /* table and pool stats */
+
+static uint32_t
+trans_pool_class(size_t size)
+{
+    uint32_t power;
+
+    for (power = TRANS_POOL_MIN_POWER; power <= TRANS_POOL_MAX_POWER; power++) {
+        if (((size_t)1 << power) >= size) {
+            break;
+        }
+    }
+
+    return power - TRANS_POOL_MIN_POWER;
+}
+
+/*
+ * Release the cached free blocks of the pool; pool lock must be held.
+ */
+static void
+trans_pool_drain(void)
+{
+    uint32_t cls;
+    void *p;
+
+    for (cls = 0; cls < TRANS_POOL_NCLASS; cls++) {
+        while ((p = tpool_free[cls]) != NULL) {
+            tpool_free[cls] = *(void **)p;
+            mc_free(p);
+            tstats.nbyte_pool -= (size_t)1 << (cls + TRANS_POOL_MIN_POWER);
+        }
+    }
+}
+
+static void *
+trans_pool_alloc(size_t size)
+{
+    uint32_t cls;
+    size_t csize;
+    void *p;
+
+    cls = trans_pool_class(size);
+    csize = (size_t)1 << (cls + TRANS_POOL_MIN_POWER);
+
+    pthread_mutex_lock(&tpool_lock);
+
+    p = NULL;
+    if (cls < TRANS_POOL_NCLASS) {
+        p = tpool_free[cls];
+        if (p != NULL) {
+            tpool_free[cls] = *(void **)p;
+        } else {
+            if (tstats.nbyte_pool + csize > settings.trans_maxbytes) {
+                trans_pool_drain();
+            }
+            if (tstats.nbyte_pool + csize <= settings.trans_maxbytes) {
+                p = mc_alloc(csize);
+            }
+            if (p != NULL) {
+                tstats.nbyte_pool += csize;
+            }
+        }
+    }
+
+    if (p != NULL) {
+        tstats.nbyte += csize;
+    } else {
+        tstats.alloc_fail++;
+    }
+
+    pthread_mutex_unlock(&tpool_lock);
+
+    return p;
+}
+
+static void
+trans_pool_free(void *p, size_t size)
+{
+    uint32_t cls;
+
+    cls = trans_pool_class(size);
+    ASSERT(cls < TRANS_POOL_NCLASS);
+
+    pthread_mutex_lock(&tpool_lock);
+    *(void **)p = tpool_free[cls];
+    tpool_free[cls] = p;
+    tstats.nbyte -= (size_t)1 << (cls + TRANS_POOL_MIN_POWER);
+    pthread_mutex_unlock(&tpool_lock);
+}
+
+/*
+ * Transactions live as long as the leases they hold (see
+ * item_lease_deadline)
+ */
+static uint64_t
+trans_exptime(void)
+{
+    uint64_t expiry = settings.lease_token_expiry;
+
+    return time_now_ms() + (expiry > 0 ? expiry : 1000);
+}
+
+static bool
+trans_expired(struct trans *t)
+{
+    return (t->exptime > 0 && t->exptime <= time_now_ms()) ? true : false;
+}
+
+static struct trans_shard *
+trans_shard(uint32_t hash)
+{
+    return &tshard[hash & tshard_mask];
+}
+
+static struct trans **
+trans_bucket(struct trans_shard *shard, uint32_t hash)
+{
+    return &shard->bucket[(hash >> tshard_power) & (shard->nbucket - 1)];
+}
+
+static size_t
+trans_keyset_size(uint32_t nslot)
+{
+    return (nslot / 2) * sizeof(struct trans_key *) + nslot * sizeof(uint32_t);
+}
+
+static void
+trans_free(struct trans *t)
+{
+    struct trans_chunk *chunk;
+
+    while ((chunk = t->chunk) != NULL) {
+        t->chunk = chunk->next;
+        trans_pool_free(chunk, chunk->size);
+    }
+
+    if (t->key != NULL) {
+        trans_pool_free(t->key, trans_keyset_size(t->nslot));
+    }
+
+    __sync_fetch_and_sub(&tstats.ntrans, 1);
+    __sync_fetch_and_sub(&tstats.nkey, t->nkey);
+
+    trans_pool_free(t, TRANS_HDR_SIZE + t->nid);
+}
+
+/*
+ * Drop the expired entries of a few buckets in a shard
+ */
+static void
+trans_sweep(struct trans_shard *shard)
+{
+    struct trans **pt, *t;
+    uint32_t i;
+
+    for (i = 0; i < TRANS_SWEEP_NBUCKET; i++) {
+        pt = &shard->bucket[shard->sweep++ & (shard->nbucket - 1)];
+        while ((t = *pt) != NULL) {
+            if (trans_expired(t)) {
+                *pt = t->next;
+                shard->ntrans--;
+                trans_free(t);
+                __sync_fetch_and_add(&tstats.expired, 1);
+            } else {
+                pt = &t->next;
+            }
+        }
+    }
+}
+
+/*
+ * Double the # buckets of a shard. Shards that cannot grow keep their
+ * buckets, which only lengthens the chains.
+ */
+static rstatus_t
+trans_shard_grow(struct trans_shard *shard)
+{
+    struct trans **bucket, **old_bucket, **pt, *t;
+    uint32_t nbucket, old_nbucket, i;
+
+    old_bucket = shard->bucket;
+    old_nbucket = shard->nbucket;
+    nbucket = (old_bucket == NULL) ? TRANS_MIN_NBUCKET : old_nbucket * 2;
+
+    if (tshard_power + __builtin_ctz(nbucket) > 32) {
+        return MC_ERROR;
+    }
+
+    bucket = trans_pool_alloc(nbucket * sizeof(*bucket));
+    if (bucket == NULL) {
+        return MC_ENOMEM;
+    }
+    memset(bucket, 0, nbucket * sizeof(*bucket));
+
+    shard->bucket = bucket;
+    shard->nbucket = nbucket;
+
+    for (i = 0; i < old_nbucket; i++) {
+        while ((t = old_bucket[i]) != NULL) {
+            old_bucket[i] = t->next;
+            pt = trans_bucket(shard, t->hash);
+            t->next = *pt;
+            *pt = t;
+        }
+    }
+
+    if (old_bucket != NULL) {
+        trans_pool_free(old_bucket, old_nbucket * sizeof(*old_bucket));
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Return the transaction or session with the given id, if any. The item
+ * stripe of the id must be held.
+ */
+struct trans *
+trans_get(trans_type_t type, const char *id, size_t nid)
+{
+    struct trans_shard *shard;
+    struct trans **pt, *t;
+    uint32_t hash;
+
+    hash = assoc_hash(id, nid);
+    shard = trans_shard(hash);
+    if (shard->bucket == NULL) {
+        return NULL;
+    }
+
+    for (pt = trans_bucket(shard, hash); (t = *pt) != NULL; pt = &t->next) {
+        if (t->hash != hash || t->type != type || t->nid != nid ||
+            memcmp(t->id, id, nid) != 0) {
+            continue;
+        }
+
+        if (trans_expired(t)) {
+            *pt = t->next;
+            shard->ntrans--;
+            trans_free(t);
+            __sync_fetch_and_add(&tstats.expired, 1);
+            return NULL;
+        }
+
+        return t;
+    }
+
+    return NULL;
+}
+
+/*
+ * Create an empty transaction or session, which must not exist yet. The
+ * item stripe of the id must be held. Returns NULL when the pool is out
+ * of memory.
+ */
+struct trans *
+trans_create(trans_type_t type, const char *id, size_t nid)
+{
+    struct trans_shard *shard;
+    struct trans **pt, *t;
+    uint32_t hash;
+
+    ASSERT(nid <= UINT8_MAX);
+    ASSERT(trans_get(type, id, nid) == NULL);
+
+    hash = assoc_hash(id, nid);
+    shard = trans_shard(hash);
+
+    if (shard->bucket == NULL ||
+        shard->ntrans >= shard->nbucket * TRANS_LOAD_FACTOR) {
+        if (trans_shard_grow(shard) != MC_OK && shard->bucket == NULL) {
+            return NULL;
+        }
+    }
+
+    t = trans_pool_alloc(TRANS_HDR_SIZE + nid);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->exptime = trans_exptime();
+    t->hash = hash;
+    t->nkey = 0;
+    t->nslot = 0;
+    t->key = NULL;
+    t->slot = NULL;
+    t->chunk = NULL;
+    t->type = (uint8_t)type;
+    t->status = TRANS_ALIVE;
+    t->nid = (uint8_t)nid;
+    memcpy(t->id, id, nid);
+
+    trans_sweep(shard);
+
+    pt = trans_bucket(shard, hash);
+    t->next = *pt;
+    *pt = t;
+    shard->ntrans++;
+
+    __sync_fetch_and_add(&tstats.ntrans, 1);
+    __sync_fetch_and_add(&tstats.total, 1);
+
+    return t;
+}
+
+/*
+ * Remove a transaction or session and release its keys
+ */
+void
+trans_remove(struct trans *t)
+{
+    struct trans_shard *shard;
+    struct trans **pt;
+
+    shard = trans_shard(t->hash);
+
+    for (pt = trans_bucket(shard, t->hash); *pt != t; pt = &(*pt)->next) {
+        ASSERT(*pt != NULL);
+    }
+
+    *pt = t->next;
+    shard->ntrans--;
+    trans_free(t);
+}
+
+/*
+ * Drop the expired entries of the bucket an id hash maps to; used by the
+ * timer armed for the id. The item stripe of the id must be held, which
+ * covers every entry of its shard. Returns the # entries dropped.
+ */
+uint32_t
+trans_expire(uint32_t hash)
+{
+    struct trans_shard *shard;
+    struct trans **pt, *t;
+    uint32_t n;
+
+    shard = trans_shard(hash);
+    if (shard->bucket == NULL) {
+        return 0;
+    }
+
+    n = 0;
+    pt = trans_bucket(shard, hash);
+    while ((t = *pt) != NULL) {
+        if (trans_expired(t)) {
+            *pt = t->next;
+            shard->ntrans--;
+            trans_free(t);
+            __sync_fetch_and_add(&tstats.expired, 1);
+            n++;
+        } else {
+            pt = &t->next;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Return the key set slot holding the key or the empty slot it would
+ * take; the key set must have room for one more key.
+ */
+static uint32_t *
+trans_slot(struct trans *t, const char *key, size_t nkey, uint32_t hash)
+{
+    struct trans_key *tk;
+    uint32_t mask, i;
+
+    mask = t->nslot - 1;
+    for (i = hash & mask; t->slot[i] != 0; i = (i + 1) & mask) {
+        tk = t->key[t->slot[i] - 1];
+        if (tk->hash == hash && tk->nkey == nkey &&
+            memcmp(tk->key, key, nkey) == 0) {
+            break;
+        }
+    }
+
+    return &t->slot[i];
+}
+
+/*
+ * Double the key set, which keeps its load at or below 1/2
+ */
+static rstatus_t
+trans_grow(struct trans *t)
+{
+    struct trans_key **key;
+    uint32_t nslot, i;
+
+    nslot = (t->nslot == 0) ? TRANS_MIN_NSLOT : t->nslot * 2;
+
+    key = trans_pool_alloc(trans_keyset_size(nslot));
+    if (key == NULL) {
+        return MC_ENOMEM;
+    }
+
+    if (t->key != NULL) {
+        memcpy(key, t->key, t->nkey * sizeof(*key));
+        trans_pool_free(t->key, trans_keyset_size(t->nslot));
+    }
+
+    t->key = key;
+    t->slot = (uint32_t *)(key + nslot / 2);
+    t->nslot = nslot;
+    memset(t->slot, 0, nslot * sizeof(*t->slot));
+
+    for (i = 0; i < t->nkey; i++) {
+        *trans_slot(t, t->key[i]->key, t->key[i]->nkey, t->key[i]->hash) = i + 1;
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Carve room for a key out of the arena of a transaction
+ */
+static struct trans_key *
+trans_key_alloc(struct trans *t, size_t nkey)
+{
+    struct trans_chunk *chunk;
+    struct trans_key *tk;
+    size_t size;
+    uint32_t csize;
+
+    size = MC_ALIGN(TRANS_KEY_HDR_SIZE + nkey, sizeof(uint32_t));
+
+    chunk = t->chunk;
+    if (chunk == NULL || chunk->used + size > chunk->size - TRANS_CHUNK_HDR_SIZE) {
+        csize = (chunk == NULL) ? TRANS_CHUNK_MIN_SIZE :
+                MIN(chunk->size * 2, TRANS_CHUNK_MAX_SIZE);
+
+        chunk = trans_pool_alloc(csize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = t->chunk;
+        chunk->size = csize;
+        chunk->used = 0;
+        t->chunk = chunk;
+    }
+
+    tk = (struct trans_key *)(chunk->data + chunk->used);
+    chunk->used += size;
+
+    return tk;
+}
+
+/*
+ * Register a key to a transaction or session, unless it already is.
+ * Registering a new key extends the life of the transaction.
+ */
+rstatus_t
+trans_add(struct trans *t, const char *key, size_t nkey)
+{
+    struct trans_key *tk;
+    uint32_t hash, *slot;
+    rstatus_t status;
+
+    ASSERT(nkey <= UINT8_MAX);
+
+    hash = assoc_hash(key, nkey);
+
+    if (t->nkey > 0 && *trans_slot(t, key, nkey, hash) != 0) {
+        return MC_OK;
+    }
+
+    if (t->nkey == t->nslot / 2) {
+        status = trans_grow(t);
+        if (status != MC_OK) {
+            return status;
+        }
+    }
+
+    tk = trans_key_alloc(t, nkey);
+    if (tk == NULL) {
+        return MC_ENOMEM;
+    }
+
+    tk->hash = hash;
+    tk->nkey = (uint8_t)nkey;
+    memcpy(tk->key, key, nkey);
+
+    slot = trans_slot(t, key, nkey, hash);
+    ASSERT(*slot == 0);
+    t->key[t->nkey++] = tk;
+    *slot = t->nkey;
+
+    t->exptime = trans_exptime();
+
+    __sync_fetch_and_add(&tstats.nkey, 1);
+
+    return MC_OK;
+}
+
+/*
+ * Is the key registered to the transaction or session?
+ */
+bool
+trans_has(struct trans *t, const char *key, size_t nkey)
+{
+    if (t->nkey == 0) {
+        return false;
+    }
+
+    return (*trans_slot(t, key, nkey, assoc_hash(key, nkey)) != 0) ? true : false;
+}
+
+/*
+ * Return the idx'th key registered to a transaction or session
+ */
+void
+trans_key(struct trans *t, uint32_t idx, char **key, size_t *nkey)
+{
+    ASSERT(idx < t->nkey);
+
+    *key = t->key[idx]->key;
+    *nkey = t->key[idx]->nkey;
+}
+
+void
+trans_get_stats(struct trans_stats *stats)
+{
+    pthread_mutex_lock(&tpool_lock);
+    *stats = tstats;
+    pthread_mutex_unlock(&tpool_lock);
+}
+
+rstatus_t
+trans_init(uint32_t nstripe)
+{
+    ASSERT(nstripe > 0 && (nstripe & (nstripe - 1)) == 0);
+
+    tshard = mc_zalloc(sizeof(*tshard) * nstripe);
+    if (tshard == NULL) {
+        return MC_ENOMEM;
+    }
+    tshard_mask = nstripe - 1;
+    tshard_power = (uint32_t)__builtin_ctz(nstripe);
+
+    pthread_mutex_init(&tpool_lock, NULL);
+    memset(tpool_free, 0, sizeof(tpool_free));
+    memset(&tstats, 0, sizeof(tstats));
+
+    return MC_OK;
+}
+
+void
+trans_deinit(void)
+{
+    struct trans_shard *shard;
+    struct trans *t;
+    uint32_t i, j;
+
+    if (tshard == NULL) {
+        return;
+    }
+
+    for (i = 0; i <= tshard_mask; i++) {
+        shard = &tshard[i];
+        for (j = 0; j < shard->nbucket; j++) {
+            while ((t = shard->bucket[j]) != NULL) {
+                shard->bucket[j] = t->next;
+                trans_free(t);
+            }
+        }
+        if (shard->bucket != NULL) {
+            trans_pool_free(shard->bucket, shard->nbucket * sizeof(*shard->bucket));
+        }
+    }
+
+    pthread_mutex_lock(&tpool_lock);
+    trans_pool_drain();
+    pthread_mutex_unlock(&tpool_lock);
+
+    mc_free(tshard);
+    tshard = NULL;
+}
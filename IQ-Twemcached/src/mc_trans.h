@@ -0,0 +1,93 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_TRANS_H_
+#define _MC_TRANS_H_
+
+#define TRANS_DEFAULT_MAXBYTES  (64 * MB)   /* memory for transaction and session key sets */
+
+typedef enum trans_type {
+    TRANS_TID,                  /* iq transaction */
+    TRANS_SID                   /* co session */
+} trans_type_t;
+
+typedef enum trans_status {
+    TRANS_ALIVE,
+    TRANS_ABORT
+} trans_status_t;
+
+struct trans_key;
+struct trans_chunk;
+
+/*
+ * A transaction or session together with the set of keys registered to
+ * it. Keys are kept in registration order and indexed by an open
+ * addressing hash set, so that registering a key and testing membership
+ * take constant time no matter how many keys a transaction touches.
+ */
+struct trans {
+    struct trans       *next;       /* next in hash bucket */
+    uint64_t           exptime;     /* expiry deadline in msec */
+    uint32_t           hash;        /* hash of id */
+    uint32_t           nkey;        /* # keys */
+    uint32_t           nslot;       /* # key set slots, power of 2 */
+    struct trans_key   **key;       /* keys in registration order */
+    uint32_t           *slot;       /* key set, index of key + 1 or 0 */
+    struct trans_chunk *chunk;      /* arena holding the keys */
+    uint8_t            type;        /* trans_type_t */
+    uint8_t            status;      /* trans_status_t */
+    uint8_t            nid;         /* id length */
+    char               id[1];       /* id */
+};
+
+struct trans_stats {
+    uint64_t ntrans;            /* # live transactions and sessions */
+    uint64_t nkey;              /* # keys registered to them */
+    uint64_t total;             /* # transactions and sessions created */
+    uint64_t expired;           /* # reclaimed after they expired */
+    uint64_t nbyte;             /* # bytes handed out by the pool */
+    uint64_t nbyte_pool;        /* # bytes held by the pool */
+    uint64_t alloc_fail;        /* # allocations refused at the pool limit */
+};
+
+rstatus_t trans_init(uint32_t nstripe);
+void trans_deinit(void);
+
+struct trans *trans_get(trans_type_t type, const char *id, size_t nid);
+struct trans *trans_create(trans_type_t type, const char *id, size_t nid);
+void trans_remove(struct trans *t);
+uint32_t trans_expire(uint32_t hash);
+
+rstatus_t trans_add(struct trans *t, const char *key, size_t nkey);
+bool trans_has(struct trans *t, const char *key, size_t nkey);
+void trans_key(struct trans *t, uint32_t idx, char **key, size_t *nkey);
+
+void trans_get_stats(struct trans_stats *stats);
+
+#endif
@@ -0,0 +1,940 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mc_core.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#   define URING_HAVE 1
+#  endif
+# endif
+#endif
+
+#ifndef URING_HAVE
+# define URING_HAVE 0
+#endif
+
+extern struct settings settings;
+
+/*
+ * io_uring network engine
+ *
+ * With -i uring, every worker thread, and the dispatcher, owns an io_uring
+ * through which its tcp sockets are driven, in place of a libevent read or
+ * write event per connection and a read or sendmsg call for every one of
+ * them. The ring fd itself is the only event a thread registers for its
+ * tcp conns: once it is readable the completions are reaped in one go,
+ * and the submissions made meanwhile go to the kernel in one io_uring_enter
+ * at the end.
+ *
+ * The dispatcher arms a multishot accept on every listening socket and
+ * hands the sockets it accepts to the workers as before. A worker arms a
+ * multishot recv on each of its conns, which picks buffers from a ring of
+ * URING_NBUF recv buffers provided to the kernel; received buffers are
+ * queued on the conn until the state machine reads them, in the states
+ * where it would have called read, and are then recycled. Replies go out
+ * with a sendmsg submission per msghdr, whose result the state machine
+ * picks up when the completion drives the conn again, so the conn state
+ * machine is the same for both engines. Udp conns stay on libevent.
+ *
+ * A conn asks to be driven again on a readable socket, or a writable one
+ * (see core_update), with a nop submission whenever the libevent engine
+ * would have fired straight away: input is queued already, or the conn
+ * yields. A conn that is closed while operations are in flight has them
+ * cancelled, and is only closed once they all have completed.
+ */
+
+#if URING_HAVE == 1
+
+#define URING_BGID      0     /* buffer group of the recv buffers */
+
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV   2
+#define URING_OP_SEND   3
+#define URING_OP_NOP    4
+#define URING_OP_CANCEL 5
+#define URING_OP_MASK   7
+
+struct uring {
+    int                      fd;          /* ring fd */
+    struct thread_worker     *t;          /* owner thread */
+    struct event             event;       /* completions to reap */
+    bool                     reaping;     /* reaping completions? */
+
+    unsigned                 *sq_head;    /* submission q head */
+    unsigned                 *sq_tail;    /* submission q tail */
+    unsigned                 *sq_flags;   /* submission q flags */
+    unsigned                 sq_mask;     /* submission q mask */
+    unsigned                 sq_entries;  /* # submission q entries */
+    unsigned                 sq_ntail;    /* tail including unpublished sqes */
+    struct io_uring_sqe      *sqes;       /* submission q entries */
+
+    unsigned                 *cq_head;    /* completion q head */
+    unsigned                 *cq_tail;    /* completion q tail */
+    unsigned                 cq_mask;     /* completion q mask */
+    struct io_uring_cqe      *cqes;       /* completion q entries */
+
+    void                     *ring;       /* mapped q rings */
+    size_t                   ring_size;   /* mapped q rings size */
+
+    struct io_uring_buf_ring *br;         /* recv buffer ring */
+    int                      nbuf;        /* # recv buffers */
+    int                      nfree;       /* # recv buffers in the ring */
+    uint16_t                 br_tail;     /* recv buffer ring tail */
+    char                     *bufs;       /* recv buffers */
+    int                      *buf_len;    /* # bytes received into a buffer */
+    int                      *buf_off;    /* # bytes of a buffer read */
+    int                      *buf_next;   /* next buffer queued on its conn */
+    struct conn              *starved;    /* conns whose recv ran out of buffers */
+};
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool
+uring_supported(void)
+{
+    return true;
+}
+
+static uint64_t
+uring_data(struct conn *c, int op)
+{
+    return (uint64_t)(uintptr_t)c | op;
+}
+
+/*
+ * Hand the sqes prepared so far to the kernel
+ */
+static void
+uring_flush(struct uring *r)
+{
+    unsigned nsqe;
+    int n;
+
+    __atomic_store_n(r->sq_tail, r->sq_ntail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        nsqe = r->sq_ntail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (nsqe == 0) {
+            return;
+        }
+
+        n = uring_enter(r->fd, nsqe, 0, 0);
+        stats_thread_incr(uring_enter);
+        if (n >= 0) {
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        /* EAGAIN or EBUSY; the sqes left go with the next flush */
+        log_debug(LOG_VERB, "io_uring enter on r %d failed: %s", r->fd,
+                  strerror(errno));
+        return;
+    }
+}
+
+/*
+ * Hand the sqes prepared so far to the kernel, unless completions are
+ * being reaped, which submits once it is done
+ */
+void
+uring_submit(struct uring *r)
+{
+    if (!r->reaping) {
+        uring_flush(r);
+    }
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if (r->sq_ntail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+        r->sq_entries) {
+        uring_flush(r);
+        if (r->sq_ntail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+            r->sq_entries) {
+            log_warn("io_uring r %d submission q is full", r->fd);
+            return NULL;
+        }
+    }
+
+    sqe = &r->sqes[r->sq_ntail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_ntail++;
+
+    return sqe;
+}
+
+/*
+ * Give recv buffer bid back to the kernel
+ */
+static void
+uring_buf_put(struct uring *r, int bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &r->br->bufs[r->br_tail & (r->nbuf - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (uint16_t)bid;
+    r->br_tail++;
+    r->nfree++;
+
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static rstatus_t
+uring_arm_accept(struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(c->thread->ring);
+    if (sqe == NULL) {
+        return MC_ENOMEM;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = c->sd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_data(c, URING_OP_ACCEPT);
+    c->u_inflight++;
+
+    return MC_OK;
+}
+
+static rstatus_t
+uring_arm_recv(struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(c->thread->ring);
+    if (sqe == NULL) {
+        return MC_ENOMEM;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uring_data(c, URING_OP_RECV);
+    c->u_recv = 1;
+    c->u_inflight++;
+
+    return MC_OK;
+}
+
+/*
+ * Have conn c driven again from the next batch of completions
+ */
+static void
+uring_arm_nop(struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->u_nop) {
+        return;
+    }
+
+    sqe = uring_sqe(c->thread->ring);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = uring_data(c, URING_OP_NOP);
+    c->u_nop = 1;
+    c->u_inflight++;
+}
+
+static void uring_accept_retry(int fd, short which, void *arg);
+
+/*
+ * Restart the accepts of listening conn c, which have stopped, a little
+ * later: on an error, rather than spin on a socket that keeps failing them,
+ * and while accepting conns is off, until it is on again. Listening conns
+ * never wait on leases, so their wait timer is free to use.
+ */
+static void
+uring_accept_later(struct conn *c)
+{
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = URING_ACCEPT_RETRY * 1000;
+    evtimer_set(&c->w_event, uring_accept_retry, c);
+    event_base_set(c->thread->base, &c->w_event);
+    evtimer_add(&c->w_event, &tv);
+}
+
+static void
+uring_accept_retry(int fd, short which, void *arg)
+{
+    struct conn *c = arg;
+
+    if (!settings.accepting_conns || uring_arm_accept(c) != MC_OK) {
+        uring_accept_later(c);
+        return;
+    }
+    uring_submit(c->thread->ring);
+}
+
+static void
+uring_complete_accept(struct conn *c, int res, bool more)
+{
+    if (res >= 0) {
+        core_accepted(c, res);
+    } else if (res == -EMFILE || res == -ENFILE) {
+        log_debug(LOG_VERB, "accept on s %d not ready - emfile", c->sd);
+        core_accept_conns(false);
+    } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+        log_error("accept on s %d failed: %s", c->sd, strerror(-res));
+    }
+
+    if (more) {
+        return;
+    }
+
+    c->u_inflight--;
+
+    if (res < 0 || !settings.accepting_conns || uring_arm_accept(c) != MC_OK) {
+        uring_accept_later(c);
+    }
+}
+
+static void
+uring_unlink_starved(struct uring *r, struct conn *c)
+{
+    struct conn **pc;
+
+    for (pc = &r->starved; *pc != NULL; pc = &(*pc)->u_next) {
+        if (*pc == c) {
+            *pc = c->u_next;
+            break;
+        }
+    }
+    c->u_next = NULL;
+    c->u_starved = 0;
+}
+
+static void
+uring_complete_recv(struct uring *r, struct conn *c, int res, uint32_t flags)
+{
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+        r->nfree--;
+
+        if (res > 0 && !c->u_closing) {
+            r->buf_len[bid] = res;
+            r->buf_off[bid] = 0;
+            r->buf_next[bid] = -1;
+            if (c->u_tail >= 0) {
+                r->buf_next[c->u_tail] = bid;
+            } else {
+                c->u_head = bid;
+            }
+            c->u_tail = bid;
+        } else {
+            uring_buf_put(r, bid);
+        }
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->u_recv = 0;
+        c->u_inflight--;
+
+        if (res == 0) {
+            c->u_eof = 1;
+        } else if (res == -ENOBUFS) {
+            /* rearmed once buffers are given back, see uring_reap */
+            if (!c->u_closing && !c->u_starved) {
+                c->u_starved = 1;
+                c->u_next = r->starved;
+                r->starved = c;
+            }
+            return;
+        } else if (res < 0 && res != -ECANCELED) {
+            c->u_err = -res;
+        }
+    }
+}
+
+static void
+uring_complete(struct uring *r, uint64_t data, int res, uint32_t flags)
+{
+    struct conn *c = (struct conn *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+    int op = (int)(data & URING_OP_MASK);
+    int which = 0;
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        uring_complete_accept(c, res, (flags & IORING_CQE_F_MORE) != 0);
+        return;
+
+    case URING_OP_RECV:
+        uring_complete_recv(r, c, res, flags);
+        which = EV_READ;
+        break;
+
+    case URING_OP_SEND:
+        c->u_send = 0;
+        c->u_sent = 1;
+        c->u_res = res;
+        c->u_inflight--;
+        which = EV_WRITE;
+        break;
+
+    case URING_OP_NOP:
+        c->u_nop = 0;
+        c->u_inflight--;
+        which = c->ev_flags & (EV_READ | EV_WRITE);
+        break;
+
+    case URING_OP_CANCEL:
+        c->u_inflight--;
+        break;
+
+    default:
+        NOT_REACHED();
+        return;
+    }
+
+    if (c->u_closing) {
+        if (c->u_inflight == 0) {
+            conn_close(c);
+        }
+        return;
+    }
+
+    if ((c->ev_flags & which) != 0) {
+        core_event_handler(c->sd, (short)which, c);
+    }
+}
+
+/*
+ * Rearm the recvs that ran out of buffers, now that some are back
+ */
+static void
+uring_feed_starved(struct uring *r)
+{
+    struct conn *c;
+
+    while (r->nfree > 0 && r->starved != NULL) {
+        c = r->starved;
+        r->starved = c->u_next;
+        c->u_next = NULL;
+        c->u_starved = 0;
+
+        if (c->ev_flags & EV_READ) {
+            core_event_handler(c->sd, EV_READ, c);
+        }
+    }
+}
+
+static void
+uring_reap(int fd, short which, void *arg)
+{
+    struct uring *r = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    uint64_t data;
+    uint32_t flags;
+    int res;
+
+    r->reaping = true;
+
+    for (;;) {
+        if (*r->sq_flags & IORING_SQ_CQ_OVERFLOW) {
+            uring_enter(r->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            break;
+        }
+
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & r->cq_mask];
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            uring_complete(r, data, res, flags);
+        }
+    }
+
+    uring_feed_starved(r);
+
+    r->reaping = false;
+
+    uring_flush(r);
+}
+
+static rstatus_t
+uring_setup_bufs(struct uring *r, int nbuf)
+{
+    struct io_uring_buf_reg reg;
+    int i, status;
+
+    r->nbuf = nbuf;
+    r->br = mmap(NULL, sizeof(struct io_uring_buf) * nbuf,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return MC_ENOMEM;
+    }
+
+    r->bufs = mc_alloc((size_t)nbuf * URING_BUF_SIZE);
+    r->buf_len = mc_alloc(sizeof(*r->buf_len) * nbuf);
+    r->buf_off = mc_alloc(sizeof(*r->buf_off) * nbuf);
+    r->buf_next = mc_alloc(sizeof(*r->buf_next) * nbuf);
+    if (r->bufs == NULL || r->buf_len == NULL || r->buf_off == NULL ||
+        r->buf_next == NULL) {
+        return MC_ENOMEM;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = (uint32_t)nbuf;
+    reg.bgid = URING_BGID;
+
+    status = uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (status < 0) {
+        log_error("io_uring register of recv buffers failed, linux 6.0 or "
+                  "newer is needed: %s", strerror(errno));
+        return MC_ERROR;
+    }
+
+    r->br_tail = 0;
+    r->nfree = 0;
+    for (i = 0; i < nbuf; i++) {
+        uring_buf_put(r, i);
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Create the io_uring of thread t, with nbuf recv buffers for a worker
+ * and none for the dispatcher, and have its completions reaped by the
+ * event loop of the thread
+ */
+struct uring *
+uring_create(struct thread_worker *t, int nbuf)
+{
+    struct io_uring_params p;
+    struct uring *r;
+    size_t sq_size, cq_size;
+    char *ring;
+    unsigned i;
+    int status;
+
+    ASSERT(nbuf == 0 || (nbuf & (nbuf - 1)) == 0);
+
+    r = mc_zalloc(sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->t = t;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = URING_ENTRIES * 4;
+
+    r->fd = uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        log_error("io_uring setup failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        log_error("io_uring of this kernel is too old, linux 6.0 or newer is "
+                  "needed");
+        return NULL;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = MAX(sq_size, cq_size);
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->ring == MAP_FAILED) {
+        log_error("io_uring mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        log_error("io_uring mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    ring = r->ring;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_flags = (unsigned *)(ring + p.sq_off.flags);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_ntail = *r->sq_tail;
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    /* sqes are submitted in the order they are taken */
+    for (i = 0; i < p.sq_entries; i++) {
+        ((unsigned *)(ring + p.sq_off.array))[i] = i;
+    }
+
+    if (nbuf > 0) {
+        status = uring_setup_bufs(r, nbuf);
+        if (status != MC_OK) {
+            return NULL;
+        }
+    }
+
+    event_set(&r->event, r->fd, EV_READ | EV_PERSIST, uring_reap, r);
+    event_base_set(t->base, &r->event);
+    status = event_add(&r->event, 0);
+    if (status < 0) {
+        log_error("event add failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    return r;
+}
+
+/*
+ * Accept on listening conn c through the ring of the dispatcher
+ */
+rstatus_t
+uring_listen(struct conn *c)
+{
+    rstatus_t status;
+
+    c->uring = 1;
+
+    status = uring_arm_accept(c);
+    if (status != MC_OK) {
+        return status;
+    }
+    uring_submit(c->thread->ring);
+
+    return MC_OK;
+}
+
+/*
+ * Drive conn c, just handed to its worker, through the worker ring
+ */
+rstatus_t
+uring_add(struct conn *c)
+{
+    rstatus_t status;
+
+    c->uring = 1;
+    c->ev_flags = EV_READ | EV_PERSIST;
+
+    status = uring_arm_recv(c);
+    if (status != MC_OK) {
+        return status;
+    }
+    uring_submit(c->thread->ring);
+
+    return MC_OK;
+}
+
+/*
+ * The io_uring counterpart of moving conn c to other libevent events
+ */
+rstatus_t
+uring_update(struct conn *c, int flags)
+{
+    c->ev_flags = flags;
+
+    /*
+     * Listening conns are updated from any thread, and pick up a change to
+     * accepting conns by themselves, see uring_accept_later
+     */
+    if (c->state == CONN_LISTEN || c->u_closing) {
+        return MC_OK;
+    }
+
+    if ((flags & EV_WRITE) ||
+        ((flags & EV_READ) && (c->u_head >= 0 || c->u_eof || c->u_err != 0))) {
+        uring_arm_nop(c);
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Read up to size bytes received on conn c into buf. Behaves as read on
+ * a nonblocking socket does, and arms the recv of c again if it has
+ * stopped.
+ */
+ssize_t
+uring_recv(struct conn *c, void *buf, size_t size)
+{
+    struct uring *r = c->thread->ring;
+    size_t n, len;
+    int bid;
+
+    n = 0;
+    while (n < size && c->u_head >= 0) {
+        bid = c->u_head;
+        len = MIN(size - n, (size_t)(r->buf_len[bid] - r->buf_off[bid]));
+
+        memcpy((char *)buf + n, r->bufs + (size_t)bid * URING_BUF_SIZE +
+               r->buf_off[bid], len);
+        n += len;
+        r->buf_off[bid] += (int)len;
+
+        if (r->buf_off[bid] == r->buf_len[bid]) {
+            c->u_head = r->buf_next[bid];
+            if (c->u_head < 0) {
+                c->u_tail = -1;
+            }
+            uring_buf_put(r, bid);
+        }
+    }
+
+    if (n > 0) {
+        return (ssize_t)n;
+    }
+
+    if (c->u_err != 0) {
+        errno = c->u_err;
+        return -1;
+    }
+
+    if (c->u_eof) {
+        return 0;
+    }
+
+    if (!c->u_recv && !c->u_starved && uring_arm_recv(c) != MC_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Send msghdr m of conn c. Returns MC_EAGAIN while the sendmsg is in
+ * flight, and MC_OK with its result in res, as sendmsg returns it, once
+ * it has completed.
+ */
+rstatus_t
+uring_sendmsg(struct conn *c, struct msghdr *m, ssize_t *res)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->u_send) {
+        /* driven by an earlier nop */
+        return MC_EAGAIN;
+    }
+
+    if (c->u_sent) {
+        c->u_sent = 0;
+        if (c->u_res < 0) {
+            errno = -c->u_res;
+            *res = -1;
+        } else {
+            *res = c->u_res;
+        }
+        return MC_OK;
+    }
+
+    sqe = uring_sqe(c->thread->ring);
+    if (sqe == NULL) {
+        errno = ENOMEM;
+        *res = -1;
+        return MC_OK;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sd;
+    sqe->addr = (uint64_t)(uintptr_t)m;
+    sqe->len = 1;
+    sqe->user_data = uring_data(c, URING_OP_SEND);
+    c->u_send = 1;
+    c->u_inflight++;
+    c->ev_flags = EV_WRITE | EV_PERSIST;
+
+    stats_thread_incr(data_sendmsg);
+
+    return MC_EAGAIN;
+}
+
+/*
+ * Get conn c ready to close. Returns true if it can be closed now, and
+ * false if operations are still in flight on it; those are cancelled, and
+ * the conn is closed once the last one completes.
+ */
+bool
+uring_drain(struct conn *c)
+{
+    struct uring *r = c->thread->ring;
+    struct io_uring_sqe *sqe;
+
+    if (c->u_inflight == 0) {
+        while (c->u_head >= 0) {
+            int bid = c->u_head;
+
+            c->u_head = r->buf_next[bid];
+            uring_buf_put(r, bid);
+        }
+        c->u_tail = -1;
+
+        if (c->u_starved) {
+            uring_unlink_starved(r, c);
+        }
+
+        return true;
+    }
+
+    if (!c->u_closing) {
+        c->u_closing = 1;
+        c->ev_flags = 0;
+
+        if (c->u_starved) {
+            uring_unlink_starved(r, c);
+        }
+
+        /* stops a recv or send the cancel cannot */
+        shutdown(c->sd, SHUT_RDWR);
+
+        sqe = uring_sqe(r);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = c->sd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = uring_data(c, URING_OP_CANCEL);
+            c->u_inflight++;
+        }
+        uring_submit(r);
+    }
+
+    return false;
+}
+
+#else
+
+bool
+uring_supported(void)
+{
+    return false;
+}
+
+struct uring *
+uring_create(struct thread_worker *t, int nbuf)
+{
+    log_error("io_uring is not supported on this platform");
+    return NULL;
+}
+
+void
+uring_submit(struct uring *r)
+{
+}
+
+rstatus_t
+uring_listen(struct conn *c)
+{
+    return MC_ERROR;
+}
+
+rstatus_t
+uring_add(struct conn *c)
+{
+    return MC_ERROR;
+}
+
+rstatus_t
+uring_update(struct conn *c, int flags)
+{
+    c->ev_flags = flags;
+    return MC_OK;
+}
+
+ssize_t
+uring_recv(struct conn *c, void *buf, size_t size)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+rstatus_t
+uring_sendmsg(struct conn *c, struct msghdr *m, ssize_t *res)
+{
+    errno = ENOSYS;
+    *res = -1;
+    return MC_OK;
+}
+
+bool
+uring_drain(struct conn *c)
+{
+    return true;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_URING_H_
+#define _MC_URING_H_
+
+typedef enum io_engine {
+    IO_ENGINE_LIBEVENT,     /* readiness from libevent, read and sendmsg per conn */
+    IO_ENGINE_URING         /* completions of a per thread io_uring */
+} io_engine_t;
+
+#define URING_ENTRIES       4096  /* # submission q entries of a ring */
+#define URING_NBUF          1024  /* # recv buffers of a worker ring, a power of 2 */
+#define URING_BUF_SIZE      4096  /* recv buffer size */
+#define URING_ACCEPT_RETRY  10    /* msec before accepts stopped by an error restart */
+
+struct uring;
+struct thread_worker;
+
+bool uring_supported(void);
+
+struct uring *uring_create(struct thread_worker *t, int nbuf);
+void uring_submit(struct uring *r);
+
+rstatus_t uring_listen(struct conn *c);
+rstatus_t uring_add(struct conn *c);
+rstatus_t uring_update(struct conn *c, int flags);
+ssize_t uring_recv(struct conn *c, void *buf, size_t size);
+rstatus_t uring_sendmsg(struct conn *c, struct msghdr *m, ssize_t *res);
+bool uring_drain(struct conn *c);
+
+#endif
@@ -35,6 +35,10 @@
 #include <stdarg.h>
 #include <execinfo.h>
 
+#ifdef __linux__
+# include <linux/filter.h>
+#endif
+
 #include <mc_core.h>
 
 int
@@ -75,6 +79,54 @@ mc_set_reuseaddr(int sd)
     return setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, len);
 }
 
+/*
+ * Let sd bind to the address that other sockets with this option set are
+ * bound to, and have the kernel spread incoming connections over them all.
+ */
+int
+mc_set_reuseport(int sd)
+{
+#ifdef SO_REUSEPORT
+    int reuse;
+    socklen_t len;
+
+    reuse = 1;
+    len = sizeof(reuse);
+
+    return setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &reuse, len);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/*
+ * Have the kernel hand a connection to the reuseport group of sd, of nsock
+ * sockets, to the one whose index in the group (the order they started
+ * listening in) is the cpu the connection arrived on modulo nsock.
+ */
+int
+mc_set_reuseport_cpu(int sd, int nsock)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nsock },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    return setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                      sizeof(prog));
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 /*
  * Disable Nagle algorithm on TCP socket.
  *
@@ -108,6 +108,8 @@ int mc_set_timeout(int sd, int timeout);
 int mc_set_blocking(int sd);
 int mc_set_nonblocking(int sd);
 int mc_set_reuseaddr(int sd);
+int mc_set_reuseport(int sd);
+int mc_set_reuseport_cpu(int sd, int nsock);
 int mc_set_tcpnodelay(int sd);
 int mc_set_keepalive(int sd);
 int mc_set_linger(int sd, int timeout);
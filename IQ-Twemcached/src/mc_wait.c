@@ -0,0 +1,280 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/time.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Lease wait lists
+ *
+ * An iqget that finds the key I leased by another client is told to back
+ * off (LEASE_HOTMISS) and its client polls until the holder has filled the
+ * key. An iqget that carries a wait timeout is parked on the wait list of
+ * its key instead: the connection stops reading requests until the I lease
+ * goes away, which is whenever the lease item is unlinked (iqset, unlease,
+ * delete, a Q lease voiding it or the lease found expired), or until its
+ * timeout or the lease expiry is up, whichever comes first. It then replays
+ * the same iqget on its own worker thread. So one fill is pushed to all the
+ * waiters, and should the holder give up, a waiter gets the lease instead.
+ *
+ * A connection is parked with the item stripe of its key held, which is
+ * the lock the lease item is unlinked under, so no wake up goes missing.
+ * Wait lists still have locks of their own, as the timer of a parked
+ * connection fires without item locks. Whoever takes a connection off a
+ * wait list resumes it: the timer does so right away, the waker hands it
+ * over to the worker thread of the connection (thread_resume).
+ */
+
+TAILQ_HEAD(wait_tqh, conn);
+
+struct wait_bucket {
+    pthread_mutex_t lock;   /* wait list lock */
+    struct wait_tqh hdr;    /* parked connections */
+};
+
+static struct wait_bucket *wait_table; /* wait lists by key hash */
+static volatile uint32_t nparked;      /* # parked connections */
+
+static int64_t
+wait_usec_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static struct wait_bucket *
+wait_bucket(uint32_t hv)
+{
+    return &wait_table[hv & (WAIT_NBUCKET - 1)];
+}
+
+/*
+ * Take a connection off its wait list, returning false if someone else
+ * did so already
+ */
+static bool
+wait_unpark(struct wait_bucket *b, struct conn *c)
+{
+    if (!c->w_parked) {
+        return false;
+    }
+
+    TAILQ_REMOVE(&b->hdr, c, w_tqe);
+    c->w_parked = false;
+    __sync_sub_and_fetch(&nparked, 1);
+    stats_thread_decr(iqget_waiting);
+
+    return true;
+}
+
+static void
+wait_timeout(int fd, short which, void *arg)
+{
+    struct conn *c = arg;
+    struct wait_bucket *b;
+    bool parked;
+
+    b = wait_bucket(c->w_hv);
+
+    pthread_mutex_lock(&b->lock);
+    parked = wait_unpark(b, c);
+    pthread_mutex_unlock(&b->lock);
+
+    /* otherwise woken up meanwhile, and on its way back to us */
+    if (!parked) {
+        return;
+    }
+
+    if (wait_usec_now() >= c->w_until) {
+        stats_thread_incr(iqget_wait_timeout);
+    }
+
+    core_resume(c);
+}
+
+/*
+ * Park connection c on the wait list of key, whose I lease expiring at
+ * exptime is held by another client. Must be called with the item stripe
+ * of key held, on the worker thread of c. Returns false if c does not
+ * want to wait, or has run out of wait time.
+ */
+bool
+wait_park(struct conn *c, char *key, size_t nkey, rel_time_t exptime)
+{
+    struct wait_bucket *b;
+    struct timeval tv;
+    int64_t now, left;
+
+    if (c->w_msec <= 0 || c->udp) {
+        return false;
+    }
+
+    now = wait_usec_now();
+    if (c->w_until == 0) {
+        c->w_until = now + (int64_t)c->w_msec * 1000;
+    }
+
+    left = c->w_until - now;
+    if (left <= 0) {
+        return false;
+    }
+
+    /*
+     * Replies held for requests pipelined ahead of this one must not wait
+     * with it: c is left off the wait list, writes them out and replays
+     * the request (see CONN_PARK in core_drive_machine)
+     */
+    if (c->hold_iov > 0) {
+        return true;
+    }
+
+    /* a lease is expired one sec after its exptime, see item_expired */
+    if (exptime > 0 && exptime >= time_now()) {
+        left = MIN(left, (int64_t)(exptime - time_now() + 1) * 1000000);
+    }
+
+    c->w_key = key;
+    c->w_nkey = nkey;
+    c->w_hv = assoc_hash(key, nkey);
+
+    b = wait_bucket(c->w_hv);
+
+    __sync_add_and_fetch(&nparked, 1);
+
+    pthread_mutex_lock(&b->lock);
+    TAILQ_INSERT_TAIL(&b->hdr, c, w_tqe);
+    c->w_parked = true;
+    pthread_mutex_unlock(&b->lock);
+
+    tv.tv_sec = left / 1000000;
+    tv.tv_usec = left % 1000000;
+
+    evtimer_set(&c->w_event, wait_timeout, c);
+    event_base_set(c->thread->base, &c->w_event);
+    evtimer_add(&c->w_event, &tv);
+
+    stats_thread_incr(iqget_wait);
+    stats_thread_incr(iqget_waiting);
+
+    log_debug(LOG_VERB, "park c %d on lease of '%.*s' for %"PRId64" usec",
+              c->sd, nkey, key, left);
+
+    return true;
+}
+
+/*
+ * Wake up all the connections parked on key. Must be called with the item
+ * stripe of key held.
+ */
+void
+wait_wake(const char *key, size_t nkey)
+{
+    struct wait_bucket *b;
+    struct conn *c, *nc;
+    uint32_t hv;
+
+    if (nparked == 0) {
+        return;
+    }
+
+    hv = assoc_hash(key, nkey);
+    b = wait_bucket(hv);
+
+    pthread_mutex_lock(&b->lock);
+    TAILQ_FOREACH_SAFE(c, &b->hdr, w_tqe, nc) {
+        if (c->w_hv != hv || c->w_nkey != nkey ||
+            memcmp(c->w_key, key, nkey) != 0) {
+            continue;
+        }
+
+        wait_unpark(b, c);
+        stats_thread_incr(iqget_wake);
+
+        thread_resume(c);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Resume a connection handed over by wait_wake, on its worker thread
+ */
+void
+wait_resume(struct conn *c)
+{
+    evtimer_del(&c->w_event);
+
+    core_resume(c);
+}
+
+uint32_t
+wait_nparked(void)
+{
+    return nparked;
+}
+
+rstatus_t
+wait_init(void)
+{
+    uint32_t i;
+
+    wait_table = mc_alloc(sizeof(*wait_table) * WAIT_NBUCKET);
+    if (wait_table == NULL) {
+        return MC_ENOMEM;
+    }
+
+    for (i = 0; i < WAIT_NBUCKET; i++) {
+        pthread_mutex_init(&wait_table[i].lock, NULL);
+        TAILQ_INIT(&wait_table[i].hdr);
+    }
+    nparked = 0;
+
+    return MC_OK;
+}
+
+void
+wait_deinit(void)
+{
+    uint32_t i;
+
+    if (wait_table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < WAIT_NBUCKET; i++) {
+        pthread_mutex_destroy(&wait_table[i].lock);
+    }
+    mc_free(wait_table);
+    wait_table = NULL;
+}
@@ -0,0 +1,434 @@
+/*
+ * iqbin - test client for the binary framing of the IQ and CO commands
+ *
+ * Runs through the commands against a server and exits nonzero on the
+ * first unexpected reply. The wire format is described in
+ * notes/binary_protocol.md.
+ *
+ *   cc -o iqbin iqbin.c
+ *   ./iqbin [host] [port]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define REQ_MAGIC       0x80
+#define RSP_MAGIC       0x81
+#define REQ_HDR_SIZE    40
+#define RSP_HDR_SIZE    24
+#define FLAG_NOREPLY    0x01
+
+enum {
+    OP_IQGET = 0x01, OP_IQSET, OP_QAREG, OP_QAREAD, OP_SAR, OP_SWAP,
+    OP_COMMIT, OP_RELEASE, OP_CIGET, OP_OQREG, OP_OQREAD, OP_OQSWAP,
+    OP_DCOMMIT, OP_VALIDATE
+};
+
+enum {
+    ST_OK, ST_STORED, ST_NOT_STORED, ST_EXISTS, ST_NOT_FOUND, ST_VALUE,
+    ST_NOVALUE, ST_LEASE, ST_LEASE_VALUE, ST_ABORT, ST_INVALID, ST_RETRY,
+    ST_FAIL, ST_CLIENT_ERROR, ST_SERVER_ERROR, ST_UNKNOWN_COMMAND
+};
+
+static const char *status_str[] = {
+    "OK", "STORED", "NOT_STORED", "EXISTS", "NOT_FOUND", "VALUE", "NOVALUE",
+    "LEASE", "LEASE_VALUE", "ABORT", "INVALID", "RETRY", "FAIL",
+    "CLIENT_ERROR", "SERVER_ERROR", "UNKNOWN_COMMAND"
+};
+
+struct req {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint8_t     arg8;
+    int32_t     config;
+    int32_t     fconfig;
+    uint32_t    dataflags;
+    int32_t     exptime;
+    uint32_t    arg;
+    uint64_t    token;
+    const char  *key;
+    const char  *tid;
+    const char  *value;
+};
+
+struct rsp {
+    uint8_t     opcode;
+    uint8_t     status;
+    uint8_t     arg8;
+    uint32_t    dataflags;
+    int32_t     config;
+    uint64_t    token;
+    uint32_t    nvalue;
+    char        value[1024];
+};
+
+static int sd;
+static int nfail;
+
+static uint64_t
+swap64(uint64_t val)
+{
+    return ((uint64_t)ntohl((uint32_t)val) << 32) | ntohl((uint32_t)(val >> 32));
+}
+
+static void
+put32(char *p, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(p, &val, 4);
+}
+
+static uint32_t
+get32(const char *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, 4);
+    return ntohl(val);
+}
+
+static void
+sendall(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(sd, buf, len, 0);
+        if (n <= 0) {
+            perror("send");
+            exit(2);
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void
+recvall(char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(sd, buf, len, 0);
+        if (n <= 0) {
+            fprintf(stderr, "recv: connection closed\n");
+            exit(2);
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void
+send_req(const struct req *r)
+{
+    char buf[REQ_HDR_SIZE + 2048];
+    size_t nkey, ntid, nvalue;
+    uint64_t token;
+
+    nkey = r->key != NULL ? strlen(r->key) : 0;
+    ntid = r->tid != NULL ? strlen(r->tid) : 0;
+    nvalue = r->value != NULL ? strlen(r->value) : 0;
+
+    memset(buf, 0, REQ_HDR_SIZE);
+    buf[0] = (char)REQ_MAGIC;
+    buf[1] = (char)r->opcode;
+    buf[2] = (char)r->flags;
+    buf[3] = (char)nkey;
+    buf[4] = (char)ntid;
+    buf[5] = (char)r->arg8;
+    put32(buf + 8, (uint32_t)(nkey + ntid + nvalue));
+    put32(buf + 12, (uint32_t)r->config);
+    put32(buf + 16, (uint32_t)r->fconfig);
+    put32(buf + 20, r->dataflags);
+    put32(buf + 24, (uint32_t)r->exptime);
+    put32(buf + 28, r->arg);
+    token = swap64(r->token);
+    memcpy(buf + 32, &token, 8);
+
+    memcpy(buf + REQ_HDR_SIZE, r->key, nkey);
+    memcpy(buf + REQ_HDR_SIZE + nkey, r->tid, ntid);
+    memcpy(buf + REQ_HDR_SIZE + nkey + ntid, r->value, nvalue);
+
+    sendall(buf, REQ_HDR_SIZE + nkey + ntid + nvalue);
+}
+
+static void
+recv_rsp(struct rsp *p)
+{
+    char buf[RSP_HDR_SIZE];
+    uint32_t nvalue;
+
+    recvall(buf, RSP_HDR_SIZE);
+    if ((uint8_t)buf[0] != RSP_MAGIC) {
+        fprintf(stderr, "bad response magic 0x%02x\n", (uint8_t)buf[0]);
+        exit(2);
+    }
+
+    p->opcode = (uint8_t)buf[1];
+    p->status = (uint8_t)buf[2];
+    p->arg8 = (uint8_t)buf[3];
+    nvalue = get32(buf + 4);
+    p->dataflags = get32(buf + 8);
+    p->config = (int32_t)get32(buf + 12);
+    memcpy(&p->token, buf + 16, 8);
+    p->token = swap64(p->token);
+
+    if (nvalue >= sizeof(p->value)) {
+        fprintf(stderr, "response value of %u bytes too large\n", nvalue);
+        exit(2);
+    }
+    recvall(p->value, nvalue);
+    p->value[nvalue] = '\0';
+    p->nvalue = nvalue;
+}
+
+/*
+ * Send r, check that the reply has status and, if value is not NULL, that
+ * it carries value
+ */
+static struct rsp
+expect(const char *what, const struct req *r, uint8_t status,
+       const char *value)
+{
+    struct rsp p;
+    bool ok;
+
+    send_req(r);
+    recv_rsp(&p);
+
+    ok = p.opcode == r->opcode && p.status == status;
+    if (ok && value != NULL) {
+        ok = p.nvalue == strlen(value) && memcmp(p.value, value, p.nvalue) == 0;
+    }
+
+    printf("%-40s %-16s %s\n", what,
+           p.status <= ST_UNKNOWN_COMMAND ? status_str[p.status] : "?",
+           ok ? "ok" : "FAILED");
+    if (!ok) {
+        fprintf(stderr, "  expected %s%s%s, got opcode 0x%02x value '%s'\n",
+                status_str[status], value != NULL ? " with " : "",
+                value != NULL ? value : "", p.opcode, p.value);
+        nfail++;
+    }
+
+    return p;
+}
+
+static struct req
+mkreq(uint8_t opcode, const char *key, const char *tid, const char *value)
+{
+    struct req r;
+
+    memset(&r, 0, sizeof(r));
+    r.opcode = opcode;
+    r.config = -1;
+    r.fconfig = -1;
+    r.key = key;
+    r.tid = tid;
+    r.value = value;
+
+    return r;
+}
+
+static void
+test_iq(void)
+{
+    struct req r;
+    struct rsp p;
+    uint64_t token;
+
+    /* a miss grants an I lease, whose holder fills the key */
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    p = expect("iqget miss", &r, ST_LEASE, NULL);
+    token = p.token;
+
+    r = mkreq(OP_IQSET, "iqbin:k1", NULL, "abc");
+    r.token = token;
+    r.dataflags = 7;
+    expect("iqset with lease", &r, ST_STORED, NULL);
+    expect("iqset with spent lease", &r, ST_NOT_STORED, NULL);
+
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    p = expect("iqget hit", &r, ST_VALUE, "abc");
+    if (p.dataflags != 7) {
+        fprintf(stderr, "  expected flags 7, got %u\n", p.dataflags);
+        nfail++;
+    }
+
+    /* a quarantined key misses until its writer commits */
+    r = mkreq(OP_QAREG, "iqbin:k1", "iqbin:t1", NULL);
+    expect("qareg", &r, ST_LEASE, NULL);
+
+    r = mkreq(OP_COMMIT, NULL, "iqbin:t1", NULL);
+    expect("commit", &r, ST_OK, NULL);
+    expect("commit again", &r, ST_NOT_FOUND, NULL);
+
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    p = expect("iqget after commit", &r, ST_LEASE, NULL);
+    token = p.token;
+
+    /* fill the key again, so a refresh can be tried */
+    r = mkreq(OP_IQSET, "iqbin:k1", NULL, "xyz");
+    r.token = token;
+    expect("iqset refill", &r, ST_STORED, NULL);
+
+    /* refresh in a transaction: read with a Q lease, swap, commit */
+    r = mkreq(OP_QAREAD, "iqbin:k1", "iqbin:t2", NULL);
+    r.arg8 = 1;
+    p = expect("qaread with value", &r, ST_LEASE_VALUE, "xyz");
+    token = p.token;
+
+    r = mkreq(OP_SWAP, "iqbin:k1", NULL, "xyz1");
+    r.token = token;
+    expect("swap", &r, ST_STORED, NULL);
+
+    r = mkreq(OP_COMMIT, NULL, "iqbin:t2", NULL);
+    expect("commit swap", &r, ST_OK, NULL);
+
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    expect("iqget swapped", &r, ST_VALUE, "xyz1");
+
+    /* a transaction that gives up leaves the value alone */
+    r = mkreq(OP_QAREAD, "iqbin:k1", "iqbin:t3", NULL);
+    expect("qaread", &r, ST_LEASE, NULL);
+
+    r = mkreq(OP_RELEASE, NULL, "iqbin:t3", NULL);
+    expect("release", &r, ST_OK, NULL);
+    expect("release again", &r, ST_NOT_FOUND, NULL);
+
+    /* refresh outside a transaction: read with a Q lease, then sar */
+    r = mkreq(OP_QAREAD, "iqbin:k1", NULL, NULL);
+    p = expect("qaread without id", &r, ST_LEASE, NULL);
+    token = p.token;
+
+    r = mkreq(OP_SAR, "iqbin:k1", NULL, "xyz2");
+    r.token = token;
+    expect("sar", &r, ST_STORED, NULL);
+    expect("sar with spent lease", &r, ST_INVALID, NULL);
+
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    expect("iqget refreshed", &r, ST_VALUE, "xyz2");
+}
+
+static void
+test_co(void)
+{
+    struct req r;
+
+    r = mkreq(OP_OQREAD, "iqbin:k3", "iqbin:s1", NULL);
+    expect("oqread miss", &r, ST_NOVALUE, NULL);
+
+    r = mkreq(OP_OQSWAP, "iqbin:k3", "iqbin:s1", "ghi");
+    expect("oqswap", &r, ST_STORED, NULL);
+
+    r = mkreq(OP_VALIDATE, NULL, "iqbin:s1", NULL);
+    expect("validate", &r, ST_OK, NULL);
+
+    r = mkreq(OP_DCOMMIT, NULL, "iqbin:s1", NULL);
+    expect("dcommit", &r, ST_OK, NULL);
+
+    r = mkreq(OP_OQREAD, "iqbin:k3", "iqbin:s2", NULL);
+    expect("oqread committed", &r, ST_VALUE, "ghi");
+
+    r = mkreq(OP_DCOMMIT, NULL, "iqbin:s2", NULL);
+    expect("dcommit reader", &r, ST_OK, NULL);
+
+    /* a key registered by one session aborts a reader in another */
+    r = mkreq(OP_OQREG, "iqbin:k3", "iqbin:s3", NULL);
+    expect("oqreg", &r, ST_OK, NULL);
+
+    r = mkreq(OP_CIGET, "iqbin:k3", "iqbin:s4", NULL);
+    expect("ciget of registered key", &r, ST_ABORT, NULL);
+
+    r = mkreq(OP_DCOMMIT, NULL, "iqbin:s3", NULL);
+    expect("dcommit writer", &r, ST_OK, NULL);
+}
+
+static void
+test_errors(void)
+{
+    struct req r;
+    char key[300];
+
+    r = mkreq(0x7f, "iqbin:k1", NULL, NULL);
+    expect("unknown opcode", &r, ST_UNKNOWN_COMMAND, NULL);
+
+    /* the value of a refused request is skipped */
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, "junk");
+    expect("iqget with value", &r, ST_CLIENT_ERROR, NULL);
+
+    memset(key, 'k', 251);
+    key[251] = '\0';
+    r = mkreq(OP_IQSET, key, NULL, "abc");
+    expect("iqset of long key", &r, ST_CLIENT_ERROR, NULL);
+
+    /* no reply to noreply, so the next reply is that of the ping */
+    r = mkreq(OP_RELEASE, NULL, "iqbin:none", NULL);
+    r.flags = FLAG_NOREPLY;
+    send_req(&r);
+
+    r = mkreq(OP_RELEASE, NULL, "iqbin:none", NULL);
+    expect("release after noreply", &r, ST_NOT_FOUND, NULL);
+
+    r = mkreq(OP_IQGET, "iqbin:k1", NULL, NULL);
+    r.arg8 = 1;
+    expect("iqget still in sync", &r, ST_VALUE, "xyz2");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *host, *port;
+    struct addrinfo hints, *ai;
+    struct timeval tv;
+    int one = 1;
+
+    host = argc > 1 ? argv[1] : "127.0.0.1";
+    port = argc > 2 ? argv[2] : "11211";
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+        return 2;
+    }
+
+    sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sd < 0 || connect(sd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        return 2;
+    }
+    freeaddrinfo(ai);
+
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    test_iq();
+    test_co();
+    test_errors();
+
+    close(sd);
+
+    printf("%d failed\n", nfail);
+
+    return nfail == 0 ? 0 : 1;
+}
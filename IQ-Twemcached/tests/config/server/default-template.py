@@ -1,3 +1,4 @@
+import os
 import subprocess
 from time import sleep
 
@@ -9,7 +10,8 @@ ARGS_UNARY = {
     'LICENSE':'-i',
     'LARGEPAGE':'-L',
     'PREALLOC':'-E',
-    'CAS':'-C'
+    'CAS':'-C',
+    'LOCKFREE_GET':'-O'
 }
 
 ARGS_BINARY = {
@@ -31,7 +33,10 @@ ARGS_BINARY = {
     'BACKLOG':'-b',
     'SLAB_SIZE':'-I',
     'AGGR_INTERVAL':'-A',
-    'SLAB_PROFILE':'-z'
+    'SLAB_PROFILE':'-z',
+    'LEASE_EXPIRY':'-G',
+    'ACCEPT':'-q',
+    'STORAGE':'-Q'
 }
 
 EXEC = 'twemcache' # command to launch twemcache
@@ -60,6 +65,7 @@ LICENSE = False
 LARGEPAGE = False
 PREALLOC = False
 CAS = False
+LOCKFREE_GET = False # serve get hits without taking item locks (-O)
 
 # Binary arguments
 PORT = '11211' # server (TCP) port (-p)
@@ -67,7 +73,7 @@ UDP = None
 SOCKET = None
 ACCESS = None
 SERVER = '127.0.0.1' # server IP (-l)
-USER = None
+USER = 'root' if os.geteuid() == 0 else None # twemcache runs as root only with -u
 EVICTION = 2 # random slab eviction by default
 MAX_MEMORY = 64 # max amount memory allocated, in MB (-m)
 CONNECTIONS = 256 # max number of concurrent connections allowed (-c)
@@ -81,6 +87,9 @@ BACKLOG = 1024
 SLAB_SIZE = NATIVE_SLAB_SIZE # (-I)
 AGGR_INTERVAL = 100000 # aggregation interval of stats, in milliseconds (-A)
 SLAB_PROFILE = None # (-z)
+LEASE_EXPIRY = None # lease expiry, in milliseconds (-G)
+ACCEPT = None # who accepts tcp connections, dispatcher, reuseport or cpu (-q)
+STORAGE = None # item storage, slab or segment (-Q)
 
 # internals, not used by launching service but useful for data generation
 ALIGNMENT = 8 # bytes
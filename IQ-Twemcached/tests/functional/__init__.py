@@ -1 +1,3 @@
-__all__ = ['basic', 'expiry', 'stats', 'advanced', 'startup', '64bit']
+__all__ = ['basic', 'expiry', 'stats', 'advanced', 'startup', '64bit',
+           'fragment', 'reaper', 'dropfrag',
+           'migrate', 'leasewait', 'batch', 'concurrency']
@@ -0,0 +1,173 @@
+__doc__ = '''
+Testing the batched IQ commands miqget, mqareg, mqaread and mcommit. Each
+answers with one line per key (per tid for mcommit), in request order, each
+the reply of the single key command with the key after the reply word,
+and ends with END.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+LEASE_HOTMISS = '3' # lease token of a key leased by someone else
+NKEY = 200 # more keys than are tokenized in one go
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+    global server
+    server = startServer(Args(command='LEASE_EXPIRY = 5000'))
+
+def tearDownModule():
+    stopServer(server)
+    print_module_done(__name__)
+
+
+class FunctionalBatch(unittest.TestCase):
+
+    # setup&teardown client
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.mc.flush_all()
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+
+    def tearDown(self):
+        self.mc.flush_all()
+        self.mc.disconnect_all()
+
+    def set(self, key, val):
+        self.conn.send_cmd("set -1 -1 %s 0 0 %d\r\n%s" % (key, len(val), val))
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+
+    def batch(self, cmd):
+        '''send a batched command, returns its reply as a list of
+        (reply word, key, other fields, value or None), END excluded'''
+        self.conn.send_cmd(cmd)
+        replies = []
+        while True:
+            line = self.conn.readline()
+            if line == "END":
+                return replies
+            fields = line.split()
+            # VALUE key flags exptime bytes config, or LEASE key flags
+            # exptime token bytes if mqaread read the value
+            if fields[0] == "VALUE":
+                val = self.conn.recv(int(fields[4]) + 2)[:-2]
+            elif fields[0] == "LEASE" and len(fields) == 6:
+                val = self.conn.recv(int(fields[5]) + 2)[:-2]
+            else:
+                val = None
+            replies.append((fields[0], fields[1], fields[2:], val))
+
+    #
+    # tests
+    #
+    def test_miqget(self):
+        '''miqget answers hits and misses in request order.'''
+        self.set("foo", "bar")
+        replies = self.batch("miqget -1 baz foo qux")
+        self.assertEqual([("LVALUE", "baz"), ("VALUE", "foo"), ("LVALUE", "qux")],
+                         [reply[:2] for reply in replies])
+        self.assertEqual("bar", replies[1][3])
+        self.assertNotEqual(LEASE_HOTMISS, replies[0][2][2])
+        self.assertNotEqual(LEASE_HOTMISS, replies[2][2][2])
+        # the batch holds the leases: a second look finds them taken
+        replies = self.batch("miqget -1 baz qux")
+        self.assertEqual([LEASE_HOTMISS, LEASE_HOTMISS],
+                         [reply[2][2] for reply in replies])
+
+    def test_miqget_fill(self):
+        '''leases from miqget are filled by iqset.'''
+        keys = ["key%d" % i for i in range(NKEY)]
+        replies = self.batch("miqget -1 %s" % ' '.join(keys))
+        self.assertEqual(keys, [reply[1] for reply in replies])
+        for word, key, fields, val in replies:
+            self.assertEqual("LVALUE", word)
+            self.conn.send_cmd("iqset -1 -1 %s 0 0 %d %s\r\n%s" %
+                               (key, len(key), fields[2], key))
+            self.assertEqual("STORED", self.conn.expect("STORED"))
+        replies = self.batch("miqget -1 %s" % ' '.join(keys))
+        self.assertEqual(keys, [reply[1] for reply in replies])
+        for word, key, fields, val in replies:
+            self.assertEqual("VALUE", word)
+            self.assertEqual(key, val)
+
+    def test_mqareg(self):
+        '''mqareg answers one LEASE line per key.'''
+        self.set("foo", "bar")
+        replies = self.batch("mqareg -1 T1 foo baz")
+        self.assertEqual([("LEASE", "foo", ["1"], None),
+                          ("LEASE", "baz", ["1"], None)], replies)
+
+    def test_mqaread(self):
+        '''mqaread with and without the value.'''
+        self.set("foo", "bar")
+        self.set("baz", "qux")
+        replies = self.batch("mqaread -1 T1 1 foo")
+        self.assertEqual(1, len(replies))
+        word, key, fields, val = replies[0]
+        self.assertEqual(("LEASE", "foo", "bar"), (word, key, val))
+        self.assertNotEqual(LEASE_HOTMISS, fields[2])
+        replies = self.batch("mqaread -1 T2 0 baz foo")
+        self.assertEqual([("LVALUE", "baz"), ("LVALUE", "foo")],
+                         [reply[:2] for reply in replies])
+        self.assertEqual([None, None], [reply[3] for reply in replies])
+        # foo is still held by T1
+        self.assertNotEqual(LEASE_HOTMISS, replies[0][2][2])
+        self.assertEqual(LEASE_HOTMISS, replies[1][2][2])
+
+    def test_mcommit(self):
+        '''mcommit answers one line per tid.'''
+        self.set("foo", "bar")
+        self.batch("mqareg -1 T1 foo")
+        self.batch("mqaread -1 T2 0 baz")
+        replies = self.batch("mcommit -1 -1 0 T1 T2 T3")
+        self.assertEqual([("OK", "T1"), ("OK", "T2"), ("NOT_FOUND", "T3")],
+                         [reply[:2] for reply in replies])
+        # the Q lease of T1 deleted foo on commit
+        self.conn.send_cmd("get -1 foo")
+        self.assertEqual("END", self.conn.expect("END"))
+
+    def test_pipelined(self):
+        '''pipelined batches are answered in order.'''
+        self.set("foo", "bar")
+        self.conn.send_cmds("miqget -1 foo\r\nmqareg -1 T1 foo\r\n"
+                            "mcommit -1 -1 0 T1\r\n")
+        self.assertEqual("VALUE foo 0 0 3", self.conn.readline()[:15])
+        self.assertEqual("bar", self.conn.readline())
+        self.assertEqual("END", self.conn.expect("END"))
+        self.assertEqual("LEASE foo 1", self.conn.readline())
+        self.assertEqual("END", self.conn.expect("END"))
+        self.assertEqual("OK T1", self.conn.readline())
+        self.assertEqual("END", self.conn.expect("END"))
+
+    def test_bad(self):
+        '''batches without keys or tids, or with a key too long.'''
+        for cmd in ["miqget -1", "mqareg -1 T1", "mqaread -1 T1 0",
+                    "mqaread -1 T1 x foo", "mcommit -1 -1 0",
+                    "miqget -1 foo %s" % ('a' * 300)]:
+            self.conn.send_cmd(cmd)
+            self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+
+if __name__ == '__main__':
+    functional_batch = unittest.TestLoader().loadTestsFromTestCase(FunctionalBatch)
+    unittest.TextTestRunner(verbosity=2).run(functional_batch)
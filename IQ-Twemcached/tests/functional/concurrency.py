@@ -0,0 +1,140 @@
+__doc__ = '''
+Testing concurrent clients: several clients write and read keys of their
+own and of each other while the hash table grows under them, and every
+value read, then and once they are done, must be the one written.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import random
+import threading
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+NCLIENT = 8
+NKEY = 15000 # keys per client, all of them more than a 2^16 table takes
+BATCH = 100 # keys a client sets, then gets, in one go
+HASH_POWER = 16 # hash power of the server when it starts
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+def key(client, i):
+    return "c%dk%d" % (client, i)
+
+def value(key):
+    '''the value of key, longer for some keys so that items span classes'''
+    return ("v-%s-" % key) * (1 + hash(key) % 8)
+
+
+class FunctionalConcurrency(unittest.TestCase):
+
+    # setup&teardown client/server
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer()
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.errors = []
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+
+    def get(self, conn, keys):
+        '''raw multi-get, returns a dict of the values of the keys hit'''
+        conn.send_cmd("get -1 %s" % ' '.join(keys))
+        values = {}
+        while True:
+            line = conn.readline()
+            if line == "END":
+                return values
+            header = line.split()
+            values[header[1]] = conn.recv(int(header[3]) + 2)[:-2]
+
+    def client(self, client):
+        '''write the keys of client a batch at a time, reading back the batch
+        and as many keys of other clients, written or not yet'''
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        conn = mc.servers[0]
+        conn.connect()
+        try:
+            for start in range(0, NKEY, BATCH):
+                keys = [key(client, i) for i in range(start, start + BATCH)]
+                conn.send_cmds(''.join(["set -1 -1 %s 0 0 %d\r\n%s\r\n" %
+                                        (k, len(value(k)), value(k))
+                                        for k in keys]))
+                for k in keys:
+                    if conn.readline() != "STORED":
+                        self.errors.append("%s not stored" % k)
+                others = [key(random.randrange(NCLIENT),
+                              random.randrange(start + BATCH))
+                          for k in keys]
+                values = self.get(conn, keys + others)
+                for k in keys:
+                    if k not in values:
+                        self.errors.append("%s not read back" % k)
+                for k, val in values.items():
+                    if val != value(k):
+                        self.errors.append("%s read as '%s'" % (k, val))
+        except Exception, e:
+            self.errors.append("client %d: %s" % (client, e))
+        mc.disconnect_all()
+
+    def run_clients(self):
+        threads = [threading.Thread(target=self.client, args=(i,))
+                   for i in range(NCLIENT)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual([], self.errors[:10])
+
+        conn = self.mc.servers[0]
+        conn.connect()
+        for client in range(NCLIENT):
+            for start in range(0, NKEY, BATCH):
+                keys = [key(client, i) for i in range(start, start + BATCH)]
+                values = self.get(conn, keys)
+                self.assertEqual([value(k) for k in keys],
+                                 [values.get(k) for k in keys])
+        stats = self.mc.get_stats('hash')[0][1]
+        self.assertTrue(int(stats['hash_power']) > HASH_POWER)
+        self.assertTrue(int(stats['expansions']) > 0)
+
+    #
+    # tests
+    #
+    def test_expand(self):
+        '''concurrent sets and gets across hash table expansions'''
+        self.run_clients()
+
+    def test_expand_lockfree(self):
+        '''the same, with gets served without item locks (-O)'''
+        self.mc.disconnect_all()
+        stopServer(self.server)
+        self.server = startServer(Args(command='LOCKFREE_GET = True'))
+        self.run_clients()
+
+if __name__ == '__main__':
+    functional_concurrency = unittest.TestLoader().loadTestsFromTestCase(FunctionalConcurrency)
+    unittest.TextTestRunner(verbosity=2).run(functional_concurrency)
@@ -0,0 +1,169 @@
+__doc__ = '''
+Testing the per-fragment item index: per-fragment accounting in
+"stats fragments" and dropping a whole fragment with dropfrag.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+NKEY = 2000
+NFRAGMENT = 4
+LEASE_HOTMISS = '3' # lease token of an iqget that did not get the lease
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+
+class FunctionalDropFragment(unittest.TestCase):
+
+    # setup&teardown client/server, leases last long enough to be dropped
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer(Args(command='LEASE_EXPIRY = 5000'))
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+        self.conn.send_cmd("updateconf 1 %d %s" %
+                           (NFRAGMENT, ' '.join(['1'] * NFRAGMENT)))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        for i in range(NKEY):
+            self.conn.send_cmd("set 1 -1 key%d 0 0 3\r\nbar" % i)
+            self.assertEqual("STORED", self.conn.expect("STORED"))
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+
+    def fragments(self):
+        return self.mc.get_stats('fragments')[0][1]
+
+    def hits(self):
+        hit = 0
+        for i in range(NKEY):
+            self.conn.send_cmd("get 1 key%d" % i)
+            line = self.conn.readline()
+            if line.startswith("VALUE"):
+                hit += 1
+                self.assertEqual("bar", self.conn.readline())
+                line = self.conn.readline()
+            self.assertEqual("END", line)
+        return hit
+
+    #
+    # tests
+    #
+    def test_stats(self):
+        '''stats fragments accounts items to their fragment.'''
+        stats = self.fragments()
+        self.assertEqual('1', stats['config'])
+        self.assertEqual(str(NFRAGMENT), stats['fragments'])
+        self.assertEqual(str(NKEY), stats['curr_items'])
+        items = 0
+        nbyte = 0
+        for i in range(NFRAGMENT):
+            self.assertTrue(int(stats['%d:curr_items' % i]) > 0)
+            items += int(stats['%d:curr_items' % i])
+            nbyte += int(stats['%d:bytes' % i])
+        self.assertEqual(NKEY, items)
+        self.assertEqual(stats['bytes'], str(nbyte))
+
+    def test_delete(self):
+        '''deleting an item leaves its fragment's count.'''
+        before = self.fragments()
+        self.conn.send_cmd("delete 1 -1 key0")
+        self.assertEqual("DELETED", self.conn.expect("DELETED"))
+        after = self.fragments()
+        self.assertEqual(str(NKEY - 1), after['curr_items'])
+        changed = [i for i in range(NFRAGMENT)
+                   if before['%d:curr_items' % i] != after['%d:curr_items' % i]]
+        self.assertEqual(1, len(changed))
+        self.assertEqual(int(before['%d:curr_items' % changed[0]]) - 1,
+                         int(after['%d:curr_items' % changed[0]]))
+
+    def test_drop(self):
+        '''dropfrag unlinks exactly one fragment.'''
+        before = self.fragments()
+        dropped = int(before['1:curr_items'])
+        self.conn.send_cmd("dropfrag 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        after = self.fragments()
+        self.assertEqual('0', after['1:curr_items'])
+        self.assertEqual('0', after['1:bytes'])
+        for i in [0, 2, 3]:
+            self.assertEqual(before['%d:curr_items' % i],
+                             after['%d:curr_items' % i])
+        self.assertEqual(str(NKEY - dropped), after['curr_items'])
+        self.assertEqual(NKEY - dropped, self.hits())
+        # dropping an empty fragment is fine
+        self.conn.send_cmd("dropfrag 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+
+    def test_droplease(self):
+        '''dropfrag drops the leases of the fragment's keys.'''
+        before = self.fragments()
+        self.conn.send_cmd("iqget 1 foo 0 1")
+        reply = self.conn.readline().split()
+        self.assertEqual("LVALUE", reply[0])
+        self.assertNotEqual(LEASE_HOTMISS, reply[4])
+        self.assertEqual("END", self.conn.expect("END"))
+        # the lease is accounted to the fragment of foo
+        after = self.fragments()
+        self.assertEqual(str(NKEY + 1), after['curr_items'])
+        changed = [i for i in range(NFRAGMENT)
+                   if before['%d:curr_items' % i] != after['%d:curr_items' % i]]
+        self.assertEqual(1, len(changed))
+        self.conn.send_cmd("dropfrag %d" % changed[0])
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.assertEqual('0', self.fragments()['%d:curr_items' % changed[0]])
+        # so another client gets a fresh lease on foo
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        conn = mc.servers[0]
+        conn.connect()
+        conn.send_cmd("iqget 1 foo 0 1")
+        reply = conn.readline().split()
+        self.assertEqual("LVALUE", reply[0])
+        self.assertNotEqual(LEASE_HOTMISS, reply[4])
+        self.assertEqual("END", conn.expect("END"))
+        mc.disconnect_all()
+
+    def test_noreply(self):
+        '''dropfrag noreply'''
+        dropped = int(self.fragments()['2:curr_items'])
+        self.conn.send_cmd("dropfrag 2 noreply")
+        self.conn.send_cmd("version")
+        self.assertEqual("VERSION", self.conn.readline().split()[0])
+        self.assertEqual(NKEY - dropped, self.hits())
+
+    def test_bad(self):
+        '''dropfrag with a fragment id out of range or not a number.'''
+        self.conn.send_cmd("dropfrag %d" % NFRAGMENT)
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        self.conn.send_cmd("dropfrag x")
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        self.assertEqual(str(NKEY), self.fragments()['curr_items'])
+
+if __name__ == '__main__':
+    functional_dropfrag = unittest.TestLoader().loadTestsFromTestCase(FunctionalDropFragment)
+    unittest.TextTestRunner(verbosity=2).run(functional_dropfrag)
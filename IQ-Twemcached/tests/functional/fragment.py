@@ -0,0 +1,188 @@
+__doc__ = '''
+Testing configuration updates that carry a fragment table (updateconf).
+Each fragment records the configuration id it was last assigned in, and
+requests whose configuration id is older than that of their key's fragment
+are rejected.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+NKEY = 200 # enough keys to land in every fragment of a small table
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+def table(nfragment, configs):
+    '''fragment table of nfragment entries, cycling through configs'''
+    return "%d %s" % (nfragment,
+                      ' '.join([str(configs[i % len(configs)])
+                                for i in range(nfragment)]))
+
+
+class FunctionalFragment(unittest.TestCase):
+
+    # setup&teardown client/server, a fresh server starts at config 0
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer()
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+
+    def fragments(self):
+        return self.mc.get_stats('fragments')[0][1]
+
+    def set_all(self, config):
+        '''set NKEY keys under config, return the replies by kind'''
+        replies = {}
+        for i in range(NKEY):
+            self.conn.send_cmd("set %d -1 key%d 0 0 3\r\nbar" % (config, i))
+            line = self.conn.readline()
+            replies[line] = replies.get(line, 0) + 1
+        return replies
+
+    #
+    # tests
+    #
+    def test_table(self):
+        '''updateconf installs a fragment table.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [1, 2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        stats = self.fragments()
+        self.assertEqual('2', stats['config'])
+        self.assertEqual('4', stats['fragments'])
+        for i in range(4):
+            self.assertEqual('0', stats['%d:curr_items' % i])
+        self.assertEqual({'STORED': NKEY}, self.set_all(2))
+        stats = self.fragments()
+        self.assertEqual(str(NKEY), stats['curr_items'])
+        total = 0
+        for i in range(4):
+            total += int(stats['%d:curr_items' % i])
+        self.assertEqual(NKEY, total)
+
+    def test_longtable(self):
+        '''a table spans more tokens than are parsed in one go.'''
+        self.conn.send_cmd("updateconf 3 %s" % table(8192, [0, 1, 2, 3]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        stats = self.fragments()
+        self.assertEqual('3', stats['config'])
+        self.assertEqual('8192', stats['fragments'])
+
+    def test_notable(self):
+        '''updateconf without a table drops the current one.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.conn.send_cmd("updateconf 3")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        stats = self.fragments()
+        self.assertEqual('3', stats['config'])
+        self.assertEqual('0', stats['fragments'])
+        self.assertEqual({'STORED': NKEY}, self.set_all(3))
+
+    def test_mismatch(self):
+        '''every fragment newer than the request rejects it.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.assertEqual({'FAIL': NKEY}, self.set_all(1))
+        self.assertEqual({'STORED': NKEY}, self.set_all(2))
+        self.conn.send_cmd("get 1 key0")
+        self.assertEqual("FAIL", self.conn.expect("FAIL"))
+        self.conn.send_cmd("get 2 key0")
+        self.assertEqual("VALUE key0 0 3", self.conn.readline()[:14])
+        self.assertEqual("bar", self.conn.readline())
+        self.assertEqual("END", self.conn.expect("END"))
+
+    def test_mismatch_fragment(self):
+        '''only the fragments moved in the new config reject old requests.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [0, 2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        replies = self.set_all(1)
+        self.assertEqual(['FAIL', 'STORED'], sorted(replies.keys()))
+        self.assertEqual(NKEY, replies['FAIL'] + replies['STORED'])
+        stats = self.fragments()
+        self.assertEqual('0', stats['1:curr_items'])
+        self.assertEqual('0', stats['3:curr_items'])
+        self.assertEqual(str(replies['STORED']),
+                         str(int(stats['0:curr_items']) +
+                             int(stats['2:curr_items'])))
+
+    def test_future(self):
+        '''requests from a config the server has not seen are rejected.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [0]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.assertEqual({'FAIL': NKEY}, self.set_all(3))
+
+    def test_noreply(self):
+        '''updateconf noreply, with and without a table.'''
+        self.conn.send_cmd("updateconf 2 %s noreply" % table(40, [1, 2]))
+        self.conn.send_cmd("version")
+        self.assertEqual("VERSION", self.conn.readline().split()[0])
+        stats = self.fragments()
+        self.assertEqual('2', stats['config'])
+        self.assertEqual('40', stats['fragments'])
+        self.conn.send_cmd("updateconf 3 noreply")
+        self.conn.send_cmd("version")
+        self.assertEqual("VERSION", self.conn.readline().split()[0])
+        stats = self.fragments()
+        self.assertEqual('3', stats['config'])
+        self.assertEqual('0', stats['fragments'])
+
+    def test_noreply_bad(self):
+        '''a rejected table is not answered under noreply.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.conn.send_cmd("updateconf 3 %s noreply" % table(40, [9]))
+        self.conn.send_cmd("version")
+        self.assertEqual("VERSION", self.conn.readline().split()[0])
+        stats = self.fragments()
+        self.assertEqual('2', stats['config'])
+        self.assertEqual('4', stats['fragments'])
+
+    def test_badtable(self):
+        '''malformed tables leave the current config alone.'''
+        self.conn.send_cmd("updateconf 2 %s" % table(4, [2]))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        # fragment assigned in a config newer than the table's own
+        self.conn.send_cmd("updateconf 3 %s" % table(40, [9]))
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        # fewer entries than announced
+        self.conn.send_cmd("updateconf 3 %s" % table(40, [1])[:-4])
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        # noreply in the middle of the table
+        self.conn.send_cmd("updateconf 3 4 noreply 1 1 1")
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        stats = self.fragments()
+        self.assertEqual('2', stats['config'])
+        self.assertEqual('4', stats['fragments'])
+
+if __name__ == '__main__':
+    functional_fragment = unittest.TestLoader().loadTestsFromTestCase(FunctionalFragment)
+    unittest.TextTestRunner(verbosity=2).run(functional_fragment)
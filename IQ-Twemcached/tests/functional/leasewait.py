@@ -0,0 +1,212 @@
+__doc__ = '''
+Testing iqget waits: an iqget that finds an I lease held by another client
+and names a wait time is parked on the key, and answered when the lease is
+filled (iqset), released (unlease) or expires, or when the wait runs out.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import threading
+import time
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+LEASE_HOTMISS = '3' # lease token of an iqget that did not get the lease
+NWAITER = 4
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+def iqget(key, wait):
+    '''iqget on a connection of its own, returns (seconds taken, reply lines)'''
+    mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+    conn = mc.servers[0]
+    conn.connect()
+    start = time.time()
+    conn.send_cmd("iqget -1 %s 0 1 %d" % (key, wait))
+    reply = [conn.readline()]
+    if reply[0].startswith("VALUE"):
+        reply.append(conn.readline())
+    reply.append(conn.readline())
+    mc.disconnect_all()
+    return (time.time() - start, reply)
+
+
+class FunctionalLeaseWait(unittest.TestCase):
+
+    # setup&teardown client/server, leases last long enough to be waited on
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer(Args(command='LEASE_EXPIRY = 5000'))
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+        self.replies = []
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+
+    def lease(self, key):
+        '''take the I lease on key, returns its token'''
+        self.conn.send_cmd("iqget -1 %s 0 1" % key)
+        reply = self.conn.readline().split()
+        self.assertEqual("LVALUE", reply[0])
+        self.assertNotEqual(LEASE_HOTMISS, reply[4])
+        self.assertEqual("END", self.conn.expect("END"))
+        return reply[4]
+
+    def park(self, key, wait, nwaiter=NWAITER):
+        '''start nwaiter iqgets on key, each waiting up to wait msec'''
+        def waiter():
+            self.replies.append(iqget(key, wait))
+        threads = [threading.Thread(target=waiter) for i in range(nwaiter)]
+        for thread in threads:
+            thread.start()
+        time.sleep(0.3) # let them park
+        return threads
+
+    def stats(self):
+        time.sleep(STATS_DELAY)
+        return self.mc.get_stats()[0][1]
+
+    #
+    # tests
+    #
+    def test_iqset(self):
+        '''parked iqgets get the value of the iqset that fills the lease.'''
+        token = self.lease("foo")
+        threads = self.park("foo", 3000)
+        self.assertEqual(0, len(self.replies))
+        self.conn.send_cmd("iqset -1 -1 foo 0 0 3 %s\r\nbar" % token)
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+        for thread in threads:
+            thread.join()
+        self.assertEqual(NWAITER, len(self.replies))
+        for elapsed, reply in self.replies:
+            self.assertTrue(elapsed < 3)
+            self.assertEqual("VALUE foo 0 0 3", reply[0][:15])
+            self.assertEqual(["bar", "END"], reply[1:])
+        stats = self.stats()
+        self.assertEqual(str(NWAITER), stats['iqget_wait'])
+        self.assertEqual(str(NWAITER), stats['iqget_wake'])
+        self.assertEqual('0', stats['iqget_waiting'])
+
+    def test_unlease(self):
+        '''a released lease passes to one parked iqget.'''
+        token = self.lease("foo")
+        threads = self.park("foo", 3000, 1)
+        self.conn.send_cmd("unlease -1 foo %s" % token)
+        self.assertEqual("DELETED", self.conn.expect("DELETED"))
+        threads[0].join()
+        elapsed, reply = self.replies[0]
+        self.assertTrue(elapsed < 3)
+        reply = reply[0].split()
+        self.assertEqual("LVALUE", reply[0])
+        self.assertNotEqual(LEASE_HOTMISS, reply[4])
+        self.assertNotEqual(token, reply[4])
+
+    def test_expire(self):
+        '''an expired lease passes to one parked iqget.'''
+        self.mc.disconnect_all()
+        stopServer(self.server)
+        self.server = startServer(Args(command='LEASE_EXPIRY = 500'))
+        self.conn.connect()
+        token = self.lease("foo")
+        elapsed, reply = iqget("foo", 3000)
+        self.assertTrue(elapsed < 3)
+        reply = reply[0].split()
+        self.assertEqual("LVALUE", reply[0])
+        self.assertNotEqual(LEASE_HOTMISS, reply[4])
+        self.assertNotEqual(token, reply[4])
+
+    def test_timeout(self):
+        '''a parked iqget gives up after its wait time.'''
+        self.lease("foo")
+        elapsed, reply = iqget("foo", 300)
+        self.assertTrue(elapsed >= 0.25)
+        self.assertTrue(elapsed < 3)
+        self.assertEqual(["LVALUE", LEASE_HOTMISS], reply[0].split()[::4])
+        self.assertEqual("END", reply[1])
+        stats = self.stats()
+        self.assertEqual('1', stats['iqget_wait_timeout'])
+        self.assertEqual('0', stats['iqget_waiting'])
+
+    def test_nowait(self):
+        '''without a wait time iqget does not park.'''
+        self.lease("foo")
+        elapsed, reply = iqget("foo", 0)
+        self.assertTrue(elapsed < 0.25)
+        self.assertEqual(["LVALUE", LEASE_HOTMISS], reply[0].split()[::4])
+        self.assertEqual('0', self.stats()['iqget_wait'])
+
+    def test_pipelined(self):
+        '''requests behind a parked iqget are served after it.'''
+        token = self.lease("foo")
+        self.conn.send_cmd("set -1 -1 bar 0 0 3\r\nbaz")
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        conn = mc.servers[0]
+        conn.connect()
+        conn.send_cmds("iqget -1 foo 0 1 3000\r\nget -1 bar\r\n")
+        time.sleep(0.3)
+        self.conn.send_cmd("iqset -1 -1 foo 0 0 3 %s\r\nbar" % token)
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+        self.assertEqual("VALUE foo 0 0 3", conn.readline()[:15])
+        self.assertEqual("bar", conn.readline())
+        self.assertEqual("END", conn.expect("END"))
+        self.assertEqual("VALUE bar 0 3", conn.readline()[:13])
+        self.assertEqual("baz", conn.readline())
+        self.assertEqual("END", conn.expect("END"))
+        mc.disconnect_all()
+
+    def test_pipelined_ahead(self):
+        '''replies to requests ahead of a parked iqget are not held back.'''
+        token = self.lease("foo")
+        self.conn.send_cmd("set -1 -1 bar 0 0 3\r\nbaz")
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        conn = mc.servers[0]
+        conn.connect()
+        start = time.time()
+        conn.send_cmds("get -1 bar\r\niqget -1 foo 0 1 3000\r\n")
+        self.assertEqual("VALUE bar 0 3", conn.readline()[:13])
+        self.assertEqual("baz", conn.readline())
+        self.assertEqual("END", conn.expect("END"))
+        self.assertTrue(time.time() - start < 1)
+        self.assertEqual('1', self.stats()['iqget_waiting'])
+        self.conn.send_cmd("iqset -1 -1 foo 0 0 3 %s\r\nbar" % token)
+        self.assertEqual("STORED", self.conn.expect("STORED"))
+        self.assertEqual("VALUE foo 0 0 3", conn.readline()[:15])
+        self.assertEqual("bar", conn.readline())
+        self.assertEqual("END", conn.expect("END"))
+        mc.disconnect_all()
+
+    def test_badwait(self):
+        '''iqget with a wait time that is not a number.'''
+        self.conn.send_cmd("iqget -1 foo 0 1 x")
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+
+if __name__ == '__main__':
+    functional_leasewait = unittest.TestLoader().loadTestsFromTestCase(FunctionalLeaseWait)
+    unittest.TextTestRunner(verbosity=2).run(functional_leasewait)
@@ -0,0 +1,186 @@
+__doc__ = '''
+Testing fragment migration: bulkset, the compact bulk insert the stream is
+made of, and migrate, which streams a fragment into a second instance.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import struct
+import time
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+NKEY = 2000
+PEER_PORT = str(int(PORT) + 1) # the instance fragments are migrated into
+MIGRATE_WAIT = 10 # seconds we give a migration to finish
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+def record(key, val, flags=0, exptime=0, config=0):
+    '''one bulkset record: key length, flags, exptime, config, value length'''
+    return struct.pack("!BIIiI", len(key), flags, exptime, config,
+                       len(val)) + key + val
+
+
+class FunctionalMigrate(unittest.TestCase):
+
+    # setup&teardown client/server
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer()
+        self.peer = None
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+        if self.peer:
+            stopServer(self.peer)
+
+    def get(self, conn, config, key):
+        '''raw get, returns (flags, value) or None on a miss'''
+        conn.send_cmd("get %d %s" % (config, key))
+        line = conn.readline()
+        if line == "END":
+            return None
+        header = line.split()
+        self.assertEqual(["VALUE", key], header[:2])
+        val = conn.recv(int(header[3]) + 2)[:-2]
+        self.assertEqual("END", conn.expect("END"))
+        return (int(header[2]), val)
+
+    def bulkset(self, payload):
+        self.conn.send_cmd("bulkset -1 %d\r\n%s" % (len(payload), payload))
+        return self.conn.readline()
+
+    #
+    # tests
+    #
+    def test_bulkset(self):
+        '''bulkset inserts every record.'''
+        payload = record("bulk1", "bar", flags=7) + \
+                  record("bulk2", "baz" * 1000, flags=8)
+        self.assertEqual("STORED", self.bulkset(payload))
+        self.assertEqual((7, "bar"), self.get(self.conn, -1, "bulk1"))
+        self.assertEqual((8, "baz" * 1000), self.get(self.conn, -1, "bulk2"))
+        self.assertEqual("STORED", self.bulkset(""))
+
+    def test_noreply(self):
+        '''bulkset noreply'''
+        payload = record("bulk1", "bar")
+        self.conn.send_cmd("bulkset -1 %d noreply\r\n%s" %
+                           (len(payload), payload))
+        self.conn.send_cmd("version")
+        self.assertEqual("VERSION", self.conn.readline().split()[0])
+        self.assertEqual((0, "bar"), self.get(self.conn, -1, "bulk1"))
+
+    def test_malformed(self):
+        '''bulkset with a truncated record or a missing terminator.'''
+        payload = record("bulk1", "bar") + record("bulk2", "baz")
+        self.assertEqual("CLIENT_ERROR", self.bulkset(payload[:-2]).split()[0])
+        self.conn.send_cmd("bulkset -1 %d" % len(payload))
+        self.conn.send_cmds(payload + "xx")
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        # the connection is still usable
+        self.assertEqual("STORED", self.bulkset(payload))
+        self.assertEqual((0, "baz"), self.get(self.conn, -1, "bulk2"))
+
+    def test_toolarge(self):
+        '''bulkset larger than a migration chunk is rejected.'''
+        self.conn.send_cmd("bulkset -1 %d" % (1024 * 1024 * 1024))
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+
+    def test_migrate(self):
+        '''migrate streams one fragment into a second instance.'''
+        self.peer = startServer(Args(command="PORT = '%s'" % PEER_PORT))
+        mc_peer = memcache.Client(["%s:%s" % (SERVER, PEER_PORT)], debug=0)
+        peer = mc_peer.servers[0]
+        peer.connect()
+
+        # fragment 1 moves from this instance to the peer in config 2
+        self.conn.send_cmd("updateconf 1 4 1 1 1 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        peer.send_cmd("updateconf 2 4 1 2 1 1")
+        self.assertEqual("OK", peer.expect("OK"))
+        for i in range(NKEY):
+            self.conn.send_cmd("set 1 -1 key%d %d 0 %d\r\n%s" %
+                               (i, i, len("val%d" % i), "val%d" % i))
+            self.assertEqual("STORED", self.conn.expect("STORED"))
+        moved = int(self.mc.get_stats('fragments')[0][1]['1:curr_items'])
+        self.assertTrue(moved > 0)
+
+        # a key of fragment 1 already written at the peer is not overwritten
+        for i in range(NKEY):
+            peer.send_cmd("set 2 -1 key%d 0 0 3\r\nnew" % i)
+            self.assertEqual("STORED", peer.expect("STORED"))
+            if mc_peer.get_stats('fragments')[0][1]['1:curr_items'] == '1':
+                fresh = i
+                break
+            peer.send_cmd("delete 2 -1 key%d" % i)
+            self.assertEqual("DELETED", peer.expect("DELETED"))
+
+        self.conn.send_cmd("migrate 1 %s %s" % (SERVER, PEER_PORT))
+        self.assertEqual("OK", self.conn.expect("OK"))
+        deadline = time.time() + MIGRATE_WAIT
+        while True:
+            stats = self.mc.get_stats('migrate')[0][1]
+            if stats['running'] == '0' and stats['migration_done'] == '1':
+                break
+            self.assertTrue(time.time() < deadline)
+            time.sleep(0.1)
+        self.assertEqual('0', stats['migration_fail'])
+        self.assertEqual(str(moved), stats['item_sent'])
+        stats = mc_peer.get_stats('migrate')[0][1]
+        self.assertEqual(str(moved), stats['item_received'])
+        self.assertEqual(str(moved - 1), stats['item_imported'])
+
+        hit = 0
+        for i in range(NKEY):
+            item = self.get(peer, 2, "key%d" % i)
+            if item is None:
+                continue
+            hit += 1
+            if i == fresh:
+                self.assertEqual((0, "new"), item)
+            else:
+                self.assertEqual((i, "val%d" % i), item)
+        self.assertEqual(moved, hit)
+        self.assertEqual(str(moved),
+                         mc_peer.get_stats('fragments')[0][1]['1:curr_items'])
+        mc_peer.disconnect_all()
+
+    def test_badmigrate(self):
+        '''migrate a fragment that does not exist.'''
+        self.conn.send_cmd("updateconf 1 4 1 1 1 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        self.conn.send_cmd("migrate 9 %s %s" % (SERVER, PEER_PORT))
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+        self.conn.send_cmd("migrate x %s %s" % (SERVER, PEER_PORT))
+        self.assertEqual("CLIENT_ERROR", self.conn.readline().split()[0])
+
+if __name__ == '__main__':
+    functional_migrate = unittest.TestLoader().loadTestsFromTestCase(FunctionalMigrate)
+    unittest.TextTestRunner(verbosity=2).run(functional_migrate)
@@ -0,0 +1,136 @@
+__doc__ = '''
+Testing the stale fragment reaper. Once a config update moves a fragment
+away, the items stored in it under an older config are unlinked in the
+background instead of waiting for eviction or a read.
+'''
+__author__ = "Yao Yue <yao@twitter.com>"
+__version__ = "0.1-1.45"
+
+import time
+import sys
+try:
+    from lib import memcache
+except ImportError:
+    print "Check your sys.path setting to include lib/memcache.py."
+    sys.exit()
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+# handling server and data configurations
+from config.defaults import *
+from lib.utilities import *
+from lib.logging import print_module_title, print_module_done
+
+NKEY = 2000
+REAPER_WAIT = 5 # seconds we give the reaper to finish a pass
+
+def setUpModule():
+    print_module_title(__name__)
+    global counter
+    counter = 0
+
+def tearDownModule():
+    print_module_done(__name__)
+
+
+class FunctionalReaper(unittest.TestCase):
+
+    # setup&teardown client/server
+    def setUp(self):
+        global counter
+        counter += 1
+        print "  running test %d" % counter
+        self.server = startServer()
+        self.mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        self.conn = self.mc.servers[0]
+        self.conn.connect()
+
+    def tearDown(self):
+        self.mc.disconnect_all()
+        stopServer(self.server)
+
+    def stats(self, kind):
+        return self.mc.get_stats(kind)[0][1]
+
+    def load(self):
+        '''four fragments all assigned in config 1, NKEY keys spread over them'''
+        self.conn.send_cmd("updateconf 1 4 1 1 1 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        for i in range(NKEY):
+            self.conn.send_cmd("set 1 -1 key%d 0 0 3\r\nbar" % i)
+            self.assertEqual("STORED", self.conn.expect("STORED"))
+        return self.stats('fragments')
+
+    def wait_pass(self, npass):
+        '''wait until the reaper has completed more than npass passes'''
+        deadline = time.time() + REAPER_WAIT
+        while time.time() < deadline:
+            stats = self.stats('reaper')
+            if int(stats['pass_done']) > npass and stats['running'] == '0':
+                return stats
+            time.sleep(0.1)
+        self.fail("reaper did not finish a pass in %d seconds" % REAPER_WAIT)
+
+    def reap(self):
+        '''move fragment 1 away, the reaper unlinks exactly its items'''
+        before = self.load()
+        moved = int(before['1:curr_items'])
+        self.assertTrue(moved > 0)
+        npass = int(self.stats('reaper')['pass_done'])
+        self.conn.send_cmd("updateconf 2 4 1 2 1 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        stats = self.wait_pass(npass)
+        self.assertEqual(str(moved), stats['item_reaped'])
+        self.assertTrue(int(stats['byte_reaped']) > 0)
+        after = self.stats('fragments')
+        self.assertEqual('0', after['1:curr_items'])
+        self.assertEqual('0', after['1:bytes'])
+        for i in [0, 2, 3]:
+            self.assertEqual(before['%d:curr_items' % i],
+                             after['%d:curr_items' % i])
+        self.assertEqual(str(NKEY - moved), after['curr_items'])
+
+    #
+    # tests
+    #
+    def test_stats(self):
+        '''stats reaper'''
+        stats = self.stats('reaper')
+        for key in ['enabled', 'rate', 'running', 'slab', 'pass', 'pass_done',
+                    'pass_restart', 'pass_start_ts', 'pass_end_ts',
+                    'item_scanned', 'item_reaped', 'byte_reaped']:
+            self.assertIn(key, stats)
+        self.assertEqual('1', stats['enabled'])
+        self.assertEqual('0', stats['item_reaped'])
+
+    def test_reap(self):
+        '''items of a fragment moved away are reaped.'''
+        self.reap()
+
+    def test_reap_segment(self):
+        '''items of a fragment moved away are reaped from segments.'''
+        self.mc.disconnect_all()
+        stopServer(self.server)
+        self.server = startServer(Args(command='STORAGE = "segment"'))
+        self.conn.connect()
+        self.reap()
+
+    def test_keep(self):
+        '''a config update that moves nothing reaps nothing.'''
+        before = self.load()
+        npass = int(self.stats('reaper')['pass_done'])
+        self.conn.send_cmd("updateconf 2 4 1 1 1 1")
+        self.assertEqual("OK", self.conn.expect("OK"))
+        stats = self.wait_pass(npass)
+        self.assertEqual('0', stats['item_reaped'])
+        self.assertEqual(str(NKEY), self.stats('fragments')['curr_items'])
+        self.conn.send_cmd("get 2 key0")
+        self.assertEqual("VALUE key0 0 3", self.conn.readline()[:14])
+        self.assertEqual("bar", self.conn.readline())
+        self.assertEqual("END", self.conn.expect("END"))
+
+if __name__ == '__main__':
+    functional_reaper = unittest.TestLoader().loadTestsFromTestCase(FunctionalReaper)
+    unittest.TextTestRunner(verbosity=2).run(functional_reaper)
@@ -0,0 +1,94 @@
+'''
+Connection accept benchmark.
+
+Starts a twemcache instance once for every accept mode (-q dispatcher,
+reuseport and cpu) and drives it with a reconnect storm, the way clients
+hit a server right after a reconfiguration: client processes that each
+connect, send one request, read the reply and close, over and over. The
+connections accepted per second are reported for every mode. Example:
+
+    python accept.py -e ../../src/twemcache -c 8 -d 10
+'''
+
+from __future__ import print_function
+
+import argparse
+import multiprocessing
+import socket
+import struct
+import sys
+import time
+
+import launch
+
+def client(port, duration, result):
+    nconn = 0
+    nfail = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        try:
+            sock = socket.create_connection(("127.0.0.1", port), timeout=5)
+            # reset on close, so that the client ports are not held in
+            # time wait for the length of the run
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                            struct.pack('ii', 1, 0))
+            sock.sendall(b"get -1 key:accept\r\n")
+            buf = b''
+            while not buf.endswith(b"\r\n"):
+                data = sock.recv(4096)
+                if not data:
+                    raise IOError("connection closed")
+                buf += data
+            sock.close()
+            nconn += 1
+            # the key is never set
+            if buf != b"END\r\n":
+                errors += 1
+        except (IOError, socket.error):
+            nfail += 1
+    result.put((nconn, nfail, errors))
+
+def run(args, mode):
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory,
+                                 "-b", 4096, "-q", mode])
+    try:
+        result = multiprocessing.Queue()
+        procs = [multiprocessing.Process(target=client,
+                                         args=(args.port, args.duration,
+                                               result))
+                 for n in range(args.clients)]
+        for p in procs:
+            p.start()
+        counts = [result.get() for p in procs]
+        for p in procs:
+            p.join()
+        nconn = sum(c[0] for c in counts)
+        nfail = sum(c[1] for c in counts)
+        return nconn / float(args.duration), nfail, sum(c[2] for c in counts)
+    finally:
+        launch.stop(server)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-q', '--modes', default='dispatcher,reuseport,cpu',
+                        help='accept modes, to compare')
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=8)
+    parser.add_argument('-d', '--duration', type=float, default=10)
+    parser.add_argument('-m', '--memory', type=int, default=64)
+    args = parser.parse_args()
+
+    print("%-12s%14s%10s" % ("accept", "accepts/s", "failed"))
+    errors = 0
+    for mode in args.modes.split(','):
+        rate, nfail, nerror = run(args, mode)
+        print("%-12s%14.0f%10d" % (mode, rate, nfail))
+        sys.stdout.flush()
+        errors += nerror
+    launch.check(errors)
+
+if __name__ == '__main__':
+    main()
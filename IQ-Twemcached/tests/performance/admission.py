@@ -0,0 +1,159 @@
+'''
+Admission filter benchmark on a scan-polluted Zipfian trace.
+
+Starts one twemcache instance per admission sketch size (-N), with less
+memory than the key space needs, and drives it from client processes that
+each get a key drawn from a Zipfian distribution and set it on a miss, as
+a look-aside cache is used. A share of the requests are a scan instead:
+gets and sets of keys that are never asked for again, as a reporting job
+reading cold rows does. Reports the hit ratio of the Zipfian keys, the
+throughput and the items the filter let in and kept out for each sketch
+size. Example:
+
+    python admission.py -e ../../src/twemcache -N 0,10 -S 0.5 -d 60
+'''
+
+from __future__ import print_function
+
+import argparse
+import bisect
+import multiprocessing
+import random
+import socket
+import sys
+import time
+
+import launch
+
+def recv_until(sock, buf, term):
+    while term not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    idx = buf.index(term) + len(term)
+    return buf[:idx], buf[idx:]
+
+def zipf_cdf(nkeys, alpha):
+    cdf = []
+    total = 0.0
+    for rank in range(1, nkeys + 1):
+        total += 1.0 / rank ** alpha
+        cdf.append(total)
+    return [c / total for c in cdf]
+
+def client(port, duration, nkeys, cdf, scan, value, filtered, seed, result):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    rand = random.Random(seed)
+    buf = b''
+    gets = 0
+    hits = 0
+    nscan = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        if rand.random() < scan:
+            key = ("scan:%d:%d" % (seed, nscan)).encode()
+            nscan += 1
+        else:
+            # scatter ranks over the key space, so hot keys share no slab
+            rank = bisect.bisect_left(cdf, rand.random())
+            key = ("key:%d" % (rank * 7919 % nkeys)).encode()
+        sock.sendall(b"get -1 " + key + b"\r\n")
+        line, buf = recv_until(sock, buf, b"END\r\n")
+        hit = line.startswith(b"VALUE " + key + b" ")
+        if not hit and line != b"END\r\n":
+            errors += 1
+        if not key.startswith(b"scan"):
+            gets += 1
+            if hit:
+                hits += 1
+                continue
+        elif hit:
+            continue
+        sock.sendall(b"set -1 -1 " + key + b" 0 0 " +
+                     str(len(value)).encode() + b"\r\n" + value + b"\r\n")
+        line, buf = recv_until(sock, buf, b"\r\n")
+        # only the admission filter may turn a set away
+        if line != b"STORED\r\n" and (not filtered or
+                                        line != b"NOT_STORED\r\n"):
+            errors += 1
+    sock.close()
+    result.put((gets, hits, nscan, errors))
+
+def stats(port, cmd, names):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.sendall(cmd + b"\r\n")
+    data, buf = recv_until(sock, b'', b"END\r\n")
+    sock.close()
+    total = dict((name, 0) for name in names)
+    for line in data.decode().split("\r\n"):
+        fields = line.split()
+        if len(fields) != 3:
+            continue
+        # per class stats are prefixed with their class id
+        name = fields[1].split(':')[-1]
+        if name in total and fields[2].isdigit():
+            total[name] += int(fields[2])
+    return total
+
+def run(args, sketch, cdf):
+    port = args.port
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory,
+                                 "-N", sketch])
+    try:
+        value = b'x' * args.value
+        result = multiprocessing.Queue()
+        procs = [multiprocessing.Process(target=client,
+                                         args=(port, args.duration, args.keys,
+                                               cdf, args.scan, value,
+                                               sketch > 0, n * 104729 + 1,
+                                               result))
+                 for n in range(args.clients)]
+        for p in procs:
+            p.start()
+        counts = [result.get() for p in procs]
+        for p in procs:
+            p.join()
+        admit = stats(port, b"stats slabs", ["item_admit", "item_admit_reject"])
+    finally:
+        launch.stop(server)
+    gets = sum(c[0] for c in counts)
+    hits = sum(c[1] for c in counts)
+    nreq = gets + sum(c[2] for c in counts)
+    errors = sum(c[3] for c in counts)
+    return (hits / float(max(gets, 1)), nreq / float(args.duration),
+            admit["item_admit"], admit["item_admit_reject"], errors)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-N', '--sketch', default='0,10',
+                        help='admission sketch sizes, per mille of max memory, to compare')
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=4)
+    parser.add_argument('-d', '--duration', type=float, default=30)
+    parser.add_argument('-m', '--memory', type=int, default=8)
+    parser.add_argument('-k', '--keys', type=int, default=200000)
+    parser.add_argument('-s', '--value', type=int, default=100)
+    parser.add_argument('-z', '--alpha', type=float, default=0.99,
+                        help='Zipfian skew of key popularity')
+    parser.add_argument('-S', '--scan', type=float, default=0.5,
+                        help='share of requests that scan keys read only once')
+    args = parser.parse_args()
+
+    cdf = zipf_cdf(args.keys, args.alpha)
+    print("%-8s%12s%12s%12s%12s" % ("sketch", "hit ratio", "req/s", "admit",
+                                     "reject"))
+    errors = 0
+    for sketch in [int(n) for n in args.sketch.split(',')]:
+        ratio, rate, admit, reject, nerror = run(args, sketch, cdf)
+        print("%-8d%12.4f%12.0f%12d%12d" % (sketch, ratio, rate, admit, reject))
+        sys.stdout.flush()
+        errors += nerror
+    launch.check(errors)
+
+if __name__ == '__main__':
+    main()
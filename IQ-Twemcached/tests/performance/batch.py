@@ -0,0 +1,147 @@
+'''
+Batched IQ command benchmark.
+
+Starts a twemcache instance and drives it from client processes that each
+run write transactions over a number of keys, the way a cache-augmented
+transaction does: register every key with the transaction (qareg), read
+it under a Q lease (qaread) and commit. Each client runs the transaction
+first with one command per key, then with the batched commands (mqareg,
+mqaread, mcommit), and the throughput and mean latency of both are
+reported for every transaction size. Example:
+
+    python batch.py -e ../../src/twemcache -k 1,10,50 -d 10
+'''
+
+from __future__ import print_function
+
+import argparse
+import multiprocessing
+import random
+import socket
+import sys
+import time
+
+import launch
+
+def recv_until(sock, buf, term):
+    while term not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    idx = buf.index(term) + len(term)
+    return buf[:idx], buf[idx:]
+
+def batch_ok(reply, word, keys):
+    '''one line per key, in order, with the key after the reply word'''
+    lines = reply.split(b"\r\n")
+    if lines[-2:] != [b"END", b""] or len(lines) != len(keys) + 2:
+        return False
+    for line, key in zip(lines, keys):
+        if not line.startswith(word + b" " + key + b" "):
+            return False
+    return True
+
+def single(sock, buf, tid, keys):
+    '''run a transaction, one command per key; returns (buf, # bad replies)'''
+    errors = 0
+    for key in keys:
+        sock.sendall(b"qareg -1 " + key + b" " + tid + b"\r\n")
+        line, buf = recv_until(sock, buf, b"\r\n")
+        if not line.startswith(b"LEASE "):
+            errors += 1
+    for key in keys:
+        sock.sendall(b"qaread -1 " + key + b" 0 0 " + tid + b"\r\n")
+        line, buf = recv_until(sock, buf, b"END\r\n")
+        if not line.startswith(b"LVALUE " + key + b" "):
+            errors += 1
+    sock.sendall(b"commit -1 -1 " + tid + b" 0\r\n")
+    line, buf = recv_until(sock, buf, b"\r\n")
+    if line != b"OK\r\n":
+        errors += 1
+    return buf, errors
+
+def batched(sock, buf, tid, keys):
+    '''run a transaction with batched commands; returns (buf, # bad replies)'''
+    errors = 0
+    keylist = b" ".join(keys)
+    sock.sendall(b"mqareg -1 " + tid + b" " + keylist + b"\r\n")
+    reply, buf = recv_until(sock, buf, b"END\r\n")
+    if not batch_ok(reply, b"LEASE", keys):
+        errors += 1
+    sock.sendall(b"mqaread -1 " + tid + b" 0 " + keylist + b"\r\n")
+    reply, buf = recv_until(sock, buf, b"END\r\n")
+    if not batch_ok(reply, b"LVALUE", keys):
+        errors += 1
+    sock.sendall(b"mcommit -1 -1 0 " + tid + b"\r\n")
+    reply, buf = recv_until(sock, buf, b"END\r\n")
+    if reply != b"OK " + tid + b"\r\nEND\r\n":
+        errors += 1
+    return buf, errors
+
+def client(port, duration, nkeys, keyspace, run, seed, result):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    rand = random.Random(seed)
+    buf = b''
+    ntrans = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        keys = [("key:%d" % rand.randrange(keyspace)).encode()
+                for n in range(nkeys)]
+        tid = ("tid:%d:%d" % (seed, ntrans)).encode()
+        buf, nerror = run(sock, buf, tid, keys)
+        ntrans += 1
+        errors += nerror
+    sock.close()
+    result.put((ntrans, errors))
+
+def measure(args, nkeys, run):
+    result = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=client,
+                                     args=(args.port, args.duration, nkeys,
+                                           args.keys, run, n * 104729 + 1,
+                                           result))
+             for n in range(args.clients)]
+    for p in procs:
+        p.start()
+    counts = [result.get() for p in procs]
+    for p in procs:
+        p.join()
+    rate = sum(c[0] for c in counts) / float(args.duration)
+    latency = args.clients / max(rate, 1.0) * 1000.0
+    return rate, latency, sum(c[1] for c in counts)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-k', '--trans-keys', default='1,10,50',
+                        help='# keys a transaction touches, to compare')
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=4)
+    parser.add_argument('-d', '--duration', type=float, default=10)
+    parser.add_argument('-m', '--memory', type=int, default=64)
+    parser.add_argument('-K', '--keys', type=int, default=100000,
+                        help='# keys transactions pick theirs from')
+    args = parser.parse_args()
+
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory])
+    errors = 0
+    try:
+        print("%-8s%14s%14s%14s%14s" % ("keys", "single tx/s", "single ms",
+                                         "batch tx/s", "batch ms"))
+        for nkeys in [int(n) for n in args.trans_keys.split(',')]:
+            srate, slatency, serror = measure(args, nkeys, single)
+            brate, blatency, berror = measure(args, nkeys, batched)
+            print("%-8d%14.0f%14.3f%14.0f%14.3f" % (nkeys, srate, slatency,
+                                                     brate, blatency))
+            sys.stdout.flush()
+            errors += serror + berror
+    finally:
+        launch.stop(server)
+    launch.check(errors)
+
+if __name__ == '__main__':
+    main()
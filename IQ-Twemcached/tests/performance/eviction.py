@@ -0,0 +1,138 @@
+'''
+Eviction strategy benchmark on a Zipfian trace.
+
+Starts one twemcache instance per eviction strategy (-M) with less memory
+than the key space needs, and drives it from client processes that each
+get a key drawn from a Zipfian distribution and set it on a miss, as a
+look-aside cache is used. Reports the hit ratio, the throughput and the
+evictions of each strategy. Example:
+
+    python eviction.py -e ../../src/twemcache -M 1,16 -d 90
+
+Item LRU eviction (1) only moves an item that was not touched for 60
+seconds, so runs much shorter than that compare against what is close to
+FIFO for it.
+'''
+
+from __future__ import print_function
+
+import argparse
+import bisect
+import multiprocessing
+import random
+import socket
+import sys
+import time
+
+import launch
+
+def recv_until(sock, buf, term):
+    while term not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    idx = buf.index(term) + len(term)
+    return buf[:idx], buf[idx:]
+
+def zipf_cdf(nkeys, alpha):
+    cdf = []
+    total = 0.0
+    for rank in range(1, nkeys + 1):
+        total += 1.0 / rank ** alpha
+        cdf.append(total)
+    return [c / total for c in cdf]
+
+def client(port, duration, nkeys, cdf, value, seed, result):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    rand = random.Random(seed)
+    buf = b''
+    gets = 0
+    hits = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        # scatter ranks over the key space, so hot keys share no slab
+        rank = bisect.bisect_left(cdf, rand.random())
+        key = ("key:%d" % (rank * 7919 % nkeys)).encode()
+        sock.sendall(b"get -1 " + key + b"\r\n")
+        line, buf = recv_until(sock, buf, b"END\r\n")
+        gets += 1
+        if line.startswith(b"VALUE " + key + b" "):
+            hits += 1
+            continue
+        if line != b"END\r\n":
+            errors += 1
+        sock.sendall(b"set -1 -1 " + key + b" 0 0 " +
+                     str(len(value)).encode() + b"\r\n" + value + b"\r\n")
+        line, buf = recv_until(sock, buf, b"\r\n")
+        if line != b"STORED\r\n":
+            errors += 1
+    sock.close()
+    result.put((gets, hits, errors))
+
+def stat(port, name):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.sendall(b"stats\r\n")
+    data, buf = recv_until(sock, b'', b"END\r\n")
+    sock.close()
+    for line in data.decode().split("\r\n"):
+        fields = line.split()
+        if len(fields) == 3 and fields[1] == name:
+            return int(fields[2])
+    return 0
+
+def run(args, evict, cdf):
+    port = args.port
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory,
+                                 "-M", evict])
+    try:
+        value = b'x' * args.value
+        result = multiprocessing.Queue()
+        procs = [multiprocessing.Process(target=client,
+                                         args=(port, args.duration, args.keys,
+                                               cdf, value, n * 104729, result))
+                 for n in range(args.clients)]
+        for p in procs:
+            p.start()
+        counts = [result.get() for p in procs]
+        for p in procs:
+            p.join()
+        evictions = stat(port, "item_evict")
+    finally:
+        launch.stop(server)
+    gets = sum(c[0] for c in counts)
+    hits = sum(c[1] for c in counts)
+    errors = sum(c[2] for c in counts)
+    return (hits / float(max(gets, 1)), gets / float(args.duration), evictions,
+            errors)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-M', '--evict', default='1,16',
+                        help='eviction strategies to compare')
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=4)
+    parser.add_argument('-d', '--duration', type=float, default=30)
+    parser.add_argument('-m', '--memory', type=int, default=8)
+    parser.add_argument('-k', '--keys', type=int, default=200000)
+    parser.add_argument('-s', '--value', type=int, default=100)
+    parser.add_argument('-z', '--alpha', type=float, default=0.99,
+                        help='Zipfian skew of key popularity')
+    args = parser.parse_args()
+
+    cdf = zipf_cdf(args.keys, args.alpha)
+    print("%-8s%12s%12s%12s" % ("evict", "hit ratio", "gets/s", "evictions"))
+    errors = 0
+    for evict in [int(m) for m in args.evict.split(',')]:
+        ratio, rate, evictions, nerror = run(args, evict, cdf)
+        print("%-8d%12.4f%12.0f%12d" % (evict, ratio, rate, evictions))
+        sys.stdout.flush()
+        errors += nerror
+    launch.check(errors)
+
+if __name__ == '__main__':
+    main()
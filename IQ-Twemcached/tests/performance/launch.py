@@ -0,0 +1,60 @@
+'''
+Starting and stopping the twemcache instance a benchmark script drives.
+
+The scripts in this directory talk raw sockets and import nothing from lib,
+so that they run under python 2 and 3 alike; this module keeps that.
+'''
+
+from __future__ import print_function
+
+import os
+import socket
+import subprocess
+import sys
+import time
+
+START_TIMEOUT = 5 # seconds we wait for the server to listen
+
+def add_arguments(parser):
+    '''options every benchmark takes to launch its server'''
+    parser.add_argument('-e', '--executable', default='../../src/twemcache')
+    parser.add_argument('-p', '--port', type=int, default=22122)
+    parser.add_argument('-u', '--user', default=None,
+                        help='user to run twemcache as, required when '
+                             'started as root (default: root if run as root)')
+    parser.add_argument('-a', '--server-args', default='',
+                        help='extra twemcache options, e.g. -a=-O')
+
+def start(args, options):
+    '''start twemcache with options on args.port, return once it listens'''
+    command = [args.executable, "-p", str(args.port)]
+    user = args.user
+    if user is None and os.geteuid() == 0:
+        user = 'root' # twemcache refuses to run as root without -u
+    if user is not None:
+        command += ["-u", user]
+    command += [str(option) for option in options] + args.server_args.split()
+    server = subprocess.Popen(command, stdout=open(os.devnull, 'w'),
+                              stderr=subprocess.STDOUT)
+    deadline = time.time() + START_TIMEOUT
+    while True:
+        if server.poll() is not None:
+            sys.exit("twemcache exited with %d: %s" %
+                     (server.returncode, ' '.join(command)))
+        try:
+            socket.create_connection(("127.0.0.1", args.port)).close()
+            return server
+        except socket.error:
+            if time.time() > deadline:
+                stop(server)
+                sys.exit("twemcache is not listening on port %d" % args.port)
+            time.sleep(0.05)
+
+def stop(server):
+    server.kill()
+    server.wait()
+
+def check(errors):
+    '''exit with a failure when a benchmark saw unexpected replies'''
+    if errors:
+        sys.exit("%d unexpected replies, numbers above are not valid" % errors)
@@ -0,0 +1,159 @@
+'''
+Pipelined reply coalescing benchmark.
+
+Starts a twemcache instance once with reply coalescing off (-j 0) and once
+with the given coalesce bytes, and drives each from client processes that
+send batches of small requests (an even mix of set and get) in one write
+and then read all of the replies. The request throughput, and the number of
+sendmsg calls the server made per request, are reported for every pipeline
+depth. Example:
+
+    python pipeline.py -e ../../src/twemcache -P 1,8,32 -d 10
+'''
+
+from __future__ import print_function
+
+import argparse
+import multiprocessing
+import random
+import socket
+import sys
+import time
+
+import launch
+
+def recv_until(sock, buf, term):
+    while term not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    idx = buf.index(term) + len(term)
+    return buf[:idx], buf[idx:]
+
+def recv_bytes(sock, buf, nbyte):
+    while len(buf) < nbyte:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    return buf[:nbyte], buf[nbyte:]
+
+def recv_replies(sock, buf, keys, value):
+    '''read the replies to a pipeline of sets (None) and gets (their key),
+    in order; returns (buf, # bad replies)'''
+    errors = 0
+    for key in keys:
+        line, buf = recv_until(sock, buf, b"\r\n")
+        if key is None:
+            if line != b"STORED\r\n":
+                errors += 1
+            continue
+        if line.startswith(b"VALUE " + key + b" "):
+            data, buf = recv_bytes(sock, buf, len(value) + 2)
+            if data != value + b"\r\n":
+                errors += 1
+            line, buf = recv_until(sock, buf, b"\r\n")
+        if line != b"END\r\n":
+            errors += 1
+    return buf, errors
+
+def client(port, duration, depth, keyspace, vlen, seed, result):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    rand = random.Random(seed)
+    value = b"v" * vlen
+    buf = b''
+    nreq = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        req = []
+        keys = []
+        for n in range(depth):
+            key = ("key:%d" % rand.randrange(keyspace)).encode()
+            if rand.random() < 0.5:
+                req.append(b"set -1 -1 " + key + b" 0 0 " +
+                           str(vlen).encode() + b"\r\n" + value + b"\r\n")
+                keys.append(None)
+            else:
+                req.append(b"get -1 " + key + b"\r\n")
+                keys.append(key)
+        sock.sendall(b"".join(req))
+        buf, nerror = recv_replies(sock, buf, keys, value)
+        nreq += depth
+        errors += nerror
+    sock.close()
+    result.put((nreq, errors))
+
+def sendmsg_calls(port):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.sendall(b"stats\r\n")
+    buf = b''
+    while not buf.endswith(b"END\r\n"):
+        buf += sock.recv(65536)
+    sock.close()
+    for line in buf.split(b"\r\n"):
+        token = line.split()
+        if len(token) == 3 and token[1] == b"data_sendmsg":
+            return int(token[2])
+    return 0
+
+def measure(args, depth):
+    result = multiprocessing.Queue()
+    before = sendmsg_calls(args.port)
+    procs = [multiprocessing.Process(target=client,
+                                     args=(args.port, args.duration, depth,
+                                           args.keys, args.value_size,
+                                           n * 104729 + 1, result))
+             for n in range(args.clients)]
+    for p in procs:
+        p.start()
+    counts = [result.get() for p in procs]
+    for p in procs:
+        p.join()
+    nreq = sum(c[0] for c in counts)
+    # let the stats aggregator catch up
+    time.sleep(0.2)
+    nsend = sendmsg_calls(args.port) - before
+    return (nreq / float(args.duration), nsend / float(max(nreq, 1)),
+            sum(c[1] for c in counts))
+
+def run(args, coalesce):
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory,
+                                 "-A", 100000, "-j", coalesce])
+    try:
+        return [measure(args, int(depth))
+                for depth in args.depths.split(',')]
+    finally:
+        launch.stop(server)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-P', '--depths', default='1,8,32',
+                        help='# requests a client pipelines, to compare')
+    parser.add_argument('-j', '--coalesce-bytes', type=int, default=65536)
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=4)
+    parser.add_argument('-d', '--duration', type=float, default=10)
+    parser.add_argument('-m', '--memory', type=int, default=64)
+    parser.add_argument('-K', '--keys', type=int, default=100000)
+    parser.add_argument('-v', '--value-size', type=int, default=32)
+    args = parser.parse_args()
+
+    off = run(args, 0)
+    on = run(args, args.coalesce_bytes)
+
+    print("%-8s%14s%14s%14s%14s" % ("depth", "off req/s", "off send/req",
+                                     "on req/s", "on send/req"))
+    for depth, (orate, osend, oerror), (nrate, nsend, nerror) in \
+            zip(args.depths.split(','), off, on):
+        print("%-8s%14.0f%14.3f%14.0f%14.3f" % (depth, orate, osend,
+                                                 nrate, nsend))
+    sys.stdout.flush()
+    launch.check(sum(r[2] for r in off + on))
+
+if __name__ == '__main__':
+    main()
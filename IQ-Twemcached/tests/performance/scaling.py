@@ -0,0 +1,121 @@
+'''
+Thread scaling benchmark for get, iqget and commit (qareg + commit).
+
+Starts one twemcache instance per worker count and drives it from as many
+client processes as there are workers, each over its own raw socket, so it
+has no dependency on the memcache module. Example:
+
+    python scaling.py -e ../../src/twemcache -w 1,2,4,8,16,32 -d 5
+'''
+
+from __future__ import print_function
+
+import argparse
+import multiprocessing
+import socket
+import sys
+import time
+
+import launch
+
+VALUE = b'x' * 64
+
+def recv_until(sock, buf, term):
+    while term not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+    idx = buf.index(term) + len(term)
+    return buf[:idx], buf[idx:]
+
+def populate(port, nkeys):
+    sock = socket.create_connection(("127.0.0.1", port))
+    buf = b''
+    for i in range(nkeys):
+        key = ("key:%d" % i).encode()
+        sock.sendall(b"set -1 -1 " + key + b" 0 0 " +
+                     str(len(VALUE)).encode() + b"\r\n" + VALUE + b"\r\n")
+        line, buf = recv_until(sock, buf, b"\r\n")
+        if line != b"STORED\r\n":
+            sys.exit("populating key:%d failed: %r" % (i, line))
+    sock.close()
+
+def client(port, op, duration, nkeys, seed, result):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    buf = b''
+    count = 0
+    errors = 0
+    i = seed
+    deadline = time.time() + duration
+    while time.time() < deadline:
+        key = ("key:%d" % (i % nkeys)).encode()
+        if op == 'get':
+            sock.sendall(b"get -1 " + key + b"\r\n")
+            reply, buf = recv_until(sock, buf, b"END\r\n")
+            ok = reply.startswith(b"VALUE ")
+        elif op == 'iqget':
+            sock.sendall(b"iqget -1 " + key + b" 0 0\r\n")
+            reply, buf = recv_until(sock, buf, b"END\r\n")
+            ok = reply.startswith(b"VALUE ")
+        else:
+            tid = ("tid:%d:%d" % (seed, i)).encode()
+            sock.sendall(b"qareg -1 " + key + b" " + tid + b"\r\n")
+            reply, buf = recv_until(sock, buf, b"\r\n")
+            ok = reply == b"LEASE 1\r\n"
+            sock.sendall(b"commit -1 -1 " + tid + b" 0\r\n")
+            reply, buf = recv_until(sock, buf, b"\r\n")
+            ok = ok and reply == b"OK\r\n"
+        count += 1
+        if not ok:
+            errors += 1
+        i += 7919
+    sock.close()
+    result.put((count, errors))
+
+def run(args, workers, op):
+    port = args.port
+    server = launch.start(args, ["-t", workers, "-m", args.memory])
+    try:
+        populate(port, args.keys)
+        result = multiprocessing.Queue()
+        procs = [multiprocessing.Process(target=client,
+                                         args=(port, op, args.duration, args.keys,
+                                               n * 104729, result))
+                 for n in range(workers * args.clients)]
+        for p in procs:
+            p.start()
+        counts = [result.get() for p in procs]
+        for p in procs:
+            p.join()
+    finally:
+        launch.stop(server)
+    return (sum(c[0] for c in counts) / float(args.duration),
+            sum(c[1] for c in counts))
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-w', '--workers', default='1,2,4,8,16,32')
+    parser.add_argument('-c', '--clients', type=int, default=1,
+                        help='client processes per worker thread')
+    parser.add_argument('-d', '--duration', type=float, default=5)
+    parser.add_argument('-m', '--memory', type=int, default=64)
+    parser.add_argument('-k', '--keys', type=int, default=100000)
+    parser.add_argument('-o', '--ops', default='get,iqget,commit')
+    args = parser.parse_args()
+
+    ops = args.ops.split(',')
+    errors = 0
+    print("%-8s" % "workers" + "".join("%14s" % op for op in ops))
+    for workers in [int(w) for w in args.workers.split(',')]:
+        row = [run(args, workers, op) for op in ops]
+        print("%-8d" % workers + "".join("%14.0f" % r[0] for r in row))
+        sys.stdout.flush()
+        errors += sum(r[1] for r in row)
+    launch.check(errors)
+
+if __name__ == '__main__':
+    main()
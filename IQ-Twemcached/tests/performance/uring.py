@@ -0,0 +1,175 @@
+'''
+Network engine benchmark.
+
+Starts a twemcache instance once with the libevent engine (-i libevent) and
+once with the io_uring engine (-i uring), and drives each from client
+processes that keep many connections busy at once, one request (an even
+mix of set and get) outstanding on each. The request throughput, and the
+number of io_uring_enter calls the server made per request, are reported
+for every connection count and value size. Example:
+
+    python uring.py -e ../../src/twemcache -C 16,256,1024 -v 32,4096 -d 10
+'''
+
+from __future__ import print_function
+
+import argparse
+import multiprocessing
+import random
+import resource
+import selectors
+import socket
+import sys
+import time
+
+import launch
+
+def reply_status(buf, key):
+    '''None while the reply to a set (key None) or a get of key is not all
+    in buf yet, else whether it is the one expected'''
+    if b"\r\n" not in buf:
+        return None
+    if key is None:
+        return buf == b"STORED\r\n"
+    if buf == b"END\r\n":
+        return True
+    header = buf[:buf.index(b"\r\n")].split()
+    if len(header) != 5 or header[:2] != [b"VALUE", key]:
+        return False
+    # the value may be from a run with another value size
+    nbyte = int(header[3])
+    start = buf.index(b"\r\n") + 2
+    if len(buf) < start + nbyte + 7:
+        return None
+    return buf[start:] == b"v" * nbyte + b"\r\nEND\r\n"
+
+def client(port, duration, nconn, keyspace, vlen, seed, result):
+    sel = selectors.DefaultSelector()
+    rand = random.Random(seed)
+    value = b"v" * vlen
+    bufs = {}
+    keys = {}
+
+    def send(sock):
+        key = ("key:%d" % rand.randrange(keyspace)).encode()
+        if rand.random() < 0.5:
+            sock.sendall(b"set -1 -1 " + key + b" 0 0 " + str(vlen).encode() +
+                         b"\r\n" + value + b"\r\n")
+            keys[sock] = None
+        else:
+            sock.sendall(b"get -1 " + key + b"\r\n")
+            keys[sock] = key
+        bufs[sock] = b''
+
+    for n in range(nconn):
+        sock = socket.create_connection(("127.0.0.1", port))
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sel.register(sock, selectors.EVENT_READ)
+        send(sock)
+
+    nreq = 0
+    errors = 0
+    end = time.time() + duration
+    while time.time() < end:
+        for key, mask in sel.select(timeout=0.1):
+            sock = key.fileobj
+            data = sock.recv(65536)
+            if not data:
+                raise IOError("connection closed")
+            bufs[sock] += data
+            status = reply_status(bufs[sock], keys[sock])
+            if status is not None:
+                nreq += 1
+                if not status:
+                    errors += 1
+                send(sock)
+
+    for key in list(sel.get_map().values()):
+        key.fileobj.close()
+    result.put((nreq, errors))
+
+def server_stat(port, name):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.sendall(b"stats\r\n")
+    buf = b''
+    while not buf.endswith(b"END\r\n"):
+        buf += sock.recv(65536)
+    sock.close()
+    for line in buf.split(b"\r\n"):
+        token = line.split()
+        if len(token) == 3 and token[1] == name:
+            return int(token[2])
+    return 0
+
+def measure(args, nconn, vlen):
+    result = multiprocessing.Queue()
+    before = server_stat(args.port, b"uring_enter")
+    per_client = max(nconn // args.clients, 1)
+    procs = [multiprocessing.Process(target=client,
+                                     args=(args.port, args.duration,
+                                           per_client, args.keys, vlen,
+                                           n * 104729 + 1, result))
+             for n in range(args.clients)]
+    for p in procs:
+        p.start()
+    counts = [result.get() for p in procs]
+    for p in procs:
+        p.join()
+    nreq = sum(c[0] for c in counts)
+    # let the stats aggregator catch up
+    time.sleep(0.2)
+    nenter = server_stat(args.port, b"uring_enter") - before
+    return (nreq / float(args.duration), nenter / float(max(nreq, 1)),
+            sum(c[1] for c in counts))
+
+def run(args, engine):
+    server = launch.start(args, ["-t", args.workers, "-m", args.memory,
+                                 "-A", 100000, "-c", args.max_conns,
+                                 "-i", engine])
+    try:
+        return [measure(args, int(nconn), int(vlen))
+                for nconn in args.conns.split(',')
+                for vlen in args.value_sizes.split(',')]
+    finally:
+        launch.stop(server)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    launch.add_arguments(parser)
+    parser.add_argument('-C', '--conns', default='16,256,1024',
+                        help='# connections, to compare')
+    parser.add_argument('-v', '--value-sizes', default='32,4096',
+                        help='value sizes, to compare')
+    parser.add_argument('-t', '--workers', type=int, default=4)
+    parser.add_argument('-c', '--clients', type=int, default=4)
+    parser.add_argument('-d', '--duration', type=float, default=10)
+    parser.add_argument('-m', '--memory', type=int, default=256)
+    parser.add_argument('-K', '--keys', type=int, default=100000)
+    parser.add_argument('-M', '--max-conns', type=int, default=8192)
+    args = parser.parse_args()
+
+    # the server inherits the limit, and clients hold one fd per connection
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    want = args.max_conns + 64
+    if hard != resource.RLIM_INFINITY:
+        want = min(want, hard)
+    if soft != resource.RLIM_INFINITY and soft < want:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (want, hard))
+
+    libevent = run(args, "libevent")
+    uring = run(args, "uring")
+
+    cases = [(nconn, vlen) for nconn in args.conns.split(',')
+             for vlen in args.value_sizes.split(',')]
+    print("%-8s%8s%16s%16s%16s" % ("conns", "value", "libevent req/s",
+                                    "uring req/s", "uring enter/req"))
+    for (nconn, vlen), (lrate, _, _), (urate, uenter, _) in \
+            zip(cases, libevent, uring):
+        print("%-8s%8s%16.0f%16.0f%16.3f" % (nconn, vlen, lrate, urate,
+                                              uenter))
+    sys.stdout.flush()
+    launch.check(sum(r[2] for r in libevent + uring))
+
+if __name__ == '__main__':
+    main()
@@ -111,6 +111,18 @@ class ProtocolBadStartup(unittest.TestCase):
         self.server.poll()
         self.assertIsNotNone(self.server.returncode)
 
+    def test_reuseport(self):
+        '''a second reuseport instance on a port in use, -q'''
+        args = Args(command='ACCEPT = "reuseport"; PORT = "%d"' % (int(PORT) + 1))
+        first = startServer(args)
+        self.server = startServer(args)
+        time.sleep(SHUTDOWN_DELAY)
+        self.server.poll()
+        self.assertIsNotNone(self.server.returncode)
+        first.poll()
+        self.assertIsNone(first.returncode)
+        stopServer(first)
+
 if __name__ == '__main__':
     protocol_badstartup = unittest.TestLoader().loadTestsFromTestCase(ProtocolBadStartup)
     unittest.TextTestRunner(verbosity=2).run(protocol_badstartup)